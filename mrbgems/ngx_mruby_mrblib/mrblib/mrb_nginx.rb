@@ -1,4 +1,242 @@
 class Nginx
+  # Suspends the running handler for msec milliseconds. The worker keeps
+  # serving other requests meanwhile.
+  def self.sleep(msec)
+    _sleep msec
+    Fiber.yield
+  end
+
+  # Runs blocks on worker timers, outside of any request; delays are msec.
+  #
+  #   Nginx::Timer.every(30000) { refresh_routes }
+  #   t = Nginx::Timer.at(500) { warm_cache }
+  #   t.cancel
+  class Timer
+    def self.at(delay, &block)
+      new delay, 0, block
+    end
+
+    # the first run is after interval, the next interval after the previous
+    # run has ended
+    def self.every(interval, &block)
+      raise ArgumentError, "interval must be positive" unless interval > 0
+      new interval, interval, block
+    end
+  end
+
+  # Suspends a handler until other code of the worker hands it a value, see
+  # ngx_http_mruby_waiter.c.
+  #
+  #   w = Nginx::Waiter.new
+  #   $waiting << w
+  #   w.wait 1000                     # the value of $waiting.shift.wake(v)
+  class Waiter
+    class Timeout < StandardError; end
+
+    # raises Timeout after msec, 0 waits until woken
+    def wait(msec = 0)
+      _wait msec
+      raise Timeout, "Nginx::Waiter timed out" unless Fiber.yield
+      v = @value
+      @value = nil
+      v
+    end
+  end
+
+  # Worker local cache of Ruby objects, see ngx_http_mruby_lru.c.
+  #
+  #   $routes = Nginx::LRUCache.new 10000, 64 * 1024 * 1024
+  #   $routes.fetch(host, 30) { lookup_backend host }
+  class LRUCache
+    # the cached value of key, or the block's, cached for ttl seconds
+    def fetch(key, ttl = 0)
+      return get(key) if key?(key)
+      set key, yield, ttl
+    end
+  end
+
+  # A worker local Nginx::LRUCache (L1) in front of a Nginx::SharedDict (L2).
+  # Any change of a key in the dict, by any worker, moves its
+  # SharedDict#generation, and a copy in L1 is used only while the generation
+  # it was read under is current. That check is a single unlocked read of a
+  # counter in the zone; :max_stale skips it for that many seconds after the
+  # last one, so hot keys do not touch shared memory at all and are at most
+  # that stale.
+  #
+  #   $users = Nginx::TieredCache.new "users", 10000, max_stale: 0.5
+  #   $users.fetch(id, 60) { load_user id }
+  class TieredCache
+    # dict is a SharedDict or the name of a mruby_shared_dict. opts:
+    # :max_bytes of L1 (0 for no limit), :max_stale (seconds, 0) and :l1_ttl
+    # (seconds, 1), which bounds how long a copy outlives an entry that
+    # expired in the dict without being swept by a writer.
+    def initialize(dict, max_items, opts = {})
+      @l2 = dict.is_a?(SharedDict) ? dict : SharedDict.new(dict)
+      @l1 = LRUCache.new max_items, opts[:max_bytes] || 0
+      @l1_ttl = opts[:l1_ttl] || 1
+      @max_stale = opts[:max_stale] || 0
+    end
+
+    def get(key)
+      e = @l1.get key
+      now = Time.now.to_f if @max_stale > 0
+      return e[0] if e && @max_stale > 0 && now < e[2]
+
+      # read before the value: a write in between moves it past ours
+      gen = @l2.generation key
+      if e && e[1] == gen
+        e[2] = now + @max_stale if @max_stale > 0
+        return e[0]
+      end
+      v = @l2.get key
+      if v.nil?
+        @l1.delete key
+      else
+        @l1.set key, [v, gen, @max_stale > 0 ? now + @max_stale : 0], @l1_ttl,
+          v.is_a?(String) ? v.bytesize : 0
+      end
+      v
+    end
+    alias [] get
+
+    # writes through to the dict; the next get of any worker reads it back
+    def set(key, value, ttl = 0)
+      @l1.delete key
+      @l2.set key, value, ttl
+    end
+
+    def []=(key, value)
+      set key, value
+    end
+
+    def delete(key)
+      @l1.delete key
+      @l2.delete key
+    end
+
+    # the cached value of key, or the block's, stored for ttl seconds
+    def fetch(key, ttl = 0)
+      v = get key
+      return v unless v.nil?
+      v = yield
+      set key, v, ttl unless v.nil?
+      v
+    end
+  end
+
+  # Longest prefix match of IPv4 and IPv6 addresses. Build sets in
+  # mruby_init_worker and replace them from a timer, lookups never see a
+  # half built set.
+  #
+  #   BLOCKED = Nginx::IPSet.new "10.0.0.0/8" => :internal, "2001:db8::/32" => :doc
+  #   Nginx.return 403 if BLOCKED.match_remote
+  class IPSet
+    # prefixes: a Hash of CIDR => value, or an Array of CIDRs with the
+    # value true
+    def initialize(prefixes = [])
+      replace prefixes
+    end
+
+    def replace(prefixes)
+      if prefixes.is_a?(Hash)
+        _build prefixes.keys, prefixes.values
+      else
+        prefixes = prefixes.to_a
+        _build prefixes, [true] * prefixes.size
+      end
+    end
+
+    def include?(addr)
+      self[addr] ? true : false
+    end
+  end
+
+  # Operations that have to wait for the peer return :again and leave the
+  # handler fiber to be resumed with the result by the socket event handler.
+  class Socket
+    def connect(host, port = nil, pool = nil)
+      host = Nginx::Resolver.resolve(host)[0] unless host.start_with?("unix:")
+      _await _connect(host, port, pool)
+    end
+
+    def send(data)
+      _await _send(data.to_s)
+    end
+
+    # a line without its terminator, or size bytes when size is given
+    def receive(size = nil)
+      _await _receive(size)
+    end
+
+    def receive_until(pattern)
+      _await _receive_until(pattern.to_s)
+    end
+
+    # up to size bytes as soon as any arrive, nil when the peer has closed
+    def receive_any(size)
+      _await _receive_any(size)
+    end
+
+    def _await(v)
+      v = Fiber.yield if v == :again
+      raise v if v.is_a?(Exception)
+      v
+    end
+  end
+
+  # Looks names up with the resolver of the location (resolver directive).
+  # Answers are cached per worker for their TTL, missing names for a while.
+  class Resolver
+    # [address, ...]
+    def self.resolve(name)
+      v = _resolve(name.to_s)
+      v = Fiber.yield if v == :again
+      raise v if v.is_a?(Exception)
+      v
+    end
+  end
+
+  # Runs subrequests in parallel; the handler resumes when all of them are
+  # done. Options: :args, :method and :body (a body defaults to POST).
+  class Subrequest
+    class Response
+      attr_reader :status, :body, :headers
+
+      def initialize(status, body, headers)
+        @status = status
+        @body = body
+        @headers = headers
+      end
+    end
+
+    def self.capture(uri, opts = nil)
+      capture_multi([[uri, opts]])[0]
+    end
+
+    # reqs: [uri, ...] or [[uri, opts], ...]
+    def self.capture_multi(reqs)
+      reqs = reqs.map { |req| req.is_a?(Array) ? req : [req, nil] }
+      return [] if reqs.empty?
+      _capture reqs
+      Fiber.yield.map { |status, body, headers| Response.new status, body, headers }
+    end
+
+    # Starts uri, and another copy every opts[:after] msec (50) until one
+    # answers below 500 or opts[:max] (2) are running. opts[:to] lists the
+    # uris of the copies in turn, opts[:args], [:method] and [:body] apply
+    # to all of them.
+    def self.hedged(uri, opts = {})
+      max = opts[:max] || 2
+      to = opts[:to] || [uri]
+      req = {}
+      [:args, :method, :body].each { |k| req[k] = opts[k] if opts.key?(k) }
+      reqs = [[uri, req]]
+      (max - 1).times { |i| reqs << [to[i % to.size], req] }
+      _hedge reqs, opts[:after] || 50
+      Response.new(*Fiber.yield)
+    end
+  end
+
   class Request
     def document_root
       Nginx::Server.new.document_root
@@ -18,4 +256,20 @@ module Kernel
   def get_server_class
     Nginx
   end
+
+  # Used by ngx_mrb_run to run a request phase handler as a fiber. The
+  # returned lambda resumes it and answers [finished, value].
+  def _ngx_mrb_prepare_fiber(callable, *args)
+    f = Fiber.new { callable.call(*args) }
+    lambda { |v| r = f.resume(v); [!f.alive?, r] }
+  end
+
+  # Used by mruby_thread_pool to call a handler in the mrb_state of a pool
+  # thread. The result, a String or [status, headers, body], is answered as
+  # [status, [[name, value], ...], body].
+  def _ngx_mrb_thread_call(handler, env)
+    res = handler.call(env)
+    status, headers, body = res.is_a?(Array) ? res : [200, nil, res]
+    [status.to_i, (headers || {}).map { |k, v| [k.to_s, v.to_s] }, body.to_s]
+  end
 end
@@ -0,0 +1,260 @@
+class Nginx
+  module HTTP
+    # HTTP/1.1 client over Nginx::Socket: a call suspends the handler
+    # instead of blocking the worker, and connections are kept per origin in
+    # the keepalive pool of the worker.
+    #
+    #   c = Nginx::HTTP::Client.new "127.0.0.1", 8080, timeout: 200
+    #   res = c.get "/auth", headers: {"X-Token" => token}
+    #   c.post "/events", body, headers: {"Content-Type" => "text/plain"}
+    #   c.get("/large") { |chunk| ... }   # streams the body
+    #   c.pipeline [["GET", "/a"], ["GET", "/b"]]
+    class Client
+      class Error < StandardError; end
+
+      class Response
+        attr_reader :status, :headers, :body
+
+        def initialize(status, headers, body)
+          @status = status
+          @headers = headers
+          @body = body
+        end
+
+        # header names are kept in lower case
+        def [](name)
+          @headers[name.downcase]
+        end
+      end
+
+      CHUNK_SIZE = 16384
+      # requests that can be sent ahead of the previous response
+      PIPELINE_METHODS = ["GET", "HEAD"]
+      # requests that are sent again when a kept connection turns out stale
+      IDEMPOTENT_METHODS = ["GET", "HEAD", "PUT", "DELETE", "OPTIONS"]
+      HEX_DIGITS = "0123456789abcdefABCDEF"
+
+      # opts: :timeout (deadline of a call in msec, 5000), :keepalive (msec,
+      # 60000) and :pool_size (16)
+      def initialize(host, port = 80, opts = {})
+        @host = host
+        @port = port
+        @timeout = opts[:timeout] || 5000
+        @keepalive = opts[:keepalive] || 60000
+        @pool_size = opts[:pool_size] || 16
+        @host_header = host.start_with?("unix:") ? "localhost" : port == 80 ? host : "#{host}:#{port}"
+      end
+
+      def get(path, opts = {}, &block)
+        request "GET", path, opts, &block
+      end
+
+      def head(path, opts = {})
+        request "HEAD", path, opts
+      end
+
+      def post(path, body, opts = {}, &block)
+        request "POST", path, opts.merge(body: body), &block
+      end
+
+      def put(path, body, opts = {}, &block)
+        request "PUT", path, opts.merge(body: body), &block
+      end
+
+      def delete(path, opts = {}, &block)
+        request "DELETE", path, opts, &block
+      end
+
+      # opts: :headers, :body and :timeout. With a block the body is yielded
+      # in chunks as it arrives and Response#body is nil.
+      def request(method, path, opts = {}, &block)
+        deadline = Client.now + (opts[:timeout] || @timeout)
+        exchange([[method, path, opts]], deadline, &block)[0]
+      end
+
+      # runs [method, path, opts] requests on one connection and answers
+      # their responses in order; GET and HEAD are written at once
+      def pipeline(reqs, opts = {})
+        deadline = Client.now + (opts[:timeout] || @timeout)
+        res = []
+        batch = []
+        reqs.each do |req|
+          if PIPELINE_METHODS.include?(req[0]) && !(req[2] && req[2][:body])
+            batch << req
+          else
+            res.concat exchange(batch, deadline) unless batch.empty?
+            batch = []
+            res.concat exchange([req], deadline)
+          end
+        end
+        res.concat exchange(batch, deadline) unless batch.empty?
+        res
+      end
+
+      def self.now
+        (Time.now.to_f * 1000).to_i
+      end
+
+      # a kept connection may have been closed by the server meanwhile, so
+      # idempotent requests are sent once more on a new connection when
+      # nothing comes back on a reused one
+      def exchange(reqs, deadline, retry_stale = true, &block)
+        data = reqs.map { |m, path, opts| encode m, path, opts || {} }.join
+        s = Nginx::Socket.new
+        arm s, deadline
+        s.connect @host, @port, "http"
+        stale = retry_stale && s.reused_times > 0 &&
+          reqs.all? { |m, path, opts| IDEMPOTENT_METHODS.include?(m) }
+        res = []
+        begin
+          begin
+            arm s, deadline
+            s.send data
+            arm s, deadline
+            line = s.receive
+          rescue Nginx::Socket::Error => e
+            raise e unless stale
+          end
+          if line.nil? && stale
+            s.close
+            return exchange(reqs, deadline, false, &block)
+          end
+          keep = true
+          reqs.each do |m, path, opts|
+            r, keep = read_response(s, m, deadline, line, &block)
+            line = nil
+            res << r
+            # the server ignores the requests after one it closes on
+            break unless keep
+          end
+        rescue => e
+          s.close
+          raise e
+        end
+        if keep
+          s.setkeepalive @keepalive, @pool_size
+        else
+          s.close
+        end
+        # only pipelined GET and HEAD requests are left, send them again
+        if res.size < reqs.size
+          res.concat exchange(reqs[res.size, reqs.size - res.size], deadline)
+        end
+        res
+      end
+
+      def encode(method, path, opts)
+        body = opts[:body]
+        req = "#{token method, "method"} #{token path, "path"} HTTP/1.1\r\nHost: #{@host_header}\r\n"
+        (opts[:headers] || {}).each do |k, v|
+          req << "#{token k, "header name"}: #{token v, "header value"}\r\n"
+        end
+        if body || method == "POST" || method == "PUT"
+          req << "Content-Length: #{body.to_s.bytesize}\r\n"
+        end
+        req << "\r\n"
+        req << body.to_s if body
+        req
+      end
+
+      # CR and LF would let a caller supplied value end the request line or
+      # a header early and inject their own
+      def token(v, what)
+        v = v.to_s
+        raise Error, "CR or LF in #{what}" if v.include?("\r") || v.include?("\n")
+        v
+      end
+
+      def arm(s, deadline)
+        left = deadline - Client.now
+        raise Error, "deadline exceeded" if left <= 0
+        s.settimeout left
+      end
+
+      # answers [response, keepalive]; line is the status line when it has
+      # been received already
+      def read_response(s, method, deadline, line = nil, &block)
+        status = 100
+        headers = nil
+        # interim responses
+        while status >= 100 && status < 200
+          unless line
+            arm s, deadline
+            line = s.receive
+          end
+          version, code = line.to_s.split(" ")
+          version = version.to_s
+          status = code.to_i
+          unless version.start_with?("HTTP/") && status >= 100 && status < 600
+            raise Error, "invalid status line: #{line.inspect}"
+          end
+          line = nil
+          headers = {}
+          while (h = s.receive) != ""
+            raise Error, "connection closed in the response header" if h.nil?
+            k, v = h.split(":", 2)
+            headers[k.strip.downcase] = v.to_s.strip
+          end
+        end
+
+        body = block ? nil : ""
+        sink = block || lambda { |chunk| body << chunk }
+        # HTTP/1.1 connections persist unless closed, HTTP/1.0 ones only on
+        # request
+        conn = headers["connection"].to_s.downcase
+        if version == "HTTP/1.1"
+          keep = !conn.include?("close")
+        else
+          keep = conn.include?("keep-alive")
+        end
+        if method == "HEAD" || status == 204 || status == 304
+          # no body
+        elsif headers["transfer-encoding"].to_s.downcase.include?("chunked")
+          while true
+            arm s, deadline
+            n = chunk_size(s.receive)
+            break if n == 0
+            sink.call s.receive(n)
+            raise Error, "invalid chunk end" if s.receive != ""
+          end
+          # trailer
+          while s.receive != ""
+          end
+        elsif headers["content-length"]
+          left = headers["content-length"].to_i
+          while left > 0
+            arm s, deadline
+            chunk = s.receive_any(left < CHUNK_SIZE ? left : CHUNK_SIZE)
+            raise Error, "connection closed before the end of the body" if chunk.nil?
+            sink.call chunk
+            left -= chunk.bytesize
+          end
+        else
+          # delimited by close
+          keep = false
+          while true
+            arm s, deadline
+            chunk = s.receive_any(CHUNK_SIZE)
+            break if chunk.nil?
+            sink.call chunk
+          end
+        end
+
+        [Response.new(status, headers, body), keep]
+      end
+
+      # the size of a chunk-size line, which may carry extensions; anything
+      # else would desync the connection
+      def chunk_size(line)
+        hex = line.to_s.split(";")[0].to_s.strip
+        if hex.empty? || hex.size > 15
+          raise Error, "invalid chunk size: #{line.inspect}"
+        end
+        hex.size.times do |i|
+          raise Error, "invalid chunk size: #{line.inspect}" unless HEX_DIGITS.include?(hex[i])
+        end
+        hex.to_i(16)
+      end
+    end
+  end
+end
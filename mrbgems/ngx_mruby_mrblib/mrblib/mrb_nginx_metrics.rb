@@ -0,0 +1,110 @@
+class Nginx
+  module Metrics
+    DEFAULT_BUCKETS = [0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10]
+
+    # Series of the registry in mruby_metrics_zone, served by mruby_metrics
+    # locations in the Prometheus text format. The objects are cached per
+    # worker, so looking one up again is a Hash lookup.
+    #
+    #   Nginx::Metrics.counter("http_requests_total", status: r.var.status).inc
+    #   Nginx::Metrics.histogram("http_request_seconds").observe t
+    def self.counter(name, labels = nil, help = nil)
+      series Counter, name, labels, help, []
+    end
+
+    # set, inc and dec
+    def self.gauge(name, labels = nil, help = nil)
+      series Gauge, name, labels, help, []
+    end
+
+    # The buckets of the first registration of name are used by all its
+    # series.
+    def self.histogram(name, labels = nil, help = nil, buckets = DEFAULT_BUCKETS)
+      series Histogram, name, labels, help, buckets
+    end
+
+    def self.series(cls, name, labels, help, buckets)
+      name = name.to_s
+      l = ""
+      if labels && !labels.empty?
+        l = labels.keys.sort_by(&:to_s).map { |k| "#{k}=\"#{escape labels[k].to_s}\"" }.join(",")
+      end
+      @series ||= {}
+      s = @series["#{name}{#{l}}"] ||= cls.new(name, l, escape(help.to_s, false), buckets)
+      raise ArgumentError, "#{name} is a #{s.class}" unless s.is_a?(cls)
+      s
+    end
+
+    # label values escape quotes as well, help texts do not
+    def self.escape(s, quote = true)
+      s = s.gsub("\\") { "\\\\" }.gsub("\n") { "\\n" }
+      quote ? s.gsub("\"") { "\\\"" } : s
+    end
+
+    class Gauge
+      def dec(by = 1)
+        inc(-by)
+      end
+    end
+
+    # statsd client that never blocks: metrics are aggregated per worker and
+    # sent in packed datagrams every :interval msec, so it is cheap enough
+    # for mruby_log_handler.
+    #
+    #   m = Nginx::Metrics::UDP.new "127.0.0.1", 8125, prefix: "web."
+    #   m.increment "requests", 1, status: r.var.status
+    #   m.timing "request_time", r.var.request_time.to_f * 1000
+    class UDP
+      # opts: :prefix, :interval (msec, 100), :max_packet (bytes, 1432) and
+      # :dogstatsd (tags and packed timings, false). All objects of a worker
+      # for the same host and port share the buffer and the options of the
+      # first one.
+      def initialize(host = "127.0.0.1", port = 8125, opts = {})
+        @prefix = opts[:prefix] || ""
+        _init host, port, opts[:interval] || 100, opts[:max_packet] || 1432, opts[:dogstatsd] ? true : false
+      end
+
+      def count(name, value, tags = nil)
+        add "c", name, value, tags
+      end
+
+      def increment(name, value = 1, tags = nil)
+        add "c", name, value, tags
+      end
+
+      def decrement(name, value = 1, tags = nil)
+        add "c", name, -value, tags
+      end
+
+      def gauge(name, value, tags = nil)
+        add "g", name, value, tags
+      end
+
+      # msec
+      def timing(name, value, tags = nil)
+        add "ms", name, value, tags
+      end
+
+      # times the block
+      def time(name, tags = nil)
+        t = Time.now
+        begin
+          yield
+        ensure
+          timing name, (Time.now - t) * 1000, tags
+        end
+      end
+
+      def histogram(name, value, tags = nil)
+        add "h", name, value, tags
+      end
+
+      # tags are a Hash or an Array of "key:value" strings
+      def add(type, name, value, tags)
+        tags = tags.map { |k, v| v.nil? ? k.to_s : "#{k}:#{v}" } if tags.is_a?(Hash)
+        tags = tags.join(",") if tags.is_a?(Array)
+        _add type, "#{@prefix}#{name}", value.to_f, tags
+      end
+    end
+  end
+end
@@ -0,0 +1,242 @@
+class Nginx
+  # Redis client speaking RESP over Nginx::Socket, so a call suspends the
+  # handler instead of blocking the worker. By default all clients of a
+  # worker with the same host, port and :pool share one connection
+  # (Nginx::Redis::Shared), and the commands of concurrent requests go out
+  # pipelined on it. Blocking commands and commands that change the state of
+  # a connection (BLPOP, MULTI, SELECT, SUBSCRIBE...) need shared: false,
+  # which checks a connection out of the keepalive pool for every call.
+  #
+  #   redis = Nginx::Redis.new "127.0.0.1", 6379
+  #   redis.set "k", "v"
+  #   redis.mget "k", "missing"           # => ["v", nil]
+  #   redis.pipelined [["INCR", "a"], ["GET", "b"]]
+  class Redis
+    # an error reply, raised by call and returned in place by pipelined
+    class Error < StandardError; end
+
+    # opts: :timeout (msec, 1000), :pool ("redis"), :shared (true), and for
+    # shared: false :keepalive (msec, 60000) and :pool_size (30)
+    def initialize(host = "127.0.0.1", port = 6379, opts = {})
+      @host = host
+      @port = port
+      @timeout = opts[:timeout] || 1000
+      @pool = opts[:pool] || "redis"
+      @shared = opts.key?(:shared) ? opts[:shared] : true
+      @keepalive = opts[:keepalive] || 60000
+      @pool_size = opts[:pool_size] || 30
+    end
+
+    def call(*args)
+      res = pipelined([args])[0]
+      raise res if res.is_a?(Error)
+      res
+    end
+
+    # sends all commands in one write and answers their replies in order
+    def pipelined(cmds)
+      return [] if cmds.empty?
+      if @shared
+        return Redis.shared(@host, @port, @pool).pipelined(cmds, @timeout)
+      end
+      s = Nginx::Socket.new
+      s.settimeout @timeout
+      s.connect @host, @port, @pool
+      begin
+        s.send cmds.map { |c| Redis.encode(*c) }.join
+        res = cmds.map { Redis.read_reply s }
+      rescue => e
+        s.close
+        raise e
+      end
+      s.setkeepalive @keepalive, @pool_size
+      res
+    end
+
+    # the connection of the worker to host:port named pool
+    def self.shared(host, port, pool)
+      @shared ||= {}
+      @shared["#{host}:#{port}:#{pool}"] ||= Shared.new(host, port)
+    end
+
+    def get(key)
+      call "GET", key
+    end
+
+    def set(key, value)
+      call "SET", key, value
+    end
+
+    def mget(*keys)
+      call "MGET", *keys
+    end
+
+    def del(*keys)
+      call "DEL", *keys
+    end
+
+    def incr(key)
+      call "INCR", key
+    end
+
+    def expire(key, sec)
+      call "EXPIRE", key, sec
+    end
+
+    # One connection shared by the requests of a worker. The request that
+    # finds it idle leads: it writes its commands and reads the replies.
+    # Commands of other requests queue up meanwhile, each request waiting on
+    # a Nginx::Waiter. When the replies are in, the leader hands over to the
+    # first queued request, which writes the whole queue in one go and wakes
+    # every other request with its replies, or with the error of the batch.
+    class Shared
+      def initialize(host, port)
+        @host = host
+        @port = port
+        @sock = nil
+        # [[cmds, waiter], ...] in arrival order
+        @queue = []
+        @busy = false
+        # the leader counts as gone with its request past this time (msec)
+        @lead_until = 0
+        @gen = 0
+      end
+
+      def pipelined(cmds, timeout)
+        if @busy && now < @lead_until
+          w = Nginx::Waiter.new
+          @queue << [cmds, w]
+          begin
+            # a batch in flight and then the one of this request
+            v = w.wait(timeout * 2)
+          rescue Nginx::Waiter::Timeout
+            @queue.delete_if { |e| e[1].equal?(w) }
+            raise Nginx::Socket::Error, "timeout"
+          end
+          return Shared.result(v) unless v == :lead
+          batch = @queue
+        else
+          # the socket of a lost leader was closed with its request
+          @sock = nil if @busy
+          batch = [[cmds, nil]] + @queue
+          w = nil
+        end
+        @queue = []
+        lead batch, w, timeout
+      end
+
+      def lead(batch, mine, timeout)
+        @busy = true
+        gen = @gen += 1
+        replies = exchange(batch, timeout, gen)
+        res = nil
+        batch.each_with_index do |e, i|
+          if e[1].equal?(mine)
+            res = replies[i]
+          else
+            e[1].wake replies[i]
+          end
+        end
+        hand_over timeout if @gen == gen
+        Shared.result(res)
+      end
+
+      # the replies of each entry of batch, or the error of the batch for each
+      def exchange(batch, timeout, gen, again = true)
+        reused = !@sock.nil?
+        read = 0
+        s = nil
+        begin
+          hold timeout
+          s = @sock || connect(timeout)
+          s.settimeout timeout
+          s.send batch.map { |e| e[0].map { |c| Redis.encode(*c) }.join }.join
+          batch.map do |e|
+            e[0].map do
+              hold timeout
+              r = Redis.read_reply s
+              read += 1
+              r
+            end
+          end
+        rescue => err
+          s.close if s
+          @sock = nil if @gen == gen
+          # the server may have closed the idle connection before the write,
+          # then none of the commands has run
+          if again && reused && read == 0 && @gen == gen && err.message != "timeout"
+            return exchange(batch, timeout, gen, false)
+          end
+          batch.map { err }
+        end
+      end
+
+      def connect(timeout)
+        s = Nginx::Socket.new
+        s.settimeout timeout
+        s.connect @host, @port
+        @sock = s
+      end
+
+      # wakes the first queued request that is still waiting to lead
+      def hand_over(timeout)
+        until @queue.empty?
+          if @queue[0][1].wake(:lead)
+            hold timeout
+            return
+          end
+          @queue.shift
+        end
+        @busy = false
+      end
+
+      def hold(timeout)
+        @lead_until = now + timeout * 2
+      end
+
+      def now
+        Time.now.to_f * 1000
+      end
+
+      def self.result(v)
+        raise v if v.is_a?(Exception)
+        v
+      end
+    end
+
+    def self.encode(*args)
+      s = "*#{args.size}\r\n"
+      args.each do |a|
+        a = a.to_s
+        s << "$#{a.bytesize}\r\n" << a << "\r\n"
+      end
+      s
+    end
+
+    # io answers a line without its terminator to receive and size bytes to
+    # receive(size), as Nginx::Socket does
+    def self.read_reply(io)
+      line = io.receive
+      rest = line[1, line.size - 1]
+      case line[0]
+      when "+"
+        rest
+      when "-"
+        Error.new rest
+      when ":"
+        rest.to_i
+      when "$"
+        n = rest.to_i
+        return nil if n < 0
+        v = io.receive(n)
+        io.receive
+        v
+      when "*"
+        n = rest.to_i
+        n < 0 ? nil : (0...n).map { read_reply io }
+      else
+        raise Nginx::Socket::Error, "invalid redis reply: #{line}"
+      end
+    end
+  end
+end
@@ -0,0 +1,314 @@
+/*
+// ngx_http_mruby_bloom.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_bloom.h"
+
+#include <sys/mman.h>
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::BloomFilter, a blocklist of any size in a file built with
+// tools/ngx_mruby_bloom.c. The file is mapped read only and shared, so all
+// workers (and the master, for filters opened in mruby_init) use the same
+// pages of the page cache and a worker holds no copy of it. The filter is
+// blocked: all k bits of a token lie in one 64 byte block, so a lookup is a
+// hash and one cache line.
+//
+// Filters are kept per worker by path and live as long as the worker. At
+// most once a second a lookup stats the path, and when another file has
+// been renamed over it, maps that one and unmaps the old one; until the new
+// file checks out, the old one stays in use.
+*/
+
+typedef struct {
+  u_char *addr;
+  size_t size;
+  ngx_file_uniq_t uniq;
+  time_t mtime;
+  ngx_uint_t k;
+  uint64_t nblocks;
+  uint64_t count;
+} ngx_mrb_bloom_map_t;
+
+typedef struct {
+  ngx_queue_t queue;
+  // NUL terminated
+  ngx_str_t path;
+  ngx_mrb_bloom_map_t map;
+  time_t checked;
+  // the file last seen at path, which may have been rejected
+  ngx_file_uniq_t uniq;
+  time_t mtime;
+  off_t size;
+} ngx_mrb_bloom_t;
+
+// filters live as long as the worker, the objects only point at them
+static const struct mrb_data_type ngx_mrb_bloom_data_type = {
+  "Nginx::BloomFilter", NULL,
+};
+
+static ngx_queue_t ngx_mrb_bloom_filters;
+
+static uint64_t ngx_mrb_bloom_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+static uint64_t ngx_mrb_bloom_le(u_char *p, ngx_uint_t n)
+{
+  uint64_t v = 0;
+
+  while (n--) {
+    v = (v << 8) | p[n];
+  }
+
+  return v;
+}
+
+// maps path into m, or returns the reason it can not
+static char *ngx_mrb_bloom_map(u_char *path, ngx_mrb_bloom_map_t *m)
+{
+  ngx_file_info_t fi;
+  ngx_fd_t fd;
+  u_char *p;
+  char *err = NULL;
+
+  fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if (fd == NGX_INVALID_FILE) {
+    return ngx_open_file_n " failed";
+  }
+  if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+    ngx_close_file(fd);
+    return ngx_fd_info_n " failed";
+  }
+  if (ngx_file_size(&fi) < NGX_MRB_BLOOM_HEADER) {
+    ngx_close_file(fd);
+    return "not a bloom filter file";
+  }
+
+  m->size = (size_t) ngx_file_size(&fi);
+  m->uniq = ngx_file_uniq(&fi);
+  m->mtime = ngx_file_mtime(&fi);
+  p = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+  ngx_close_file(fd);
+  if (p == MAP_FAILED) {
+    return "mmap() failed";
+  }
+
+  m->k = (ngx_uint_t) ngx_mrb_bloom_le(p + 12, 4);
+  m->nblocks = ngx_mrb_bloom_le(p + 16, 8);
+  m->count = ngx_mrb_bloom_le(p + 24, 8);
+  if (ngx_memcmp(p, NGX_MRB_BLOOM_MAGIC, 8) != 0) {
+    err = "not a bloom filter file";
+  }
+  else if (ngx_mrb_bloom_le(p + 8, 4) != NGX_MRB_BLOOM_VERSION) {
+    err = "unsupported bloom filter version";
+  }
+  else if (m->k == 0 || m->k > NGX_MRB_BLOOM_K_MAX || m->nblocks == 0
+           || m->nblocks > (m->size - NGX_MRB_BLOOM_HEADER)
+                           / NGX_MRB_BLOOM_BLOCK) {
+    err = "truncated or corrupt bloom filter file";
+  }
+  if (err != NULL) {
+    munmap(p, m->size);
+    return err;
+  }
+  m->addr = p;
+
+  return NULL;
+}
+
+// swaps in the file renamed over the path of b, at most once a second
+static void ngx_mrb_bloom_check(ngx_mrb_bloom_t *b)
+{
+  ngx_mrb_bloom_map_t m;
+  ngx_file_info_t fi;
+  char *err;
+
+  if (b->checked == ngx_time()) {
+    return;
+  }
+  b->checked = ngx_time();
+
+  if (ngx_file_info(b->path.data, &fi) == NGX_FILE_ERROR
+      || (ngx_file_uniq(&fi) == b->uniq
+          && ngx_file_mtime(&fi) == b->mtime
+          && ngx_file_size(&fi) == b->size)) {
+    return;
+  }
+  // not again until the file changes once more, whether it loads or not
+  b->uniq = ngx_file_uniq(&fi);
+  b->mtime = ngx_file_mtime(&fi);
+  b->size = ngx_file_size(&fi);
+
+  err = ngx_mrb_bloom_map(b->path.data, &m);
+  if (err != NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0
+      , "%s ERROR %s:%d: %s, keeping the bloom filter loaded from \"%V\""
+      , MODULE_NAME
+      , __func__
+      , __LINE__
+      , err
+      , &b->path
+    );
+    return;
+  }
+
+  munmap(b->map.addr, b->map.size);
+  b->map = m;
+  ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0
+    , "%s NOTICE %s:%d: reloaded bloom filter \"%V\""
+    , MODULE_NAME
+    , __func__
+    , __LINE__
+    , &b->path
+  );
+}
+
+static ngx_mrb_bloom_t *ngx_mrb_bloom_get(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_bloom_t *b;
+
+  b = mrb_data_get_ptr(mrb, self, &ngx_mrb_bloom_data_type);
+  if (b == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::BloomFilter");
+  }
+
+  return b;
+}
+
+// Nginx::BloomFilter.open(path), the same filter for the same path
+static mrb_value ngx_mrb_bloom_open(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_bloom_map_t m;
+  ngx_mrb_bloom_t *b;
+  ngx_queue_t *q;
+  mrb_value path;
+  char *err;
+
+  mrb_get_args(mrb, "S", &path);
+  if (ngx_mrb_bloom_filters.next == NULL) {
+    ngx_queue_init(&ngx_mrb_bloom_filters);
+  }
+
+  for (q = ngx_queue_head(&ngx_mrb_bloom_filters);
+       q != ngx_queue_sentinel(&ngx_mrb_bloom_filters);
+       q = ngx_queue_next(q)) {
+    b = ngx_queue_data(q, ngx_mrb_bloom_t, queue);
+    if (b->path.len == (size_t) RSTRING_LEN(path)
+        && ngx_strncmp(b->path.data, RSTRING_PTR(path), b->path.len) == 0) {
+      ngx_mrb_bloom_check(b);
+      goto found;
+    }
+  }
+
+  b = ngx_calloc(sizeof(ngx_mrb_bloom_t) + RSTRING_LEN(path) + 1,
+      ngx_cycle->log);
+  if (b == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::BloomFilter");
+  }
+  b->path.data = (u_char *) (b + 1);
+  b->path.len = RSTRING_LEN(path);
+  ngx_memcpy(b->path.data, RSTRING_PTR(path), b->path.len);
+
+  err = ngx_mrb_bloom_map(b->path.data, &m);
+  if (err != NULL) {
+    ngx_free(b);
+    mrb_raisef(mrb, ngx_mrb_ud(mrb)->bloom_error_class, "%S: %S",
+        mrb_str_new_cstr(mrb, err), path);
+  }
+  b->map = m;
+  b->uniq = m.uniq;
+  b->mtime = m.mtime;
+  b->size = (off_t) m.size;
+  b->checked = ngx_time();
+  ngx_queue_insert_tail(&ngx_mrb_bloom_filters, &b->queue);
+
+found:
+
+  return mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_ptr(self), b,
+        &ngx_mrb_bloom_data_type));
+}
+
+// include?(token): false when token was not added, true when it likely was
+static mrb_value ngx_mrb_bloom_include(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_bloom_t *b = ngx_mrb_bloom_get(mrb, self);
+  mrb_value token;
+  uint64_t h, g;
+  ngx_uint_t i, bit;
+  u_char *block, *p, *last;
+
+  mrb_get_args(mrb, "S", &token);
+  ngx_mrb_bloom_check(b);
+
+  // FNV-1a, mixed; the builder hashes the same way
+  h = 0xcbf29ce484222325ULL;
+  p = (u_char *) RSTRING_PTR(token);
+  for (last = p + RSTRING_LEN(token); p < last; p++) {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  h = ngx_mrb_bloom_mix(h);
+  g = ngx_mrb_bloom_mix(h ^ 0x9e3779b97f4a7c15ULL);
+
+  block = b->map.addr + NGX_MRB_BLOOM_HEADER
+          + (h % b->map.nblocks) * NGX_MRB_BLOOM_BLOCK;
+  // 9 bits address a block, a hash gives 7 of them
+  for (i = 0; i < b->map.k; i++) {
+    if (i > 0 && i % 7 == 0) {
+      g = ngx_mrb_bloom_mix(g + i);
+    }
+    bit = (g >> (i % 7 * 9)) & 511;
+    if (!(block[bit >> 3] & (1 << (bit & 7)))) {
+      return mrb_false_value();
+    }
+  }
+
+  return mrb_true_value();
+}
+
+// the number of tokens the file was built from
+static mrb_value ngx_mrb_bloom_count(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_bloom_t *b = ngx_mrb_bloom_get(mrb, self);
+
+  ngx_mrb_bloom_check(b);
+
+  return mrb_fixnum_value((mrb_int) b->map.count);
+}
+
+static mrb_value ngx_mrb_bloom_path(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_bloom_t *b = ngx_mrb_bloom_get(mrb, self);
+
+  return mrb_str_new(mrb, (char *) b->path.data, b->path.len);
+}
+
+void ngx_mrb_bloom_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_bloom;
+
+  class_bloom = mrb_define_class_under(mrb, class, "BloomFilter", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_bloom, MRB_TT_DATA);
+  mrb_define_class_under(mrb, class_bloom, "Error", mrb->eStandardError_class);
+
+  mrb_define_class_method(mrb, class_bloom, "open", ngx_mrb_bloom_open, MRB_ARGS_REQ(1));
+  mrb_undef_class_method(mrb, class_bloom, "new");
+  mrb_define_method(mrb, class_bloom, "include?", ngx_mrb_bloom_include, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_bloom, "count", ngx_mrb_bloom_count, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_bloom, "path", ngx_mrb_bloom_path, MRB_ARGS_NONE());
+}
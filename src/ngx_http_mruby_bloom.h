@@ -0,0 +1,31 @@
+/*
+// ngx_http_mruby_bloom.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_BLOOM_H
+#define NGX_HTTP_MRUBY_BLOOM_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+/*
+// the file format, written by tools/ngx_mruby_bloom.c: a header of
+// NGX_MRB_BLOOM_HEADER bytes, then nblocks blocks of 512 bits
+//
+//   0  "NGXBLOOM"
+//   8  version, 32 bit little endian
+//  12  k, 32 bit little endian
+//  16  nblocks, 64 bit little endian
+//  24  number of tokens added, 64 bit little endian
+*/
+#define NGX_MRB_BLOOM_MAGIC            "NGXBLOOM"
+#define NGX_MRB_BLOOM_VERSION          1
+#define NGX_MRB_BLOOM_HEADER           64
+#define NGX_MRB_BLOOM_BLOCK            64
+#define NGX_MRB_BLOOM_K_MAX            32
+
+#endif // NGX_HTTP_MRUBY_BLOOM_H
@@ -13,35 +13,32 @@
 #include <mruby/string.h>
 #include <mruby/class.h>
 
-// extern from ngx_http_mruby_request.c
-extern mrb_value ngx_mrb_get_request_var(mrb_state *mrb, mrb_value self);
-
 static mrb_value ngx_mrb_get_conn_var_remote_addr(mrb_state *mrb,
     mrb_value self)
 {
-  return mrb_funcall(mrb, ngx_mrb_get_request_var(mrb, self), "remote_addr", 0,
-      NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_REMOTE_ADDR);
 }
 
 static mrb_value ngx_mrb_get_conn_var_remote_port(mrb_state *mrb,
     mrb_value self)
 {
-  return mrb_funcall(mrb, ngx_mrb_get_request_var(mrb, self), "remote_port", 0,
-      NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_REMOTE_PORT);
 }
 
 static mrb_value ngx_mrb_get_conn_var_server_addr(mrb_state *mrb,
     mrb_value self)
 {
-  return mrb_funcall(mrb, ngx_mrb_get_request_var(mrb, self), "server_addr", 0,
-      NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_SERVER_ADDR);
 }
 
 static mrb_value ngx_mrb_get_conn_var_server_port(mrb_state *mrb,
     mrb_value self)
 {
-  return mrb_funcall(mrb, ngx_mrb_get_request_var(mrb, self), "server_port", 0,
-      NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_SERVER_PORT);
 }
 
 void ngx_mrb_conn_class_init(mrb_state *mrb, struct RClass *class)
@@ -11,5 +11,6 @@
 #include <mruby.h>
 #include <mruby/hash.h>
 #include <mruby/variable.h>
+#include "ngx_http_mruby_var.h"
 
 #endif // NGX_HTTP_MRUBY_CONNECTION_H
@@ -14,6 +14,7 @@
 #include "mruby/compile.h"
 #include "mruby/string.h"
 #include "mruby/array.h"
+#include "mruby/hash.h"
 #include "mruby/variable.h"
 
 #include <nginx.h>
@@ -78,17 +79,44 @@ void ngx_mrb_raise_conf_error(mrb_state *mrb, mrb_value obj, ngx_conf_t *cf)
   }
 }
 
+// keeps obj alive until ngx_mrb_gc_unregister by referencing it from a
+// hidden instance variable of the Nginx class
+void ngx_mrb_gc_register(mrb_state *mrb, mrb_value obj)
+{
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(mrb);
+  mrb_value nginx = mrb_obj_value(ud->nginx_class);
+  mrb_value roots;
+
+  roots = mrb_iv_get(mrb, nginx, ud->gc_roots_sym);
+  if (mrb_nil_p(roots)) {
+    roots = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, nginx, ud->gc_roots_sym, roots);
+  }
+  mrb_hash_set(mrb, roots, mrb_fixnum_value(mrb_obj_id(obj)), obj);
+}
+
+void ngx_mrb_gc_unregister(mrb_state *mrb, mrb_value obj)
+{
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(mrb);
+  mrb_value roots;
+
+  roots = mrb_iv_get(mrb, mrb_obj_value(ud->nginx_class), ud->gc_roots_sym);
+  if (!mrb_nil_p(roots)) {
+    mrb_hash_delete_key(mrb, roots, mrb_fixnum_value(mrb_obj_id(obj)));
+  }
+}
+
 static mrb_value ngx_mrb_send_header(mrb_state *mrb, mrb_value self)
 {
   ngx_mrb_rputs_chain_list_t *chain = NULL;
   ngx_http_mruby_ctx_t *ctx;
 
-  ngx_http_request_t *r = ngx_mrb_get_request();
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb);
   mrb_int status = NGX_HTTP_OK;
   mrb_get_args(mrb, "i", &status);
   r->headers_out.status = status;
 
-  ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  ctx = ngx_mrb_get_ctx(mrb);
   if (ctx == NULL) {
     ngx_log_error(NGX_LOG_ERR
       , r->connection->log
@@ -129,8 +157,8 @@ static mrb_value ngx_mrb_rputs(mrb_state *mrb, mrb_value self)
   u_char *str;
   ngx_str_t ns;
 
-  ngx_http_request_t *r = ngx_mrb_get_request();
-  ngx_http_mruby_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb);
+  ngx_http_mruby_ctx_t *ctx = ngx_mrb_get_ctx(mrb);
 
   mrb_get_args(mrb, "o", &argv);
 
@@ -199,8 +227,8 @@ static mrb_value ngx_mrb_echo(mrb_state *mrb, mrb_value self)
   u_char *str;
   ngx_str_t ns;
 
-  ngx_http_request_t *r = ngx_mrb_get_request();
-  ngx_http_mruby_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb);
+  ngx_http_mruby_ctx_t *ctx = ngx_mrb_get_ctx(mrb);
 
   mrb_get_args(mrb, "o", &argv);
 
@@ -268,7 +296,7 @@ static mrb_value ngx_mrb_errlogger(mrb_state *mrb, mrb_value self)
   mrb_value msg;
   mrb_int argc;
   mrb_int log_level;
-  ngx_http_request_t *r = ngx_mrb_get_request();
+  ngx_http_request_t *r = ngx_mrb_get_request(mrb);
   if (r == NULL) {
     mrb_raise(mrb, E_RUNTIME_ERROR,
         "can't use logger at this phase. only use at request phase");
@@ -357,7 +385,7 @@ static mrb_value ngx_mrb_redirect(mrb_state *mrb, mrb_value self)
   ngx_str_t ns;
   ngx_table_elt_t *location;
 
-  ngx_http_request_t *r = ngx_mrb_get_request();
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb);
   argc = mrb_get_args(mrb, "o|oo", &uri, &code);
 
   // get status code from args
@@ -420,6 +448,66 @@ static mrb_value ngx_mrb_redirect(mrb_state *mrb, mrb_value self)
   return self;
 }
 
+static void ngx_mrb_sleep_handler(ngx_event_t *ev)
+{
+  ngx_mrb_async_resume(ev->data, mrb_nil_value());
+}
+
+static void ngx_mrb_sleep_cleanup(void *data)
+{
+  ngx_event_t *ev = data;
+
+  if (ev->timer_set) {
+    ngx_del_timer(ev);
+  }
+}
+
+// request context of a handler fiber that can wait on nginx events; raises
+// anywhere else (filters, set and log handlers, init scripts)
+ngx_http_mruby_ctx_t *ngx_mrb_get_async_ctx(mrb_state *mrb, const char *name)
+{
+  ngx_http_mruby_ctx_t *ctx = ngx_mrb_get_ctx(mrb);
+
+  if (ctx == NULL || !ngx_mrb_ud(mrb)->in_fiber) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "%S is only available in post_read,"
+        " rewrite, access and content handlers with the \"fiber\" option",
+        mrb_str_new_cstr(mrb, name));
+  }
+
+  return ctx;
+}
+
+// arms the timer of Nginx.sleep, which then yields the handler fiber
+static mrb_value ngx_mrb_sleep(mrb_state *mrb, mrb_value self)
+{
+  mrb_int msec;
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_event_t *ev;
+  ngx_pool_cleanup_t *cln;
+
+  mrb_get_args(mrb, "i", &msec);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx.sleep");
+  if (msec < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative sleep time");
+  }
+
+  ev = ngx_pcalloc(ctx->r->pool, sizeof(ngx_event_t));
+  cln = ngx_pool_cleanup_add(ctx->r->pool, 0);
+  if (ev == NULL || cln == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate sleep timer");
+  }
+  ev->handler = ngx_mrb_sleep_handler;
+  ev->data = ctx;
+  ev->log = ctx->r->connection->log;
+  cln->handler = ngx_mrb_sleep_cleanup;
+  cln->data = ev;
+
+  ngx_add_timer(ev, (ngx_msec_t)msec);
+  ctx->async_wait = 1;
+
+  return self;
+}
+
 mrb_value ngx_mrb_f_global_remove(mrb_state *mrb, mrb_value self)
 {
   mrb_sym id;
@@ -502,4 +590,5 @@ void ngx_mrb_core_class_init(mrb_state *mrb, struct RClass *class)
   mrb_define_class_method(mrb, class, "configure", ngx_http_mruby_get_nginx_configure, MRB_ARGS_NONE());
   mrb_define_class_method(mrb, class, "redirect", ngx_mrb_redirect, MRB_ARGS_ANY());
   mrb_define_class_method(mrb, class, "remove_global_variable", ngx_mrb_f_global_remove, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, class, "_sleep", ngx_mrb_sleep, MRB_ARGS_REQ(1));
 }
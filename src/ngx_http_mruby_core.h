@@ -17,14 +17,72 @@ typedef struct ngx_mrb_rputs_chain_list_t {
 } ngx_mrb_rputs_chain_list_t;
 
 typedef struct ngx_http_mruby_ctx_t {
+  ngx_http_request_t *r;
   ngx_mrb_rputs_chain_list_t *rputs_chain;
   u_char *body;
   u_char *last;
   size_t body_length;
+
+  // execution stats reported by mruby_stats_header
+  ngx_uint_t exec_runs;
+  ngx_int_t exec_usec;
+  ngx_uint_t exec_allocs;
+
+  // handler running as a fiber, see ngx_mrb_fiber_start
+  struct ngx_mrb_state_t *async_state;
+  struct ngx_mrb_code_t *async_code;
+  ngx_flag_t async_cached;
+  mrb_value async_fiber;
+  ngx_int_t async_rc;
+  // write_event_handler while waiting, set by the operation that yields
+  ngx_http_event_handler_pt async_write_handler;
+
+  // subrequests of Nginx::Subrequest.capture_multi
+  struct ngx_mrb_capture_t *captures;
+  ngx_uint_t ncaptures;
+  ngx_uint_t captures_pending;
+  // Nginx::Subrequest.hedged in progress
+  struct ngx_mrb_hedge_t *hedge;
+  unsigned async_wait:1;
+  unsigned async_done:1;
+  unsigned async_rooted:1;
+  unsigned async_cleanup:1;
 } ngx_http_mruby_ctx_t;
 
+// classes and symbols used by the bindings, resolved once per mrb_state by
+// ngx_mrb_class_init and reachable through mrb->ud
+typedef struct ngx_mrb_ud_t {
+  struct RClass *nginx_class;
+  struct RClass *request_class;
+  struct RClass *var_class;
+  struct RClass *headers_in_class;
+  struct RClass *headers_out_class;
+  mrb_sym iv_var_sym;
+  mrb_sym headers_in_obj_sym;
+  mrb_sym headers_out_obj_sym;
+  mrb_sym gc_roots_sym;
+  mrb_sym call_sym;
+  mrb_sym prepare_fiber_sym;
+  mrb_sym again_sym;
+  struct RClass *socket_error_class;
+  struct RClass *resolver_error_class;
+  struct RClass *shdict_error_class;
+  struct RClass *bloom_error_class;
+  struct RClass *table_error_class;
+
+  // set by ngx_mrb_run for the duration of a handler invocation
+  ngx_http_mruby_ctx_t *ctx;
+  // the running code is a handler fiber that may yield
+  ngx_uint_t in_fiber;
+} ngx_mrb_ud_t;
+
+#define ngx_mrb_ud(mrb) ((ngx_mrb_ud_t *)(mrb)->ud)
+
 void ngx_mrb_raise_error(mrb_state *mrb, mrb_value obj, ngx_http_request_t *r);
 void ngx_mrb_raise_cycle_error(mrb_state *mrb, mrb_value obj, ngx_cycle_t *cycle);
 void ngx_mrb_raise_conf_error(mrb_state *mrb, mrb_value obj, ngx_conf_t *cf);
+void ngx_mrb_gc_register(mrb_state *mrb, mrb_value obj);
+void ngx_mrb_gc_unregister(mrb_state *mrb, mrb_value obj);
+ngx_http_mruby_ctx_t *ngx_mrb_get_async_ctx(mrb_state *mrb, const char *name);
 
 #endif // NGX_HTTP_MRUBY_CORE_H
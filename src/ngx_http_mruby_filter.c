@@ -17,16 +17,18 @@
 
 static mrb_value ngx_mrb_get_filter_body(mrb_state *mrb, mrb_value self)
 {
-  ngx_http_request_t *r = ngx_mrb_get_request();
-  ngx_http_mruby_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  ngx_http_mruby_ctx_t *ctx;
+
+  (void) ngx_mrb_get_request_or_raise(mrb);
+  ctx = ngx_mrb_get_ctx(mrb);
 
   return mrb_str_new(mrb, (char *)ctx->body, ctx->body_length);
 }
 
 static mrb_value ngx_mrb_set_filter_body(mrb_state *mrb, mrb_value self)
 {
-  ngx_http_request_t *r = ngx_mrb_get_request();
-  ngx_http_mruby_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb);
+  ngx_http_mruby_ctx_t *ctx = ngx_mrb_get_ctx(mrb);
   ngx_int_t rc;
   ngx_chain_t out;
   ngx_buf_t *b;
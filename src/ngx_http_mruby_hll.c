@@ -0,0 +1,449 @@
+/*
+// ngx_http_mruby_hll.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_hll.h"
+
+#include <math.h>
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::HyperLogLog, named cardinality counters in a zone declared with
+// mruby_hll_zone and shared by all workers. A counter has 2^14 registers
+// of 6 bits, ten to an atomic word (about 12.8 KB), for a standard error of
+// 0.81%. Adding a value is a hash and, only when it raises its register, a
+// compare-and-swap of one word; counting is a pass over the words.
+//
+// The zone is a fixed table of counters. A name is hashed to a 64 bit
+// fingerprint that claims a counter with a CAS, as Nginx::RateLimiter does
+// with its slots; a counter opened with a ttl may be claimed by another
+// name once the ttl has passed, which suits a counter per time window.
+*/
+
+#define NGX_MRB_HLL_P                  14
+#define NGX_MRB_HLL_REGISTERS          (1 << NGX_MRB_HLL_P)
+#define NGX_MRB_HLL_PER_WORD           10
+#define NGX_MRB_HLL_WORDS                                                    \
+  ((NGX_MRB_HLL_REGISTERS + NGX_MRB_HLL_PER_WORD - 1) / NGX_MRB_HLL_PER_WORD)
+// counters looked at for a name, starting at the one it hashes to
+#define NGX_MRB_HLL_PROBES             16
+
+typedef struct {
+  // fingerprint of the name, 0 for an unused counter
+  ngx_atomic_t key;
+  // msec since the epoch, 0 for never
+  ngx_atomic_t expires;
+  ngx_atomic_t words[NGX_MRB_HLL_WORDS];
+} ngx_mrb_hll_counter_t;
+
+typedef struct {
+  ngx_uint_t ncounters;
+  ngx_mrb_hll_counter_t *counters;
+} ngx_mrb_hll_sh_t;
+
+// shm_zone->data of a mruby_hll_zone, one per cycle
+typedef struct {
+  ngx_str_t name;
+  ngx_mrb_hll_sh_t *sh;
+} ngx_mrb_hll_zone_t;
+
+// an Nginx::HyperLogLog
+typedef struct {
+  ngx_mrb_hll_zone_t *zone;
+  uint64_t fp;
+  ngx_msec_t ttl;
+  // the counter of fp when it was last looked up
+  ngx_mrb_hll_counter_t *counter;
+} ngx_mrb_hll_t;
+
+static void ngx_mrb_hll_free(mrb_state *mrb, void *data);
+
+static const struct mrb_data_type ngx_mrb_hll_data_type = {
+  "Nginx::HyperLogLog", ngx_mrb_hll_free,
+};
+
+static void ngx_mrb_hll_free(mrb_state *mrb, void *data)
+{
+  mrb_free(mrb, data);
+}
+
+static uint64_t ngx_mrb_hll_now(void)
+{
+  ngx_time_t *tp = ngx_timeofday();
+
+  return (uint64_t) tp->sec * 1000 + tp->msec;
+}
+
+// FNV-1a with the finalizer of MurmurHash3, all 64 bits are good
+static uint64_t ngx_mrb_hll_hash(u_char *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+static ngx_int_t ngx_mrb_hll_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_mrb_hll_zone_t *octx = data;
+  ngx_mrb_hll_zone_t *ctx = shm_zone->data;
+  ngx_slab_pool_t *shpool;
+  ngx_mrb_hll_sh_t *sh;
+  size_t len;
+
+  // the zone of the previous cycle, kept by nginx with its contents
+  if (octx != NULL) {
+    ctx->sh = octx->sh;
+    return NGX_OK;
+  }
+
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  if (shm_zone->shm.exists) {
+    ctx->sh = shpool->data;
+    return NGX_OK;
+  }
+
+  len = sizeof(" in mruby_hll_zone \"\"") + shm_zone->shm.name.len;
+  shpool->log_ctx = ngx_slab_alloc(shpool, len);
+  sh = ngx_slab_alloc(shpool, sizeof(ngx_mrb_hll_sh_t));
+  if (shpool->log_ctx == NULL || sh == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(shpool->log_ctx, " in mruby_hll_zone \"%V\"%Z",
+      &shm_zone->shm.name);
+
+  // the counters take the pages left, less a few for the small allocations
+  // above and the rounding of the slab pool
+  len = shpool->end - shpool->start;
+  len = len > 3 * ngx_pagesize ? len - 3 * ngx_pagesize : 0;
+  sh->ncounters = len / sizeof(ngx_mrb_hll_counter_t);
+  if (sh->ncounters == 0) {
+    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0
+      , "%s ERROR %s:%d: mruby_hll_zone \"%V\" is too small for a counter"
+      , MODULE_NAME
+      , __func__
+      , __LINE__
+      , &shm_zone->shm.name
+    );
+    return NGX_ERROR;
+  }
+  len = sh->ncounters * sizeof(ngx_mrb_hll_counter_t);
+  sh->counters = ngx_slab_alloc(shpool, len);
+  if (sh->counters == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(sh->counters, len);
+  ctx->sh = sh;
+  shpool->data = sh;
+
+  return NGX_OK;
+}
+
+char *ngx_http_mruby_hll_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_mruby_main_conf_t *mmcf = conf;
+  ngx_str_t *value;
+  ngx_shm_zone_t *shm_zone, **zp;
+  ngx_mrb_hll_zone_t *ctx;
+  ssize_t size;
+
+  value = cf->args->elts;
+
+#if (NGX_PTR_SIZE < 8)
+  // the registers are packed into 64 bit atomic words
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_hll_zone needs a 64 bit"
+      " platform");
+  return NGX_CONF_ERROR;
+#endif
+
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"",
+        &value[2]);
+    return NGX_CONF_ERROR;
+  }
+  if (size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_hll_zone \"%V\" is too"
+        " small", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_mrb_hll_zone_t));
+  if (ctx == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  ctx->name = value[1];
+
+  shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+      &ngx_http_mruby_module);
+  if (shm_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  // zone names are shared with the other mruby zones
+  if (shm_zone->data != NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+        &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  shm_zone->init = ngx_mrb_hll_init_zone;
+  shm_zone->data = ctx;
+
+  if (mmcf->hll_zones == NULL) {
+    mmcf->hll_zones = ngx_array_create(cf->pool, 4, sizeof(ngx_shm_zone_t *));
+    if (mmcf->hll_zones == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+  zp = ngx_array_push(mmcf->hll_zones);
+  if (zp == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  *zp = shm_zone;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_mrb_hll_zone_t *ngx_mrb_hll_zone(mrb_state *mrb, mrb_value name)
+{
+  ngx_http_mruby_main_conf_t *mmcf;
+  ngx_shm_zone_t **zones;
+  ngx_mrb_hll_zone_t *z;
+  ngx_uint_t i;
+
+  name = mrb_str_to_str(mrb, name);
+  mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mruby_module);
+  if (mmcf != NULL && mmcf->hll_zones != NULL) {
+    zones = mmcf->hll_zones->elts;
+    for (i = 0; i < mmcf->hll_zones->nelts; i++) {
+      z = zones[i]->data;
+      if (z->name.len == (size_t) RSTRING_LEN(name)
+          && ngx_strncmp(z->name.data, RSTRING_PTR(name), z->name.len) == 0
+          && z->sh != NULL) {
+        return z;
+      }
+    }
+  }
+
+  // the zones are mapped after the configuration, i.e. after mruby_init
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "no mruby_hll_zone %S", name);
+
+  return NULL;
+}
+
+/*
+// the counter of h, claimed when h has none; the counter of another name
+// may be claimed when it has expired
+*/
+static ngx_mrb_hll_counter_t *ngx_mrb_hll_counter(mrb_state *mrb,
+    ngx_mrb_hll_t *h)
+{
+  ngx_mrb_hll_sh_t *sh = h->zone->sh;
+  ngx_mrb_hll_counter_t *c, *victim = NULL;
+  ngx_atomic_uint_t key, vkey = 0;
+  ngx_uint_t i, n;
+  uint64_t now;
+
+  c = h->counter;
+  if (c != NULL && c->key == h->fp) {
+    return c;
+  }
+
+  now = ngx_mrb_hll_now();
+  i = h->fp % sh->ncounters;
+  for (n = 0; n < NGX_MRB_HLL_PROBES && n < sh->ncounters; n++) {
+    c = &sh->counters[(i + n) % sh->ncounters];
+    key = c->key;
+    if (key == h->fp) {
+      h->counter = c;
+      return c;
+    }
+    if (victim == NULL
+        && (key == 0 || (c->expires != 0 && c->expires <= now))) {
+      victim = c;
+      vkey = key;
+    }
+  }
+
+  if (victim != NULL && ngx_atomic_cmp_set(&victim->key, vkey, h->fp)) {
+    ngx_memzero((void *) victim->words, sizeof(victim->words));
+    victim->expires = h->ttl ? now + h->ttl : 0;
+    h->counter = victim;
+    return victim;
+  }
+  // claimed meanwhile, maybe for the same name by another worker
+  if (victim != NULL && victim->key == h->fp) {
+    h->counter = victim;
+    return victim;
+  }
+
+  mrb_raisef(mrb, E_RUNTIME_ERROR, "no free counter in mruby_hll_zone %S",
+      mrb_str_new(mrb, (char *) h->zone->name.data, h->zone->name.len));
+
+  return NULL;
+}
+
+static ngx_mrb_hll_t *ngx_mrb_hll_get(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_hll_t *h;
+
+  h = mrb_data_get_ptr(mrb, self, &ngx_mrb_hll_data_type);
+  if (h == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::HyperLogLog");
+  }
+
+  return h;
+}
+
+// initialize(zone, name, ttl = 0), ttl in seconds
+static mrb_value ngx_mrb_hll_init(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_hll_zone_t *zone;
+  ngx_mrb_hll_t *h;
+  mrb_value zname, name;
+  mrb_float ttl = 0;
+
+  mrb_get_args(mrb, "oS|f", &zname, &name, &ttl);
+  if (ttl < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative ttl");
+  }
+  zone = ngx_mrb_hll_zone(mrb, zname);
+  if (DATA_PTR(self) != NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::HyperLogLog already initialized");
+  }
+
+  h = mrb_malloc(mrb, sizeof(ngx_mrb_hll_t));
+  h->zone = zone;
+  h->fp = ngx_mrb_hll_hash((u_char *) RSTRING_PTR(name), RSTRING_LEN(name));
+  if (h->fp == 0) {
+    h->fp = 1;
+  }
+  h->ttl = (ngx_msec_t) (ttl * 1000);
+  h->counter = NULL;
+  DATA_TYPE(self) = &ngx_mrb_hll_data_type;
+  DATA_PTR(self) = h;
+
+  return self;
+}
+
+// add(value): true when the estimate may have changed
+static mrb_value ngx_mrb_hll_add(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_hll_t *h = ngx_mrb_hll_get(mrb, self);
+  ngx_mrb_hll_counter_t *c;
+  ngx_atomic_uint_t old, mask;
+  ngx_uint_t j, shift;
+  mrb_value v;
+  uint64_t x, rank;
+
+  mrb_get_args(mrb, "S", &v);
+  c = ngx_mrb_hll_counter(mrb, h);
+
+  x = ngx_mrb_hll_hash((u_char *) RSTRING_PTR(v), RSTRING_LEN(v));
+  j = (ngx_uint_t) (x >> (64 - NGX_MRB_HLL_P));
+  // the position of the first 1 bit in the rest, at most 64 - p + 1
+  x = (x << NGX_MRB_HLL_P) | ((uint64_t) 1 << (NGX_MRB_HLL_P - 1));
+  for (rank = 1; !(x & 0x8000000000000000ULL); x <<= 1) {
+    rank++;
+  }
+
+  shift = (j % NGX_MRB_HLL_PER_WORD) * 6;
+  mask = (ngx_atomic_uint_t) 63 << shift;
+  for ( ;; ) {
+    old = c->words[j / NGX_MRB_HLL_PER_WORD];
+    if (((old & mask) >> shift) >= rank) {
+      return mrb_false_value();
+    }
+    if (ngx_atomic_cmp_set(&c->words[j / NGX_MRB_HLL_PER_WORD], old,
+          (old & ~mask) | ((ngx_atomic_uint_t) rank << shift))) {
+      return mrb_true_value();
+    }
+  }
+}
+
+static mrb_value ngx_mrb_hll_count(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_hll_t *h = ngx_mrb_hll_get(mrb, self);
+  ngx_mrb_hll_counter_t *c;
+  ngx_atomic_uint_t v;
+  ngx_uint_t i, j, n, zeros = 0;
+  double sum = 0, m = NGX_MRB_HLL_REGISTERS, e;
+
+  c = ngx_mrb_hll_counter(mrb, h);
+  for (i = 0, n = 0; i < NGX_MRB_HLL_WORDS; i++) {
+    v = c->words[i];
+    for (j = 0; j < NGX_MRB_HLL_PER_WORD && n < NGX_MRB_HLL_REGISTERS;
+         j++, n++, v >>= 6) {
+      sum += 1.0 / (double) ((uint64_t) 1 << (v & 63));
+      zeros += (v & 63) == 0;
+    }
+  }
+
+  e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  // linear counting while many registers are still empty
+  if (e <= 2.5 * m && zeros > 0) {
+    e = m * log(m / zeros);
+  }
+
+  return mrb_fixnum_value((mrb_int) (e + 0.5));
+}
+
+// merge(other): adds the values counted by other, of any zone
+static mrb_value ngx_mrb_hll_merge(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_hll_t *h = ngx_mrb_hll_get(mrb, self);
+  ngx_mrb_hll_counter_t *c, *oc;
+  ngx_atomic_uint_t old, ov, nv, mask;
+  ngx_uint_t i, j;
+  mrb_value other;
+
+  mrb_get_args(mrb, "o", &other);
+  oc = ngx_mrb_hll_counter(mrb, ngx_mrb_hll_get(mrb, other));
+  c = ngx_mrb_hll_counter(mrb, h);
+  if (c == oc) {
+    return self;
+  }
+
+  for (i = 0; i < NGX_MRB_HLL_WORDS; i++) {
+    ov = oc->words[i];
+    do {
+      old = c->words[i];
+      nv = old;
+      for (j = 0; j < NGX_MRB_HLL_PER_WORD; j++) {
+        mask = (ngx_atomic_uint_t) 63 << (j * 6);
+        if ((ov & mask) > (nv & mask)) {
+          nv = (nv & ~mask) | (ov & mask);
+        }
+      }
+    } while (nv != old && !ngx_atomic_cmp_set(&c->words[i], old, nv));
+  }
+
+  return self;
+}
+
+void ngx_mrb_hll_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_hll;
+
+  class_hll = mrb_define_class_under(mrb, class, "HyperLogLog", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_hll, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_hll, "initialize", ngx_mrb_hll_init, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_hll, "add", ngx_mrb_hll_add, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_hll, "count", ngx_mrb_hll_count, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_hll, "merge", ngx_mrb_hll_merge, MRB_ARGS_REQ(1));
+}
@@ -12,6 +12,21 @@
 #include "ngx_http_mruby_var.h"
 #include "ngx_http_mruby_connection.h"
 #include "ngx_http_mruby_server.h"
+#include "ngx_http_mruby_socket.h"
+#include "ngx_http_mruby_subrequest.h"
+#include "ngx_http_mruby_resolver.h"
+#include "ngx_http_mruby_metrics.h"
+#include "ngx_http_mruby_timer.h"
+#include "ngx_http_mruby_waiter.h"
+#include "ngx_http_mruby_shdict.h"
+#include "ngx_http_mruby_lru.h"
+#include "ngx_http_mruby_ratelimit.h"
+#include "ngx_http_mruby_registry.h"
+#include "ngx_http_mruby_topk.h"
+#include "ngx_http_mruby_hll.h"
+#include "ngx_http_mruby_bloom.h"
+#include "ngx_http_mruby_ipset.h"
+#include "ngx_http_mruby_table.h"
 
 #include <mruby.h>
 #include <mruby/compile.h>
@@ -23,8 +38,62 @@ void ngx_mrb_var_class_init(mrb_state *mrb, struct RClass *calss);
 void ngx_mrb_conn_class_init(mrb_state *mrb, struct RClass *calss);
 void ngx_mrb_server_class_init(mrb_state *mrb, struct RClass *calss);
 void ngx_mrb_filter_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_socket_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_subrequest_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_resolver_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_metrics_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_timer_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_waiter_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_shdict_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_lru_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_ratelimit_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_registry_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_topk_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_hll_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_bloom_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_ipset_class_init(mrb_state *mrb, struct RClass *calss);
+void ngx_mrb_table_class_init(mrb_state *mrb, struct RClass *calss);
 
 
+static ngx_int_t ngx_mrb_ud_init(mrb_state *mrb, struct RClass *class)
+{
+  ngx_mrb_ud_t *ud;
+
+  ud = mrb_malloc(mrb, sizeof(ngx_mrb_ud_t));
+  if (ud == NULL) {
+    return NGX_ERROR;
+  }
+
+  ud->nginx_class = class;
+  ud->request_class = mrb_class_get_under(mrb, class, "Request");
+  ud->var_class = mrb_class_get_under(mrb, class, "Var");
+  ud->headers_in_class = mrb_class_get_under(mrb, class, "Headers_in");
+  ud->headers_out_class = mrb_class_get_under(mrb, class, "Headers_out");
+  ud->iv_var_sym = mrb_intern_lit(mrb, "@iv_var");
+  ud->headers_in_obj_sym = mrb_intern_lit(mrb, "headers_in_obj");
+  ud->headers_out_obj_sym = mrb_intern_lit(mrb, "headers_out_obj");
+  ud->gc_roots_sym = mrb_intern_lit(mrb, "ngx_mrb_gc_roots");
+  ud->call_sym = mrb_intern_lit(mrb, "call");
+  ud->prepare_fiber_sym = mrb_intern_lit(mrb, "_ngx_mrb_prepare_fiber");
+  ud->again_sym = mrb_intern_lit(mrb, "again");
+  ud->socket_error_class = mrb_class_get_under(mrb,
+      mrb_class_get_under(mrb, class, "Socket"), "Error");
+  ud->resolver_error_class = mrb_class_get_under(mrb,
+      mrb_class_get_under(mrb, class, "Resolver"), "Error");
+  ud->shdict_error_class = mrb_class_get_under(mrb,
+      mrb_class_get_under(mrb, class, "SharedDict"), "Error");
+  ud->bloom_error_class = mrb_class_get_under(mrb,
+      mrb_class_get_under(mrb, class, "BloomFilter"), "Error");
+  ud->table_error_class = mrb_class_get_under(mrb,
+      mrb_class_get_under(mrb, class, "MmapTable"), "Error");
+  ud->ctx = NULL;
+  ud->in_fiber = 0;
+
+  mrb->ud = ud;
+
+  return NGX_OK;
+}
+
 ngx_int_t ngx_mrb_class_init(mrb_state *mrb)
 {
   struct RClass *class;
@@ -37,6 +106,21 @@ ngx_int_t ngx_mrb_class_init(mrb_state *mrb)
   ngx_mrb_conn_class_init(mrb, class); GC_ARENA_RESTORE;
   ngx_mrb_server_class_init(mrb, class); GC_ARENA_RESTORE;
   ngx_mrb_filter_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_socket_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_subrequest_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_resolver_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_metrics_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_timer_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_waiter_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_shdict_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_lru_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_ratelimit_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_registry_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_topk_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_hll_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_bloom_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_ipset_class_init(mrb, class); GC_ARENA_RESTORE;
+  ngx_mrb_table_class_init(mrb, class); GC_ARENA_RESTORE;
 
-  return NGX_OK;
+  return ngx_mrb_ud_init(mrb, class);
 }
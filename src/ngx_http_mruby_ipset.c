@@ -0,0 +1,503 @@
+/*
+// ngx_http_mruby_ipset.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_ipset.h"
+#include "ngx_http_mruby_request.h"
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/array.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::IPSet maps IPv4 and IPv6 prefixes to values, the longest prefix
+// matching an address wins. The prefixes are compiled into a poptrie: a
+// multibit trie of 64 way nodes where a node keeps a bitmap of its children
+// and a bitmap of the runs of equal leaves, and finds the child or leaf of
+// the next 6 bits of the address with a popcount. Nodes are 24 bytes and
+// runs of leaves are stored once, so 100k prefixes take a few MB, and a
+// lookup is a walk of at most 6 nodes for IPv4 (22 for IPv6, 11 for
+// prefixes up to /64).
+//
+// The trie is per worker. replace compiles a new trie beside the one in use
+// and swaps them when it is done; a bad prefix raises and leaves the set as
+// it was.
+*/
+
+#define NGX_MRB_IPSET_FANOUT  (1 << NGX_MRB_IPSET_STRIDE)
+
+typedef struct {
+  // children, in the order of their bits
+  uint64_t vector;
+  // bits of the leaves that start a run of equal values
+  uint64_t leafvec;
+  uint32_t base0;
+  uint32_t base1;
+} ngx_mrb_ipset_node_t;
+
+// an address or prefix, big endian, IPv4 in the top 32 bits of hi
+typedef struct {
+  uint64_t hi;
+  uint64_t lo;
+} ngx_mrb_ipset_key_t;
+
+typedef struct {
+  ngx_mrb_ipset_key_t key;
+  uint32_t len;
+  // index in @values plus one, leaves are 0 where nothing matches
+  uint32_t value;
+} ngx_mrb_ipset_prefix_t;
+
+typedef struct {
+  ngx_mrb_ipset_node_t *nodes;
+  uint32_t *leaves;
+  uint32_t nnodes;
+  uint32_t nleaves;
+  uint32_t nodes_size;
+  uint32_t leaves_size;
+  uint32_t root4;
+  uint32_t root6;
+} ngx_mrb_ipset_trie_t;
+
+typedef struct {
+  ngx_mrb_ipset_trie_t trie;
+  // while replace runs; freed with the set when it raises
+  ngx_mrb_ipset_trie_t next;
+  ngx_mrb_ipset_prefix_t *prefixes;
+  mrb_int count;
+} ngx_mrb_ipset_t;
+
+static void ngx_mrb_ipset_free(mrb_state *mrb, void *data);
+
+static const struct mrb_data_type ngx_mrb_ipset_data_type = {
+  "Nginx::IPSet", ngx_mrb_ipset_free,
+};
+
+#if (defined __GNUC__ || defined __clang__)
+#define ngx_mrb_ipset_popcount(x)  __builtin_popcountll(x)
+#else
+static ngx_uint_t ngx_mrb_ipset_popcount(uint64_t x)
+{
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+  return (ngx_uint_t) ((x * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+static void ngx_mrb_ipset_trie_free(mrb_state *mrb, ngx_mrb_ipset_trie_t *t)
+{
+  mrb_free(mrb, t->nodes);
+  mrb_free(mrb, t->leaves);
+  ngx_memzero(t, sizeof(ngx_mrb_ipset_trie_t));
+}
+
+static void ngx_mrb_ipset_free(mrb_state *mrb, void *data)
+{
+  ngx_mrb_ipset_t *s = data;
+
+  ngx_mrb_ipset_trie_free(mrb, &s->trie);
+  ngx_mrb_ipset_trie_free(mrb, &s->next);
+  mrb_free(mrb, s->prefixes);
+  mrb_free(mrb, s);
+}
+
+// the stride bits of k from bit depth on
+static ngx_inline ngx_uint_t ngx_mrb_ipset_chunk(ngx_mrb_ipset_key_t *k,
+    ngx_uint_t depth)
+{
+  uint64_t v;
+
+  if (depth == 0) {
+    v = k->hi;
+  }
+  else if (depth < 64) {
+    v = (k->hi << depth) | (k->lo >> (64 - depth));
+  }
+  else {
+    v = k->lo << (depth - 64);
+  }
+
+  return (ngx_uint_t) (v >> (64 - NGX_MRB_IPSET_STRIDE));
+}
+
+static uint32_t ngx_mrb_ipset_lookup(ngx_mrb_ipset_trie_t *t, uint32_t root,
+    ngx_mrb_ipset_key_t *k)
+{
+  ngx_mrb_ipset_node_t *n;
+  ngx_uint_t depth;
+  uint64_t bit, mask;
+
+  n = &t->nodes[root];
+  for (depth = 0; ; depth += NGX_MRB_IPSET_STRIDE) {
+    bit = (uint64_t) 1 << ngx_mrb_ipset_chunk(k, depth);
+    mask = bit | (bit - 1);
+    if (!(n->vector & bit)) {
+      return t->leaves[n->base0 + ngx_mrb_ipset_popcount(n->leafvec & mask)
+                       - 1];
+    }
+    n = &t->nodes[n->base1 + ngx_mrb_ipset_popcount(n->vector & mask) - 1];
+  }
+}
+
+static int ngx_mrb_ipset_cmp(const void *one, const void *two)
+{
+  const ngx_mrb_ipset_prefix_t *a = one, *b = two;
+
+  if (a->key.hi != b->key.hi) {
+    return a->key.hi < b->key.hi ? -1 : 1;
+  }
+  if (a->key.lo != b->key.lo) {
+    return a->key.lo < b->key.lo ? -1 : 1;
+  }
+  if (a->len != b->len) {
+    return a->len < b->len ? -1 : 1;
+  }
+  // the later of two equal prefixes wins
+  return a->value < b->value ? -1 : (a->value > b->value);
+}
+
+static uint32_t ngx_mrb_ipset_alloc_nodes(mrb_state *mrb,
+    ngx_mrb_ipset_trie_t *t, uint32_t n)
+{
+  uint32_t first;
+
+  if (t->nnodes + n > t->nodes_size) {
+    t->nodes_size = ngx_max(t->nodes_size * 2, t->nnodes + n);
+    t->nodes = mrb_realloc(mrb, t->nodes,
+        t->nodes_size * sizeof(ngx_mrb_ipset_node_t));
+  }
+  first = t->nnodes;
+  t->nnodes += n;
+
+  return first;
+}
+
+static void ngx_mrb_ipset_push_leaf(mrb_state *mrb, ngx_mrb_ipset_trie_t *t,
+    uint32_t value)
+{
+  if (t->nleaves == t->leaves_size) {
+    t->leaves_size = ngx_max(t->leaves_size * 2, 64);
+    t->leaves = mrb_realloc(mrb, t->leaves,
+        t->leaves_size * sizeof(uint32_t));
+  }
+  t->leaves[t->nleaves++] = value;
+}
+
+/*
+// fills node idx from the n prefixes longer than depth below it, sorted by
+// ngx_mrb_ipset_cmp; def is the value of the longest prefix above it. A
+// prefix sorts before the prefixes it contains, so applying them in order
+// lets the more specific one win, and the prefixes longer than the node
+// under one child are next to each other.
+*/
+static void ngx_mrb_ipset_build(mrb_state *mrb, ngx_mrb_ipset_trie_t *t,
+    uint32_t idx, ngx_uint_t depth, ngx_mrb_ipset_prefix_t *p, ngx_uint_t n,
+    uint32_t def)
+{
+  uint32_t leaf[NGX_MRB_IPSET_FANOUT], base0, base1;
+  uint64_t vector = 0, leafvec = 0;
+  ngx_uint_t i, j, c, end, span;
+  ngx_int_t last = -1;
+
+  for (c = 0; c < NGX_MRB_IPSET_FANOUT; c++) {
+    leaf[c] = def;
+  }
+  for (i = 0; i < n; i++) {
+    c = ngx_mrb_ipset_chunk(&p[i].key, depth);
+    if (p[i].len > depth + NGX_MRB_IPSET_STRIDE) {
+      vector |= (uint64_t) 1 << c;
+      continue;
+    }
+    span = (ngx_uint_t) 1 << (depth + NGX_MRB_IPSET_STRIDE - p[i].len);
+    for (end = c + span; c < end; c++) {
+      leaf[c] = p[i].value;
+    }
+  }
+
+  base0 = t->nleaves;
+  for (c = 0; c < NGX_MRB_IPSET_FANOUT; c++) {
+    if (vector & ((uint64_t) 1 << c)) {
+      continue;
+    }
+    if (last == -1 || leaf[c] != (uint32_t) last) {
+      leafvec |= (uint64_t) 1 << c;
+      ngx_mrb_ipset_push_leaf(mrb, t, leaf[c]);
+      last = leaf[c];
+    }
+  }
+  base1 = ngx_mrb_ipset_alloc_nodes(mrb, t,
+      (uint32_t) ngx_mrb_ipset_popcount(vector));
+  t->nodes[idx].vector = vector;
+  t->nodes[idx].leafvec = leafvec;
+  t->nodes[idx].base0 = base0;
+  t->nodes[idx].base1 = base1;
+
+  for (i = 0; i < n; i = j) {
+    if (p[i].len <= depth + NGX_MRB_IPSET_STRIDE) {
+      j = i + 1;
+      continue;
+    }
+    c = ngx_mrb_ipset_chunk(&p[i].key, depth);
+    for (j = i + 1; j < n && p[j].len > depth + NGX_MRB_IPSET_STRIDE
+         && ngx_mrb_ipset_chunk(&p[j].key, depth) == c; j++) { }
+    ngx_mrb_ipset_build(mrb, t, base1 + (uint32_t) ngx_mrb_ipset_popcount(
+          vector & (((uint64_t) 1 << c) - 1)), depth + NGX_MRB_IPSET_STRIDE,
+        p + i, j - i, leaf[c]);
+  }
+}
+
+// the root of the n prefixes of a family, /0 ones are the default
+static uint32_t ngx_mrb_ipset_build_root(mrb_state *mrb,
+    ngx_mrb_ipset_trie_t *t, ngx_mrb_ipset_prefix_t *p, ngx_uint_t n)
+{
+  uint32_t root, def = 0;
+
+  while (n > 0 && p->len == 0) {
+    def = p->value;
+    p++;
+    n--;
+  }
+  root = ngx_mrb_ipset_alloc_nodes(mrb, t, 1);
+  ngx_mrb_ipset_build(mrb, t, root, 0, p, n, def);
+
+  return root;
+}
+
+// text as an address, IPv4 mapped IPv6 addresses as IPv4 ones
+static ngx_int_t ngx_mrb_ipset_parse(u_char *text, size_t len,
+    ngx_mrb_ipset_prefix_t *p)
+{
+  ngx_str_t s;
+  ngx_cidr_t cidr;
+#if (NGX_HAVE_INET6)
+  ngx_uint_t i;
+  u_char *a;
+#endif
+
+  s.data = text;
+  s.len = len;
+  if (ngx_ptocidr(&s, &cidr) == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  if (cidr.family == AF_INET) {
+    p->key.hi = (uint64_t) ntohl(cidr.u.in.addr) << 32;
+    p->key.lo = 0;
+    p->len = ngx_mrb_ipset_popcount(ntohl(cidr.u.in.mask));
+    return AF_INET;
+  }
+
+#if (NGX_HAVE_INET6)
+  a = cidr.u.in6.addr.s6_addr;
+  p->key.hi = 0;
+  p->key.lo = 0;
+  for (i = 0; i < 8; i++) {
+    p->key.hi = (p->key.hi << 8) | a[i];
+    p->key.lo = (p->key.lo << 8) | a[i + 8];
+  }
+  p->len = 0;
+  for (i = 0; i < 16; i++) {
+    p->len += ngx_mrb_ipset_popcount(cidr.u.in6.mask.s6_addr[i]);
+  }
+  if (IN6_IS_ADDR_V4MAPPED(&cidr.u.in6.addr) && p->len >= 96) {
+    p->key.hi = p->key.lo << 32;
+    p->key.lo = 0;
+    p->len -= 96;
+    return AF_INET;
+  }
+
+  return AF_INET6;
+#else
+  return NGX_ERROR;
+#endif
+}
+
+static ngx_mrb_ipset_t *ngx_mrb_ipset_get(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_ipset_t *s;
+
+  s = mrb_data_get_ptr(mrb, self, &ngx_mrb_ipset_data_type);
+  if (s == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::IPSet");
+  }
+
+  return s;
+}
+
+// _build(cidrs, values), see Nginx::IPSet#replace
+static mrb_value ngx_mrb_ipset_replace(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_ipset_prefix_t *p, tmp;
+  ngx_mrb_ipset_t *s;
+  ngx_uint_t n4, n6;
+  mrb_value cidrs, values, cidr;
+  mrb_int i, n;
+  ngx_int_t family;
+
+  mrb_get_args(mrb, "AA", &cidrs, &values);
+  n = RARRAY_LEN(cidrs);
+  if (RARRAY_LEN(values) != n) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "a value for each prefix required");
+  }
+
+  s = DATA_PTR(self);
+  if (s == NULL) {
+    s = mrb_malloc(mrb, sizeof(ngx_mrb_ipset_t));
+    ngx_memzero(s, sizeof(ngx_mrb_ipset_t));
+    DATA_TYPE(self) = &ngx_mrb_ipset_data_type;
+    DATA_PTR(self) = s;
+  }
+  // left over by a replace that raised
+  ngx_mrb_ipset_trie_free(mrb, &s->next);
+  mrb_free(mrb, s->prefixes);
+  s->prefixes = mrb_malloc(mrb,
+      (n ? n : 1) * sizeof(ngx_mrb_ipset_prefix_t));
+
+  // IPv4 prefixes from the start, IPv6 ones from the end
+  n4 = 0;
+  n6 = 0;
+  for (i = 0; i < n; i++) {
+    cidr = mrb_ary_ref(mrb, cidrs, i);
+    if (!mrb_string_p(cidr)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "IP prefix must be a String");
+    }
+    family = ngx_mrb_ipset_parse((u_char *) RSTRING_PTR(cidr),
+        RSTRING_LEN(cidr), &tmp);
+    if (family == NGX_ERROR) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid IP prefix %S", cidr);
+    }
+    tmp.value = (uint32_t) i + 1;
+    if (family == AF_INET) {
+      s->prefixes[n4++] = tmp;
+    }
+    else {
+      s->prefixes[n - 1 - n6++] = tmp;
+    }
+  }
+  p = s->prefixes;
+  ngx_qsort(p, n4, sizeof(ngx_mrb_ipset_prefix_t), ngx_mrb_ipset_cmp);
+  ngx_qsort(p + n - n6, n6, sizeof(ngx_mrb_ipset_prefix_t),
+      ngx_mrb_ipset_cmp);
+
+  s->next.root4 = ngx_mrb_ipset_build_root(mrb, &s->next, p, n4);
+  s->next.root6 = ngx_mrb_ipset_build_root(mrb, &s->next, p + n - n6, n6);
+  mrb_free(mrb, s->prefixes);
+  s->prefixes = NULL;
+
+  ngx_mrb_ipset_trie_free(mrb, &s->trie);
+  s->trie = s->next;
+  ngx_memzero(&s->next, sizeof(ngx_mrb_ipset_trie_t));
+  s->count = n;
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@values"), values);
+
+  return self;
+}
+
+static mrb_value ngx_mrb_ipset_value(mrb_state *mrb, mrb_value self,
+    uint32_t value)
+{
+  if (value == 0) {
+    return mrb_nil_value();
+  }
+
+  return mrb_ary_ref(mrb, mrb_iv_get(mrb, self,
+        mrb_intern_lit(mrb, "@values")), value - 1);
+}
+
+// [](address): the value of the longest prefix containing it, or nil
+static mrb_value ngx_mrb_ipset_aref(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_ipset_t *s = ngx_mrb_ipset_get(mrb, self);
+  ngx_mrb_ipset_prefix_t p;
+  ngx_int_t family;
+  char *addr;
+  mrb_int len;
+
+  mrb_get_args(mrb, "s", &addr, &len);
+  // an address, not a prefix
+  if (ngx_strlchr((u_char *) addr, (u_char *) addr + len, '/') != NULL) {
+    return mrb_nil_value();
+  }
+  family = ngx_mrb_ipset_parse((u_char *) addr, len, &p);
+  if (family == NGX_ERROR) {
+    return mrb_nil_value();
+  }
+
+  return ngx_mrb_ipset_value(mrb, self, ngx_mrb_ipset_lookup(&s->trie,
+        family == AF_INET ? s->trie.root4 : s->trie.root6, &p.key));
+}
+
+// the value for the client address of the request, from its sockaddr
+static mrb_value ngx_mrb_ipset_match_remote(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_ipset_t *s = ngx_mrb_ipset_get(mrb, self);
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb);
+  ngx_mrb_ipset_key_t k;
+  struct sockaddr_in *sin;
+#if (NGX_HAVE_INET6)
+  struct sockaddr_in6 *sin6;
+  ngx_uint_t i;
+  u_char *a;
+#endif
+
+  switch (r->connection->sockaddr->sa_family) {
+
+  case AF_INET:
+    sin = (struct sockaddr_in *) r->connection->sockaddr;
+    k.hi = (uint64_t) ntohl(sin->sin_addr.s_addr) << 32;
+    k.lo = 0;
+    return ngx_mrb_ipset_value(mrb, self,
+        ngx_mrb_ipset_lookup(&s->trie, s->trie.root4, &k));
+
+#if (NGX_HAVE_INET6)
+  case AF_INET6:
+    sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+    a = sin6->sin6_addr.s6_addr;
+    k.hi = 0;
+    k.lo = 0;
+    for (i = 0; i < 8; i++) {
+      k.hi = (k.hi << 8) | a[i];
+      k.lo = (k.lo << 8) | a[i + 8];
+    }
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+      k.hi = k.lo << 32;
+      k.lo = 0;
+      return ngx_mrb_ipset_value(mrb, self,
+          ngx_mrb_ipset_lookup(&s->trie, s->trie.root4, &k));
+    }
+    return ngx_mrb_ipset_value(mrb, self,
+        ngx_mrb_ipset_lookup(&s->trie, s->trie.root6, &k));
+#endif
+
+  default:
+    // unix sockets
+    return mrb_nil_value();
+  }
+}
+
+static mrb_value ngx_mrb_ipset_size(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_ipset_t *s = ngx_mrb_ipset_get(mrb, self);
+
+  return mrb_fixnum_value(s->count);
+}
+
+void ngx_mrb_ipset_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_ipset;
+
+  class_ipset = mrb_define_class_under(mrb, class, "IPSet", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_ipset, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_ipset, "_build", ngx_mrb_ipset_replace, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, class_ipset, "[]", ngx_mrb_ipset_aref, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_ipset, "match_remote", ngx_mrb_ipset_match_remote, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_ipset, "size", ngx_mrb_ipset_size, MRB_ARGS_NONE());
+}
@@ -0,0 +1,18 @@
+/*
+// ngx_http_mruby_ipset.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_IPSET_H
+#define NGX_HTTP_MRUBY_IPSET_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+// address bits consumed per trie level, a node has 1 << stride children
+#define NGX_MRB_IPSET_STRIDE           6
+
+#endif // NGX_HTTP_MRUBY_IPSET_H
@@ -0,0 +1,446 @@
+/*
+// ngx_http_mruby_lru.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_lru.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::LRUCache, a cache local to the worker (to its mrb_state) holding at
+// most max_items entries and max_bytes bytes. Keys are converted to Strings
+// as by Nginx::SharedDict (42 and "42" are the same key) and kept in a
+// chained hash table in C, the entries on an intrusive list in use order, so
+// get and set are O(1) and eviction takes the tail. The values themselves
+// stay Ruby objects: they live in the @values Array of the cache, in the
+// slot of their entry, which keeps them marked for the GC.
+*/
+
+#define NGX_MRB_LRU_BUCKETS            16
+
+typedef struct ngx_mrb_lru_entry_s  ngx_mrb_lru_entry_t;
+
+struct ngx_mrb_lru_entry_s {
+  ngx_mrb_lru_entry_t *next;
+  ngx_queue_t queue;
+  uint32_t hash;
+  // ngx_current_msec, when expire is set
+  ngx_msec_t expires;
+  unsigned expire:1;
+  size_t size;
+  ngx_uint_t slot;
+  size_t key_len;
+  u_char key[1];
+};
+
+typedef struct {
+  ngx_mrb_lru_entry_t **buckets;
+  ngx_uint_t nbuckets;
+  // most recently used first
+  ngx_queue_t lru;
+  ngx_uint_t items;
+  ngx_uint_t max_items;
+  size_t bytes;
+  // 0 for no limit
+  size_t max_bytes;
+  // unused slots of @values
+  ngx_uint_t *free;
+  ngx_uint_t nfree;
+
+  ngx_uint_t hits;
+  ngx_uint_t misses;
+  ngx_uint_t evictions;
+  ngx_uint_t expirations;
+} ngx_mrb_lru_t;
+
+static void ngx_mrb_lru_free(mrb_state *mrb, void *data);
+
+static const struct mrb_data_type ngx_mrb_lru_data_type = {
+  "Nginx::LRUCache", ngx_mrb_lru_free,
+};
+
+static void ngx_mrb_lru_clear_entries(ngx_mrb_lru_t *c)
+{
+  ngx_mrb_lru_entry_t *e;
+  ngx_queue_t *q;
+
+  while (!ngx_queue_empty(&c->lru)) {
+    q = ngx_queue_head(&c->lru);
+    e = ngx_queue_data(q, ngx_mrb_lru_entry_t, queue);
+    ngx_queue_remove(q);
+    ngx_free(e);
+  }
+  ngx_memzero(c->buckets, c->nbuckets * sizeof(ngx_mrb_lru_entry_t *));
+  for (c->nfree = 0; c->nfree < c->max_items; c->nfree++) {
+    c->free[c->nfree] = c->max_items - 1 - c->nfree;
+  }
+  c->items = 0;
+  c->bytes = 0;
+}
+
+static void ngx_mrb_lru_free(mrb_state *mrb, void *data)
+{
+  ngx_mrb_lru_t *c = data;
+
+  ngx_mrb_lru_clear_entries(c);
+  ngx_free(c->buckets);
+  ngx_free(c->free);
+  ngx_free(c);
+}
+
+static ngx_mrb_lru_t *ngx_mrb_lru_get(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c;
+
+  c = mrb_data_get_ptr(mrb, self, &ngx_mrb_lru_data_type);
+  if (c == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::LRUCache");
+  }
+
+  return c;
+}
+
+static mrb_value ngx_mrb_lru_values(mrb_state *mrb, mrb_value self)
+{
+  return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@values"));
+}
+
+static ngx_mrb_lru_entry_t **ngx_mrb_lru_find(ngx_mrb_lru_t *c,
+    mrb_value key, uint32_t hash)
+{
+  ngx_mrb_lru_entry_t **ep;
+
+  for (ep = &c->buckets[hash & (c->nbuckets - 1)]; *ep; ep = &(*ep)->next) {
+    if ((*ep)->hash == hash && (*ep)->key_len == (size_t) RSTRING_LEN(key)
+        && ngx_memcmp((*ep)->key, RSTRING_PTR(key), RSTRING_LEN(key)) == 0) {
+      return ep;
+    }
+  }
+
+  return NULL;
+}
+
+// unlinks the entry at *ep and frees it with its slot
+static void ngx_mrb_lru_remove(mrb_state *mrb, ngx_mrb_lru_t *c,
+    mrb_value values, ngx_mrb_lru_entry_t **ep)
+{
+  ngx_mrb_lru_entry_t *e = *ep;
+
+  *ep = e->next;
+  ngx_queue_remove(&e->queue);
+  mrb_ary_set(mrb, values, e->slot, mrb_nil_value());
+  c->free[c->nfree++] = e->slot;
+  c->items--;
+  c->bytes -= e->size;
+  ngx_free(e);
+}
+
+static void ngx_mrb_lru_remove_entry(mrb_state *mrb, ngx_mrb_lru_t *c,
+    mrb_value values, ngx_mrb_lru_entry_t *e)
+{
+  ngx_mrb_lru_entry_t **ep;
+
+  for (ep = &c->buckets[e->hash & (c->nbuckets - 1)]; *ep != e;
+      ep = &(*ep)->next) { /* void */ }
+  ngx_mrb_lru_remove(mrb, c, values, ep);
+}
+
+static ngx_int_t ngx_mrb_lru_grow(ngx_mrb_lru_t *c)
+{
+  ngx_mrb_lru_entry_t **buckets, *e;
+  ngx_uint_t i, n = c->nbuckets * 2;
+
+  buckets = ngx_calloc(n * sizeof(ngx_mrb_lru_entry_t *), ngx_cycle->log);
+  if (buckets == NULL) {
+    return NGX_ERROR;
+  }
+  for (i = 0; i < c->nbuckets; i++) {
+    while (c->buckets[i] != NULL) {
+      e = c->buckets[i];
+      c->buckets[i] = e->next;
+      e->next = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+    }
+  }
+  ngx_free(c->buckets);
+  c->buckets = buckets;
+  c->nbuckets = n;
+
+  return NGX_OK;
+}
+
+static ngx_uint_t ngx_mrb_lru_expired(ngx_mrb_lru_entry_t *e)
+{
+  return e->expire && (ngx_msec_int_t) (e->expires - ngx_current_msec) <= 0;
+}
+
+// the live entry of key, counted as a hit or a miss
+static ngx_mrb_lru_entry_t *ngx_mrb_lru_lookup(mrb_state *mrb,
+    ngx_mrb_lru_t *c, mrb_value self, mrb_value key, ngx_uint_t count)
+{
+  ngx_mrb_lru_entry_t **ep;
+  uint32_t hash;
+
+  hash = ngx_murmur_hash2((u_char *) RSTRING_PTR(key), RSTRING_LEN(key));
+  ep = ngx_mrb_lru_find(c, key, hash);
+  if (ep != NULL && ngx_mrb_lru_expired(*ep)) {
+    ngx_mrb_lru_remove(mrb, c, ngx_mrb_lru_values(mrb, self), ep);
+    c->expirations++;
+    ep = NULL;
+  }
+  if (ep == NULL) {
+    c->misses += count;
+    return NULL;
+  }
+  c->hits += count;
+
+  return *ep;
+}
+
+// initialize(max_items, max_bytes = 0), 0 bytes for no limit
+static mrb_value ngx_mrb_lru_init(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c;
+  mrb_int max_items, max_bytes = 0, i;
+  mrb_value values;
+
+  mrb_get_args(mrb, "i|i", &max_items, &max_bytes);
+  if (max_items <= 0 || max_bytes < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_items must be positive");
+  }
+  if (DATA_PTR(self) != NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::LRUCache already initialized");
+  }
+  DATA_TYPE(self) = &ngx_mrb_lru_data_type;
+
+  values = mrb_ary_new_capa(mrb, max_items);
+  for (i = 0; i < max_items; i++) {
+    mrb_ary_push(mrb, values, mrb_nil_value());
+  }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@values"), values);
+
+  c = ngx_calloc(sizeof(ngx_mrb_lru_t), ngx_cycle->log);
+  if (c == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::LRUCache");
+  }
+  c->nbuckets = NGX_MRB_LRU_BUCKETS;
+  c->buckets = ngx_calloc(c->nbuckets * sizeof(ngx_mrb_lru_entry_t *),
+      ngx_cycle->log);
+  c->free = ngx_alloc(max_items * sizeof(ngx_uint_t), ngx_cycle->log);
+  if (c->buckets == NULL || c->free == NULL) {
+    ngx_free(c->buckets);
+    ngx_free(c->free);
+    ngx_free(c);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::LRUCache");
+  }
+  c->max_items = max_items;
+  c->max_bytes = max_bytes;
+  ngx_queue_init(&c->lru);
+  ngx_mrb_lru_clear_entries(c);
+  DATA_PTR(self) = c;
+
+  return self;
+}
+
+static mrb_value ngx_mrb_lru_get_method(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c = ngx_mrb_lru_get(mrb, self);
+  ngx_mrb_lru_entry_t *e;
+  mrb_value key;
+
+  mrb_get_args(mrb, "o", &key);
+  key = mrb_str_to_str(mrb, key);
+  e = ngx_mrb_lru_lookup(mrb, c, self, key, 1);
+  if (e == NULL) {
+    return mrb_nil_value();
+  }
+  ngx_queue_remove(&e->queue);
+  ngx_queue_insert_head(&c->lru, &e->queue);
+
+  return mrb_ary_ref(mrb, ngx_mrb_lru_values(mrb, self), e->slot);
+}
+
+static mrb_value ngx_mrb_lru_key_p(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c = ngx_mrb_lru_get(mrb, self);
+  mrb_value key;
+
+  mrb_get_args(mrb, "o", &key);
+  key = mrb_str_to_str(mrb, key);
+
+  return mrb_bool_value(ngx_mrb_lru_lookup(mrb, c, self, key, 0) != NULL);
+}
+
+/*
+// set(key, value, ttl = 0, size = nil): ttl in seconds, 0 for none; size
+// is what the entry counts against max_bytes, by default the key and, for a
+// String, its bytes. An entry larger than max_bytes is not kept.
+*/
+static mrb_value ngx_mrb_lru_set(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c = ngx_mrb_lru_get(mrb, self);
+  ngx_mrb_lru_entry_t **ep, *e;
+  mrb_value key, value, values, size = mrb_nil_value();
+  mrb_float ttl = 0;
+  uint32_t hash;
+  size_t bytes;
+  ngx_queue_t *q;
+
+  mrb_get_args(mrb, "oo|fo", &key, &value, &ttl, &size);
+  key = mrb_str_to_str(mrb, key);
+  if (ttl < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative ttl");
+  }
+  if (!mrb_nil_p(size)) {
+    bytes = (size_t) mrb_fixnum(mrb_to_int(mrb, size));
+  }
+  else {
+    bytes = mrb_string_p(value) ? (size_t) RSTRING_LEN(value) : 0;
+  }
+  bytes += sizeof(ngx_mrb_lru_entry_t) + RSTRING_LEN(key);
+
+  values = ngx_mrb_lru_values(mrb, self);
+  hash = ngx_murmur_hash2((u_char *) RSTRING_PTR(key), RSTRING_LEN(key));
+  ep = ngx_mrb_lru_find(c, key, hash);
+
+  if (c->max_bytes && bytes > c->max_bytes) {
+    if (ep != NULL) {
+      ngx_mrb_lru_remove(mrb, c, values, ep);
+    }
+    return value;
+  }
+
+  if (ep != NULL) {
+    e = *ep;
+    ngx_queue_remove(&e->queue);
+    c->bytes -= e->size;
+  }
+  else {
+    if (c->items >= c->nbuckets && ngx_mrb_lru_grow(c) != NGX_OK) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "failed to grow Nginx::LRUCache");
+    }
+    e = ngx_alloc(offsetof(ngx_mrb_lru_entry_t, key) + RSTRING_LEN(key),
+        ngx_cycle->log);
+    if (e == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate cache entry");
+    }
+    // room for the new entry, it is not linked yet
+    while (c->items >= c->max_items
+        || (c->max_bytes && c->bytes + bytes > c->max_bytes)) {
+      q = ngx_queue_last(&c->lru);
+      ngx_mrb_lru_remove_entry(mrb, c, values,
+          ngx_queue_data(q, ngx_mrb_lru_entry_t, queue));
+      c->evictions++;
+    }
+    e->hash = hash;
+    e->key_len = RSTRING_LEN(key);
+    ngx_memcpy(e->key, RSTRING_PTR(key), e->key_len);
+    e->slot = c->free[--c->nfree];
+    e->next = c->buckets[hash & (c->nbuckets - 1)];
+    c->buckets[hash & (c->nbuckets - 1)] = e;
+    c->items++;
+  }
+
+  e->size = bytes;
+  e->expire = ttl > 0;
+  e->expires = ngx_current_msec + (ngx_msec_t) (ttl * 1000);
+  mrb_ary_set(mrb, values, e->slot, value);
+  c->bytes += bytes;
+
+  // a grown entry may push out others, never itself
+  while (c->max_bytes && c->bytes > c->max_bytes
+      && !ngx_queue_empty(&c->lru)) {
+    q = ngx_queue_last(&c->lru);
+    ngx_mrb_lru_remove_entry(mrb, c, values,
+        ngx_queue_data(q, ngx_mrb_lru_entry_t, queue));
+    c->evictions++;
+  }
+  ngx_queue_insert_head(&c->lru, &e->queue);
+
+  return value;
+}
+
+static mrb_value ngx_mrb_lru_delete(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c = ngx_mrb_lru_get(mrb, self);
+  ngx_mrb_lru_entry_t **ep;
+  mrb_value key, values, value;
+  uint32_t hash;
+
+  mrb_get_args(mrb, "o", &key);
+  key = mrb_str_to_str(mrb, key);
+  hash = ngx_murmur_hash2((u_char *) RSTRING_PTR(key), RSTRING_LEN(key));
+  ep = ngx_mrb_lru_find(c, key, hash);
+  if (ep == NULL) {
+    return mrb_nil_value();
+  }
+  values = ngx_mrb_lru_values(mrb, self);
+  value = ngx_mrb_lru_expired(*ep) ? mrb_nil_value()
+    : mrb_ary_ref(mrb, values, (*ep)->slot);
+  ngx_mrb_lru_remove(mrb, c, values, ep);
+
+  return value;
+}
+
+static mrb_value ngx_mrb_lru_clear(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c = ngx_mrb_lru_get(mrb, self);
+  mrb_value values = ngx_mrb_lru_values(mrb, self);
+  ngx_uint_t i;
+
+  ngx_mrb_lru_clear_entries(c);
+  for (i = 0; i < c->max_items; i++) {
+    mrb_ary_set(mrb, values, i, mrb_nil_value());
+  }
+
+  return self;
+}
+
+static mrb_value ngx_mrb_lru_size(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c = ngx_mrb_lru_get(mrb, self);
+
+  return mrb_fixnum_value(c->items);
+}
+
+static mrb_value ngx_mrb_lru_stats(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_lru_t *c = ngx_mrb_lru_get(mrb, self);
+  mrb_value h = mrb_hash_new(mrb);
+
+  mrb_hash_set(mrb, h, mrb_str_new_lit(mrb, "items"), mrb_fixnum_value(c->items));
+  mrb_hash_set(mrb, h, mrb_str_new_lit(mrb, "bytes"), mrb_fixnum_value(c->bytes));
+  mrb_hash_set(mrb, h, mrb_str_new_lit(mrb, "hits"), mrb_fixnum_value(c->hits));
+  mrb_hash_set(mrb, h, mrb_str_new_lit(mrb, "misses"), mrb_fixnum_value(c->misses));
+  mrb_hash_set(mrb, h, mrb_str_new_lit(mrb, "evictions"), mrb_fixnum_value(c->evictions));
+  mrb_hash_set(mrb, h, mrb_str_new_lit(mrb, "expirations"), mrb_fixnum_value(c->expirations));
+
+  return h;
+}
+
+void ngx_mrb_lru_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_lru;
+
+  class_lru = mrb_define_class_under(mrb, class, "LRUCache", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_lru, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_lru, "initialize", ngx_mrb_lru_init, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_lru, "get", ngx_mrb_lru_get_method, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_lru, "[]", ngx_mrb_lru_get_method, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_lru, "key?", ngx_mrb_lru_key_p, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_lru, "set", ngx_mrb_lru_set, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, class_lru, "[]=", ngx_mrb_lru_set, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, class_lru, "delete", ngx_mrb_lru_delete, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_lru, "clear", ngx_mrb_lru_clear, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_lru, "size", ngx_mrb_lru_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_lru, "stats", ngx_mrb_lru_stats, MRB_ARGS_NONE());
+}
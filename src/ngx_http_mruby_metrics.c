@@ -0,0 +1,596 @@
+/*
+// ngx_http_mruby_metrics.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_metrics.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::Metrics::UDP, a statsd (or dogstatsd) client. Metrics are buffered
+// per worker and destination: counters of the same name and tags are summed,
+// gauges keep their last value and timings are collected. A timer flushes
+// them every interval msec as newline separated lines packed into datagrams
+// of up to max_packet bytes, written with send(2) on a non-blocking socket;
+// a datagram the socket can not take at once is dropped and counted.
+*/
+
+// flush early rather than buffer without bound
+#define NGX_MRB_METRICS_MAX_KEYS       1024
+#define NGX_MRB_METRICS_MAX_VALUES     8192
+// longest value ngx_mrb_metrics_value writes
+#define NGX_MRB_METRICS_VALUE_LEN      24
+#define NGX_MRB_METRICS_VALUE_MAX      1e15
+
+typedef enum {
+  NGX_MRB_METRICS_COUNTER = 0,
+  NGX_MRB_METRICS_GAUGE,
+  // timings, histograms and distributions keep every value
+  NGX_MRB_METRICS_SERIES
+} ngx_mrb_metrics_type_t;
+
+typedef struct {
+  // "name|type" or "name|type|#tags", the line without its value
+  ngx_str_node_t sn;
+  ngx_queue_t queue;
+  size_t name_len;
+  ngx_mrb_metrics_type_t type;
+  double value;
+  double *values;
+  ngx_uint_t nvalues;
+  ngx_uint_t nalloc;
+} ngx_mrb_metrics_entry_t;
+
+typedef struct {
+  ngx_queue_t queue;
+  // "host:port"
+  ngx_str_t name;
+  u_char sockaddr[NGX_SOCKADDRLEN];
+  socklen_t socklen;
+  ngx_socket_t fd;
+  ngx_msec_t interval;
+  size_t max_packet;
+  ngx_uint_t dogstatsd;
+  ngx_event_t timer;
+
+  ngx_rbtree_t tree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t entries;
+  ngx_uint_t nentries;
+  ngx_uint_t nvalues;
+
+  u_char *packet;
+  size_t packet_len;
+  u_char *line;
+  ngx_uint_t sent;
+  ngx_uint_t dropped;
+} ngx_mrb_metrics_udp_t;
+
+// packets collects the datagrams of a flush instead of sending them
+typedef struct {
+  mrb_state *mrb;
+  mrb_value packets;
+} ngx_mrb_metrics_out_t;
+
+// destinations live as long as the worker, the objects only point at them
+static const struct mrb_data_type ngx_mrb_metrics_udp_data_type = {
+  "Nginx::Metrics::UDP", NULL,
+};
+
+static ngx_queue_t ngx_mrb_metrics_udp_sinks;
+
+static void ngx_mrb_metrics_udp_sinks_init(void)
+{
+  if (ngx_mrb_metrics_udp_sinks.next == NULL) {
+    ngx_queue_init(&ngx_mrb_metrics_udp_sinks);
+  }
+}
+
+static u_char *ngx_mrb_metrics_value(u_char *p, double v)
+{
+  u_char *last;
+
+  if (v > -NGX_MRB_METRICS_VALUE_MAX && v < NGX_MRB_METRICS_VALUE_MAX
+      && v == (double) (int64_t) v) {
+    return ngx_sprintf(p, "%L", (int64_t) v);
+  }
+
+  last = ngx_sprintf(p, "%.3f", v);
+  while (last[-1] == '0') {
+    last--;
+  }
+  if (last[-1] == '.') {
+    last--;
+  }
+
+  return last;
+}
+
+static ngx_int_t ngx_mrb_metrics_udp_open(ngx_mrb_metrics_udp_t *u)
+{
+  ngx_socket_t fd;
+
+  fd = ngx_socket(((struct sockaddr *) u->sockaddr)->sa_family, SOCK_DGRAM, 0);
+  if (fd == (ngx_socket_t) -1) {
+    ngx_log_error(NGX_LOG_ERR
+      , ngx_cycle->log
+      , ngx_socket_errno
+      , "%s ERROR %s:%d: " ngx_socket_n " failed for \"%V\""
+      , MODULE_NAME
+      , __func__
+      , __LINE__
+      , &u->name
+    );
+    return NGX_ERROR;
+  }
+  if (ngx_nonblocking(fd) == -1
+      || connect(fd, (struct sockaddr *) u->sockaddr, u->socklen) == -1) {
+    ngx_log_error(NGX_LOG_ERR
+      , ngx_cycle->log
+      , ngx_socket_errno
+      , "%s ERROR %s:%d: failed to set up the socket for \"%V\""
+      , MODULE_NAME
+      , __func__
+      , __LINE__
+      , &u->name
+    );
+    ngx_close_socket(fd);
+    return NGX_ERROR;
+  }
+  u->fd = fd;
+
+  return NGX_OK;
+}
+
+static void ngx_mrb_metrics_udp_send(ngx_mrb_metrics_udp_t *u,
+    ngx_mrb_metrics_out_t *out)
+{
+  ssize_t n;
+  ngx_err_t err;
+
+  if (out != NULL) {
+    mrb_ary_push(out->mrb, out->packets, mrb_str_new(out->mrb,
+          (char *) u->packet, u->packet_len));
+    u->packet_len = 0;
+    return;
+  }
+
+  if (u->fd == (ngx_socket_t) -1 && ngx_mrb_metrics_udp_open(u) != NGX_OK) {
+    u->dropped++;
+    u->packet_len = 0;
+    return;
+  }
+
+  u->sent++;
+  n = send(u->fd, u->packet, u->packet_len, 0);
+  if (n == -1) {
+    err = ngx_socket_errno;
+    u->dropped++;
+    // a refused datagram only means that nothing listens right now
+    if (err != NGX_EAGAIN) {
+      ngx_log_error(NGX_LOG_INFO
+        , ngx_cycle->log
+        , err
+        , "%s INFO %s:%d: send() to \"%V\" failed"
+        , MODULE_NAME
+        , __func__
+        , __LINE__
+        , &u->name
+      );
+    }
+  }
+  u->packet_len = 0;
+}
+
+static void ngx_mrb_metrics_udp_put(ngx_mrb_metrics_udp_t *u, u_char *line,
+    size_t len, ngx_mrb_metrics_out_t *out)
+{
+  if (u->packet_len > 0 && u->packet_len + 1 + len > u->max_packet) {
+    ngx_mrb_metrics_udp_send(u, out);
+  }
+  if (u->packet_len > 0) {
+    u->packet[u->packet_len++] = '\n';
+  }
+  ngx_memcpy(u->packet + u->packet_len, line, len);
+  u->packet_len += len;
+}
+
+static void ngx_mrb_metrics_udp_clear(ngx_mrb_metrics_udp_t *u)
+{
+  ngx_mrb_metrics_entry_t *e;
+  ngx_queue_t *q;
+
+  while (!ngx_queue_empty(&u->entries)) {
+    q = ngx_queue_head(&u->entries);
+    e = ngx_queue_data(q, ngx_mrb_metrics_entry_t, queue);
+    ngx_queue_remove(q);
+    ngx_rbtree_delete(&u->tree, &e->sn.node);
+    if (e->values != NULL) {
+      ngx_free(e->values);
+    }
+    ngx_free(e);
+  }
+  u->nentries = 0;
+  u->nvalues = 0;
+}
+
+// writes out the buffered metrics, into out when given and keeping them
+static ngx_uint_t ngx_mrb_metrics_udp_flush(ngx_mrb_metrics_udp_t *u,
+    ngx_mrb_metrics_out_t *out)
+{
+  ngx_mrb_metrics_entry_t *e;
+  ngx_queue_t *q;
+  ngx_uint_t i, sent = u->sent;
+  u_char *p, *start, *suffix;
+  size_t suffix_len;
+
+  for (q = ngx_queue_head(&u->entries);
+      q != ngx_queue_sentinel(&u->entries);
+      q = ngx_queue_next(q)) {
+    e = ngx_queue_data(q, ngx_mrb_metrics_entry_t, queue);
+    suffix = e->sn.str.data + e->name_len;
+    suffix_len = e->sn.str.len - e->name_len;
+    start = ngx_cpymem(u->line, e->sn.str.data, e->name_len);
+
+    if (e->type != NGX_MRB_METRICS_SERIES) {
+      p = start;
+      *p++ = ':';
+      p = ngx_mrb_metrics_value(p, e->value);
+      p = ngx_cpymem(p, suffix, suffix_len);
+      ngx_mrb_metrics_udp_put(u, u->line, p - u->line, out);
+      continue;
+    }
+
+    // dogstatsd takes "name:1:2:3|ms", statsd one value per line
+    p = start;
+    for (i = 0; i < e->nvalues; i++) {
+      if (p != start
+          && (!u->dogstatsd
+            || (size_t) (p - u->line) + 1 + NGX_MRB_METRICS_VALUE_LEN
+               + suffix_len > u->max_packet)) {
+        p = ngx_cpymem(p, suffix, suffix_len);
+        ngx_mrb_metrics_udp_put(u, u->line, p - u->line, out);
+        p = start;
+      }
+      *p++ = ':';
+      p = ngx_mrb_metrics_value(p, e->values[i]);
+    }
+    p = ngx_cpymem(p, suffix, suffix_len);
+    ngx_mrb_metrics_udp_put(u, u->line, p - u->line, out);
+  }
+
+  if (u->packet_len > 0) {
+    ngx_mrb_metrics_udp_send(u, out);
+  }
+  if (out != NULL) {
+    return 0;
+  }
+
+  if (u->timer.timer_set) {
+    ngx_del_timer(&u->timer);
+  }
+  ngx_mrb_metrics_udp_clear(u);
+
+  return u->sent - sent;
+}
+
+static void ngx_mrb_metrics_udp_timer_handler(ngx_event_t *ev)
+{
+  ngx_mrb_metrics_udp_flush(ev->data, NULL);
+}
+
+void ngx_mrb_metrics_exit_worker(void)
+{
+  ngx_mrb_metrics_udp_t *u;
+  ngx_queue_t *q;
+
+  ngx_mrb_metrics_udp_sinks_init();
+  for (q = ngx_queue_head(&ngx_mrb_metrics_udp_sinks);
+      q != ngx_queue_sentinel(&ngx_mrb_metrics_udp_sinks);
+      q = ngx_queue_next(q)) {
+    u = ngx_queue_data(q, ngx_mrb_metrics_udp_t, queue);
+    ngx_mrb_metrics_udp_flush(u, NULL);
+  }
+}
+
+static ngx_mrb_metrics_udp_t *ngx_mrb_metrics_udp_get(mrb_state *mrb,
+    mrb_value self)
+{
+  ngx_mrb_metrics_udp_t *u;
+
+  u = mrb_data_get_ptr(mrb, self, &ngx_mrb_metrics_udp_data_type);
+  if (u == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::Metrics::UDP");
+  }
+
+  return u;
+}
+
+// _init(host, port, interval, max_packet, dogstatsd); objects for the same
+// host and port share one buffer, set up by the first of them
+static mrb_value ngx_mrb_metrics_udp_init(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_metrics_udp_t *u;
+  ngx_queue_t *q;
+  ngx_addr_t addr;
+  mrb_value host;
+  mrb_int port, interval, max_packet;
+  mrb_bool dogstatsd;
+  u_char name[NGX_SOCKADDR_STRLEN + NGX_INT_T_LEN];
+  size_t len;
+
+  mrb_get_args(mrb, "Siiib", &host, &port, &interval, &max_packet,
+      &dogstatsd);
+  if (port <= 0 || port > 65535) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid port");
+  }
+  if (interval <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "interval must be positive");
+  }
+  if (max_packet < 32 || max_packet > 65507) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_packet must be 32 to 65507");
+  }
+  if (RSTRING_LEN(host) > NGX_SOCKADDR_STRLEN) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "host must be an IP address");
+  }
+  len = ngx_sprintf(ngx_cpymem(name, RSTRING_PTR(host), RSTRING_LEN(host)),
+      ":%i", (ngx_int_t) port) - name;
+
+  DATA_TYPE(self) = &ngx_mrb_metrics_udp_data_type;
+  DATA_PTR(self) = NULL;
+
+  ngx_mrb_metrics_udp_sinks_init();
+  for (q = ngx_queue_head(&ngx_mrb_metrics_udp_sinks);
+      q != ngx_queue_sentinel(&ngx_mrb_metrics_udp_sinks);
+      q = ngx_queue_next(q)) {
+    u = ngx_queue_data(q, ngx_mrb_metrics_udp_t, queue);
+    if (u->name.len == len && ngx_memcmp(u->name.data, name, len) == 0) {
+      DATA_PTR(self) = u;
+      return self;
+    }
+  }
+
+  // a blocking lookup has no place in a worker, see Nginx::Resolver
+  if (ngx_parse_addr(ngx_cycle->pool, &addr, (u_char *) RSTRING_PTR(host),
+        RSTRING_LEN(host)) != NGX_OK) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "host must be an IP address");
+  }
+
+  u = ngx_calloc(sizeof(ngx_mrb_metrics_udp_t) + len + 2 * max_packet,
+      ngx_cycle->log);
+  if (u == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::Metrics::UDP");
+  }
+  u->name.data = (u_char *) (u + 1);
+  u->name.len = len;
+  ngx_memcpy(u->name.data, name, len);
+  u->packet = u->name.data + len;
+  u->line = u->packet + max_packet;
+
+  ngx_memcpy(u->sockaddr, addr.sockaddr, addr.socklen);
+  u->socklen = addr.socklen;
+  switch (addr.sockaddr->sa_family) {
+#if (NGX_HAVE_INET6)
+  case AF_INET6:
+    ((struct sockaddr_in6 *) u->sockaddr)->sin6_port = htons((in_port_t) port);
+    break;
+#endif
+  default:
+    ((struct sockaddr_in *) u->sockaddr)->sin_port = htons((in_port_t) port);
+    break;
+  }
+
+  u->fd = (ngx_socket_t) -1;
+  u->interval = (ngx_msec_t) interval;
+  u->max_packet = (size_t) max_packet;
+  u->dogstatsd = dogstatsd;
+  u->timer.handler = ngx_mrb_metrics_udp_timer_handler;
+  u->timer.data = u;
+  u->timer.log = ngx_cycle->log;
+  ngx_rbtree_init(&u->tree, &u->sentinel, ngx_str_rbtree_insert_value);
+  ngx_queue_init(&u->entries);
+  ngx_queue_insert_tail(&ngx_mrb_metrics_udp_sinks, &u->queue);
+
+  DATA_PTR(self) = u;
+
+  return self;
+}
+
+static ngx_int_t ngx_mrb_metrics_type(mrb_value type,
+    ngx_mrb_metrics_type_t *t)
+{
+  ngx_str_t s;
+
+  s.data = (u_char *) RSTRING_PTR(type);
+  s.len = RSTRING_LEN(type);
+
+  if (s.len == 1 && s.data[0] == 'c') {
+    *t = NGX_MRB_METRICS_COUNTER;
+  }
+  else if (s.len == 1 && s.data[0] == 'g') {
+    *t = NGX_MRB_METRICS_GAUGE;
+  }
+  else if ((s.len == 2 && ngx_strncmp(s.data, "ms", 2) == 0)
+      || (s.len == 1 && (s.data[0] == 'h' || s.data[0] == 'd'))) {
+    *t = NGX_MRB_METRICS_SERIES;
+  }
+  else {
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+// _add(type, name, value, tags): type is "c", "g", "ms", "h" or "d" and
+// tags a "k:v,k:v" string or nil
+static mrb_value ngx_mrb_metrics_udp_add(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_metrics_udp_t *u = ngx_mrb_metrics_udp_get(mrb, self);
+  ngx_mrb_metrics_entry_t *e;
+  ngx_mrb_metrics_type_t t;
+  ngx_str_node_t *sn;
+  ngx_str_t key;
+  mrb_value type, name, tags = mrb_nil_value();
+  mrb_float value;
+  uint32_t hash;
+  double *values;
+  size_t len;
+  u_char *p;
+
+  mrb_get_args(mrb, "SSf|o", &type, &name, &value, &tags);
+  if (!mrb_nil_p(tags)) {
+    tags = mrb_str_to_str(mrb, tags);
+  }
+  if (ngx_mrb_metrics_type(type, &t) != NGX_OK) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown metric type");
+  }
+  if (!(value > -NGX_MRB_METRICS_VALUE_MAX
+        && value < NGX_MRB_METRICS_VALUE_MAX)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "metric value out of range");
+  }
+  if (RSTRING_LEN(name) == 0
+      || ngx_strlchr((u_char *) RSTRING_PTR(name),
+        (u_char *) RSTRING_PTR(name) + RSTRING_LEN(name), ':') != NULL
+      || ngx_strlchr((u_char *) RSTRING_PTR(name),
+        (u_char *) RSTRING_PTR(name) + RSTRING_LEN(name), '|') != NULL
+      || ngx_strlchr((u_char *) RSTRING_PTR(name),
+        (u_char *) RSTRING_PTR(name) + RSTRING_LEN(name), '\n') != NULL) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid metric name");
+  }
+
+  len = RSTRING_LEN(name) + 1 + RSTRING_LEN(type);
+  if (!mrb_nil_p(tags) && RSTRING_LEN(tags) > 0) {
+    if (ngx_strlchr((u_char *) RSTRING_PTR(tags),
+          (u_char *) RSTRING_PTR(tags) + RSTRING_LEN(tags), '|') != NULL
+        || ngx_strlchr((u_char *) RSTRING_PTR(tags),
+          (u_char *) RSTRING_PTR(tags) + RSTRING_LEN(tags), '\n') != NULL) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid metric tags");
+    }
+    len += 2 + RSTRING_LEN(tags);
+  }
+  if (len + 1 + NGX_MRB_METRICS_VALUE_LEN > u->max_packet) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "metric does not fit into max_packet");
+  }
+
+  // the key is built in u->line, which a flush overwrites
+  if (u->nentries >= NGX_MRB_METRICS_MAX_KEYS) {
+    ngx_mrb_metrics_udp_flush(u, NULL);
+  }
+
+  p = ngx_cpymem(u->line, RSTRING_PTR(name), RSTRING_LEN(name));
+  *p++ = '|';
+  p = ngx_cpymem(p, RSTRING_PTR(type), RSTRING_LEN(type));
+  if (!mrb_nil_p(tags) && RSTRING_LEN(tags) > 0) {
+    *p++ = '|';
+    *p++ = '#';
+    p = ngx_cpymem(p, RSTRING_PTR(tags), RSTRING_LEN(tags));
+  }
+  key.data = u->line;
+  key.len = len;
+  hash = ngx_crc32_short(key.data, key.len);
+
+  sn = ngx_str_rbtree_lookup(&u->tree, &key, hash);
+  if (sn != NULL) {
+    e = (ngx_mrb_metrics_entry_t *) sn;
+  }
+  else {
+    e = ngx_calloc(sizeof(ngx_mrb_metrics_entry_t) + len, ngx_cycle->log);
+    if (e == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate metric");
+    }
+    e->sn.str.data = (u_char *) (e + 1);
+    e->sn.str.len = len;
+    ngx_memcpy(e->sn.str.data, key.data, len);
+    e->sn.node.key = hash;
+    e->name_len = RSTRING_LEN(name);
+    e->type = t;
+    ngx_rbtree_insert(&u->tree, &e->sn.node);
+    ngx_queue_insert_tail(&u->entries, &e->queue);
+    u->nentries++;
+  }
+
+  switch (t) {
+  case NGX_MRB_METRICS_COUNTER:
+    e->value += value;
+    break;
+  case NGX_MRB_METRICS_GAUGE:
+    e->value = value;
+    break;
+  default:
+    if (e->nvalues == e->nalloc) {
+      values = ngx_alloc((e->nalloc ? 2 * e->nalloc : 8) * sizeof(double),
+          ngx_cycle->log);
+      if (values == NULL) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate metric");
+      }
+      if (e->values != NULL) {
+        ngx_memcpy(values, e->values, e->nvalues * sizeof(double));
+        ngx_free(e->values);
+      }
+      e->values = values;
+      e->nalloc = e->nalloc ? 2 * e->nalloc : 8;
+    }
+    e->values[e->nvalues++] = value;
+    u->nvalues++;
+    break;
+  }
+
+  if (u->nvalues >= NGX_MRB_METRICS_MAX_VALUES) {
+    ngx_mrb_metrics_udp_flush(u, NULL);
+  }
+  // there is no event loop before ngx_event_process_init, e.g. in
+  // mruby_init; the first metric of the worker arms the timer then
+  else if (!u->timer.timer_set && ngx_cycle->connections != NULL) {
+    ngx_add_timer(&u->timer, u->interval);
+  }
+
+  return self;
+}
+
+static mrb_value ngx_mrb_metrics_udp_flush_method(mrb_state *mrb,
+    mrb_value self)
+{
+  ngx_mrb_metrics_udp_t *u = ngx_mrb_metrics_udp_get(mrb, self);
+
+  return mrb_fixnum_value(ngx_mrb_metrics_udp_flush(u, NULL));
+}
+
+static mrb_value ngx_mrb_metrics_udp_packets(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_metrics_udp_t *u = ngx_mrb_metrics_udp_get(mrb, self);
+  ngx_mrb_metrics_out_t out;
+
+  out.mrb = mrb;
+  out.packets = mrb_ary_new(mrb);
+  ngx_mrb_metrics_udp_flush(u, &out);
+
+  return out.packets;
+}
+
+static mrb_value ngx_mrb_metrics_udp_dropped(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_metrics_udp_t *u = ngx_mrb_metrics_udp_get(mrb, self);
+
+  return mrb_fixnum_value(u->dropped);
+}
+
+void ngx_mrb_metrics_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *module_metrics, *class_udp;
+
+  module_metrics = mrb_define_module_under(mrb, class, "Metrics");
+  class_udp = mrb_define_class_under(mrb, module_metrics, "UDP", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_udp, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_udp, "_init", ngx_mrb_metrics_udp_init, MRB_ARGS_REQ(5));
+  mrb_define_method(mrb, class_udp, "_add", ngx_mrb_metrics_udp_add, MRB_ARGS_REQ(3) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_udp, "flush", ngx_mrb_metrics_udp_flush_method, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_udp, "packets", ngx_mrb_metrics_udp_packets, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_udp, "dropped", ngx_mrb_metrics_udp_dropped, MRB_ARGS_NONE());
+}
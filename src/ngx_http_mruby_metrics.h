@@ -0,0 +1,18 @@
+/*
+// ngx_http_mruby_metrics.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_METRICS_H
+#define NGX_HTTP_MRUBY_METRICS_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+// sends what Nginx::Metrics::UDP still buffers
+void ngx_mrb_metrics_exit_worker(void);
+
+#endif // NGX_HTTP_MRUBY_METRICS_H
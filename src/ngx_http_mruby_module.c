@@ -12,6 +12,14 @@
 #include "ngx_http_mruby_module.h"
 #include "ngx_http_mruby_core.h"
 #include "ngx_http_mruby_request.h"
+#include "ngx_http_mruby_subrequest.h"
+#include "ngx_http_mruby_thread.h"
+#include "ngx_http_mruby_metrics.h"
+#include "ngx_http_mruby_shdict.h"
+#include "ngx_http_mruby_ratelimit.h"
+#include "ngx_http_mruby_registry.h"
+#include "ngx_http_mruby_topk.h"
+#include "ngx_http_mruby_hll.h"
 
 #include <mruby.h>
 #include <mruby/proc.h>
@@ -40,7 +48,8 @@ static char *ngx_http_mruby_merge_loc_conf(ngx_conf_t *cf, void *parent,
 // set init function
 static ngx_int_t ngx_http_mruby_preinit(ngx_conf_t *cf);
 static ngx_int_t ngx_http_mruby_init(ngx_conf_t *cf);
-static ngx_int_t ngx_http_mruby_handler_init(ngx_http_core_main_conf_t *cmcf);
+static ngx_int_t ngx_http_mruby_handler_init(ngx_http_core_main_conf_t *cmcf,
+    ngx_http_mruby_main_conf_t *mmcf);
 static ngx_int_t ngx_http_mruby_init_worker(ngx_cycle_t *cycle);
 static void ngx_http_mruby_exit_worker(ngx_cycle_t *cycle);
 
@@ -53,6 +62,20 @@ static ngx_int_t ngx_mrb_run_cycle(ngx_cycle_t *cycle, ngx_mrb_state_t *state,
     ngx_mrb_code_t *code);
 static ngx_int_t ngx_mrb_run_conf(ngx_conf_t *cf, ngx_mrb_state_t *state,
     ngx_mrb_code_t *code);
+static ngx_int_t ngx_mrb_run_finish(ngx_http_request_t *r,
+    ngx_mrb_state_t *state, ngx_mrb_code_t *code, ngx_flag_t cached,
+    ngx_str_t *result, mrb_value mrb_result, ngx_http_mruby_ctx_t *prev_ctx);
+static mrb_value ngx_mrb_code_handler(ngx_mrb_state_t *state,
+    ngx_mrb_code_t *code);
+static mrb_value ngx_mrb_call_handler(ngx_mrb_state_t *state,
+    ngx_mrb_code_t *code);
+static ngx_uint_t ngx_mrb_fiber_start(ngx_mrb_state_t *state,
+    ngx_mrb_code_t *code, ngx_flag_t cached, ngx_http_mruby_ctx_t *ctx);
+static ngx_uint_t ngx_mrb_fiber_resume(ngx_http_mruby_ctx_t *ctx,
+    mrb_value value);
+static void ngx_mrb_fiber_cleanup(void *data);
+static ngx_uint_t ngx_http_mruby_async_done(ngx_http_request_t *r,
+    ngx_int_t *rc);
 
 /*
 // ngx_mruby mruby state functions
@@ -74,6 +97,8 @@ do { \
 
 static ngx_int_t ngx_http_mruby_state_reinit_from_file(ngx_mrb_state_t *state,
     ngx_mrb_code_t *code);
+static struct mrb_parser_state *ngx_mrb_parse_code(mrb_state *mrb,
+    ngx_mrb_code_t *code);
 static ngx_mrb_code_t *ngx_http_mruby_mrb_code_from_file(ngx_pool_t *pool,
     ngx_str_t *code_file_path);
 static ngx_mrb_code_t *ngx_http_mruby_mrb_code_from_string(ngx_pool_t *pool,
@@ -81,6 +106,8 @@ static ngx_mrb_code_t *ngx_http_mruby_mrb_code_from_string(ngx_pool_t *pool,
 static ngx_int_t ngx_http_mruby_shared_state_init(ngx_mrb_state_t *state);
 static ngx_int_t ngx_http_mruby_shared_state_compile(ngx_conf_t *cf,
     ngx_mrb_state_t *state, ngx_mrb_code_t *code);
+static char *ngx_http_mruby_code_option(ngx_conf_t *cf, ngx_mrb_code_t *code,
+    ngx_str_t *option, ngx_uint_t allowed);
 
 /*
 // ngx_mruby mruby directive functions
@@ -98,34 +125,18 @@ static char *ngx_http_mruby_exit_worker_phase(ngx_conf_t *cf,
 static char *ngx_http_mruby_exit_worker_inline(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 
-static char *ngx_http_mruby_post_read_phase(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf);
-static char *ngx_http_mruby_server_rewrite_phase(ngx_conf_t *cf,
-    ngx_command_t *cmd, void *conf);
-static char *ngx_http_mruby_rewrite_phase(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf);
-static char *ngx_http_mruby_access_phase(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf);
-static char *ngx_http_mruby_content_phase(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf);
-static char *ngx_http_mruby_log_phase(ngx_conf_t *cf, ngx_command_t *cmd,
+static char *ngx_http_mruby_handler_phase(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
-static char *ngx_http_mruby_post_read_inline(ngx_conf_t *cf, ngx_command_t *cmd,
+static char *ngx_http_mruby_handler_inline(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
-static char *ngx_http_mruby_server_rewrite_inline(ngx_conf_t *cf,
-    ngx_command_t *cmd, void *conf);
-static char *ngx_http_mruby_rewrite_inline(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf);
-static char *ngx_http_mruby_access_inline(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf);
-static char *ngx_http_mruby_content_inline(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf);
-static char *ngx_http_mruby_log_inline(ngx_conf_t *cf, ngx_command_t *cmd,
+static char *ngx_http_mruby_add_handler(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_mruby_body_filter_phase(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 static char *ngx_http_mruby_body_filter_inline(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
+static char *ngx_http_mruby_stats_header(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 #if defined(NDK) && NDK
 static char *ngx_http_mruby_set_inner(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -144,13 +155,33 @@ static ngx_int_t ngx_http_mruby_rewrite_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_mruby_access_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_mruby_content_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_mruby_log_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_mruby_post_read_inline_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_mruby_server_rewrite_inline_handler(
-    ngx_http_request_t *r);
-static ngx_int_t ngx_http_mruby_rewrite_inline_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_mruby_access_inline_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_mruby_content_inline_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_mruby_log_inline_handler(ngx_http_request_t *r);
+
+/*
+// one descriptor per phase: file and inline directives of a phase share the
+// code slot at offset, and the handler is registered only if the bit of mask
+// is set in ngx_http_mruby_main_conf_t.enabled_phases
+*/
+static ngx_http_mruby_phase_handler_t ngx_http_mruby_phase_handlers[] = {
+  { NGX_HTTP_POST_READ_PHASE, NGX_HTTP_MRUBY_POST_READ_PHASE,
+    offsetof(ngx_http_mruby_loc_conf_t, post_read_code),
+    ngx_http_mruby_post_read_handler },
+  { NGX_HTTP_SERVER_REWRITE_PHASE, NGX_HTTP_MRUBY_SERVER_REWRITE_PHASE,
+    offsetof(ngx_http_mruby_loc_conf_t, server_rewrite_code),
+    ngx_http_mruby_server_rewrite_handler },
+  { NGX_HTTP_REWRITE_PHASE, NGX_HTTP_MRUBY_REWRITE_PHASE,
+    offsetof(ngx_http_mruby_loc_conf_t, rewrite_code),
+    ngx_http_mruby_rewrite_handler },
+  { NGX_HTTP_ACCESS_PHASE, NGX_HTTP_MRUBY_ACCESS_PHASE,
+    offsetof(ngx_http_mruby_loc_conf_t, access_code),
+    ngx_http_mruby_access_handler },
+  { NGX_HTTP_CONTENT_PHASE, NGX_HTTP_MRUBY_CONTENT_PHASE,
+    offsetof(ngx_http_mruby_loc_conf_t, content_code),
+    ngx_http_mruby_content_handler },
+  { NGX_HTTP_LOG_PHASE, NGX_HTTP_MRUBY_LOG_PHASE,
+    offsetof(ngx_http_mruby_loc_conf_t, log_code),
+    ngx_http_mruby_log_handler },
+  { 0, 0, 0, NULL }
+};
 
 #if defined(NDK) && NDK
 static ngx_int_t ngx_http_mruby_set_handler(ngx_http_request_t *r,
@@ -173,6 +204,8 @@ static ngx_int_t ngx_http_mruby_body_filter_handler(ngx_http_request_t *r,
     ngx_chain_t *in);
 static ngx_int_t ngx_http_mruby_body_filter_inline_handler(
     ngx_http_request_t *r, ngx_chain_t *in);
+static ngx_int_t ngx_http_mruby_stats_header_set(ngx_http_request_t *r,
+    ngx_http_mruby_ctx_t *ctx);
 
 static ngx_command_t ngx_http_mruby_commands[] = {
 
@@ -218,6 +251,48 @@ static ngx_command_t ngx_http_mruby_commands[] = {
     0,
     NULL },
 
+  { ngx_string("mruby_shared_dict"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+    ngx_http_mruby_shared_dict,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("mruby_rate_limit_zone"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+    ngx_http_mruby_rate_limit_zone,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("mruby_metrics_zone"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_http_mruby_metrics_zone,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("mruby_topk_zone"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE234,
+    ngx_http_mruby_topk_zone,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("mruby_hll_zone"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+    ngx_http_mruby_hll_zone,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("mruby_metrics"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+    ngx_http_mruby_metrics,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
   { ngx_string("mruby_cache"),
     NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
     ngx_conf_set_flag_slot,
@@ -227,106 +302,120 @@ static ngx_command_t ngx_http_mruby_commands[] = {
 
   { ngx_string("mruby_add_handler"),
     NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
-    ngx_conf_set_flag_slot,
+    ngx_http_mruby_add_handler,
     NGX_HTTP_LOC_CONF_OFFSET,
     offsetof(ngx_http_mruby_loc_conf_t, add_handler),
     NULL },
 
+  { ngx_string("mruby_stats_header"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_http_mruby_stats_header,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_mruby_loc_conf_t, stats_header),
+    NULL },
+
+  { ngx_string("mruby_thread_pool"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_http_mruby_thread_pool,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
   { ngx_string("mruby_post_read_handler"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE12,
-    ngx_http_mruby_post_read_phase,
+            |NGX_CONF_TAKE123,
+    ngx_http_mruby_handler_phase,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    NULL },
+    &ngx_http_mruby_phase_handlers[0] },
 
   { ngx_string("mruby_server_rewrite_handler"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE12,
-    ngx_http_mruby_server_rewrite_phase,
+            |NGX_CONF_TAKE123,
+    ngx_http_mruby_handler_phase,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    NULL },
+    &ngx_http_mruby_phase_handlers[1] },
 
   { ngx_string("mruby_rewrite_handler"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE12,
-    ngx_http_mruby_rewrite_phase,
+            |NGX_CONF_TAKE123,
+    ngx_http_mruby_handler_phase,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    NULL },
+    &ngx_http_mruby_phase_handlers[2] },
 
   { ngx_string("mruby_access_handler"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE12,
-    ngx_http_mruby_access_phase,
+            |NGX_CONF_TAKE123,
+    ngx_http_mruby_handler_phase,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    NULL },
+    &ngx_http_mruby_phase_handlers[3] },
 
   { ngx_string("mruby_content_handler"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE12,
-    ngx_http_mruby_content_phase,
+            |NGX_CONF_TAKE123,
+    ngx_http_mruby_handler_phase,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    NULL },
+    &ngx_http_mruby_phase_handlers[4] },
 
   { ngx_string("mruby_log_handler"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE12,
-    ngx_http_mruby_log_phase,
+            |NGX_CONF_TAKE123,
+    ngx_http_mruby_handler_phase,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    NULL },
+    &ngx_http_mruby_phase_handlers[5] },
 
   { ngx_string("mruby_post_read_handler_code"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE1,
-    ngx_http_mruby_post_read_inline,
+            |NGX_CONF_TAKE12,
+    ngx_http_mruby_handler_inline,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    ngx_http_mruby_post_read_inline_handler },
+    &ngx_http_mruby_phase_handlers[0] },
 
   { ngx_string("mruby_server_rewrite_handler_code"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE1,
-    ngx_http_mruby_server_rewrite_inline,
+            |NGX_CONF_TAKE12,
+    ngx_http_mruby_handler_inline,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    ngx_http_mruby_server_rewrite_inline_handler },
+    &ngx_http_mruby_phase_handlers[1] },
 
   { ngx_string("mruby_rewrite_handler_code"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE1,
-    ngx_http_mruby_rewrite_inline,
+            |NGX_CONF_TAKE12,
+    ngx_http_mruby_handler_inline,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    ngx_http_mruby_rewrite_inline_handler },
+    &ngx_http_mruby_phase_handlers[2] },
 
   { ngx_string("mruby_access_handler_code"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE1,
-    ngx_http_mruby_access_inline,
+            |NGX_CONF_TAKE12,
+    ngx_http_mruby_handler_inline,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    ngx_http_mruby_access_inline_handler },
+    &ngx_http_mruby_phase_handlers[3] },
 
   { ngx_string("mruby_content_handler_code"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
-            |NGX_CONF_TAKE1,
-    ngx_http_mruby_content_inline,
+            |NGX_CONF_TAKE12,
+    ngx_http_mruby_handler_inline,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    ngx_http_mruby_content_inline_handler },
+    &ngx_http_mruby_phase_handlers[4] },
 
   { ngx_string("mruby_log_handler_code"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
             |NGX_CONF_TAKE1,
-    ngx_http_mruby_log_inline,
+    ngx_http_mruby_handler_inline,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
-    ngx_http_mruby_log_inline_handler },
+    &ngx_http_mruby_phase_handlers[5] },
 
 #if defined(NDK) && NDK
   { ngx_string("mruby_set"),
@@ -394,8 +483,6 @@ ngx_module_t ngx_http_mruby_module = {
   NGX_MODULE_V1_PADDING
 };
 
-extern ngx_http_request_t *ngx_mruby_request;
-
 static void *ngx_http_mruby_create_main_conf(ngx_conf_t *cf)
 {
   ngx_http_mruby_main_conf_t *mmcf;
@@ -437,18 +524,15 @@ static void *ngx_http_mruby_create_loc_conf(ngx_conf_t *cf)
   conf->content_code = NGX_CONF_UNSET_PTR;
   conf->log_code = NGX_CONF_UNSET_PTR;
 
-  conf->post_read_inline_code = NGX_CONF_UNSET_PTR;
-  conf->server_rewrite_inline_code = NGX_CONF_UNSET_PTR;
-  conf->rewrite_inline_code = NGX_CONF_UNSET_PTR;
-  conf->access_inline_code = NGX_CONF_UNSET_PTR;
-  conf->content_inline_code = NGX_CONF_UNSET_PTR;
-  conf->log_inline_code = NGX_CONF_UNSET_PTR;
-
   conf->body_filter_code = NGX_CONF_UNSET_PTR;
   conf->body_filter_inline_code = NGX_CONF_UNSET_PTR;
 
   conf->cached = NGX_CONF_UNSET;
   conf->add_handler = NGX_CONF_UNSET;
+  conf->stats_header = NGX_CONF_UNSET;
+#if (NGX_HTTP_MRUBY_THREADS)
+  conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
 
   return conf;
 }
@@ -466,21 +550,16 @@ static char *ngx_http_mruby_merge_loc_conf(ngx_conf_t *cf, void *parent,
   NGX_MRUBY_MERGE_CODE(prev->content_code, conf->content_code);
   NGX_MRUBY_MERGE_CODE(prev->log_code, conf->log_code);
 
-  NGX_MRUBY_MERGE_CODE(prev->post_read_inline_code,
-      conf->post_read_inline_code);
-  NGX_MRUBY_MERGE_CODE(prev->server_rewrite_inline_code,
-      conf->server_rewrite_inline_code);
-  NGX_MRUBY_MERGE_CODE(prev->rewrite_inline_code, conf->rewrite_inline_code);
-  NGX_MRUBY_MERGE_CODE(prev->access_inline_code, conf->access_inline_code);
-  NGX_MRUBY_MERGE_CODE(prev->content_inline_code, conf->content_inline_code);
-  NGX_MRUBY_MERGE_CODE(prev->log_inline_code, conf->log_inline_code);
-
   NGX_MRUBY_MERGE_CODE(prev->body_filter_code, conf->body_filter_code);
   NGX_MRUBY_MERGE_CODE(prev->body_filter_inline_code,
       conf->body_filter_inline_code);
 
   ngx_conf_merge_value(conf->cached, prev->cached, 0);
   ngx_conf_merge_value(conf->add_handler, prev->add_handler, 0);
+  ngx_conf_merge_value(conf->stats_header, prev->stats_header, 0);
+#if (NGX_HTTP_MRUBY_THREADS)
+  ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
 
   return NGX_CONF_OK;
 }
@@ -507,8 +586,6 @@ static ngx_int_t ngx_http_mruby_init(ngx_conf_t *cf)
   cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
   mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mruby_module);
 
-  ngx_mruby_request = NULL;
-
   ngx_conf_log_error(NGX_LOG_NOTICE
     , cf
     , 0
@@ -519,7 +596,7 @@ static ngx_int_t ngx_http_mruby_init(ngx_conf_t *cf)
     , MRUBY_VERSION
   );
 
-  if (ngx_http_mruby_handler_init(cmcf) != NGX_OK) {
+  if (ngx_http_mruby_handler_init(cmcf, mmcf) != NGX_OK) {
     return NGX_ERROR;
   }
 
@@ -560,88 +637,24 @@ static void ngx_http_mruby_exit_worker(ngx_cycle_t *cycle)
     ngx_mrb_run_cycle(cycle, mmcf->state, mmcf->exit_worker_code);
   }
 
+  ngx_mrb_metrics_exit_worker();
 }
 
-static ngx_int_t ngx_http_mruby_handler_init(ngx_http_core_main_conf_t *cmcf)
+static ngx_int_t ngx_http_mruby_handler_init(ngx_http_core_main_conf_t *cmcf,
+    ngx_http_mruby_main_conf_t *mmcf)
 {
-  ngx_int_t i;
   ngx_http_handler_pt *h;
-  ngx_http_phases phase;
-  ngx_http_phases phases[] = {
-    NGX_HTTP_POST_READ_PHASE,
-    //NGX_HTTP_FIND_CONFIG_PHASE,
-    NGX_HTTP_SERVER_REWRITE_PHASE,
-    NGX_HTTP_REWRITE_PHASE,
-    //NGX_HTTP_POST_REWRITE_PHASE,
-    //NGX_HTTP_PREACCESS_PHASE,
-    NGX_HTTP_ACCESS_PHASE,
-    //NGX_HTTP_POST_ACCESS_PHASE,
-    //NGX_HTTP_TRY_FILES_PHASE,
-    NGX_HTTP_CONTENT_PHASE,
-    NGX_HTTP_LOG_PHASE,
-  };
-  ngx_int_t phases_c;
-
-  phases_c = sizeof(phases) / sizeof(ngx_http_phases);
-  for (i=0;i<phases_c;i++) {
-    phase = phases[i];
-    h = ngx_array_push(&cmcf->phases[phase].handlers);
+  ngx_http_mruby_phase_handler_t *ph;
+
+  for (ph = ngx_http_mruby_phase_handlers; ph->handler != NULL; ph++) {
+    if (!(mmcf->enabled_phases & ph->mask)) {
+      continue;
+    }
+    h = ngx_array_push(&cmcf->phases[ph->phase].handlers);
     if (h == NULL) {
       return NGX_ERROR;
     }
-    switch (phase) {
-    case NGX_HTTP_POST_READ_PHASE:
-      *h = ngx_http_mruby_post_read_handler;
-      h = ngx_array_push(&cmcf->phases[phase].handlers);
-      if (h == NULL) {
-        return NGX_ERROR;
-      }
-      *h = ngx_http_mruby_post_read_inline_handler;
-      break;
-    case NGX_HTTP_SERVER_REWRITE_PHASE:
-      *h = ngx_http_mruby_server_rewrite_handler;
-      h = ngx_array_push(&cmcf->phases[phase].handlers);
-      if (h == NULL) {
-        return NGX_ERROR;
-      }
-      *h = ngx_http_mruby_server_rewrite_inline_handler;
-      break;
-    case NGX_HTTP_REWRITE_PHASE:
-      *h = ngx_http_mruby_rewrite_handler;
-      h = ngx_array_push(&cmcf->phases[phase].handlers);
-      if (h == NULL) {
-        return NGX_ERROR;
-      }
-      *h = ngx_http_mruby_rewrite_inline_handler;
-      break;
-    case NGX_HTTP_ACCESS_PHASE:
-      *h = ngx_http_mruby_access_handler;
-      h = ngx_array_push(&cmcf->phases[phase].handlers);
-      if (h == NULL) {
-        return NGX_ERROR;
-      }
-      *h = ngx_http_mruby_access_inline_handler;
-      break;
-    case NGX_HTTP_CONTENT_PHASE:
-      *h = ngx_http_mruby_content_handler;
-      h = ngx_array_push(&cmcf->phases[phase].handlers);
-      if (h == NULL) {
-        return NGX_ERROR;
-      }
-      *h = ngx_http_mruby_content_inline_handler;
-      break;
-    case NGX_HTTP_LOG_PHASE:
-      *h = ngx_http_mruby_log_handler;
-      h = ngx_array_push(&cmcf->phases[phase].handlers);
-      if (h == NULL) {
-        return NGX_ERROR;
-      }
-      *h = ngx_http_mruby_log_inline_handler;
-      break;
-    default:
-      // not through
-      break;
-    }
+    *h = ph->handler;
   }
 
   return NGX_OK;
@@ -660,7 +673,26 @@ static void ngx_mrb_code_clean(ngx_http_request_t *r, ngx_mrb_state_t *state,
     ngx_mrb_code_t *code)
 {
   //mrb_irep_decref(state->mrb, code->proc->body.irep);
-  mrbc_context_free(state->mrb, code->ctx);
+  // a suspended request may finish after another one recompiled the code
+  if (code->ctx != NULL) {
+    mrbc_context_free(state->mrb, code->ctx);
+    code->ctx = NULL;
+  }
+}
+
+// allocations of the mrb_states of the worker, see mruby_stats_header
+static ngx_uint_t ngx_mrb_allocs;
+
+// the default allocator of mruby, counting every allocation and growth
+static void *ngx_mrb_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  if (size == 0) {
+    free(p);
+    return NULL;
+  }
+  ngx_mrb_allocs++;
+
+  return realloc(p, size);
 }
 
 ngx_int_t ngx_mrb_run_cycle(ngx_cycle_t *cycle, ngx_mrb_state_t *state,
@@ -713,11 +745,14 @@ ngx_int_t ngx_mrb_run_conf(ngx_conf_t *cf, ngx_mrb_state_t *state,
 ngx_int_t ngx_mrb_run(ngx_http_request_t *r, ngx_mrb_state_t *state,
     ngx_mrb_code_t *code, ngx_flag_t cached, ngx_str_t *result)
 {
-  int result_len;
   int ai = 0;
-  mrb_value mrb_result;
-  ngx_http_mruby_ctx_t *ctx;
-  ngx_mrb_rputs_chain_list_t *chain;
+  mrb_value mrb_result = mrb_nil_value();
+  ngx_http_mruby_ctx_t *ctx, *prev_ctx;
+  ngx_http_mruby_loc_conf_t *mlcf;
+  ngx_mrb_ud_t *ud;
+  ngx_uint_t prev_in_fiber, finished = 1;
+  struct timeval tv_start, tv_end;
+  ngx_uint_t allocs = 0;
 
   if (state == NGX_CONF_UNSET_PTR || code == NGX_CONF_UNSET_PTR) {
     return NGX_DECLINED;
@@ -734,7 +769,16 @@ ngx_int_t ngx_mrb_run(ngx_http_request_t *r, ngx_mrb_state_t *state,
     return NGX_ERROR;
   }
   ngx_http_set_ctx(r, ctx, ngx_http_mruby_module);
-  ngx_mrb_push_request(r);
+  ctx->r = r;
+
+  // bindings find the request through mrb->ud; the previous invocation is
+  // restored below because filters can run while another handler is inside
+  // mrb_run (e.g. Nginx.send_header)
+  ud = ngx_mrb_ud(state->mrb);
+  prev_ctx = ud->ctx;
+  prev_in_fiber = ud->in_fiber;
+  ud->ctx = ctx;
+  ud->in_fiber = 0;
 
   if (!cached && !code->cache) {
     ai = mrb_gc_arena_save(state->mrb);
@@ -748,7 +792,48 @@ ngx_int_t ngx_mrb_run(ngx_http_request_t *r, ngx_mrb_state_t *state,
       , ai
     );
   }
-  mrb_result = mrb_run(state->mrb, code->proc, mrb_top_self(state->mrb));
+  mlcf = ngx_http_get_module_loc_conf(r, ngx_http_mruby_module);
+  if (mlcf->stats_header) {
+    allocs = ngx_mrb_allocs;
+    ngx_gettimeofday(&tv_start);
+  }
+  if (code->fiber) {
+    finished = ngx_mrb_fiber_start(state, code, cached, ctx);
+  }
+  else if (code->callable) {
+    mrb_result = ngx_mrb_call_handler(state, code);
+  }
+  else {
+    mrb_result = mrb_run(state->mrb, code->proc, mrb_top_self(state->mrb));
+  }
+  if (mlcf->stats_header) {
+    ngx_gettimeofday(&tv_end);
+    ctx->exec_runs++;
+    ctx->exec_usec += (tv_end.tv_sec - tv_start.tv_sec) * 1000000
+      + (tv_end.tv_usec - tv_start.tv_usec);
+    ctx->exec_allocs += ngx_mrb_allocs - allocs;
+  }
+
+  ud->in_fiber = prev_in_fiber;
+  if (!finished) {
+    // ngx_mrb_async_resume continues when the awaited event fires
+    ud->ctx = prev_ctx;
+    return NGX_DONE;
+  }
+
+  return ngx_mrb_run_finish(r, state, code, cached, result, mrb_result,
+      prev_ctx);
+}
+
+static ngx_int_t ngx_mrb_run_finish(ngx_http_request_t *r,
+    ngx_mrb_state_t *state, ngx_mrb_code_t *code, ngx_flag_t cached,
+    ngx_str_t *result, mrb_value mrb_result, ngx_http_mruby_ctx_t *prev_ctx)
+{
+  int result_len;
+  ngx_http_mruby_ctx_t *ctx = ngx_http_get_module_ctx(r,
+      ngx_http_mruby_module);
+  ngx_mrb_rputs_chain_list_t *chain;
+
   if (state->mrb->exc) {
     ngx_mrb_raise_error(state->mrb, mrb_obj_value(state->mrb->exc), r);
     r->headers_out.status = NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -765,6 +850,7 @@ ngx_int_t ngx_mrb_run(ngx_http_request_t *r, ngx_mrb_state_t *state,
       result_len = RSTRING_LEN(mrb_result);
       result->data = ngx_palloc(r->pool, result_len);
       if (result->data == NULL) {
+        ngx_mrb_ud(state->mrb)->ctx = prev_ctx;
         return NGX_ERROR;
       }
       ngx_memcpy(result->data, (u_char *)mrb_str_to_cstr(state->mrb,
@@ -787,9 +873,10 @@ ngx_int_t ngx_mrb_run(ngx_http_request_t *r, ngx_mrb_state_t *state,
     //mrb_gc_arena_restore(state->mrb, ai);
   }
   ngx_mrb_state_clean(r, state);
+  ngx_mrb_ud(state->mrb)->ctx = prev_ctx;
 
   // TODO: Support rputs by multi directive
-  if (ngx_http_get_module_ctx(r, ngx_http_mruby_module) != NULL) {
+  if (ctx != NULL) {
     chain = ctx->rputs_chain;
     if (chain == NULL) {
       ngx_log_error(NGX_LOG_INFO
@@ -822,26 +909,296 @@ ngx_int_t ngx_mrb_run(ngx_http_request_t *r, ngx_mrb_state_t *state,
   return NGX_OK;
 }
 
+/*
+// a script loaded with the "call" option evaluates to a handler object on
+// the first request of each worker; later requests only send it call with
+// the preallocated Nginx::Request of the state
+*/
+static mrb_value ngx_mrb_code_handler(ngx_mrb_state_t *state,
+    ngx_mrb_code_t *code)
+{
+  static const char msg[] = "handler script must return an object responding"
+    " to call";
+  mrb_state *mrb = state->mrb;
+  mrb_value handler;
+
+  if (mrb_nil_p(code->handler)) {
+    handler = mrb_run(mrb, code->proc, mrb_top_self(mrb));
+    if (mrb->exc) {
+      return mrb_nil_value();
+    }
+    if (!mrb_respond_to(mrb, handler, ngx_mrb_ud(mrb)->call_sym)) {
+      mrb->exc = mrb_obj_ptr(mrb_exc_new(mrb, E_TYPE_ERROR, msg,
+            sizeof(msg) - 1));
+      return mrb_nil_value();
+    }
+    ngx_mrb_gc_register(mrb, handler);
+    code->handler = handler;
+  }
+
+  return code->handler;
+}
+
+static mrb_value ngx_mrb_call_handler(ngx_mrb_state_t *state,
+    ngx_mrb_code_t *code)
+{
+  mrb_state *mrb = state->mrb;
+  mrb_value handler;
+
+  handler = ngx_mrb_code_handler(state, code);
+  if (mrb->exc) {
+    return mrb_nil_value();
+  }
+
+  return mrb_funcall_argv(mrb, handler, ngx_mrb_ud(mrb)->call_sym, 1,
+      &state->request);
+}
+
+/*
+// fiber execution of request phase handlers
+//
+// Handlers of the post read, rewrite, access and content phases given the
+// "fiber" option run in a Fiber so that module operations (Nginx.sleep, ...)
+// can suspend them and hand control back to the event loop. Other handlers
+// run with mrb_run as they always did, without the cost of a Fiber per
+// request. A plain script is compiled wrapped
+// in a lambda (see ngx_mrb_parse_code) because mruby can only run a block
+// as a fiber body. The operation arms an nginx event, sets ctx->async_wait
+// and yields; ngx_mrb_run then returns NGX_DONE, and the event handler calls
+// ngx_mrb_async_resume which continues the fiber. Once the fiber finishes,
+// its result is parked in ctx->async_rc and the phase engine is restarted
+// so the same phase handler picks it up (ngx_http_mruby_async_done).
+*/
+static ngx_uint_t ngx_mrb_fiber_start(ngx_mrb_state_t *state,
+    ngx_mrb_code_t *code, ngx_flag_t cached, ngx_http_mruby_ctx_t *ctx)
+{
+  mrb_state *mrb = state->mrb;
+  mrb_value args[2], callable;
+  mrb_int argc = 1;
+
+  if (code->callable) {
+    callable = ngx_mrb_code_handler(state, code);
+    args[argc++] = state->request;
+  }
+  else if (!mrb_nil_p(code->handler)) {
+    callable = code->handler;
+  }
+  else {
+    // evaluating the wrapper only creates the lambda
+    callable = mrb_run(mrb, code->proc, mrb_top_self(mrb));
+    if (!mrb->exc && (cached || code->cache)) {
+      ngx_mrb_gc_register(mrb, callable);
+      code->handler = callable;
+    }
+  }
+  if (mrb->exc) {
+    return 1;
+  }
+
+  args[0] = callable;
+  ctx->async_fiber = mrb_funcall_argv(mrb, mrb_top_self(mrb),
+      ngx_mrb_ud(mrb)->prepare_fiber_sym, argc, args);
+  if (mrb->exc) {
+    return 1;
+  }
+  ctx->async_state = state;
+  ctx->async_code = code;
+  ctx->async_cached = cached;
+
+  return ngx_mrb_fiber_resume(ctx, mrb_nil_value());
+}
+
+static void ngx_mrb_fiber_cleanup(void *data)
+{
+  ngx_http_mruby_ctx_t *ctx = data;
+
+  if (ctx->async_rooted) {
+    ngx_mrb_gc_unregister(ctx->async_state->mrb, ctx->async_fiber);
+    ctx->async_rooted = 0;
+  }
+}
+
+// runs the fiber until it yields or ends, returns 1 when it has ended
+static ngx_uint_t ngx_mrb_fiber_resume(ngx_http_mruby_ctx_t *ctx,
+    mrb_value value)
+{
+  static const char msg[] = "handler fiber yielded without a pending nginx"
+    " operation";
+  mrb_state *mrb = ctx->async_state->mrb;
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(mrb);
+  ngx_pool_cleanup_t *cln;
+  mrb_value ret;
+
+  ctx->async_wait = 0;
+  ctx->async_write_handler = NULL;
+  ud->in_fiber = 1;
+  // [finished, value], see Kernel#_ngx_mrb_prepare_fiber
+  ret = mrb_funcall_argv(mrb, ctx->async_fiber, ud->call_sym, 1, &value);
+  ud->in_fiber = 0;
+
+  if (!mrb->exc && mrb_array_p(ret) && !mrb_test(mrb_ary_ref(mrb, ret, 0))) {
+    if (ctx->async_wait) {
+      if (!ctx->async_cleanup) {
+        cln = ngx_pool_cleanup_add(ctx->r->pool, 0);
+        if (cln == NULL) {
+          return 1;
+        }
+        cln->handler = ngx_mrb_fiber_cleanup;
+        cln->data = ctx;
+        ctx->async_cleanup = 1;
+      }
+      if (!ctx->async_rooted) {
+        ngx_mrb_gc_register(mrb, ctx->async_fiber);
+        ctx->async_rooted = 1;
+      }
+      // the request is posted when its subrequests finish
+      ctx->r->write_event_handler = ctx->async_write_handler
+        ? ctx->async_write_handler : ngx_http_request_empty_handler;
+      return 0;
+    }
+    mrb->exc = mrb_obj_ptr(mrb_exc_new(mrb, E_RUNTIME_ERROR, msg,
+          sizeof(msg) - 1));
+  }
+
+  ngx_mrb_fiber_cleanup(ctx);
+  return 1;
+}
+
+void ngx_mrb_async_resume(ngx_http_mruby_ctx_t *ctx, mrb_value value)
+{
+  ngx_http_request_t *r = ctx->r;
+  ngx_connection_t *c = r->connection;
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(ctx->async_state->mrb);
+  ngx_http_mruby_ctx_t *prev_ctx;
+  ngx_int_t rc;
+
+  prev_ctx = ud->ctx;
+  ud->ctx = ctx;
+  if (!ngx_mrb_fiber_resume(ctx, value)) {
+    ud->ctx = prev_ctx;
+    // subrequests started by the fiber are posted
+    ngx_http_run_posted_requests(c);
+    return;
+  }
+
+  rc = ngx_mrb_run_finish(r, ctx->async_state, ctx->async_code,
+      ctx->async_cached, NULL, mrb_nil_value(), prev_ctx);
+
+  // a sent response drops the module ctx, but the phase handler needs it
+  // to find the result
+  if (ngx_http_get_module_ctx(r, ngx_http_mruby_module) == NULL) {
+    ctx->rputs_chain = NULL;
+    ngx_http_set_ctx(r, ctx, ngx_http_mruby_module);
+  }
+  ctx->async_rc = rc;
+  ctx->async_done = 1;
+
+  r->write_event_handler = ngx_http_core_run_phases;
+  ngx_http_core_run_phases(r);
+  ngx_http_run_posted_requests(c);
+}
+
+static ngx_uint_t ngx_http_mruby_async_done(ngx_http_request_t *r,
+    ngx_int_t *rc)
+{
+  ngx_http_mruby_ctx_t *ctx = ngx_http_get_module_ctx(r,
+      ngx_http_mruby_module);
+
+  if (ctx == NULL || !ctx->async_done) {
+    return 0;
+  }
+  ctx->async_done = 0;
+  *rc = ctx->async_rc;
+
+  return 1;
+}
+
 /*
 // ngx_mruby mruby state functions
 */
 
+#define NGX_MRB_FIBER_CODE_HEAD "lambda do;"
+#define NGX_MRB_FIBER_CODE_TAIL "\nend"
+
+/*
+// parses the script of code with a new code->ctx. Scripts run as fibers are
+// wrapped in a lambda, opened on the first line to keep line numbers intact
+*/
+static struct mrb_parser_state *ngx_mrb_parse_code(mrb_state *mrb,
+    ngx_mrb_code_t *code)
+{
+  FILE *mrb_file = NULL;
+  struct mrb_parser_state *p;
+  char *buf;
+  size_t len, head, tail;
+  long size;
+
+  if (code->code_type == NGX_MRB_CODE_TYPE_FILE
+      && (mrb_file = fopen((char *)code->code.file, "r")) == NULL) {
+    return NULL;
+  }
+
+  code->ctx = mrbc_context_new(mrb);
+  mrbc_filename(mrb, code->ctx, mrb_file ? (char *)code->code.file
+      : "INLINE CODE");
+
+  if (!code->fiber || code->callable) {
+    if (mrb_file) {
+      p = mrb_parse_file(mrb, mrb_file, code->ctx);
+      fclose(mrb_file);
+      return p;
+    }
+    return mrb_parse_string(mrb, (char *)code->code.string, code->ctx);
+  }
+
+  if (mrb_file) {
+    if (fseek(mrb_file, 0, SEEK_END) != 0 || (size = ftell(mrb_file)) < 0
+        || fseek(mrb_file, 0, SEEK_SET) != 0) {
+      fclose(mrb_file);
+      return NULL;
+    }
+    len = size;
+  }
+  else {
+    len = ngx_strlen(code->code.string);
+  }
+
+  head = sizeof(NGX_MRB_FIBER_CODE_HEAD) - 1;
+  tail = sizeof(NGX_MRB_FIBER_CODE_TAIL) - 1;
+  buf = mrb_malloc(mrb, head + len + tail);
+  ngx_memcpy(buf, NGX_MRB_FIBER_CODE_HEAD, head);
+  if (mrb_file) {
+    size = fread(buf + head, 1, len, mrb_file);
+    fclose(mrb_file);
+    if ((size_t)size != len) {
+      mrb_free(mrb, buf);
+      return NULL;
+    }
+  }
+  else {
+    ngx_memcpy(buf + head, code->code.string, len);
+  }
+  ngx_memcpy(buf + head + len, NGX_MRB_FIBER_CODE_TAIL, tail);
+
+  p = mrb_parse_nstring(mrb, buf, (int)(head + len + tail), code->ctx);
+  mrb_free(mrb, buf);
+
+  return p;
+}
+
 static ngx_int_t ngx_mrb_gencode_state(ngx_mrb_state_t *state,
     ngx_mrb_code_t *code)
 {
   int ai;
-  FILE *mrb_file;
   struct mrb_parser_state *p;
 
-  if ((mrb_file = fopen((char *)code->code.file, "r")) == NULL) {
-    return NGX_ERROR;
+  if (code->ctx != NULL) {
+    mrbc_context_free(state->mrb, code->ctx);
+    code->ctx = NULL;
   }
 
   ai = mrb_gc_arena_save(state->mrb);
-  code->ctx = mrbc_context_new(state->mrb);
-  mrbc_filename(state->mrb, code->ctx, (char *)code->code.file);
-  p = mrb_parse_file(state->mrb, mrb_file, code->ctx);
-  fclose(mrb_file);
+  p = ngx_mrb_parse_code(state->mrb, code);
   if (p == NULL) {
     return NGX_ERROR;
   }
@@ -888,6 +1245,7 @@ static ngx_mrb_code_t *ngx_http_mruby_mrb_code_from_file(ngx_pool_t *pool,
       code_file_path->len + 1);
   code->code_type = NGX_MRB_CODE_TYPE_FILE;
   code->cache = OFF;
+  code->handler = mrb_nil_value();
   return code;
 }
 
@@ -909,6 +1267,7 @@ static ngx_mrb_code_t *ngx_http_mruby_mrb_code_from_string(ngx_pool_t *pool,
   ngx_cpystrn((u_char *)code->code.string, code_s->data, len + 1);
   code->code_type = NGX_MRB_CODE_TYPE_STRING;
   code->cache = ON;
+  code->handler = mrb_nil_value();
   return code;
 }
 
@@ -916,11 +1275,17 @@ static ngx_int_t ngx_http_mruby_shared_state_init(ngx_mrb_state_t *state)
 {
   mrb_state *mrb;
 
-  mrb = mrb_open();
+  mrb = mrb_open_allocf(ngx_mrb_allocf, NULL);
   if (mrb == NULL) {
     return NGX_ERROR;
   }
-  ngx_mrb_class_init(mrb);
+  if (ngx_mrb_class_init(mrb) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  // passed to every handler loaded with the "call" option
+  state->request = mrb_obj_new(mrb, ngx_mrb_ud(mrb)->request_class, 0, NULL);
+  ngx_mrb_gc_register(mrb, state->request);
 
   state->mrb = mrb;
 
@@ -930,24 +1295,9 @@ static ngx_int_t ngx_http_mruby_shared_state_init(ngx_mrb_state_t *state)
 static ngx_int_t ngx_http_mruby_shared_state_compile(ngx_conf_t *cf,
     ngx_mrb_state_t *state, ngx_mrb_code_t *code)
 {
-  FILE *mrb_file;
   struct mrb_parser_state *p;
 
-  if (code->code_type == NGX_MRB_CODE_TYPE_FILE) {
-    if ((mrb_file = fopen((char *)code->code.file, "r")) == NULL) {
-      return NGX_ERROR;
-    }
-    code->ctx = mrbc_context_new(state->mrb);
-    mrbc_filename(state->mrb, code->ctx, (char *)code->code.file);
-    p = mrb_parse_file(state->mrb, mrb_file, code->ctx);
-    fclose(mrb_file);
-  }
-  else {
-    code->ctx = mrbc_context_new(state->mrb);
-    mrbc_filename(state->mrb, code->ctx, "INLINE CODE");
-    p = mrb_parse_string(state->mrb, (char *)code->code.string, code->ctx);
-  }
-
+  p = ngx_mrb_parse_code(state->mrb, code);
   if (p == NULL) {
     return NGX_ERROR;
   }
@@ -986,6 +1336,62 @@ static ngx_int_t ngx_http_mruby_shared_state_compile(ngx_conf_t *cf,
   return NGX_OK;
 }
 
+// options of script directives besides "cache"
+#define NGX_HTTP_MRUBY_OPTION_CALL   0x01
+#define NGX_HTTP_MRUBY_OPTION_FIBER  0x02
+
+static void ngx_http_mruby_code_fiber(ngx_conf_t *cf, ngx_mrb_code_t *code)
+{
+  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
+      ngx_http_mruby_module);
+
+  code->fiber = ON;
+
+  // Nginx::Subrequest is only available in fiber handlers; the filters
+  // capture the output of its subrequests
+  mmcf->enabled_header_filter = 1;
+  mmcf->enabled_body_filter   = 1;
+}
+
+static char *ngx_http_mruby_code_option(ngx_conf_t *cf, ngx_mrb_code_t *code,
+    ngx_str_t *option, ngx_uint_t allowed)
+{
+  if (ngx_strcmp(option->data, "cache") == 0) {
+    code->cache = ON;
+    return NGX_CONF_OK;
+  }
+  if ((allowed & NGX_HTTP_MRUBY_OPTION_CALL)
+      && ngx_strcmp(option->data, "call") == 0) {
+    // the handler object outlives the request, so the script is never
+    // recompiled
+    code->cache = ON;
+    code->callable = ON;
+    return NGX_CONF_OK;
+  }
+  if ((allowed & NGX_HTTP_MRUBY_OPTION_FIBER)
+      && ngx_strcmp(option->data, "fiber") == 0) {
+    ngx_http_mruby_code_fiber(cf, code);
+    return NGX_CONF_OK;
+  }
+
+  if (allowed & NGX_HTTP_MRUBY_OPTION_FIBER) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+        "invalid parameter \"%V\", vaild parameters are \"cache\", "
+        "\"call\" and \"fiber\"", option);
+  }
+  else if (allowed & NGX_HTTP_MRUBY_OPTION_CALL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+        "invalid parameter \"%V\", vaild parameters are \"cache\" and "
+        "\"call\"", option);
+  }
+  else {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+        "invalid parameter \"%V\", vaild parameter is only \"cache\"",
+        option);
+  }
+  return NGX_CONF_ERROR;
+}
+
 /*
 // ngx_mruby mruby directive functions
 */
@@ -1011,16 +1417,9 @@ static char *ngx_http_mruby_init_phase(ngx_conf_t *cf, ngx_command_t *cmd,
         value[1].data);
     return NGX_CONF_ERROR;
   }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
+  if (cf->args->nelts == 3
+      && ngx_http_mruby_code_option(cf, code, &value[2], 0) != NGX_CONF_OK) {
+    return NGX_CONF_ERROR;
   }
   mmcf->init_code = code;
   rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
@@ -1084,16 +1483,9 @@ static char *ngx_http_mruby_init_worker_phase(ngx_conf_t *cf, ngx_command_t *cmd
         value[1].data);
     return NGX_CONF_ERROR;
   }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
+  if (cf->args->nelts == 3
+      && ngx_http_mruby_code_option(cf, code, &value[2], 0) != NGX_CONF_OK) {
+    return NGX_CONF_ERROR;
   }
   mmcf->init_worker_code = code;
   rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
@@ -1157,16 +1549,9 @@ static char *ngx_http_mruby_exit_worker_phase(ngx_conf_t *cf, ngx_command_t *cmd
         value[1].data);
     return NGX_CONF_ERROR;
   }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
+  if (cf->args->nelts == 3
+      && ngx_http_mruby_code_option(cf, code, &value[2], 0) != NGX_CONF_OK) {
+    return NGX_CONF_ERROR;
   }
   mmcf->exit_worker_code = code;
   rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
@@ -1209,59 +1594,22 @@ static char *ngx_http_mruby_exit_worker_inline(ngx_conf_t *cf,
   return NGX_CONF_OK;
 }
 
-static char *ngx_http_mruby_post_read_phase(ngx_conf_t *cf, ngx_command_t *cmd,
+static char *ngx_http_mruby_handler_phase(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf)
 {
   ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
       ngx_http_mruby_module);
-  ngx_http_mruby_loc_conf_t *mlcf;
+  ngx_http_mruby_phase_handler_t *ph = cmd->post;
   ngx_str_t *value;
-  ngx_mrb_code_t *code;
+  ngx_mrb_code_t *code, **slot;
+  ngx_uint_t i, allowed;
   ngx_int_t rc;
 
-  mlcf = conf;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_file(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
-  }
-  mlcf->post_read_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
+  slot = (ngx_mrb_code_t **)((char *)conf + ph->offset);
+  if (*slot != NGX_CONF_UNSET_PTR) {
+    return "is duplicated";
   }
 
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_server_rewrite_phase(ngx_conf_t *cf,
-    ngx_command_t *cmd, void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_http_mruby_loc_conf_t *mlcf;
-  ngx_mrb_code_t *code;
-  ngx_int_t rc;
-
-  mlcf = conf;
-
   value = cf->args->elts;
   code  = ngx_http_mruby_mrb_code_from_file(cf->pool, &value[1]);
   if (code == NGX_CONF_UNSET_PTR) {
@@ -1269,336 +1617,85 @@ static char *ngx_http_mruby_server_rewrite_phase(ngx_conf_t *cf,
         value[1].data);
     return NGX_CONF_ERROR;
   }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
-  }
-  mlcf->server_rewrite_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_rewrite_phase(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_mrb_code_t *code;
-  ngx_int_t rc;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_file(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
+  // the log phase can not wait for events
+  allowed = NGX_HTTP_MRUBY_OPTION_CALL;
+  if (ph->phase != NGX_HTTP_LOG_PHASE) {
+    allowed |= NGX_HTTP_MRUBY_OPTION_FIBER;
   }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_http_mruby_code_option(cf, code, &value[i], allowed)
+        != NGX_CONF_OK) {
       return NGX_CONF_ERROR;
     }
   }
-  mlcf->rewrite_code = code;
+  *slot = code;
   rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
   if (rc != NGX_OK) {
     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
         value[1].data);
     return NGX_CONF_ERROR;
   }
+  mmcf->enabled_phases |= ph->mask;
 
   return NGX_CONF_OK;
 }
 
-static char *ngx_http_mruby_access_phase(ngx_conf_t *cf, ngx_command_t *cmd,
+static char *ngx_http_mruby_handler_inline(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf)
 {
   ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
       ngx_http_mruby_module);
+  ngx_http_mruby_phase_handler_t *ph = cmd->post;
   ngx_str_t *value;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_mrb_code_t *code;
+  ngx_mrb_code_t *code, **slot;
   ngx_int_t rc;
 
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_file(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
-  }
-  mlcf->access_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_content_phase(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_mrb_code_t *code;
-  ngx_int_t rc;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_file(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
-  }
-  mlcf->content_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
+  slot = (ngx_mrb_code_t **)((char *)conf + ph->offset);
+  if (*slot != NGX_CONF_UNSET_PTR) {
+    return "is duplicated";
   }
 
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_log_phase(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_mrb_code_t *code;
-  ngx_int_t rc;
-
   value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_file(cf->pool, &value[1]);
+  code  = ngx_http_mruby_mrb_code_from_string(cf->pool, &value[1]);
   if (code == NGX_CONF_UNSET_PTR) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
     return NGX_CONF_ERROR;
   }
+  // mruby_log_handler_code takes no option
   if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
+    if (ngx_strcmp(value[2].data, "fiber") != 0) {
       ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
+          "invalid parameter \"%V\", vaild parameter is only \"fiber\"",
           &value[2]);
       return NGX_CONF_ERROR;
     }
+    ngx_http_mruby_code_fiber(cf, code);
   }
-  mlcf->log_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_file(%s) open failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_post_read_inline(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_mrb_code_t *code;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_int_t rc;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_string(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    return NGX_CONF_ERROR;
-  }
-  mlcf->post_read_inline_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_string(%s) load failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_server_rewrite_inline(ngx_conf_t *cf,
-    ngx_command_t *cmd, void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_mrb_code_t *code;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_int_t rc;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_string(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    return NGX_CONF_ERROR;
-  }
-  mlcf->server_rewrite_inline_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_string(%s) load failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_rewrite_inline(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_mrb_code_t *code;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_int_t rc;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_string(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    return NGX_CONF_ERROR;
-  }
-  mlcf->rewrite_inline_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_string(%s) load failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
-
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_access_inline(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_mrb_code_t *code;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_int_t rc;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_string(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    return NGX_CONF_ERROR;
-  }
-  mlcf->access_inline_code = code;
+  *slot = code;
   rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
   if (rc != NGX_OK) {
     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_string(%s) load failed",
         value[1].data);
     return NGX_CONF_ERROR;
   }
+  mmcf->enabled_phases |= ph->mask;
 
   return NGX_CONF_OK;
 }
 
-static char *ngx_http_mruby_content_inline(ngx_conf_t *cf, ngx_command_t *cmd,
+static char *ngx_http_mruby_add_handler(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf)
 {
   ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
       ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_mrb_code_t *code;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_int_t rc;
+  char *rv;
 
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_string(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    return NGX_CONF_ERROR;
-  }
-  mlcf->content_inline_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_string(%s) load failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
+  rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+  if (rv != NGX_CONF_OK) {
+    return rv;
   }
 
-  return NGX_CONF_OK;
-}
-
-static char *ngx_http_mruby_log_inline(ngx_conf_t *cf, ngx_command_t *cmd,
-    void *conf)
-{
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
-      ngx_http_mruby_module);
-  ngx_str_t *value;
-  ngx_mrb_code_t *code;
-  ngx_http_mruby_loc_conf_t *mlcf = conf;
-  ngx_int_t rc;
-
-  value = cf->args->elts;
-  code  = ngx_http_mruby_mrb_code_from_string(cf->pool, &value[1]);
-  if (code == NGX_CONF_UNSET_PTR) {
-    return NGX_CONF_ERROR;
-  }
-  mlcf->log_inline_code = code;
-  rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
-  if (rc != NGX_OK) {
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mrb_string(%s) load failed",
-        value[1].data);
-    return NGX_CONF_ERROR;
-  }
+  // *.rb files are run by the content phase handler
+  mmcf->enabled_phases |= NGX_HTTP_MRUBY_CONTENT_PHASE;
 
   return NGX_CONF_OK;
 }
@@ -1620,16 +1717,10 @@ static char *ngx_http_mruby_body_filter_phase(ngx_conf_t *cf,
         value[1].data);
     return NGX_CONF_ERROR;
   }
-  if (cf->args->nelts == 3) {
-    if (ngx_strcmp(value[2].data, "cache") == 0) {
-      code->cache = ON;
-    }
-    else {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-          "invalid parameter \"%V\", vaild parameter is only \"cache\"",
-          &value[2]);
-      return NGX_CONF_ERROR;
-    }
+  if (cf->args->nelts == 3
+      && ngx_http_mruby_code_option(cf, code, &value[2],
+        NGX_HTTP_MRUBY_OPTION_CALL) != NGX_CONF_OK) {
+    return NGX_CONF_ERROR;
   }
   rc = ngx_http_mruby_shared_state_compile(cf, mmcf->state, code);
   if (rc != NGX_OK) {
@@ -1674,6 +1765,24 @@ static char *ngx_http_mruby_body_filter_inline(ngx_conf_t *cf,
   return NGX_CONF_OK;
 }
 
+static char *ngx_http_mruby_stats_header(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+  ngx_http_mruby_main_conf_t *mmcf = ngx_http_conf_get_module_main_conf(cf,
+      ngx_http_mruby_module);
+  char *rv;
+
+  rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+  if (rv != NGX_CONF_OK) {
+    return rv;
+  }
+
+  // X-Mruby-Stats is appended by the header filter
+  mmcf->enabled_header_filter = 1;
+
+  return NGX_CONF_OK;
+}
+
 #if defined(NDK) && NDK
 
 static char *ngx_http_mruby_set_inner(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -1771,16 +1880,17 @@ static char *ngx_http_mruby_set_inline(ngx_conf_t *cf, ngx_command_t *cmd,
 #define NGX_MRUBY_DEFINE_METHOD_NGX_HANDLER(handler_name, code) \
 static ngx_int_t ngx_http_mruby_##handler_name##_handler(ngx_http_request_t *r) \
 { \
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_get_module_main_conf(r, \
-      ngx_http_mruby_module); \
+  ngx_http_mruby_main_conf_t *mmcf; \
   ngx_http_mruby_loc_conf_t  *mlcf = ngx_http_get_module_loc_conf(r, \
       ngx_http_mruby_module); \
-  if (mmcf->state == NGX_CONF_UNSET_PTR) { \
-    return NGX_DECLINED; \
+  ngx_int_t rc; \
+  if (ngx_http_mruby_async_done(r, &rc)) { \
+    return rc; \
   } \
   if (code == NGX_CONF_UNSET_PTR) { \
     return NGX_DECLINED; \
   } \
+  mmcf = ngx_http_get_module_main_conf(r, ngx_http_mruby_module); \
   if (!code->cache) { \
     NGX_MRUBY_STATE_REINIT_IF_NOT_CACHED( \
       mlcf->cached, \
@@ -1789,7 +1899,7 @@ static ngx_int_t ngx_http_mruby_##handler_name##_handler(ngx_http_request_t *r)
       ngx_http_mruby_state_reinit_from_file \
     ); \
   } \
-  return ngx_mrb_run(r, mmcf->state, code, mlcf->cached, NULL);                 \
+  return ngx_mrb_run(r, mmcf->state, code, mlcf->cached, NULL); \
 }
 
 NGX_MRUBY_DEFINE_METHOD_NGX_HANDLER(post_read, mlcf->post_read_code)
@@ -1801,14 +1911,18 @@ NGX_MRUBY_DEFINE_METHOD_NGX_HANDLER(log, mlcf->log_code)
 
 static ngx_int_t ngx_http_mruby_content_handler(ngx_http_request_t *r)
 {
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_get_module_main_conf(r,
-      ngx_http_mruby_module);
+  ngx_http_mruby_main_conf_t *mmcf;
   ngx_http_mruby_loc_conf_t  *mlcf = ngx_http_get_module_loc_conf(r,
       ngx_http_mruby_module);
 
   ngx_mrb_code_t *code;
   size_t root;
   ngx_str_t path;
+  ngx_int_t rc;
+
+  if (ngx_http_mruby_async_done(r, &rc)) {
+    return rc;
+  }
 
   if (mlcf->add_handler) {
     if (ngx_http_map_uri_to_path(r, &path, &root, 0) == NULL) {
@@ -1852,6 +1966,12 @@ static ngx_int_t ngx_http_mruby_content_handler(ngx_http_request_t *r)
   if (code == NGX_CONF_UNSET_PTR) {
     return NGX_DECLINED;
   }
+#if (NGX_HTTP_MRUBY_THREADS)
+  if (mlcf->thread_pool != NULL && !mlcf->add_handler) {
+    return ngx_http_mruby_thread_handler(r);
+  }
+#endif
+  mmcf = ngx_http_get_module_main_conf(r, ngx_http_mruby_module);
   if (!code->cache) {
     NGX_MRUBY_STATE_REINIT_IF_NOT_CACHED(
       mlcf->cached,
@@ -1860,32 +1980,15 @@ static ngx_int_t ngx_http_mruby_content_handler(ngx_http_request_t *r)
       ngx_http_mruby_state_reinit_from_file
     );
   }
-  return ngx_mrb_run(r, mmcf->state, code, mlcf->cached, NULL);
-}
-
-#define NGX_MRUBY_DEFINE_METHOD_NGX_INLINE_HANDLER(handler_name, code) \
-static ngx_int_t ngx_http_mruby_##handler_name##_inline_handler( \
-    ngx_http_request_t *r) \
-{ \
-  ngx_http_mruby_main_conf_t *mmcf = ngx_http_get_module_main_conf(r, \
-      ngx_http_mruby_module); \
-  ngx_http_mruby_loc_conf_t  *mlcf = ngx_http_get_module_loc_conf(r, \
-      ngx_http_mruby_module);  \
-  return ngx_mrb_run(r, mmcf->state, code, 1, NULL); \
+  rc = ngx_mrb_run(r, mmcf->state, code, mlcf->cached, NULL);
+  if (rc == NGX_DONE) {
+    // the content phase finalizes with NGX_DONE, keep the request alive
+    // until the suspended handler resumes
+    r->main->count++;
+  }
+  return rc;
 }
 
-NGX_MRUBY_DEFINE_METHOD_NGX_INLINE_HANDLER(post_read,
-    mlcf->post_read_inline_code)
-NGX_MRUBY_DEFINE_METHOD_NGX_INLINE_HANDLER(server_rewrite,
-    mlcf->server_rewrite_inline_code)
-NGX_MRUBY_DEFINE_METHOD_NGX_INLINE_HANDLER(rewrite,
-    mlcf->rewrite_inline_code)
-NGX_MRUBY_DEFINE_METHOD_NGX_INLINE_HANDLER(access,
-    mlcf->access_inline_code)
-NGX_MRUBY_DEFINE_METHOD_NGX_INLINE_HANDLER(content,
-    mlcf->content_inline_code)
-NGX_MRUBY_DEFINE_METHOD_NGX_INLINE_HANDLER(log, mlcf->log_inline_code)
-
 #if defined(NDK) && NDK
 static ngx_int_t ngx_http_mruby_set_handler(ngx_http_request_t *r,
     ngx_str_t *val, ngx_http_variable_value_t *v, void *data)
@@ -2020,8 +2123,20 @@ static ngx_int_t ngx_http_mruby_header_filter(ngx_http_request_t *r)
   ngx_http_mruby_loc_conf_t *mlcf;
   ngx_http_mruby_ctx_t *ctx;
 
+  if (r != r->main && ngx_mrb_capture_header_filter(r) != NGX_DECLINED) {
+    return NGX_OK;
+  }
+
   mlcf = ngx_http_get_module_loc_conf(r, ngx_http_mruby_module);
 
+  if (mlcf->stats_header && r == r->main) {
+    ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+    if (ctx != NULL && ctx->exec_runs > 0
+        && ngx_http_mruby_stats_header_set(r, ctx) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
   if (mlcf->body_filter_handler == NULL) {
     return ngx_http_next_header_filter(r);
   }
@@ -2050,6 +2165,32 @@ static ngx_int_t ngx_http_mruby_header_filter(ngx_http_request_t *r)
   return NGX_OK;
 }
 
+static ngx_int_t ngx_http_mruby_stats_header_set(ngx_http_request_t *r,
+    ngx_http_mruby_ctx_t *ctx)
+{
+  ngx_table_elt_t *h;
+  u_char *p;
+
+  h = ngx_list_push(&r->headers_out.headers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = ngx_pnalloc(r->pool, sizeof("runs=; usec=; allocs=") - 1
+      + 3 * NGX_INT_T_LEN);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  h->hash = 1;
+  ngx_str_set(&h->key, "X-Mruby-Stats");
+  h->value.data = p;
+  h->value.len = ngx_sprintf(p, "runs=%ui; usec=%i; allocs=%ui",
+      ctx->exec_runs, ctx->exec_usec, ctx->exec_allocs) - p;
+
+  return NGX_OK;
+}
+
 static ngx_int_t ngx_http_mruby_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in)
 {
@@ -2057,6 +2198,13 @@ static ngx_int_t ngx_http_mruby_body_filter(ngx_http_request_t *r,
   ngx_http_mruby_ctx_t *ctx;
   ngx_int_t rc;
 
+  if (r != r->main) {
+    rc = ngx_mrb_capture_body_filter(r, in);
+    if (rc != NGX_DECLINED) {
+      return rc;
+    }
+  }
+
   mlcf = ngx_http_get_module_loc_conf(r, ngx_http_mruby_module);
   if (mlcf->body_filter_handler == NULL) {
     return ngx_http_next_body_filter(r, in);
@@ -14,6 +14,12 @@
 #include "ngx_http_mruby_core.h"
 #include "ngx_http_mruby_init.h"
 
+// thread pools (mruby_thread_pool) appeared in nginx 1.7.11 --with-threads
+#if (NGX_THREADS) && (nginx_version >= 1007011)
+#define NGX_HTTP_MRUBY_THREADS 1
+#include <ngx_thread_pool.h>
+#endif
+
 #define MODULE_NAME "ngx_mruby"
 #define MODULE_VERSION "1.7.8"
 
@@ -25,6 +31,7 @@ typedef enum code_type_t {
 typedef struct ngx_mrb_state_t {
   mrb_state *mrb;
   int ai;
+  mrb_value request;
 } ngx_mrb_state_t;
 
 typedef struct ngx_mrb_code_t {
@@ -35,8 +42,13 @@ typedef struct ngx_mrb_code_t {
   code_type_t code_type;
   int n;
   unsigned int cache;
+  unsigned int callable;
+  // run as a fiber by ngx_mrb_run (request phase handlers)
+  unsigned int fiber;
   struct RProc *proc;
   mrbc_context *ctx;
+  // object returned by a "call" script, nil until the first request
+  mrb_value handler;
 } ngx_mrb_code_t;
 
 #if defined(NDK) && NDK
@@ -51,6 +63,20 @@ typedef struct {
 
 extern ngx_module_t  ngx_http_mruby_module;
 
+#define NGX_HTTP_MRUBY_POST_READ_PHASE      0x0001
+#define NGX_HTTP_MRUBY_SERVER_REWRITE_PHASE 0x0002
+#define NGX_HTTP_MRUBY_REWRITE_PHASE        0x0004
+#define NGX_HTTP_MRUBY_ACCESS_PHASE         0x0008
+#define NGX_HTTP_MRUBY_CONTENT_PHASE        0x0010
+#define NGX_HTTP_MRUBY_LOG_PHASE            0x0020
+
+typedef struct ngx_http_mruby_phase_handler_t {
+  ngx_http_phases phase;
+  ngx_uint_t mask;
+  ngx_uint_t offset;
+  ngx_http_handler_pt handler;
+} ngx_http_mruby_phase_handler_t;
+
 typedef struct ngx_http_mruby_main_conf_t {
   ngx_mrb_state_t *state;
   ngx_mrb_code_t *init_code;
@@ -58,33 +84,46 @@ typedef struct ngx_http_mruby_main_conf_t {
   ngx_mrb_code_t *exit_worker_code;
   ngx_int_t enabled_header_filter;
   ngx_int_t enabled_body_filter;
+  ngx_uint_t enabled_phases;
+  // ngx_shm_zone_t * of mruby_shared_dict, see ngx_http_mruby_shdict.c
+  ngx_array_t *shared_dicts;
+  // ngx_shm_zone_t * of mruby_rate_limit_zone, see ngx_http_mruby_ratelimit.c
+  ngx_array_t *rate_limit_zones;
+  // the zone of mruby_metrics_zone, see ngx_http_mruby_registry.c
+  ngx_shm_zone_t *metrics_zone;
+  // ngx_shm_zone_t * of mruby_topk_zone, see ngx_http_mruby_topk.c
+  ngx_array_t *topk_zones;
+  // ngx_shm_zone_t * of mruby_hll_zone, see ngx_http_mruby_hll.c
+  ngx_array_t *hll_zones;
 } ngx_http_mruby_main_conf_t;
 
 typedef struct ngx_http_mruby_loc_conf_t {
+  // mruby_*_handler and mruby_*_handler_code of a phase share one slot
   ngx_mrb_code_t *post_read_code;
   ngx_mrb_code_t *server_rewrite_code;
   ngx_mrb_code_t *rewrite_code;
   ngx_mrb_code_t *access_code;
   ngx_mrb_code_t *content_code;
   ngx_mrb_code_t *log_code;
-  ngx_mrb_code_t *post_read_inline_code;
-  ngx_mrb_code_t *server_rewrite_inline_code;
-  ngx_mrb_code_t *rewrite_inline_code;
-  ngx_mrb_code_t *access_inline_code;
-  ngx_mrb_code_t *content_inline_code;
-  ngx_mrb_code_t *log_inline_code;
   ngx_mrb_code_t *header_filter_code;
   ngx_mrb_code_t *header_filter_inline_code;
   ngx_mrb_code_t *body_filter_code;
   ngx_mrb_code_t *body_filter_inline_code;
   ngx_flag_t cached;
   ngx_flag_t add_handler;
+  ngx_flag_t stats_header;
+#if (NGX_HTTP_MRUBY_THREADS)
+  // the content handler runs there, see ngx_http_mruby_thread.c
+  ngx_thread_pool_t *thread_pool;
+#endif
 
   // filter handlers
   ngx_http_handler_pt header_filter_handler;
   ngx_http_output_body_filter_pt body_filter_handler;
 } ngx_http_mruby_loc_conf_t;
 
+void ngx_mrb_async_resume(ngx_http_mruby_ctx_t *ctx, mrb_value value);
+
 ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 ngx_http_output_body_filter_pt   ngx_http_next_body_filter;
 
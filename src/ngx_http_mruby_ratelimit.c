@@ -0,0 +1,451 @@
+/*
+// ngx_http_mruby_ratelimit.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_ratelimit.h"
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::RateLimiter keeps the state of any number of limits in a zone
+// declared with mruby_rate_limit_zone, shared by all workers. The zone is a
+// fixed table of slots and the state of a key is a single word of its slot,
+// so a check is a hash, a short probe and a compare-and-swap, never a lock
+// or an allocation.
+//
+// limit! is a token bucket in the form of GCRA: the word is the time at
+// which the bucket would be full again. sliding_window! packs the counts of
+// the current and the previous window with the number of the window into
+// the word and weighs the previous count by how much of it still overlaps.
+//
+// A slot is claimed by a key with a CAS of its 64 bit fingerprint, after a
+// CAS has emptied the state the slot was chosen by. When the slot has been
+// idle long enough for its state to be worthless it may be taken over by
+// another key, and when all slots a key may use are busy the check lets the
+// request through rather than fail it.
+*/
+
+// slots looked at for a key, starting at the one it hashes to
+#define NGX_MRB_RATELIMIT_PROBES       8
+// a freshly claimed slot is kept from other keys for this long, usec
+#define NGX_MRB_RATELIMIT_CLAIM        1000000
+#define NGX_MRB_RATELIMIT_COUNT_MAX    0xffffff
+
+// salts of the fingerprints, a key limited both ways has two slots
+#define NGX_MRB_RATELIMIT_BUCKET       0
+#define NGX_MRB_RATELIMIT_WINDOW       0x5bd1e9955bd1e995ULL
+
+typedef struct {
+  // fingerprint of the key, 0 for an unused slot
+  ngx_atomic_t key;
+  ngx_atomic_t state;
+  // usec since the epoch after which the state is worthless
+  ngx_atomic_t idle;
+} ngx_mrb_ratelimit_slot_t;
+
+typedef struct {
+  ngx_uint_t nslots;
+  ngx_mrb_ratelimit_slot_t slots[1];
+} ngx_mrb_ratelimit_sh_t;
+
+// shm_zone->data of a mruby_rate_limit_zone, one per cycle
+typedef struct {
+  ngx_str_t name;
+  ngx_mrb_ratelimit_sh_t *sh;
+} ngx_mrb_ratelimit_t;
+
+static const struct mrb_data_type ngx_mrb_ratelimit_data_type = {
+  "Nginx::RateLimiter", NULL,
+};
+
+static ngx_int_t ngx_mrb_ratelimit_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data)
+{
+  ngx_mrb_ratelimit_t *octx = data;
+  ngx_mrb_ratelimit_t *ctx = shm_zone->data;
+  ngx_slab_pool_t *shpool;
+  ngx_uint_t n;
+  size_t len;
+
+  // the zone of the previous cycle, kept by nginx with its contents
+  if (octx != NULL) {
+    ctx->sh = octx->sh;
+    return NGX_OK;
+  }
+
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  if (shm_zone->shm.exists) {
+    ctx->sh = shpool->data;
+    return NGX_OK;
+  }
+
+  // the other half is left to the slab pages and their bookkeeping
+  n = shm_zone->shm.size / 2 / sizeof(ngx_mrb_ratelimit_slot_t);
+  len = offsetof(ngx_mrb_ratelimit_sh_t, slots)
+        + n * sizeof(ngx_mrb_ratelimit_slot_t);
+  ctx->sh = ngx_slab_alloc(shpool, len);
+  if (ctx->sh == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(ctx->sh, len);
+  ctx->sh->nslots = n;
+  shpool->data = ctx->sh;
+
+  len = sizeof(" in mruby_rate_limit_zone \"\"") + shm_zone->shm.name.len;
+  shpool->log_ctx = ngx_slab_alloc(shpool, len);
+  if (shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(shpool->log_ctx, " in mruby_rate_limit_zone \"%V\"%Z",
+      &shm_zone->shm.name);
+
+  return NGX_OK;
+}
+
+char *ngx_http_mruby_rate_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+  ngx_http_mruby_main_conf_t *mmcf = conf;
+  ngx_str_t *value;
+  ngx_shm_zone_t *shm_zone, **zp;
+  ngx_mrb_ratelimit_t *ctx;
+  ssize_t size;
+
+  value = cf->args->elts;
+
+#if (NGX_PTR_SIZE < 8)
+  // the slots hold 64 bit fingerprints and usec times in atomic words
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_rate_limit_zone needs a"
+      " 64 bit platform");
+  return NGX_CONF_ERROR;
+#endif
+
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"",
+        &value[2]);
+    return NGX_CONF_ERROR;
+  }
+  if (size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_rate_limit_zone \"%V\""
+        " is too small", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_mrb_ratelimit_t));
+  if (ctx == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  ctx->name = value[1];
+
+  shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+      &ngx_http_mruby_module);
+  if (shm_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  // zone names are shared with mruby_shared_dict
+  if (shm_zone->data != NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+        &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  shm_zone->init = ngx_mrb_ratelimit_init_zone;
+  shm_zone->data = ctx;
+
+  if (mmcf->rate_limit_zones == NULL) {
+    mmcf->rate_limit_zones = ngx_array_create(cf->pool, 4,
+        sizeof(ngx_shm_zone_t *));
+    if (mmcf->rate_limit_zones == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+  zp = ngx_array_push(mmcf->rate_limit_zones);
+  if (zp == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  *zp = shm_zone;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_mrb_ratelimit_t *ngx_mrb_ratelimit_zone(mrb_state *mrb,
+    mrb_value name)
+{
+  ngx_http_mruby_main_conf_t *mmcf;
+  ngx_shm_zone_t **zones;
+  ngx_mrb_ratelimit_t *l;
+  ngx_uint_t i;
+
+  name = mrb_str_to_str(mrb, name);
+  mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mruby_module);
+  if (mmcf != NULL && mmcf->rate_limit_zones != NULL) {
+    zones = mmcf->rate_limit_zones->elts;
+    for (i = 0; i < mmcf->rate_limit_zones->nelts; i++) {
+      l = zones[i]->data;
+      if (l->name.len == (size_t) RSTRING_LEN(name)
+          && ngx_strncmp(l->name.data, RSTRING_PTR(name), l->name.len) == 0
+          && l->sh != NULL) {
+        return l;
+      }
+    }
+  }
+
+  // the zones are mapped after the configuration, i.e. after mruby_init
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "no mruby_rate_limit_zone %S", name);
+
+  return NULL;
+}
+
+static ngx_mrb_ratelimit_t *ngx_mrb_ratelimit_self(mrb_state *mrb,
+    mrb_value self)
+{
+  ngx_mrb_ratelimit_t *l;
+
+  l = mrb_data_get_ptr(mrb, self, &ngx_mrb_ratelimit_data_type);
+  if (l == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::RateLimiter");
+  }
+
+  return l;
+}
+
+static ngx_atomic_uint_t ngx_mrb_ratelimit_now(void)
+{
+  ngx_time_t *tp = ngx_timeofday();
+
+  return (ngx_atomic_uint_t) tp->sec * 1000000 + tp->msec * 1000;
+}
+
+// raises the idle time of s to at least t
+static void ngx_mrb_ratelimit_idle(ngx_mrb_ratelimit_slot_t *s,
+    ngx_atomic_uint_t t)
+{
+  ngx_atomic_uint_t old;
+
+  for (old = s->idle; old < t; old = s->idle) {
+    if (ngx_atomic_cmp_set(&s->idle, old, t)) {
+      return;
+    }
+  }
+}
+
+/*
+// the slot of key, claimed for it when it has none; NULL when all slots it
+// may use belong to keys that are still limited
+*/
+static ngx_mrb_ratelimit_slot_t *ngx_mrb_ratelimit_slot(mrb_state *mrb,
+    ngx_mrb_ratelimit_t *l, mrb_value k, uint64_t salt,
+    ngx_atomic_uint_t now)
+{
+  ngx_mrb_ratelimit_slot_t *s, *victim = NULL;
+  ngx_atomic_uint_t fp, key, state, vkey = 0, vstate = 0;
+  ngx_uint_t i, n;
+  uint32_t hash;
+  u_char *p;
+  size_t len;
+
+  k = mrb_str_to_str(mrb, k);
+  p = (u_char *) RSTRING_PTR(k);
+  len = RSTRING_LEN(k);
+  hash = ngx_murmur_hash2(p, len);
+  fp = (ngx_atomic_uint_t)
+       ((((uint64_t) ngx_crc32_short(p, len) << 32) | hash) ^ salt);
+  if (fp == 0) {
+    fp = 1;
+  }
+
+  i = hash % l->sh->nslots;
+  for (n = 0; n < NGX_MRB_RATELIMIT_PROBES; n++) {
+    s = &l->sh->slots[(i + n) % l->sh->nslots];
+    // the state first, a claim resets it before it publishes the key
+    state = s->state;
+    ngx_memory_barrier();
+    key = s->key;
+    if (key == fp) {
+      return s;
+    }
+    if (victim == NULL && (key == 0 || s->idle < now)) {
+      victim = s;
+      vkey = key;
+      vstate = state;
+    }
+  }
+
+  if (victim == NULL) {
+    return NULL;
+  }
+  // 0 is the empty state of both kinds of limit. It is set with a CAS
+  // against the state the victim was chosen by, then the key changes with
+  // another CAS. The previous owner may still write the state in between,
+  // and the new key then starts with its last request counted. That race
+  // is benign: the victim was free or idle long enough for its state to be
+  // worthless, so at most one request of another key is charged once. A
+  // state written by a worker that found the slot claimed already makes
+  // the first CAS fail and is never wiped out.
+  if (!ngx_atomic_cmp_set(&victim->state, vstate, 0)
+      || !ngx_atomic_cmp_set(&victim->key, vkey, fp)) {
+    // claimed meanwhile, maybe for the same key by another worker
+    return victim->key == fp ? victim : NULL;
+  }
+  ngx_mrb_ratelimit_idle(victim, now + NGX_MRB_RATELIMIT_CLAIM);
+
+  return victim;
+}
+
+// the zone is full or the claim of a slot lost a race; either can happen on
+// every request to a busy zone, so it is only worth a debug line
+static void ngx_mrb_ratelimit_full(ngx_mrb_ratelimit_t *l, mrb_value k)
+{
+  ngx_log_error(NGX_LOG_DEBUG, ngx_cycle->log, 0
+    , "%s DEBUG %s:%d: no slot for \"%*s\" in mruby_rate_limit_zone"
+      " \"%V\", request let through"
+    , MODULE_NAME
+    , __func__
+    , __LINE__
+    , (size_t) RSTRING_LEN(k)
+    , RSTRING_PTR(k)
+    , &l->name
+  );
+}
+
+static mrb_value ngx_mrb_ratelimit_init(mrb_state *mrb, mrb_value self)
+{
+  mrb_value name;
+
+  mrb_get_args(mrb, "o", &name);
+  DATA_TYPE(self) = &ngx_mrb_ratelimit_data_type;
+  DATA_PTR(self) = ngx_mrb_ratelimit_zone(mrb, name);
+
+  return self;
+}
+
+/*
+// limit!(key, rate, burst = 0, nodelay = false): rate requests a second with
+// up to burst more at once. false when the request is over the limit, else
+// the seconds it should be delayed by to keep to rate, 0.0 with nodelay.
+*/
+static mrb_value ngx_mrb_ratelimit_limit(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_ratelimit_t *l = ngx_mrb_ratelimit_self(mrb, self);
+  ngx_mrb_ratelimit_slot_t *s;
+  ngx_atomic_uint_t now, t, tau, old, tat;
+  mrb_value k;
+  mrb_float rate, burst = 0;
+  mrb_bool nodelay = 0;
+
+  mrb_get_args(mrb, "Sf|fb", &k, &rate, &burst, &nodelay);
+  if (rate <= 0 || burst < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "rate must be positive and burst not"
+        " negative");
+  }
+
+  // usec between requests, rates above 1000000 a second are that
+  t = (ngx_atomic_uint_t) (1000000 / rate);
+  if (t == 0) {
+    t = 1;
+  }
+  tau = (ngx_atomic_uint_t) (burst * t);
+  now = ngx_mrb_ratelimit_now();
+
+  s = ngx_mrb_ratelimit_slot(mrb, l, k, NGX_MRB_RATELIMIT_BUCKET, now);
+  if (s == NULL) {
+    ngx_mrb_ratelimit_full(l, k);
+    return mrb_float_value(mrb, 0.0);
+  }
+
+  for ( ;; ) {
+    old = s->state;
+    tat = old > now ? old : now;
+    if (tat - now > tau) {
+      return mrb_false_value();
+    }
+    if (ngx_atomic_cmp_set(&s->state, old, tat + t)) {
+      break;
+    }
+  }
+  ngx_mrb_ratelimit_idle(s, tat + t);
+
+  if (nodelay) {
+    return mrb_float_value(mrb, 0.0);
+  }
+
+  return mrb_float_value(mrb, (mrb_float) (tat - now) / 1000000);
+}
+
+/*
+// sliding_window!(key, limit, window): counts the request and returns true
+// when fewer than limit were counted in the last window seconds, else false
+*/
+static mrb_value ngx_mrb_ratelimit_window(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_ratelimit_t *l = ngx_mrb_ratelimit_self(mrb, self);
+  ngx_mrb_ratelimit_slot_t *s;
+  ngx_atomic_uint_t now, len, old;
+  uint64_t w, prev, cur;
+  mrb_value k;
+  mrb_int limit;
+  mrb_float window;
+  double weight;
+
+  mrb_get_args(mrb, "Sif", &k, &limit, &window);
+  if (limit <= 0 || limit > NGX_MRB_RATELIMIT_COUNT_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "limit must be 1 to 16777215");
+  }
+  if (window < 0.001) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "window must be at least a msec");
+  }
+
+  len = (ngx_atomic_uint_t) (window * 1000000);
+  now = ngx_mrb_ratelimit_now();
+  w = now / len;
+  // the share of the previous window still in the sliding one
+  weight = (double) (len - now % len) / len;
+
+  s = ngx_mrb_ratelimit_slot(mrb, l, k, NGX_MRB_RATELIMIT_WINDOW, now);
+  if (s == NULL) {
+    ngx_mrb_ratelimit_full(l, k);
+    return mrb_true_value();
+  }
+
+  // 16 bits of the window number, the previous count, the current count
+  for ( ;; ) {
+    old = s->state;
+    prev = ((uint64_t) old >> 24) & NGX_MRB_RATELIMIT_COUNT_MAX;
+    cur = (uint64_t) old & NGX_MRB_RATELIMIT_COUNT_MAX;
+    if (((uint64_t) old >> 48) == ((w - 1) & 0xffff)) {
+      prev = cur;
+      cur = 0;
+    }
+    else if (((uint64_t) old >> 48) != (w & 0xffff)) {
+      prev = 0;
+      cur = 0;
+    }
+    if (prev * weight + cur >= limit) {
+      return mrb_false_value();
+    }
+    if (ngx_atomic_cmp_set(&s->state, old, (ngx_atomic_uint_t)
+          (((w & 0xffff) << 48) | (prev << 24) | (cur + 1)))) {
+      break;
+    }
+  }
+  ngx_mrb_ratelimit_idle(s, (ngx_atomic_uint_t) (w + 2) * len);
+
+  return mrb_true_value();
+}
+
+void ngx_mrb_ratelimit_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_limiter;
+
+  class_limiter = mrb_define_class_under(mrb, class, "RateLimiter", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_limiter, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_limiter, "initialize", ngx_mrb_ratelimit_init, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_limiter, "limit!", ngx_mrb_ratelimit_limit, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, class_limiter, "sliding_window!", ngx_mrb_ratelimit_window, MRB_ARGS_REQ(3));
+}
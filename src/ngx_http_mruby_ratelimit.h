@@ -0,0 +1,18 @@
+/*
+// ngx_http_mruby_ratelimit.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_RATELIMIT_H
+#define NGX_HTTP_MRUBY_RATELIMIT_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+char *ngx_http_mruby_rate_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+#endif // NGX_HTTP_MRUBY_RATELIMIT_H
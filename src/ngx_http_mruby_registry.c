@@ -0,0 +1,821 @@
+/*
+// ngx_http_mruby_registry.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_registry.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// The metrics registry behind Nginx::Metrics.counter, .gauge and .histogram
+// lives in the zone of mruby_metrics_zone and is served in the Prometheus
+// text format by locations with mruby_metrics.
+//
+// A metric family (name, type, help, histogram buckets) holds series, one
+// per set of labels. Registering takes the zone mutex, but a series is
+// never freed, so the Ruby object of a series points right at its values
+// and updates it without the lock. Counters and histograms have one row of
+// values per worker (ngx_mrb_registry_row), as a rule written only by that
+// worker, and summed when the registry is read; gauges are one value set by
+// all.
+// Values are doubles in atomic words, added to with compare-and-swap, which
+// does not contend in a row of its own. Since the zone survives the workers
+// and reloads, so do the counts of a worker that exits.
+*/
+
+#define NGX_MRB_REGISTRY_BUCKETS_MAX   64
+#define NGX_MRB_REGISTRY_NAME_MAX      255
+// a line of the output less its name and labels
+#define NGX_MRB_REGISTRY_LINE_MAX      128
+
+typedef enum {
+  NGX_MRB_REGISTRY_COUNTER = 1,
+  NGX_MRB_REGISTRY_GAUGE,
+  NGX_MRB_REGISTRY_HISTOGRAM
+} ngx_mrb_registry_type_t;
+
+static ngx_str_t ngx_mrb_registry_types[] = {
+  ngx_null_string,
+  ngx_string("counter"),
+  ngx_string("gauge"),
+  ngx_string("histogram")
+};
+
+typedef struct {
+  // str is the name
+  ngx_str_node_t sn;
+  // in ngx_mrb_registry_sh_t.families, in order of registration
+  ngx_queue_t queue;
+  ngx_queue_t series;
+  ngx_uint_t type;
+  ngx_str_t help;
+  ngx_uint_t nbuckets;
+  double *bounds;
+} ngx_mrb_registry_family_t;
+
+typedef struct {
+  // str is name{labels}
+  ngx_str_node_t sn;
+  ngx_queue_t queue;
+  ngx_mrb_registry_family_t *family;
+  ngx_str_t labels;
+  // rows of nvalues, one for each worker but just one for gauges
+  ngx_uint_t nrows;
+  ngx_uint_t nvalues;
+  ngx_atomic_t *values;
+} ngx_mrb_registry_series_t;
+
+typedef struct {
+  ngx_rbtree_t families;
+  ngx_rbtree_node_t families_sentinel;
+  ngx_rbtree_t series;
+  ngx_rbtree_node_t series_sentinel;
+  ngx_queue_t family_list;
+} ngx_mrb_registry_sh_t;
+
+typedef struct {
+  ngx_mrb_registry_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ngx_mrb_registry_t;
+
+// the series stays in the zone
+static const struct mrb_data_type ngx_mrb_registry_data_type = {
+  "Nginx::Metrics series", NULL,
+};
+
+static double ngx_mrb_registry_load(ngx_atomic_t *v)
+{
+  ngx_atomic_uint_t bits = *v;
+  double d;
+
+  ngx_memcpy(&d, &bits, sizeof(double));
+
+  return d;
+}
+
+static void ngx_mrb_registry_add(ngx_atomic_t *v, double d)
+{
+  ngx_atomic_uint_t old, bits;
+  double sum;
+
+  do {
+    old = *v;
+    ngx_memcpy(&sum, &old, sizeof(double));
+    sum += d;
+    ngx_memcpy(&bits, &sum, sizeof(double));
+  } while (!ngx_atomic_cmp_set(v, old, bits));
+}
+
+static ngx_int_t ngx_mrb_registry_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data)
+{
+  ngx_mrb_registry_t *octx = data;
+  ngx_mrb_registry_t *ctx = shm_zone->data;
+  ngx_mrb_registry_sh_t *sh;
+  size_t len;
+
+  // the zone of the previous cycle, kept by nginx with its contents
+  if (octx != NULL) {
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    return NGX_OK;
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  if (shm_zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+
+  sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_mrb_registry_sh_t));
+  if (sh == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_rbtree_init(&sh->families, &sh->families_sentinel,
+      ngx_str_rbtree_insert_value);
+  ngx_rbtree_init(&sh->series, &sh->series_sentinel,
+      ngx_str_rbtree_insert_value);
+  ngx_queue_init(&sh->family_list);
+  ctx->sh = sh;
+  ctx->shpool->data = sh;
+
+  len = sizeof(" in mruby_metrics_zone");
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if (ctx->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memcpy(ctx->shpool->log_ctx, " in mruby_metrics_zone", len);
+
+  return NGX_OK;
+}
+
+char *ngx_http_mruby_metrics_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+  ngx_http_mruby_main_conf_t *mmcf = conf;
+  ngx_str_t *value, name = ngx_string("mruby_metrics");
+  ngx_mrb_registry_t *ctx;
+  ssize_t size;
+
+  value = cf->args->elts;
+
+#if (NGX_PTR_SIZE < 8)
+  // the values are doubles in atomic words
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_metrics_zone needs a 64 bit"
+      " platform");
+  return NGX_CONF_ERROR;
+#endif
+
+  if (mmcf->metrics_zone != NULL) {
+    return "is duplicate";
+  }
+
+  size = ngx_parse_size(&value[1]);
+  if (size == NGX_ERROR) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"",
+        &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  if (size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_metrics_zone is too"
+        " small");
+    return NGX_CONF_ERROR;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_mrb_registry_t));
+  if (ctx == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  mmcf->metrics_zone = ngx_shared_memory_add(cf, &name, size,
+      &ngx_http_mruby_module);
+  if (mmcf->metrics_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  if (mmcf->metrics_zone->data != NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+        &name);
+    return NGX_CONF_ERROR;
+  }
+  mmcf->metrics_zone->init = ngx_mrb_registry_init_zone;
+  mmcf->metrics_zone->data = ctx;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_mrb_registry_t *ngx_mrb_registry_zone(mrb_state *mrb)
+{
+  ngx_http_mruby_main_conf_t *mmcf;
+  ngx_mrb_registry_t *reg;
+
+  mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mruby_module);
+  if (mmcf == NULL || mmcf->metrics_zone == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::Metrics needs mruby_metrics_zone");
+  }
+  reg = mmcf->metrics_zone->data;
+  // the zones are mapped after the configuration, i.e. after mruby_init
+  if (reg->sh == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "mruby_metrics_zone is not mapped yet");
+  }
+
+  return reg;
+}
+
+static ngx_int_t ngx_mrb_registry_valid_name(u_char *p, size_t len)
+{
+  size_t i;
+
+  if (len == 0 || len > NGX_MRB_REGISTRY_NAME_MAX
+      || (p[0] >= '0' && p[0] <= '9')) {
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    if (!((p[i] >= 'a' && p[i] <= 'z') || (p[i] >= 'A' && p[i] <= 'Z')
+          || (p[i] >= '0' && p[i] <= '9') || p[i] == '_' || p[i] == ':')) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// copies data into the zone, the lock is held
+static ngx_int_t ngx_mrb_registry_strdup(ngx_mrb_registry_t *reg,
+    ngx_str_t *dst, u_char *data, size_t len)
+{
+  dst->len = len;
+  if (len == 0) {
+    dst->data = NULL;
+    return NGX_OK;
+  }
+  dst->data = ngx_slab_alloc_locked(reg->shpool, len);
+  if (dst->data == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memcpy(dst->data, data, len);
+
+  return NGX_OK;
+}
+
+/*
+// the family of name, registered when new; NULL with *err set when it does
+// not fit or is registered with another type. The lock is held.
+*/
+static ngx_mrb_registry_family_t *ngx_mrb_registry_family(
+    ngx_mrb_registry_t *reg, ngx_uint_t type, ngx_str_t *name,
+    ngx_str_t *help, double *bounds, ngx_uint_t nbuckets, const char **err)
+{
+  ngx_mrb_registry_family_t *f;
+  uint32_t hash;
+
+  hash = ngx_crc32_short(name->data, name->len);
+  f = (ngx_mrb_registry_family_t *) ngx_str_rbtree_lookup(
+      &reg->sh->families, name, hash);
+  if (f != NULL) {
+    if (f->type != type) {
+      *err = "metric registered with another type";
+      return NULL;
+    }
+    return f;
+  }
+
+  *err = "no memory in mruby_metrics_zone";
+  f = ngx_slab_alloc_locked(reg->shpool, sizeof(ngx_mrb_registry_family_t));
+  if (f == NULL) {
+    return NULL;
+  }
+  ngx_memzero(f, sizeof(ngx_mrb_registry_family_t));
+  if (ngx_mrb_registry_strdup(reg, &f->sn.str, name->data, name->len)
+      != NGX_OK
+      || ngx_mrb_registry_strdup(reg, &f->help, help->data, help->len)
+      != NGX_OK) {
+    goto failed;
+  }
+  if (nbuckets > 0) {
+    f->bounds = ngx_slab_alloc_locked(reg->shpool, nbuckets * sizeof(double));
+    if (f->bounds == NULL) {
+      goto failed;
+    }
+    ngx_memcpy(f->bounds, bounds, nbuckets * sizeof(double));
+  }
+  f->nbuckets = nbuckets;
+  f->type = type;
+  f->sn.node.key = hash;
+  ngx_queue_init(&f->series);
+  ngx_rbtree_insert(&reg->sh->families, &f->sn.node);
+  ngx_queue_insert_tail(&reg->sh->family_list, &f->queue);
+
+  return f;
+
+failed:
+
+  if (f->sn.str.data != NULL) {
+    ngx_slab_free_locked(reg->shpool, f->sn.str.data);
+  }
+  if (f->help.data != NULL) {
+    ngx_slab_free_locked(reg->shpool, f->help.data);
+  }
+  ngx_slab_free_locked(reg->shpool, f);
+
+  return NULL;
+}
+
+// the series of key (name{labels}) in f, registered when new; the lock is held
+static ngx_mrb_registry_series_t *ngx_mrb_registry_series(
+    ngx_mrb_registry_t *reg, ngx_mrb_registry_family_t *f, ngx_str_t *key)
+{
+  ngx_mrb_registry_series_t *s;
+  ngx_core_conf_t *ccf;
+  uint32_t hash;
+  size_t size;
+
+  hash = ngx_crc32_short(key->data, key->len);
+  s = (ngx_mrb_registry_series_t *) ngx_str_rbtree_lookup(&reg->sh->series,
+      key, hash);
+  if (s != NULL) {
+    return s;
+  }
+
+  s = ngx_slab_alloc_locked(reg->shpool, sizeof(ngx_mrb_registry_series_t));
+  if (s == NULL) {
+    return NULL;
+  }
+  ngx_memzero(s, sizeof(ngx_mrb_registry_series_t));
+
+  ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx, ngx_core_module);
+  // a row per worker and one for other processes, see ngx_mrb_registry_row
+  s->nrows = f->type == NGX_MRB_REGISTRY_GAUGE ? 1
+      : (ngx_uint_t) ngx_max(ccf->worker_processes, 1) + 1;
+  // bucket counts, the count above the last bound and the sum
+  s->nvalues = f->type == NGX_MRB_REGISTRY_HISTOGRAM ? f->nbuckets + 2 : 1;
+  size = s->nrows * s->nvalues * sizeof(ngx_atomic_t);
+  s->values = ngx_slab_alloc_locked(reg->shpool, size);
+  if (s->values == NULL
+      || ngx_mrb_registry_strdup(reg, &s->sn.str, key->data, key->len)
+      != NGX_OK) {
+    if (s->values != NULL) {
+      ngx_slab_free_locked(reg->shpool, s->values);
+    }
+    ngx_slab_free_locked(reg->shpool, s);
+    return NULL;
+  }
+  ngx_memzero(s->values, size);
+  s->family = f;
+  s->labels.data = s->sn.str.data + f->sn.str.len + 1;
+  s->labels.len = key->len - f->sn.str.len - 2;
+  s->sn.node.key = hash;
+  ngx_rbtree_insert(&reg->sh->series, &s->sn.node);
+  ngx_queue_insert_tail(&f->series, &s->queue);
+
+  return s;
+}
+
+static ngx_mrb_registry_series_t *ngx_mrb_registry_get(mrb_state *mrb,
+    mrb_value self)
+{
+  ngx_mrb_registry_series_t *s;
+
+  s = mrb_data_get_ptr(mrb, self, &ngx_mrb_registry_data_type);
+  if (s == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::Metrics series");
+  }
+
+  return s;
+}
+
+/*
+// the row of the running worker; the master, or nginx without
+// master_process, takes the last row. nginx before 1.9.1 has no ngx_worker,
+// so workers go by ngx_process_slot there, and respawned workers can share
+// a row. As with series kept over a reload that raised worker_processes,
+// that only costs contention: rows are added to with compare-and-swap.
+*/
+static ngx_atomic_t *ngx_mrb_registry_row(ngx_mrb_registry_series_t *s)
+{
+  ngx_uint_t row;
+
+  if (s->nrows == 1) {
+    return s->values;
+  }
+  if (ngx_process != NGX_PROCESS_WORKER) {
+    row = s->nrows - 1;
+  }
+  else {
+#if (nginx_version >= 1009001)
+    row = ngx_worker % (s->nrows - 1);
+#else
+    row = ngx_process_slot % (s->nrows - 1);
+#endif
+  }
+
+  return s->values + row * s->nvalues;
+}
+
+/*
+// initialize(name, labels, help, buckets) of Counter, Gauge and Histogram,
+// see Nginx::Metrics.counter; labels are rendered already
+*/
+static mrb_value ngx_mrb_registry_init(mrb_state *mrb, mrb_value self,
+    ngx_uint_t type)
+{
+  ngx_mrb_registry_t *reg = ngx_mrb_registry_zone(mrb);
+  ngx_mrb_registry_family_t *f;
+  ngx_mrb_registry_series_t *s = NULL;
+  double bounds[NGX_MRB_REGISTRY_BUCKETS_MAX];
+  mrb_value name, labels, help, buckets, key;
+  ngx_str_t n, h, k;
+  const char *err;
+  mrb_int i, nbuckets = 0;
+
+  mrb_get_args(mrb, "SSSA", &name, &labels, &help, &buckets);
+  if (!ngx_mrb_registry_valid_name((u_char *) RSTRING_PTR(name),
+        RSTRING_LEN(name))) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid metric name %S", name);
+  }
+  if (type == NGX_MRB_REGISTRY_HISTOGRAM) {
+    nbuckets = RARRAY_LEN(buckets);
+    if (nbuckets == 0 || nbuckets > NGX_MRB_REGISTRY_BUCKETS_MAX) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "a histogram has 1 to 64 buckets");
+    }
+    for (i = 0; i < nbuckets; i++) {
+      bounds[i] = (double) mrb_to_flo(mrb, mrb_ary_ref(mrb, buckets, i));
+      if (i > 0 && bounds[i] <= bounds[i - 1]) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "histogram buckets must increase");
+      }
+    }
+  }
+
+  key = mrb_str_dup(mrb, name);
+  mrb_str_cat(mrb, key, "{", 1);
+  mrb_str_cat_str(mrb, key, labels);
+  mrb_str_cat(mrb, key, "}", 1);
+  n.data = (u_char *) RSTRING_PTR(name);
+  n.len = RSTRING_LEN(name);
+  h.data = (u_char *) RSTRING_PTR(help);
+  h.len = RSTRING_LEN(help);
+  k.data = (u_char *) RSTRING_PTR(key);
+  k.len = RSTRING_LEN(key);
+
+  ngx_shmtx_lock(&reg->shpool->mutex);
+  f = ngx_mrb_registry_family(reg, type, &n, &h, bounds, nbuckets, &err);
+  if (f != NULL) {
+    err = "no memory in mruby_metrics_zone";
+    s = ngx_mrb_registry_series(reg, f, &k);
+  }
+  ngx_shmtx_unlock(&reg->shpool->mutex);
+
+  if (s == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "%S: %S", mrb_str_new_cstr(mrb, err),
+        key);
+  }
+
+  DATA_TYPE(self) = &ngx_mrb_registry_data_type;
+  DATA_PTR(self) = s;
+
+  return self;
+}
+
+static mrb_value ngx_mrb_registry_counter_init(mrb_state *mrb, mrb_value self)
+{
+  return ngx_mrb_registry_init(mrb, self, NGX_MRB_REGISTRY_COUNTER);
+}
+
+static mrb_value ngx_mrb_registry_gauge_init(mrb_state *mrb, mrb_value self)
+{
+  return ngx_mrb_registry_init(mrb, self, NGX_MRB_REGISTRY_GAUGE);
+}
+
+static mrb_value ngx_mrb_registry_histogram_init(mrb_state *mrb,
+    mrb_value self)
+{
+  return ngx_mrb_registry_init(mrb, self, NGX_MRB_REGISTRY_HISTOGRAM);
+}
+
+// counter.inc(by = 1)
+static mrb_value ngx_mrb_registry_counter_inc(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_registry_series_t *s = ngx_mrb_registry_get(mrb, self);
+  mrb_float by = 1;
+
+  mrb_get_args(mrb, "|f", &by);
+  if (by < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "counters only go up");
+  }
+  ngx_mrb_registry_add(ngx_mrb_registry_row(s), (double) by);
+
+  return self;
+}
+
+// the sum of the value idx of all rows
+static double ngx_mrb_registry_sum(ngx_mrb_registry_series_t *s,
+    ngx_uint_t idx)
+{
+  ngx_uint_t i;
+  double sum = 0;
+
+  for (i = 0; i < s->nrows; i++) {
+    sum += ngx_mrb_registry_load(&s->values[i * s->nvalues + idx]);
+  }
+
+  return sum;
+}
+
+static mrb_value ngx_mrb_registry_value(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_registry_series_t *s = ngx_mrb_registry_get(mrb, self);
+
+  return mrb_float_value(mrb, (mrb_float) ngx_mrb_registry_sum(s, 0));
+}
+
+// gauge.set(value)
+static mrb_value ngx_mrb_registry_gauge_set(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_registry_series_t *s = ngx_mrb_registry_get(mrb, self);
+  ngx_atomic_uint_t bits;
+  mrb_float v;
+  double d;
+
+  mrb_get_args(mrb, "f", &v);
+  d = (double) v;
+  ngx_memcpy(&bits, &d, sizeof(double));
+  *s->values = bits;
+
+  return self;
+}
+
+// gauge.inc(by = 1), dec is inc(-by)
+static mrb_value ngx_mrb_registry_gauge_inc(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_registry_series_t *s = ngx_mrb_registry_get(mrb, self);
+  mrb_float by = 1;
+
+  mrb_get_args(mrb, "|f", &by);
+  ngx_mrb_registry_add(s->values, (double) by);
+
+  return self;
+}
+
+// histogram.observe(value)
+static mrb_value ngx_mrb_registry_observe(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_registry_series_t *s = ngx_mrb_registry_get(mrb, self);
+  ngx_mrb_registry_family_t *f = s->family;
+  ngx_atomic_t *row;
+  ngx_uint_t i;
+  mrb_float v;
+
+  mrb_get_args(mrb, "f", &v);
+  for (i = 0; i < f->nbuckets && v > f->bounds[i]; i++) { /* void */ }
+
+  row = ngx_mrb_registry_row(s);
+  (void) ngx_atomic_fetch_add(&row[i], 1);
+  ngx_mrb_registry_add(&row[f->nbuckets + 1], (double) v);
+
+  return self;
+}
+
+static mrb_value ngx_mrb_registry_count(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_registry_series_t *s = ngx_mrb_registry_get(mrb, self);
+  ngx_atomic_uint_t n = 0;
+  ngx_uint_t i, j;
+
+  for (i = 0; i < s->nrows; i++) {
+    for (j = 0; j <= s->family->nbuckets; j++) {
+      n += s->values[i * s->nvalues + j];
+    }
+  }
+
+  return mrb_fixnum_value((mrb_int) n);
+}
+
+static mrb_value ngx_mrb_registry_hsum(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_registry_series_t *s = ngx_mrb_registry_get(mrb, self);
+
+  return mrb_float_value(mrb,
+      (mrb_float) ngx_mrb_registry_sum(s, s->family->nbuckets + 1));
+}
+
+// without trailing zeros, as Prometheus clients print numbers
+static u_char *ngx_mrb_registry_number(u_char *p, double d)
+{
+  if (d == (double) (int64_t) d && d < 1e15 && d > -1e15) {
+    return ngx_sprintf(p, "%L", (int64_t) d);
+  }
+
+  p = ngx_sprintf(p, "%.6f", d);
+  while (p[-1] == '0') {
+    p--;
+  }
+
+  return p[-1] == '.' ? p - 1 : p;
+}
+
+static u_char *ngx_mrb_registry_line(u_char *p, ngx_str_t *name,
+    const char *suffix, ngx_str_t *labels, u_char *le, size_t le_len)
+{
+  p = ngx_cpymem(p, name->data, name->len);
+  p = ngx_sprintf(p, "%s", suffix);
+  if (labels->len == 0 && le_len == 0) {
+    return ngx_sprintf(p, " ");
+  }
+  *p++ = '{';
+  p = ngx_cpymem(p, labels->data, labels->len);
+  if (le_len > 0) {
+    p = ngx_sprintf(p, "%sle=\"%*s\"", labels->len ? "," : "", le_len, le);
+  }
+
+  return ngx_sprintf(p, "} ");
+}
+
+// the registry in the text format, the lock is held
+static u_char *ngx_mrb_registry_render(ngx_mrb_registry_t *reg, u_char *p)
+{
+  ngx_mrb_registry_family_t *f;
+  ngx_mrb_registry_series_t *s;
+  ngx_queue_t *fq, *sq;
+  ngx_atomic_uint_t n, count;
+  u_char le[NGX_MRB_REGISTRY_LINE_MAX], *e;
+  ngx_uint_t i, j;
+
+  for (fq = ngx_queue_head(&reg->sh->family_list);
+       fq != ngx_queue_sentinel(&reg->sh->family_list);
+       fq = ngx_queue_next(fq)) {
+    f = ngx_queue_data(fq, ngx_mrb_registry_family_t, queue);
+    if (f->help.len > 0) {
+      p = ngx_sprintf(p, "# HELP %V %V\n", &f->sn.str, &f->help);
+    }
+    p = ngx_sprintf(p, "# TYPE %V %V\n", &f->sn.str,
+        &ngx_mrb_registry_types[f->type]);
+
+    for (sq = ngx_queue_head(&f->series);
+         sq != ngx_queue_sentinel(&f->series);
+         sq = ngx_queue_next(sq)) {
+      s = ngx_queue_data(sq, ngx_mrb_registry_series_t, queue);
+      if (f->type != NGX_MRB_REGISTRY_HISTOGRAM) {
+        p = ngx_mrb_registry_line(p, &f->sn.str, "", &s->labels, NULL, 0);
+        p = ngx_mrb_registry_number(p, ngx_mrb_registry_sum(s, 0));
+        *p++ = LF;
+        continue;
+      }
+
+      count = 0;
+      for (i = 0; i <= f->nbuckets; i++) {
+        for (n = 0, j = 0; j < s->nrows; j++) {
+          n += s->values[j * s->nvalues + i];
+        }
+        count += n;
+        if (i == f->nbuckets) {
+          e = ngx_cpymem(le, "+Inf", 4);
+        }
+        else {
+          e = ngx_mrb_registry_number(le, f->bounds[i]);
+        }
+        p = ngx_mrb_registry_line(p, &f->sn.str, "_bucket", &s->labels, le,
+            e - le);
+        p = ngx_sprintf(p, "%uA\n", count);
+      }
+      p = ngx_mrb_registry_line(p, &f->sn.str, "_sum", &s->labels, NULL, 0);
+      p = ngx_mrb_registry_number(p,
+          ngx_mrb_registry_sum(s, f->nbuckets + 1));
+      *p++ = LF;
+      p = ngx_mrb_registry_line(p, &f->sn.str, "_count", &s->labels, NULL,
+          0);
+      p = ngx_sprintf(p, "%uA\n", count);
+    }
+  }
+
+  return p;
+}
+
+// an upper bound of the length of ngx_mrb_registry_render, the lock is held
+static size_t ngx_mrb_registry_size(ngx_mrb_registry_t *reg)
+{
+  ngx_mrb_registry_family_t *f;
+  ngx_mrb_registry_series_t *s;
+  ngx_queue_t *fq, *sq;
+  size_t len = 0;
+
+  for (fq = ngx_queue_head(&reg->sh->family_list);
+       fq != ngx_queue_sentinel(&reg->sh->family_list);
+       fq = ngx_queue_next(fq)) {
+    f = ngx_queue_data(fq, ngx_mrb_registry_family_t, queue);
+    len += 2 * f->sn.str.len + f->help.len + NGX_MRB_REGISTRY_LINE_MAX;
+
+    for (sq = ngx_queue_head(&f->series);
+         sq != ngx_queue_sentinel(&f->series);
+         sq = ngx_queue_next(sq)) {
+      s = ngx_queue_data(sq, ngx_mrb_registry_series_t, queue);
+      len += (f->nbuckets + 3)
+             * (f->sn.str.len + s->labels.len + NGX_MRB_REGISTRY_LINE_MAX);
+    }
+  }
+
+  return len;
+}
+
+static ngx_int_t ngx_http_mruby_metrics_handler(ngx_http_request_t *r)
+{
+  ngx_http_mruby_main_conf_t *mmcf;
+  ngx_mrb_registry_t *reg;
+  ngx_chain_t out;
+  ngx_buf_t *b;
+  ngx_int_t rc;
+  size_t len;
+  u_char *p;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  mmcf = ngx_http_get_module_main_conf(r, ngx_http_mruby_module);
+  reg = mmcf->metrics_zone->data;
+
+  ngx_shmtx_lock(&reg->shpool->mutex);
+  len = ngx_mrb_registry_size(reg);
+  p = ngx_pnalloc(r->pool, len + 1);
+  if (p == NULL) {
+    ngx_shmtx_unlock(&reg->shpool->mutex);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  len = ngx_mrb_registry_render(reg, p) - p;
+  ngx_shmtx_unlock(&reg->shpool->mutex);
+
+  ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = len;
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  b = ngx_calloc_buf(r->pool);
+  if (b == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  b->pos = p;
+  b->last = p + len;
+  b->memory = len > 0;
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  out.buf = b;
+  out.next = NULL;
+
+  return ngx_http_output_filter(r, &out);
+}
+
+char *ngx_http_mruby_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_mruby_main_conf_t *mmcf;
+  ngx_http_core_loc_conf_t *clcf;
+
+  mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mruby_module);
+  if (mmcf->metrics_zone == NULL) {
+    return "needs mruby_metrics_zone before it";
+  }
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_mruby_metrics_handler;
+
+  return NGX_CONF_OK;
+}
+
+void ngx_mrb_registry_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_metrics, *class_counter, *class_gauge, *class_histogram;
+
+  class_metrics = mrb_define_module_under(mrb, class, "Metrics");
+
+  class_counter = mrb_define_class_under(mrb, class_metrics, "Counter", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_counter, MRB_TT_DATA);
+  mrb_define_method(mrb, class_counter, "initialize", ngx_mrb_registry_counter_init, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, class_counter, "inc", ngx_mrb_registry_counter_inc, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_counter, "value", ngx_mrb_registry_value, MRB_ARGS_NONE());
+
+  class_gauge = mrb_define_class_under(mrb, class_metrics, "Gauge", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_gauge, MRB_TT_DATA);
+  mrb_define_method(mrb, class_gauge, "initialize", ngx_mrb_registry_gauge_init, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, class_gauge, "set", ngx_mrb_registry_gauge_set, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_gauge, "inc", ngx_mrb_registry_gauge_inc, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_gauge, "value", ngx_mrb_registry_value, MRB_ARGS_NONE());
+
+  class_histogram = mrb_define_class_under(mrb, class_metrics, "Histogram", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_histogram, MRB_TT_DATA);
+  mrb_define_method(mrb, class_histogram, "initialize", ngx_mrb_registry_histogram_init, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, class_histogram, "observe", ngx_mrb_registry_observe, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_histogram, "count", ngx_mrb_registry_count, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_histogram, "sum", ngx_mrb_registry_hsum, MRB_ARGS_NONE());
+}
@@ -18,7 +18,7 @@
 static mrb_value ngx_mrb_get_##method_suffix(mrb_state *mrb, mrb_value self);   \
 static mrb_value ngx_mrb_get_##method_suffix(mrb_state *mrb, mrb_value self)    \
 { \
-  ngx_http_request_t *r = ngx_mrb_get_request(); \
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb); \
   return mrb_str_new(mrb, (const char *)member.data, member.len); \
 }
 
@@ -37,7 +37,7 @@ static mrb_value ngx_mrb_set_##method_suffix(mrb_state *mrb, mrb_value self)
   } \
   str = (u_char *)mrb_str_to_cstr(mrb, arg); \
   len = RSTRING_LEN(arg); \
-  r = ngx_mrb_get_request(); \
+  r = ngx_mrb_get_request_or_raise(mrb); \
   member.len = len; \
   member.data = (u_char *)str; \
   return self; \
@@ -56,7 +56,7 @@ static mrb_value ngx_mrb_get_request_headers_##direction##_hash( \
   mrb_value hash; \
   mrb_value key; \
   mrb_value value; \
-  r = ngx_mrb_get_request(); \
+  r = ngx_mrb_get_request_or_raise(mrb); \
   hash = mrb_hash_new(mrb); \
   part = &(r->headers_##direction.headers.part); \
   header = part->elts; \
@@ -78,8 +78,6 @@ static mrb_value ngx_mrb_get_request_headers_##direction##_hash( \
   return hash; \
 }
 
-ngx_http_request_t *ngx_mruby_request = NULL;
-
 static mrb_value ngx_mrb_get_request_header(mrb_state *mrb,
     ngx_list_t *headers);
 static mrb_value ngx_mrb_get_request_headers_in(mrb_state *mrb, mrb_value self);
@@ -91,15 +89,31 @@ static mrb_value ngx_mrb_set_request_headers_in(mrb_state *mrb, mrb_value self);
 static mrb_value ngx_mrb_set_request_headers_out(mrb_state *mrb,
     mrb_value self);
 
-ngx_int_t ngx_mrb_push_request(ngx_http_request_t *r)
+// the invocation ngx_mrb_run is executing on this mrb_state, NULL outside
+// of request processing (init code, worker hooks)
+ngx_http_mruby_ctx_t *ngx_mrb_get_ctx(mrb_state *mrb)
 {
-  ngx_mruby_request = r;
-  return NGX_OK;
+  return ngx_mrb_ud(mrb)->ctx;
 }
 
-ngx_http_request_t *ngx_mrb_get_request(void)
+ngx_http_request_t *ngx_mrb_get_request(mrb_state *mrb)
 {
-  return ngx_mruby_request;
+  ngx_http_mruby_ctx_t *ctx = ngx_mrb_ud(mrb)->ctx;
+
+  return ctx == NULL ? NULL : ctx->r;
+}
+
+// the request of a binding; there is none in init code, worker hooks and
+// Nginx::Timer blocks
+ngx_http_request_t *ngx_mrb_get_request_or_raise(mrb_state *mrb)
+{
+  ngx_http_request_t *r = ngx_mrb_get_request(mrb);
+
+  if (r == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no request outside a handler");
+  }
+
+  return r;
 }
 
 // request member getter
@@ -142,7 +156,7 @@ static mrb_value ngx_mrb_get_request_body(mrb_state *mrb, mrb_value self)
   size_t len;
   u_char *p;
   u_char *buf;
-  ngx_http_request_t *r = ngx_mrb_get_request();
+  ngx_http_request_t *r = ngx_mrb_get_request_or_raise(mrb);
 
   if (r->request_body == NULL || r->request_body->temp_file
       || r->request_body->bufs == NULL) {
@@ -272,21 +286,21 @@ static ngx_int_t ngx_mrb_set_request_header(mrb_state *mrb, ngx_list_t *headers,
 static mrb_value ngx_mrb_get_request_headers_in(mrb_state *mrb, mrb_value self)
 {
   ngx_http_request_t *r;
-  r = ngx_mrb_get_request();
+  r = ngx_mrb_get_request_or_raise(mrb);
   return ngx_mrb_get_request_header(mrb, &r->headers_in.headers);
 }
 
 static mrb_value ngx_mrb_get_request_headers_out(mrb_state *mrb, mrb_value self)
 {
   ngx_http_request_t *r;
-  r = ngx_mrb_get_request();
+  r = ngx_mrb_get_request_or_raise(mrb);
   return ngx_mrb_get_request_header(mrb, &r->headers_out.headers);
 }
 
 static mrb_value ngx_mrb_set_request_headers_in(mrb_state *mrb, mrb_value self)
 {
   ngx_http_request_t *r;
-  r = ngx_mrb_get_request();
+  r = ngx_mrb_get_request_or_raise(mrb);
   ngx_mrb_set_request_header(mrb, &r->headers_in.headers, 0);
   return self;
 }
@@ -294,28 +308,23 @@ static mrb_value ngx_mrb_set_request_headers_in(mrb_state *mrb, mrb_value self)
 static mrb_value ngx_mrb_set_request_headers_out(mrb_state *mrb, mrb_value self)
 {
   ngx_http_request_t *r;
-  r = ngx_mrb_get_request();
+  r = ngx_mrb_get_request_or_raise(mrb);
   ngx_mrb_set_request_header(mrb, &r->headers_out.headers, 1);
   return self;
 }
 
-// using from ngx_http_mruby_connection.c and ngx_http_mruby_server.c
+// Nginx::Request#var, one Nginx::Var instance per request object
 mrb_value ngx_mrb_get_request_var(mrb_state *mrb, mrb_value self)
 {
-  const char *iv_var_str     = "@iv_var";
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(mrb);
   mrb_value iv_var;
-  struct RClass *class_var, *ngx_class;
 
-  iv_var = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, iv_var_str));
+  iv_var = mrb_iv_get(mrb, self, ud->iv_var_sym);
   if (mrb_nil_p(iv_var)) {
-    // get class from Nginx::Var
-    ngx_class = mrb_class_get(mrb, "Nginx");
-    class_var = (struct RClass*)mrb_class_ptr(mrb_const_get(mrb,
-          mrb_obj_value(ngx_class), mrb_intern_cstr(mrb, "Var")));
     // initialize a Var instance
-    iv_var = mrb_class_new_instance(mrb, 0, 0, class_var);
+    iv_var = mrb_class_new_instance(mrb, 0, 0, ud->var_class);
     // save Var, avoid multi initialize
-    mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, iv_var_str), iv_var);
+    mrb_iv_set(mrb, self, ud->iv_var_sym, iv_var);
   }
 
   return iv_var;
@@ -324,49 +333,48 @@ mrb_value ngx_mrb_get_request_var(mrb_state *mrb, mrb_value self)
 static mrb_value ngx_mrb_get_request_var_hostname(mrb_state *mrb,
     mrb_value self)
 {
-  mrb_value v = ngx_mrb_get_request_var(mrb, self);
-  return mrb_funcall(mrb, v, "hostname", 0, NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_HOSTNAME);
 }
 
 static mrb_value ngx_mrb_get_request_var_filename(mrb_state *mrb,
     mrb_value self)
 {
-  mrb_value v = ngx_mrb_get_request_var(mrb, self);
-  return mrb_funcall(mrb, v, "request_filename", 0, NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_REQUEST_FILENAME);
 }
 
 static mrb_value ngx_mrb_get_request_var_user(mrb_state *mrb, mrb_value self)
 {
-  mrb_value v = ngx_mrb_get_request_var(mrb, self);
-  return mrb_funcall(mrb, v, "remote_user", 0, NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_REMOTE_USER);
 }
 
-// TODO: combine ngx_mrb_get_request_var
 static mrb_value ngx_mrb_get_class_obj(mrb_state *mrb, mrb_value self,
-    char *obj_id, char *class_name)
+    mrb_sym obj_id, struct RClass *obj_class)
 {
   mrb_value obj;
-  struct RClass *obj_class, *ngx_class;
 
-  obj = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, obj_id));
+  obj = mrb_iv_get(mrb, self, obj_id);
   if (mrb_nil_p(obj)) {
-    ngx_class = mrb_class_get(mrb, "Nginx");
-    obj_class = (struct RClass*)mrb_class_ptr(mrb_const_get(mrb,
-          mrb_obj_value(ngx_class), mrb_intern_cstr(mrb, class_name)));
     obj = mrb_obj_new(mrb, obj_class, 0, NULL);
-    mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, obj_id), obj);
+    mrb_iv_set(mrb, self, obj_id, obj);
   }
   return obj;
 }
 
 static mrb_value ngx_mrb_headers_in_obj(mrb_state *mrb, mrb_value self)
 {
-  return ngx_mrb_get_class_obj(mrb, self, "headers_in_obj", "Headers_in");
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(mrb);
+  return ngx_mrb_get_class_obj(mrb, self, ud->headers_in_obj_sym,
+      ud->headers_in_class);
 }
 
 static mrb_value ngx_mrb_headers_out_obj(mrb_state *mrb, mrb_value self)
 {
-  return ngx_mrb_get_class_obj(mrb, self, "headers_out_obj", "Headers_out");
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(mrb);
+  return ngx_mrb_get_class_obj(mrb, self, ud->headers_out_obj_sym,
+      ud->headers_out_class);
 }
 
 void ngx_mrb_request_class_init(mrb_state *mrb, struct RClass *class)
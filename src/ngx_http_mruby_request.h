@@ -13,8 +13,9 @@
 #include <mruby/variable.h>
 #include "ngx_http_mruby_var.h"
 
-ngx_int_t ngx_mrb_push_request(ngx_http_request_t *r);
-ngx_http_request_t *ngx_mrb_get_request(void);
+ngx_http_mruby_ctx_t *ngx_mrb_get_ctx(mrb_state *mrb);
+ngx_http_request_t *ngx_mrb_get_request(mrb_state *mrb);
+ngx_http_request_t *ngx_mrb_get_request_or_raise(mrb_state *mrb);
 mrb_value ngx_mrb_get_request_var(mrb_state *mrb, mrb_value self);
 
 #endif // NGX_HTTP_MRUBY_REQUEST_H
@@ -0,0 +1,380 @@
+/*
+// ngx_http_mruby_resolver.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_resolver.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::Resolver.resolve looks a name up with the resolver of the location
+// (the resolver directive) and yields the handler fiber while the query is
+// out. Answers are kept in a per worker cache until the record expires in
+// the nginx resolver (its TTL, or valid= of the resolver directive); names
+// that do not exist are cached for NGX_MRB_RESOLVER_NEGATIVE_VALID. Timeouts
+// and server failures are not cached.
+*/
+
+#define NGX_MRB_RESOLVER_CACHE_SIZE      1024
+#define NGX_MRB_RESOLVER_NEGATIVE_VALID  10
+// when the record is no longer in the nginx resolver
+#define NGX_MRB_RESOLVER_DEFAULT_VALID   30
+
+typedef struct {
+  ngx_str_node_t sn;
+  ngx_queue_t queue;
+  time_t valid;
+  // resolver error of a negative entry
+  ngx_int_t state;
+  ngx_uint_t naddrs;
+  ngx_str_t *addrs;
+} ngx_mrb_resolver_entry_t;
+
+typedef struct {
+  mrb_state *mrb;
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_resolver_ctx_t *rctx;
+  ngx_str_t name;
+  ngx_int_t state;
+  ngx_mrb_resolver_entry_t *entry;
+  // set while ngx_resolve_name runs, which answers cached names at once
+  unsigned sync:1;
+  unsigned done:1;
+} ngx_mrb_resolve_t;
+
+static ngx_rbtree_t ngx_mrb_resolver_cache;
+static ngx_rbtree_node_t ngx_mrb_resolver_sentinel;
+static ngx_queue_t ngx_mrb_resolver_lru;
+static ngx_uint_t ngx_mrb_resolver_entries;
+
+static void ngx_mrb_resolver_cache_init(void)
+{
+  if (ngx_mrb_resolver_lru.next == NULL) {
+    ngx_rbtree_init(&ngx_mrb_resolver_cache, &ngx_mrb_resolver_sentinel,
+        ngx_str_rbtree_insert_value);
+    ngx_queue_init(&ngx_mrb_resolver_lru);
+  }
+}
+
+static void ngx_mrb_resolver_cache_delete(ngx_mrb_resolver_entry_t *e)
+{
+  ngx_rbtree_delete(&ngx_mrb_resolver_cache, &e->sn.node);
+  ngx_queue_remove(&e->queue);
+  ngx_mrb_resolver_entries--;
+  ngx_free(e);
+}
+
+static ngx_mrb_resolver_entry_t *ngx_mrb_resolver_cache_get(ngx_str_t *name)
+{
+  ngx_mrb_resolver_entry_t *e;
+  ngx_str_node_t *sn;
+
+  sn = ngx_str_rbtree_lookup(&ngx_mrb_resolver_cache, name,
+      ngx_crc32_short(name->data, name->len));
+  if (sn == NULL) {
+    return NULL;
+  }
+  e = (ngx_mrb_resolver_entry_t *) sn;
+  if (e->valid <= ngx_time()) {
+    ngx_mrb_resolver_cache_delete(e);
+    return NULL;
+  }
+  ngx_queue_remove(&e->queue);
+  ngx_queue_insert_head(&ngx_mrb_resolver_lru, &e->queue);
+
+  return e;
+}
+
+static ngx_mrb_resolver_entry_t *ngx_mrb_resolver_cache_add(ngx_str_t *name,
+    ngx_uint_t naddrs, time_t valid)
+{
+  ngx_mrb_resolver_entry_t *e;
+  ngx_str_node_t *sn;
+  ngx_queue_t *q;
+  u_char *p;
+
+  sn = ngx_str_rbtree_lookup(&ngx_mrb_resolver_cache, name,
+      ngx_crc32_short(name->data, name->len));
+  if (sn != NULL) {
+    ngx_mrb_resolver_cache_delete((ngx_mrb_resolver_entry_t *) sn);
+  }
+  if (ngx_mrb_resolver_entries >= NGX_MRB_RESOLVER_CACHE_SIZE) {
+    q = ngx_queue_last(&ngx_mrb_resolver_lru);
+    ngx_mrb_resolver_cache_delete(ngx_queue_data(q, ngx_mrb_resolver_entry_t,
+          queue));
+  }
+
+  e = ngx_alloc(sizeof(ngx_mrb_resolver_entry_t)
+      + naddrs * (sizeof(ngx_str_t) + NGX_SOCKADDR_STRLEN) + name->len,
+      ngx_cycle->log);
+  if (e == NULL) {
+    return NULL;
+  }
+  e->addrs = (ngx_str_t *) (e + 1);
+  e->naddrs = naddrs;
+  e->valid = valid;
+  e->state = 0;
+  p = (u_char *) (e->addrs + naddrs) + naddrs * NGX_SOCKADDR_STRLEN;
+  ngx_memcpy(p, name->data, name->len);
+  e->sn.str.data = p;
+  e->sn.str.len = name->len;
+  e->sn.node.key = ngx_crc32_short(name->data, name->len);
+
+  ngx_rbtree_insert(&ngx_mrb_resolver_cache, &e->sn.node);
+  ngx_queue_insert_head(&ngx_mrb_resolver_lru, &e->queue);
+  ngx_mrb_resolver_entries++;
+
+  return e;
+}
+
+// expiry of name in the cache of the nginx resolver, the same walk as its
+// ngx_resolver_lookup_name
+static time_t ngx_mrb_resolver_valid(ngx_resolver_t *r, ngx_str_t *name)
+{
+  ngx_rbtree_node_t *node, *sentinel;
+  ngx_resolver_node_t *rn;
+  uint32_t hash;
+  ngx_int_t rc;
+
+  hash = ngx_crc32_short(name->data, name->len);
+  node = r->name_rbtree.root;
+  sentinel = r->name_rbtree.sentinel;
+  while (node != sentinel) {
+    if (hash < node->key) {
+      node = node->left;
+      continue;
+    }
+    if (hash > node->key) {
+      node = node->right;
+      continue;
+    }
+    rn = (ngx_resolver_node_t *) node;
+    rc = ngx_memn2cmp(name->data, rn->name, name->len, rn->nlen);
+    if (rc == 0) {
+      return rn->valid;
+    }
+    node = (rc < 0) ? node->left : node->right;
+  }
+
+  return 0;
+}
+
+static mrb_value ngx_mrb_resolver_value(mrb_state *mrb, ngx_str_t *name,
+    ngx_mrb_resolver_entry_t *e, ngx_int_t state)
+{
+  mrb_value addrs;
+  ngx_uint_t i;
+
+  if (e != NULL && e->state == 0) {
+    addrs = mrb_ary_new_capa(mrb, e->naddrs);
+    for (i = 0; i < e->naddrs; i++) {
+      mrb_ary_push(mrb, addrs, mrb_str_new(mrb, (char *) e->addrs[i].data,
+            e->addrs[i].len));
+    }
+    return addrs;
+  }
+  if (e != NULL) {
+    state = e->state;
+  }
+
+  return mrb_exc_new_str(mrb, ngx_mrb_ud(mrb)->resolver_error_class,
+      mrb_format(mrb, "%S could not be resolved (%S)",
+        mrb_str_new(mrb, (char *) name->data, name->len),
+        mrb_str_new_cstr(mrb, ngx_resolver_strerror(state))));
+}
+
+// keeps the answer of rctx in the cache, or the failure in res->state
+static void ngx_mrb_resolver_store(ngx_mrb_resolve_t *res,
+    ngx_resolver_ctx_t *rctx)
+{
+  ngx_mrb_resolver_entry_t *e;
+  ngx_uint_t i;
+  time_t valid;
+  u_char *p;
+
+  if (rctx->state == NGX_RESOLVE_NXDOMAIN
+      || (rctx->state == NGX_OK && rctx->naddrs == 0)) {
+    e = ngx_mrb_resolver_cache_add(&res->name, 0,
+        ngx_time() + NGX_MRB_RESOLVER_NEGATIVE_VALID);
+    if (e != NULL) {
+      e->state = NGX_RESOLVE_NXDOMAIN;
+    }
+    res->state = NGX_RESOLVE_NXDOMAIN;
+    res->entry = e;
+    return;
+  }
+  if (rctx->state != NGX_OK) {
+    res->state = rctx->state;
+    return;
+  }
+
+  valid = ngx_mrb_resolver_valid(rctx->resolver, &res->name);
+  if (valid <= ngx_time()) {
+    valid = ngx_time() + NGX_MRB_RESOLVER_DEFAULT_VALID;
+  }
+  e = ngx_mrb_resolver_cache_add(&res->name, rctx->naddrs, valid);
+  if (e == NULL) {
+    res->state = NGX_RESOLVE_SERVFAIL;
+    return;
+  }
+  p = (u_char *) (e->addrs + rctx->naddrs);
+  for (i = 0; i < rctx->naddrs; i++) {
+    e->addrs[i].data = p;
+    e->addrs[i].len = ngx_sock_ntop(rctx->addrs[i].sockaddr,
+        rctx->addrs[i].socklen, p, NGX_SOCKADDR_STRLEN, 0);
+    p += NGX_SOCKADDR_STRLEN;
+  }
+  res->entry = e;
+}
+
+static void ngx_mrb_resolver_handler(ngx_resolver_ctx_t *rctx)
+{
+  ngx_mrb_resolve_t *res = rctx->data;
+  mrb_state *mrb = res->mrb;
+  mrb_value v;
+  int ai;
+
+  ngx_mrb_resolver_store(res, rctx);
+  ngx_resolve_name_done(rctx);
+  res->rctx = NULL;
+  res->done = 1;
+  if (res->sync) {
+    return;
+  }
+
+  ai = mrb_gc_arena_save(mrb);
+  v = ngx_mrb_resolver_value(mrb, &res->name, res->entry, res->state);
+  ngx_mrb_async_resume(res->ctx, v);
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+static void ngx_mrb_resolver_cleanup(void *data)
+{
+  ngx_mrb_resolve_t *res = data;
+
+  if (res->rctx != NULL) {
+    ngx_resolve_name_done(res->rctx);
+    res->rctx = NULL;
+  }
+}
+
+static mrb_value ngx_mrb_resolver_resolve(mrb_state *mrb, mrb_value self)
+{
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_http_request_t *r;
+  ngx_mrb_resolver_entry_t *e;
+  ngx_mrb_resolve_t *res;
+  ngx_resolver_ctx_t *rctx;
+  ngx_pool_cleanup_t *cln;
+  mrb_value name, v;
+  u_char *p;
+#if (NGX_HAVE_INET6)
+  u_char addr6[16];
+#endif
+
+  mrb_get_args(mrb, "S", &name);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Resolver.resolve");
+  r = ctx->r;
+
+  // a trailing dot names the same host
+  if (RSTRING_LEN(name) > 0
+      && RSTRING_PTR(name)[RSTRING_LEN(name) - 1] == '.') {
+    name = mrb_str_new(mrb, RSTRING_PTR(name), RSTRING_LEN(name) - 1);
+  }
+  if (RSTRING_LEN(name) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "empty host name");
+  }
+
+  // addresses answer themselves
+  if (ngx_inet_addr((u_char *) RSTRING_PTR(name), RSTRING_LEN(name))
+      != INADDR_NONE
+#if (NGX_HAVE_INET6)
+      || ngx_inet6_addr((u_char *) RSTRING_PTR(name), RSTRING_LEN(name),
+        addr6) == NGX_OK
+#endif
+     ) {
+    v = mrb_ary_new_capa(mrb, 1);
+    mrb_ary_push(mrb, v, name);
+    return v;
+  }
+
+  res = ngx_pcalloc(r->pool, sizeof(ngx_mrb_resolve_t));
+  p = ngx_pnalloc(r->pool, RSTRING_LEN(name));
+  if (res == NULL || p == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate resolver query");
+  }
+  ngx_strlow(p, (u_char *) RSTRING_PTR(name), RSTRING_LEN(name));
+  res->name.data = p;
+  res->name.len = RSTRING_LEN(name);
+
+  ngx_mrb_resolver_cache_init();
+  e = ngx_mrb_resolver_cache_get(&res->name);
+  if (e != NULL) {
+    v = ngx_mrb_resolver_value(mrb, &res->name, e, 0);
+    if (mrb_obj_is_kind_of(mrb, v, mrb->eException_class)) {
+      mrb_exc_raise(mrb, v);
+    }
+    return v;
+  }
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  rctx = ngx_resolve_start(clcf->resolver, NULL);
+  if (rctx == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to start resolver query");
+  }
+  if (rctx == NGX_NO_RESOLVER) {
+    mrb_raise(mrb, ngx_mrb_ud(mrb)->resolver_error_class,
+        "no resolver defined, see the resolver directive");
+  }
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) {
+    ngx_resolve_name_done(rctx);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate resolver query");
+  }
+  cln->handler = ngx_mrb_resolver_cleanup;
+  cln->data = res;
+
+  res->mrb = mrb;
+  res->ctx = ctx;
+  res->rctx = rctx;
+  rctx->name = res->name;
+  rctx->handler = ngx_mrb_resolver_handler;
+  rctx->data = res;
+  rctx->timeout = clcf->resolver_timeout;
+
+  res->sync = 1;
+  if (ngx_resolve_name(rctx) != NGX_OK) {
+    // ngx_resolve_name has freed rctx
+    res->rctx = NULL;
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to start resolver query");
+  }
+  res->sync = 0;
+
+  if (res->done) {
+    v = ngx_mrb_resolver_value(mrb, &res->name, res->entry, res->state);
+    if (mrb_obj_is_kind_of(mrb, v, mrb->eException_class)) {
+      mrb_exc_raise(mrb, v);
+    }
+    return v;
+  }
+
+  ctx->async_wait = 1;
+
+  return mrb_symbol_value(ngx_mrb_ud(mrb)->again_sym);
+}
+
+void ngx_mrb_resolver_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_resolver;
+
+  class_resolver = mrb_define_class_under(mrb, class, "Resolver", mrb->object_class);
+  mrb_define_class_under(mrb, class_resolver, "Error", mrb->eStandardError_class);
+
+  mrb_define_class_method(mrb, class_resolver, "_resolve", ngx_mrb_resolver_resolve, MRB_ARGS_REQ(1));
+}
@@ -0,0 +1,15 @@
+/*
+// ngx_http_mruby_resolver.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_RESOLVER_H
+#define NGX_HTTP_MRUBY_RESOLVER_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+#endif // NGX_HTTP_MRUBY_RESOLVER_H
@@ -13,20 +13,17 @@
 #include <mruby/string.h>
 #include <mruby/class.h>
 
-// extern from ngx_http_mruby_request.c
-extern mrb_value ngx_mrb_get_request_var(mrb_state *mrb, mrb_value self);
-
 static mrb_value ngx_mrb_get_server_var_docroot(mrb_state *mrb, mrb_value self)
 {
-  return mrb_funcall(mrb, ngx_mrb_get_request_var(mrb, self), "document_root",
-      0, NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_DOCUMENT_ROOT);
 }
 
 static mrb_value ngx_mrb_get_server_var_realpath_root(mrb_state *mrb,
     mrb_value self)
 {
-  return mrb_funcall(mrb, ngx_mrb_get_request_var(mrb, self), "realpath_root",
-      0, NULL);
+  return ngx_mrb_var_get_by_id(mrb, ngx_mrb_get_request_or_raise(mrb),
+      NGX_MRB_VAR_REALPATH_ROOT);
 }
 
 void ngx_mrb_server_class_init(mrb_state *mrb, struct RClass *class)
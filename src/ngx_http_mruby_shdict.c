@@ -0,0 +1,927 @@
+/*
+// ngx_http_mruby_shdict.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_shdict.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::SharedDict, a key/value store in a shared memory zone declared with
+// mruby_shared_dict and seen by all workers. Writers hold the mutex of the
+// slab pool and bump the sequence number of the zone around every change.
+// Readers do not lock: they walk the tree and copy the value out, and retry
+// (in the end under the lock) when the sequence number moved meanwhile.
+// Every address a reader follows is checked to lie in the zone, so a node
+// freed under it yields garbage that the sequence check throws away, never a
+// fault. Entries expire after their ttl, and the least recently used ones
+// make room when the zone is full; a read moves its entry to the front at
+// most once a second, which is the only time a read locks. The zone and its
+// data survive reloads as long as its size stays the same.
+//
+// Every change of an entry, whether written, deleted, expired or evicted,
+// also bumps one of NGX_MRB_SHDICT_GENERATIONS counters picked by the hash of
+// its key. Caches in front of the zone (Nginx::TieredCache) remember the
+// generation they saw and need only compare it to know that a copy is
+// still current.
+*/
+
+#define NGX_MRB_SHDICT_READ_TRIES      3
+#define NGX_MRB_SHDICT_EVICT_TRIES     30
+// writers drop this many expired entries from the tail on their way
+#define NGX_MRB_SHDICT_EXPIRE_TAIL     2
+// a longer walk is a torn read, the tree of a full zone is far shallower
+#define NGX_MRB_SHDICT_DEPTH_MAX       128
+#define NGX_MRB_SHDICT_KEY_MAX         65535
+
+typedef enum {
+  NGX_MRB_SHDICT_STRING = 1,
+  NGX_MRB_SHDICT_INTEGER,
+  NGX_MRB_SHDICT_FLOAT,
+  NGX_MRB_SHDICT_TRUE,
+  NGX_MRB_SHDICT_FALSE
+} ngx_mrb_shdict_type_t;
+
+typedef struct {
+  // node.key is the crc32 of the key
+  ngx_rbtree_node_t node;
+  ngx_queue_t queue;
+  // msec since the epoch, 0 for never
+  uint64_t expires;
+  time_t touched;
+  uint32_t value_len;
+  u_short key_len;
+  u_char type;
+  // the key, then the value
+  u_char data[1];
+} ngx_mrb_shdict_node_t;
+
+// a value copied out of the zone, its bytes are in ngx_mrb_shdict_buf
+typedef struct {
+  ngx_uint_t type;
+  size_t len;
+  time_t touched;
+} ngx_mrb_shdict_value_t;
+
+// a value on its way into the zone
+typedef struct {
+  ngx_uint_t type;
+  u_char *data;
+  size_t len;
+  int64_t i;
+  double f;
+} ngx_mrb_shdict_in_t;
+
+static const struct mrb_data_type ngx_mrb_shdict_data_type = {
+  "Nginx::SharedDict", NULL,
+};
+
+static u_char *ngx_mrb_shdict_buf;
+static size_t ngx_mrb_shdict_buf_size;
+
+#define ngx_mrb_shdict_in_zone(d, p, size)                                   \
+  ((u_char *) (p) >= (u_char *) (d)->shpool                                  \
+   && (u_char *) (p) <= (d)->shpool->end                                     \
+   && (size_t) ((d)->shpool->end - (u_char *) (p)) >= (size_t) (size))
+
+uint64_t ngx_mrb_shdict_now(void)
+{
+  ngx_time_t *tp = ngx_timeofday();
+
+  return (uint64_t) tp->sec * 1000 + tp->msec;
+}
+
+// orders nodes of the same hash by key, as ngx_mrb_shdict_find expects
+static void ngx_mrb_shdict_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+  ngx_mrb_shdict_node_t *sn, *snt;
+  ngx_rbtree_node_t **p;
+
+  for ( ;; ) {
+    if (node->key != temp->key) {
+      p = (node->key < temp->key) ? &temp->left : &temp->right;
+    }
+    else {
+      sn = (ngx_mrb_shdict_node_t *) node;
+      snt = (ngx_mrb_shdict_node_t *) temp;
+      p = (ngx_memn2cmp(sn->data, snt->data, sn->key_len, snt->key_len) < 0)
+          ? &temp->left : &temp->right;
+    }
+
+    if (*p == sentinel) {
+      break;
+    }
+    temp = *p;
+  }
+
+  *p = temp;
+  node->parent = temp;
+  node->left = sentinel;
+  node->right = sentinel;
+  ngx_rbt_red(node);
+}
+
+static ngx_int_t ngx_mrb_shdict_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data)
+{
+  ngx_mrb_shdict_t *octx = data;
+  ngx_mrb_shdict_t *ctx = shm_zone->data;
+  ngx_mrb_shdict_sh_t *sh;
+  size_t len;
+
+  // the zone of the previous cycle, kept by nginx with its contents
+  if (octx != NULL) {
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    return NGX_OK;
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  if (shm_zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+
+  sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_mrb_shdict_sh_t));
+  if (sh == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+      ngx_mrb_shdict_insert_value);
+  ngx_queue_init(&sh->lru);
+  sh->seq = 0;
+  ngx_memzero(sh->generations, sizeof(sh->generations));
+  ctx->sh = sh;
+  ctx->shpool->data = sh;
+
+  len = sizeof(" in mruby_shared_dict \"\"") + shm_zone->shm.name.len;
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if (ctx->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(ctx->shpool->log_ctx, " in mruby_shared_dict \"%V\"%Z",
+      &shm_zone->shm.name);
+
+  return NGX_OK;
+}
+
+char *ngx_http_mruby_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+  ngx_http_mruby_main_conf_t *mmcf = conf;
+  ngx_str_t *value;
+  ngx_shm_zone_t *shm_zone, **zp;
+  ngx_mrb_shdict_t *ctx;
+  ssize_t size;
+
+  value = cf->args->elts;
+
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"",
+        &value[2]);
+    return NGX_CONF_ERROR;
+  }
+  if (size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_shared_dict \"%V\" is"
+        " too small", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_mrb_shdict_t));
+  if (ctx == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  ctx->name = value[1];
+
+  shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+      &ngx_http_mruby_module);
+  if (shm_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  if (shm_zone->data != NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate mruby_shared_dict"
+        " \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  shm_zone->init = ngx_mrb_shdict_init_zone;
+  shm_zone->data = ctx;
+
+  if (mmcf->shared_dicts == NULL) {
+    mmcf->shared_dicts = ngx_array_create(cf->pool, 4,
+        sizeof(ngx_shm_zone_t *));
+    if (mmcf->shared_dicts == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+  zp = ngx_array_push(mmcf->shared_dicts);
+  if (zp == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  *zp = shm_zone;
+
+  return NGX_CONF_OK;
+}
+
+ngx_mrb_shdict_t *ngx_mrb_shdict_get(mrb_state *mrb, mrb_value name)
+{
+  ngx_http_mruby_main_conf_t *mmcf;
+  ngx_shm_zone_t **zones;
+  ngx_mrb_shdict_t *d;
+  ngx_uint_t i;
+
+  name = mrb_str_to_str(mrb, name);
+  mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mruby_module);
+  if (mmcf != NULL && mmcf->shared_dicts != NULL) {
+    zones = mmcf->shared_dicts->elts;
+    for (i = 0; i < mmcf->shared_dicts->nelts; i++) {
+      d = zones[i]->data;
+      if (d->name.len == (size_t) RSTRING_LEN(name)
+          && ngx_strncmp(d->name.data, RSTRING_PTR(name), d->name.len) == 0
+          && d->sh != NULL) {
+        return d;
+      }
+    }
+  }
+
+  // the zones are mapped after the configuration, i.e. after mruby_init
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "no mruby_shared_dict %S", name);
+
+  return NULL;
+}
+
+// the write side of the sequence lock, readers retry while it is odd
+static void ngx_mrb_shdict_write_begin(ngx_mrb_shdict_t *d)
+{
+  ngx_shmtx_lock(&d->shpool->mutex);
+  // left odd by a worker that died in between
+  if (d->sh->seq & 1) {
+    d->sh->seq++;
+  }
+  d->sh->seq++;
+  ngx_memory_barrier();
+}
+
+static void ngx_mrb_shdict_write_end(ngx_mrb_shdict_t *d)
+{
+  ngx_memory_barrier();
+  d->sh->seq++;
+  ngx_shmtx_unlock(&d->shpool->mutex);
+}
+
+static u_char *ngx_mrb_shdict_buf_get(size_t size)
+{
+  u_char *buf;
+
+  if (size <= ngx_mrb_shdict_buf_size) {
+    return ngx_mrb_shdict_buf;
+  }
+  buf = ngx_alloc(size, ngx_cycle->log);
+  if (buf == NULL) {
+    return NULL;
+  }
+  if (ngx_mrb_shdict_buf != NULL) {
+    ngx_free(ngx_mrb_shdict_buf);
+  }
+  ngx_mrb_shdict_buf = buf;
+  ngx_mrb_shdict_buf_size = size;
+
+  return buf;
+}
+
+/*
+// looks key up and copies its value out; safe without the lock, every field
+// is read once and checked before use. Returns NGX_OK, NGX_DECLINED when
+// there is no such (live) entry and NGX_AGAIN for a torn read.
+*/
+static ngx_int_t ngx_mrb_shdict_read_node(ngx_mrb_shdict_t *d,
+    ngx_str_t *key, uint32_t hash, uint64_t now, ngx_mrb_shdict_value_t *v)
+{
+  volatile ngx_mrb_shdict_node_t *sn;
+  ngx_rbtree_node_t *node, *sentinel;
+  ngx_uint_t depth = 0;
+  size_t key_len, value_len;
+  uint64_t expires;
+  ngx_rbtree_key_t node_key;
+  u_char *buf;
+  ngx_int_t rc;
+
+  sentinel = &d->sh->sentinel;
+  node = d->sh->rbtree.root;
+
+  while (node != sentinel) {
+    if (++depth > NGX_MRB_SHDICT_DEPTH_MAX
+        || !ngx_mrb_shdict_in_zone(d, node, sizeof(ngx_mrb_shdict_node_t))) {
+      return NGX_AGAIN;
+    }
+    sn = (volatile ngx_mrb_shdict_node_t *) node;
+    node_key = sn->node.key;
+    if (hash < node_key) {
+      node = sn->node.left;
+      continue;
+    }
+    if (hash > node_key) {
+      node = sn->node.right;
+      continue;
+    }
+
+    key_len = sn->key_len;
+    value_len = sn->value_len;
+    if (!ngx_mrb_shdict_in_zone(d, sn->data, key_len + value_len)) {
+      return NGX_AGAIN;
+    }
+    rc = ngx_memn2cmp(key->data, (u_char *) sn->data, key->len, key_len);
+    if (rc != 0) {
+      node = (rc < 0) ? sn->node.left : sn->node.right;
+      continue;
+    }
+
+    expires = sn->expires;
+    if (expires != 0 && expires <= now) {
+      return NGX_DECLINED;
+    }
+    if (value_len > 0) {
+      buf = ngx_mrb_shdict_buf_get(value_len);
+      if (buf == NULL) {
+        return NGX_ERROR;
+      }
+      ngx_memcpy(buf, (u_char *) sn->data + key_len, value_len);
+    }
+    v->type = sn->type;
+    v->len = value_len;
+    v->touched = sn->touched;
+    return NGX_OK;
+  }
+
+  return NGX_DECLINED;
+}
+
+// the node of key, live or expired; the lock is held
+static ngx_mrb_shdict_node_t *ngx_mrb_shdict_find(ngx_mrb_shdict_t *d,
+    ngx_str_t *key, uint32_t hash)
+{
+  ngx_rbtree_node_t *node, *sentinel;
+  ngx_mrb_shdict_node_t *sn;
+  ngx_int_t rc;
+
+  node = d->sh->rbtree.root;
+  sentinel = d->sh->rbtree.sentinel;
+  while (node != sentinel) {
+    if (hash < node->key) {
+      node = node->left;
+      continue;
+    }
+    if (hash > node->key) {
+      node = node->right;
+      continue;
+    }
+    sn = (ngx_mrb_shdict_node_t *) node;
+    rc = ngx_memn2cmp(key->data, sn->data, key->len, sn->key_len);
+    if (rc == 0) {
+      return sn;
+    }
+    node = (rc < 0) ? node->left : node->right;
+  }
+
+  return NULL;
+}
+
+static ngx_int_t ngx_mrb_shdict_read(ngx_mrb_shdict_t *d, ngx_str_t *key,
+    ngx_mrb_shdict_value_t *v)
+{
+  ngx_mrb_shdict_node_t *sn;
+  ngx_atomic_uint_t seq;
+  uint32_t hash;
+  uint64_t now;
+  ngx_uint_t i;
+  ngx_int_t rc = NGX_DECLINED;
+
+  hash = ngx_crc32_short(key->data, key->len);
+  now = ngx_mrb_shdict_now();
+
+  for (i = 0; i < NGX_MRB_SHDICT_READ_TRIES; i++) {
+    seq = d->sh->seq;
+    ngx_memory_barrier();
+    if (seq & 1) {
+      ngx_cpu_pause();
+      continue;
+    }
+    rc = ngx_mrb_shdict_read_node(d, key, hash, now, v);
+    ngx_memory_barrier();
+    if (rc != NGX_AGAIN && d->sh->seq == seq) {
+      goto found;
+    }
+  }
+
+  ngx_shmtx_lock(&d->shpool->mutex);
+  rc = ngx_mrb_shdict_read_node(d, key, hash, now, v);
+  ngx_shmtx_unlock(&d->shpool->mutex);
+
+found:
+
+  if (rc == NGX_OK && v->touched != ngx_time()) {
+    // readers do not look at the LRU list, no need to bump seq
+    ngx_shmtx_lock(&d->shpool->mutex);
+    sn = ngx_mrb_shdict_find(d, key, hash);
+    if (sn != NULL) {
+      ngx_queue_remove(&sn->queue);
+      ngx_queue_insert_head(&d->sh->lru, &sn->queue);
+      sn->touched = ngx_time();
+    }
+    ngx_shmtx_unlock(&d->shpool->mutex);
+  }
+
+  return rc;
+}
+
+// inside the write, so a reader that saw the new generation reads the new
+// data; the write lock is held
+#define ngx_mrb_shdict_bump(d, hash)                                         \
+  (d)->sh->generations[(hash) & (NGX_MRB_SHDICT_GENERATIONS - 1)]++
+
+static void ngx_mrb_shdict_delete_node(ngx_mrb_shdict_t *d,
+    ngx_mrb_shdict_node_t *sn)
+{
+  ngx_mrb_shdict_bump(d, sn->node.key);
+  ngx_rbtree_delete(&d->sh->rbtree, &sn->node);
+  ngx_queue_remove(&sn->queue);
+  ngx_slab_free_locked(d->shpool, sn);
+}
+
+// allocates a node of size bytes, evicting least recently used entries
+static ngx_mrb_shdict_node_t *ngx_mrb_shdict_alloc(ngx_mrb_shdict_t *d,
+    size_t size, uint64_t now)
+{
+  ngx_mrb_shdict_node_t *sn;
+  ngx_queue_t *q;
+  ngx_uint_t i;
+
+  for (i = 0; i < NGX_MRB_SHDICT_EXPIRE_TAIL; i++) {
+    if (ngx_queue_empty(&d->sh->lru)) {
+      break;
+    }
+    q = ngx_queue_last(&d->sh->lru);
+    sn = ngx_queue_data(q, ngx_mrb_shdict_node_t, queue);
+    if (sn->expires == 0 || sn->expires > now) {
+      break;
+    }
+    ngx_mrb_shdict_delete_node(d, sn);
+  }
+
+  for (i = 0; ; i++) {
+    sn = ngx_slab_alloc_locked(d->shpool, size);
+    if (sn != NULL || i == NGX_MRB_SHDICT_EVICT_TRIES
+        || ngx_queue_empty(&d->sh->lru)) {
+      return sn;
+    }
+    q = ngx_queue_last(&d->sh->lru);
+    ngx_mrb_shdict_delete_node(d, ngx_queue_data(q, ngx_mrb_shdict_node_t,
+          queue));
+  }
+}
+
+/*
+// stores value under key; with add only when there is no live entry yet.
+// NGX_OK, NGX_DECLINED when add found one and NGX_ERROR when it does not
+// fit. The write lock is held.
+*/
+static ngx_int_t ngx_mrb_shdict_store(ngx_mrb_shdict_t *d, ngx_str_t *key,
+    ngx_mrb_shdict_in_t *in, uint64_t expires, ngx_uint_t add)
+{
+  ngx_mrb_shdict_node_t *sn;
+  uint32_t hash;
+  uint64_t now;
+
+  hash = ngx_crc32_short(key->data, key->len);
+  now = ngx_mrb_shdict_now();
+
+  sn = ngx_mrb_shdict_find(d, key, hash);
+  if (sn != NULL && sn->expires != 0 && sn->expires <= now) {
+    ngx_mrb_shdict_delete_node(d, sn);
+    sn = NULL;
+  }
+  if (sn != NULL && add) {
+    return NGX_DECLINED;
+  }
+
+  if (sn != NULL && sn->value_len == in->len) {
+    ngx_queue_remove(&sn->queue);
+  }
+  else {
+    if (sn != NULL) {
+      ngx_mrb_shdict_delete_node(d, sn);
+    }
+    sn = ngx_mrb_shdict_alloc(d,
+        offsetof(ngx_mrb_shdict_node_t, data) + key->len + in->len, now);
+    if (sn == NULL) {
+      return NGX_ERROR;
+    }
+    sn->node.key = hash;
+    sn->key_len = (u_short) key->len;
+    sn->value_len = (uint32_t) in->len;
+    ngx_memcpy(sn->data, key->data, key->len);
+    ngx_rbtree_insert(&d->sh->rbtree, &sn->node);
+  }
+
+  sn->type = (u_char) in->type;
+  sn->expires = expires;
+  sn->touched = ngx_time();
+  ngx_memcpy(sn->data + sn->key_len, in->data, in->len);
+  ngx_queue_insert_head(&d->sh->lru, &sn->queue);
+  ngx_mrb_shdict_bump(d, hash);
+
+  return NGX_OK;
+}
+
+static ngx_mrb_shdict_t *ngx_mrb_shdict_self(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_shdict_t *d;
+
+  d = mrb_data_get_ptr(mrb, self, &ngx_mrb_shdict_data_type);
+  if (d == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::SharedDict");
+  }
+
+  return d;
+}
+
+static void ngx_mrb_shdict_key(mrb_state *mrb, mrb_value k, ngx_str_t *key)
+{
+  k = mrb_str_to_str(mrb, k);
+  if (RSTRING_LEN(k) == 0 || RSTRING_LEN(k) > NGX_MRB_SHDICT_KEY_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "shared dict keys are 1 to 65535"
+        " bytes");
+  }
+  key->data = (u_char *) RSTRING_PTR(k);
+  key->len = RSTRING_LEN(k);
+}
+
+static void ngx_mrb_shdict_value_in(mrb_state *mrb, mrb_value v,
+    ngx_mrb_shdict_in_t *in)
+{
+  switch (mrb_type(v)) {
+  case MRB_TT_STRING:
+    in->type = NGX_MRB_SHDICT_STRING;
+    in->data = (u_char *) RSTRING_PTR(v);
+    in->len = RSTRING_LEN(v);
+    break;
+  case MRB_TT_FIXNUM:
+    in->type = NGX_MRB_SHDICT_INTEGER;
+    in->i = (int64_t) mrb_fixnum(v);
+    in->data = (u_char *) &in->i;
+    in->len = sizeof(int64_t);
+    break;
+  case MRB_TT_FLOAT:
+    in->type = NGX_MRB_SHDICT_FLOAT;
+    in->f = (double) mrb_float(v);
+    in->data = (u_char *) &in->f;
+    in->len = sizeof(double);
+    break;
+  case MRB_TT_TRUE:
+  case MRB_TT_FALSE:
+    in->type = mrb_test(v) ? NGX_MRB_SHDICT_TRUE : NGX_MRB_SHDICT_FALSE;
+    in->data = NULL;
+    in->len = 0;
+    break;
+  default:
+    mrb_raise(mrb, E_TYPE_ERROR, "shared dict values are strings, numbers,"
+        " true or false");
+  }
+}
+
+static mrb_value ngx_mrb_shdict_value_out(mrb_state *mrb,
+    ngx_mrb_shdict_value_t *v)
+{
+  int64_t i;
+  double f;
+
+  switch (v->type) {
+  case NGX_MRB_SHDICT_STRING:
+    return mrb_str_new(mrb, (char *) ngx_mrb_shdict_buf, v->len);
+  case NGX_MRB_SHDICT_INTEGER:
+    ngx_memcpy(&i, ngx_mrb_shdict_buf, sizeof(int64_t));
+    return mrb_fixnum_value((mrb_int) i);
+  case NGX_MRB_SHDICT_FLOAT:
+    ngx_memcpy(&f, ngx_mrb_shdict_buf, sizeof(double));
+    return mrb_float_value(mrb, (mrb_float) f);
+  case NGX_MRB_SHDICT_TRUE:
+    return mrb_true_value();
+  default:
+    return mrb_false_value();
+  }
+}
+
+static uint64_t ngx_mrb_shdict_expires(mrb_state *mrb, mrb_float ttl)
+{
+  if (ttl < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative ttl");
+  }
+  if (ttl == 0) {
+    return 0;
+  }
+
+  return ngx_mrb_shdict_now() + (uint64_t) (ttl * 1000);
+}
+
+static mrb_value ngx_mrb_shdict_get_value(mrb_state *mrb,
+    ngx_mrb_shdict_t *d, mrb_value k)
+{
+  ngx_mrb_shdict_value_t v;
+  ngx_str_t key;
+  ngx_int_t rc;
+
+  ngx_mrb_shdict_key(mrb, k, &key);
+  rc = ngx_mrb_shdict_read(d, &key, &v);
+  if (rc == NGX_ERROR) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate shared dict value");
+  }
+  if (rc != NGX_OK) {
+    return mrb_nil_value();
+  }
+
+  return ngx_mrb_shdict_value_out(mrb, &v);
+}
+
+static mrb_value ngx_mrb_shdict_init(mrb_state *mrb, mrb_value self)
+{
+  mrb_value name;
+
+  mrb_get_args(mrb, "o", &name);
+  DATA_TYPE(self) = &ngx_mrb_shdict_data_type;
+  DATA_PTR(self) = ngx_mrb_shdict_get(mrb, name);
+
+  return self;
+}
+
+static mrb_value ngx_mrb_shdict_get_method(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_shdict_t *d = ngx_mrb_shdict_self(mrb, self);
+  mrb_value k;
+
+  mrb_get_args(mrb, "o", &k);
+
+  return ngx_mrb_shdict_get_value(mrb, d, k);
+}
+
+static mrb_value ngx_mrb_shdict_mget(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_shdict_t *d = ngx_mrb_shdict_self(mrb, self);
+  mrb_value keys, res;
+  mrb_int i;
+  int ai;
+
+  mrb_get_args(mrb, "A", &keys);
+  res = mrb_ary_new_capa(mrb, RARRAY_LEN(keys));
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    mrb_ary_push(mrb, res, ngx_mrb_shdict_get_value(mrb, d,
+          mrb_ary_ref(mrb, keys, i)));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return res;
+}
+
+// set(key, value, ttl = 0) and add; set with a nil value deletes
+static mrb_value ngx_mrb_shdict_put(mrb_state *mrb, mrb_value self,
+    ngx_uint_t add)
+{
+  ngx_mrb_shdict_t *d = ngx_mrb_shdict_self(mrb, self);
+  ngx_mrb_shdict_node_t *sn;
+  ngx_mrb_shdict_in_t in;
+  mrb_value k, v;
+  mrb_float ttl = 0;
+  ngx_str_t key;
+  uint64_t expires;
+  ngx_int_t rc;
+
+  mrb_get_args(mrb, "oo|f", &k, &v, &ttl);
+  ngx_mrb_shdict_key(mrb, k, &key);
+  expires = ngx_mrb_shdict_expires(mrb, ttl);
+
+  if (mrb_nil_p(v) && add) {
+    mrb_raise(mrb, E_TYPE_ERROR, "add does not take a nil value");
+  }
+  if (mrb_nil_p(v)) {
+    ngx_mrb_shdict_write_begin(d);
+    sn = ngx_mrb_shdict_find(d, &key, ngx_crc32_short(key.data, key.len));
+    if (sn != NULL) {
+      ngx_mrb_shdict_delete_node(d, sn);
+    }
+    ngx_mrb_shdict_write_end(d);
+    return mrb_true_value();
+  }
+
+  ngx_mrb_shdict_value_in(mrb, v, &in);
+  ngx_mrb_shdict_write_begin(d);
+  rc = ngx_mrb_shdict_store(d, &key, &in, expires, add);
+  ngx_mrb_shdict_write_end(d);
+
+  if (rc == NGX_ERROR) {
+    mrb_raisef(mrb, ngx_mrb_ud(mrb)->shdict_error_class,
+        "no memory in mruby_shared_dict %S",
+        mrb_str_new(mrb, (char *) d->name.data, d->name.len));
+  }
+
+  return mrb_bool_value(rc == NGX_OK);
+}
+
+static mrb_value ngx_mrb_shdict_set(mrb_state *mrb, mrb_value self)
+{
+  return ngx_mrb_shdict_put(mrb, self, 0);
+}
+
+static mrb_value ngx_mrb_shdict_add(mrb_state *mrb, mrb_value self)
+{
+  return ngx_mrb_shdict_put(mrb, self, 1);
+}
+
+// mset(hash, ttl = 0), all entries in one write
+static mrb_value ngx_mrb_shdict_mset(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_shdict_t *d = ngx_mrb_shdict_self(mrb, self);
+  ngx_mrb_shdict_in_t *in;
+  ngx_str_t *keys;
+  mrb_value hash, ks, vs, v;
+  mrb_float ttl = 0;
+  ngx_mrb_shdict_in_t value;
+  ngx_str_t key;
+  uint64_t expires;
+  mrb_int i, n;
+  ngx_int_t rc = NGX_OK;
+
+  mrb_get_args(mrb, "H|f", &hash, &ttl);
+  expires = ngx_mrb_shdict_expires(mrb, ttl);
+  ks = mrb_hash_keys(mrb, hash);
+  n = RARRAY_LEN(ks);
+  if (n == 0) {
+    return mrb_true_value();
+  }
+
+  // checked before the allocation and converted after it, nothing may
+  // raise in between or while the lock is held
+  vs = mrb_ary_new_capa(mrb, n);
+  for (i = 0; i < n; i++) {
+    v = mrb_hash_get(mrb, hash, mrb_ary_ref(mrb, ks, i));
+    if (mrb_nil_p(v)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "mset does not take nil values");
+    }
+    mrb_ary_set(mrb, ks, i, mrb_str_to_str(mrb, mrb_ary_ref(mrb, ks, i)));
+    ngx_mrb_shdict_key(mrb, mrb_ary_ref(mrb, ks, i), &key);
+    ngx_mrb_shdict_value_in(mrb, v, &value);
+    mrb_ary_push(mrb, vs, v);
+  }
+  keys = mrb_malloc(mrb, n * (sizeof(ngx_str_t) + sizeof(ngx_mrb_shdict_in_t)));
+  in = (ngx_mrb_shdict_in_t *) (keys + n);
+  for (i = 0; i < n; i++) {
+    ngx_mrb_shdict_key(mrb, mrb_ary_ref(mrb, ks, i), &keys[i]);
+    ngx_mrb_shdict_value_in(mrb, mrb_ary_ref(mrb, vs, i), &in[i]);
+  }
+
+  ngx_mrb_shdict_write_begin(d);
+  for (i = 0; i < n && rc == NGX_OK; i++) {
+    rc = ngx_mrb_shdict_store(d, &keys[i], &in[i], expires, 0);
+  }
+  ngx_mrb_shdict_write_end(d);
+  mrb_free(mrb, keys);
+
+  if (rc == NGX_ERROR) {
+    mrb_raisef(mrb, ngx_mrb_ud(mrb)->shdict_error_class,
+        "no memory in mruby_shared_dict %S",
+        mrb_str_new(mrb, (char *) d->name.data, d->name.len));
+  }
+
+  return mrb_true_value();
+}
+
+// incr(key, by = 1, init = nil, ttl = 0): nil for a missing key without init
+static mrb_value ngx_mrb_shdict_incr(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_shdict_t *d = ngx_mrb_shdict_self(mrb, self);
+  ngx_mrb_shdict_node_t *sn;
+  ngx_mrb_shdict_in_t in;
+  mrb_value k, init = mrb_nil_value();
+  mrb_int by = 1;
+  mrb_float ttl = 0;
+  ngx_str_t key;
+  uint64_t expires;
+  int64_t n;
+  ngx_int_t rc = NGX_OK;
+
+  mrb_get_args(mrb, "o|iof", &k, &by, &init, &ttl);
+  ngx_mrb_shdict_key(mrb, k, &key);
+  expires = ngx_mrb_shdict_expires(mrb, ttl);
+  if (!mrb_nil_p(init)) {
+    init = mrb_to_int(mrb, init);
+  }
+
+  ngx_mrb_shdict_write_begin(d);
+  sn = ngx_mrb_shdict_find(d, &key, ngx_crc32_short(key.data, key.len));
+  if (sn != NULL && sn->expires != 0
+      && sn->expires <= ngx_mrb_shdict_now()) {
+    ngx_mrb_shdict_delete_node(d, sn);
+    sn = NULL;
+  }
+  if (sn != NULL) {
+    if (sn->type != NGX_MRB_SHDICT_INTEGER) {
+      ngx_mrb_shdict_write_end(d);
+      mrb_raise(mrb, E_TYPE_ERROR, "shared dict value is not an integer");
+    }
+    ngx_memcpy(&n, sn->data + sn->key_len, sizeof(int64_t));
+    n += by;
+    ngx_memcpy(sn->data + sn->key_len, &n, sizeof(int64_t));
+    ngx_mrb_shdict_bump(d, sn->node.key);
+  }
+  else if (!mrb_nil_p(init)) {
+    n = (int64_t) mrb_fixnum(init) + by;
+    in.type = NGX_MRB_SHDICT_INTEGER;
+    in.i = n;
+    in.data = (u_char *) &in.i;
+    in.len = sizeof(int64_t);
+    rc = ngx_mrb_shdict_store(d, &key, &in, expires, 0);
+  }
+  else {
+    ngx_mrb_shdict_write_end(d);
+    return mrb_nil_value();
+  }
+  ngx_mrb_shdict_write_end(d);
+
+  if (rc == NGX_ERROR) {
+    mrb_raisef(mrb, ngx_mrb_ud(mrb)->shdict_error_class,
+        "no memory in mruby_shared_dict %S",
+        mrb_str_new(mrb, (char *) d->name.data, d->name.len));
+  }
+
+  return mrb_fixnum_value((mrb_int) n);
+}
+
+static mrb_value ngx_mrb_shdict_delete(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_shdict_t *d = ngx_mrb_shdict_self(mrb, self);
+  ngx_mrb_shdict_node_t *sn;
+  mrb_value k;
+  ngx_str_t key;
+  ngx_uint_t live = 0;
+
+  mrb_get_args(mrb, "o", &k);
+  ngx_mrb_shdict_key(mrb, k, &key);
+
+  ngx_mrb_shdict_write_begin(d);
+  sn = ngx_mrb_shdict_find(d, &key, ngx_crc32_short(key.data, key.len));
+  if (sn != NULL) {
+    live = sn->expires == 0 || sn->expires > ngx_mrb_shdict_now();
+    ngx_mrb_shdict_delete_node(d, sn);
+  }
+  ngx_mrb_shdict_write_end(d);
+
+  return mrb_bool_value(live);
+}
+
+/*
+// generation(key): a number that changes whenever key may have changed, read
+// without locking. Keys share counters, so it also changes for others.
+*/
+static mrb_value ngx_mrb_shdict_generation(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_shdict_t *d = ngx_mrb_shdict_self(mrb, self);
+  volatile ngx_atomic_t *gen;
+  mrb_value k;
+  ngx_str_t key;
+  uint32_t hash;
+
+  mrb_get_args(mrb, "o", &k);
+  ngx_mrb_shdict_key(mrb, k, &key);
+  hash = ngx_crc32_short(key.data, key.len);
+  gen = &d->sh->generations[hash & (NGX_MRB_SHDICT_GENERATIONS - 1)];
+
+  return mrb_fixnum_value((mrb_int) *gen);
+}
+
+void ngx_mrb_shdict_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_shdict;
+
+  class_shdict = mrb_define_class_under(mrb, class, "SharedDict", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_shdict, MRB_TT_DATA);
+  mrb_define_class_under(mrb, class_shdict, "Error", mrb->eStandardError_class);
+
+  mrb_define_method(mrb, class_shdict, "initialize", ngx_mrb_shdict_init, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_shdict, "get", ngx_mrb_shdict_get_method, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_shdict, "[]", ngx_mrb_shdict_get_method, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_shdict, "mget", ngx_mrb_shdict_mget, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_shdict, "set", ngx_mrb_shdict_set, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_shdict, "[]=", ngx_mrb_shdict_set, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, class_shdict, "add", ngx_mrb_shdict_add, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_shdict, "mset", ngx_mrb_shdict_mset, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_shdict, "incr", ngx_mrb_shdict_incr, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(3));
+  mrb_define_method(mrb, class_shdict, "delete", ngx_mrb_shdict_delete, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_shdict, "generation", ngx_mrb_shdict_generation, MRB_ARGS_REQ(1));
+}
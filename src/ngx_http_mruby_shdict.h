@@ -0,0 +1,46 @@
+/*
+// ngx_http_mruby_shdict.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_SHDICT_H
+#define NGX_HTTP_MRUBY_SHDICT_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+// generation counters of a zone, a power of two
+#define NGX_MRB_SHDICT_GENERATIONS     1024
+
+// the head of a mruby_shared_dict zone
+typedef struct {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  // most recently used first
+  ngx_queue_t lru;
+  // odd while a writer changes the tree, see ngx_mrb_shdict_write_begin
+  ngx_atomic_t seq;
+  // bumped on every change of a key hashing to the slot, see
+  // Nginx::SharedDict#generation
+  ngx_atomic_t generations[NGX_MRB_SHDICT_GENERATIONS];
+} ngx_mrb_shdict_sh_t;
+
+// shm_zone->data of a mruby_shared_dict zone, one per cycle
+typedef struct {
+  ngx_str_t name;
+  ngx_mrb_shdict_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ngx_mrb_shdict_t;
+
+char *ngx_http_mruby_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+// the zone named name in the running cycle, raises when there is none
+ngx_mrb_shdict_t *ngx_mrb_shdict_get(mrb_state *mrb, mrb_value name);
+// msec since the epoch, the clock of expiry times
+uint64_t ngx_mrb_shdict_now(void);
+
+#endif // NGX_HTTP_MRUBY_SHDICT_H
@@ -0,0 +1,935 @@
+/*
+// ngx_http_mruby_socket.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_socket.h"
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::Socket, a TCP or unix domain socket client driven by the nginx event
+// loop. An operation that can not complete at once arms the connection
+// events and returns :again; the Ruby side (mrb_nginx.rb) then yields the
+// handler fiber, which the event handler resumes with the result or with an
+// Nginx::Socket::Error. Connections handed to setkeepalive are kept in a per
+// worker pool keyed by "host:port:pool" and picked up by later connects.
+*/
+
+#define NGX_MRB_SOCKET_TIMEOUT         60000
+#define NGX_MRB_SOCKET_BUFFER_SIZE     4096
+// receive and receive_until give up on a peer that never sends the pattern
+#define NGX_MRB_SOCKET_LINE_MAX        (1024 * 1024)
+#define NGX_MRB_SOCKET_POOL_SIZE       30
+
+typedef enum {
+  NGX_MRB_SOCKET_OP_NONE = 0,
+  NGX_MRB_SOCKET_OP_CONNECT,
+  NGX_MRB_SOCKET_OP_SEND,
+  NGX_MRB_SOCKET_OP_RECEIVE
+} ngx_mrb_socket_op_t;
+
+typedef struct {
+  ngx_queue_t queue;
+  ngx_connection_t *connection;
+  ngx_uint_t reused;
+  size_t key_len;
+  u_char key[1];
+} ngx_mrb_socket_keepalive_t;
+
+typedef struct {
+  mrb_state *mrb;
+  ngx_peer_connection_t peer;
+  u_char sockaddr[NGX_SOCKADDRLEN];
+  ngx_str_t name;
+  // keepalive pool key, name is its "host:port" prefix
+  u_char *key;
+  size_t key_len;
+  ngx_uint_t reused;
+  ngx_msec_t timeout;
+
+  // pending operation and the request waiting for it
+  ngx_mrb_socket_op_t op;
+  ngx_http_mruby_ctx_t *ctx;
+  // closes the connection when that request ends first
+  ngx_pool_cleanup_t *cleanup;
+  ngx_http_request_t *cleanup_r;
+
+  // send: data not written yet, copied out of the Ruby string on NGX_AGAIN
+  u_char *out;
+  size_t out_len;
+  size_t out_total;
+  u_char *out_data;
+
+  // receive: want bytes (up to want when partial is set), or up to pattern
+  // when pattern_len is set
+  u_char *buf_start;
+  u_char *buf_pos;
+  u_char *buf_last;
+  u_char *buf_end;
+  size_t want;
+  u_char *pattern;
+  size_t pattern_len;
+  size_t pattern_size;
+  size_t scanned;
+  ngx_uint_t line;
+  ngx_uint_t partial;
+} ngx_mrb_socket_t;
+
+static void ngx_mrb_socket_free(mrb_state *mrb, void *data);
+
+static const struct mrb_data_type ngx_mrb_socket_data_type = {
+  "Nginx::Socket", ngx_mrb_socket_free,
+};
+
+static ngx_queue_t ngx_mrb_socket_keepalive;
+
+static void ngx_mrb_socket_keepalive_init(void)
+{
+  if (ngx_mrb_socket_keepalive.next == NULL) {
+    ngx_queue_init(&ngx_mrb_socket_keepalive);
+  }
+}
+
+static void ngx_mrb_socket_close_connection(ngx_mrb_socket_t *sock)
+{
+  if (sock->peer.connection != NULL) {
+    ngx_close_connection(sock->peer.connection);
+    sock->peer.connection = NULL;
+  }
+  if (sock->out_data != NULL) {
+    ngx_free(sock->out_data);
+    sock->out_data = NULL;
+  }
+  sock->buf_pos = sock->buf_last = sock->buf_start;
+  sock->op = NGX_MRB_SOCKET_OP_NONE;
+  sock->ctx = NULL;
+}
+
+// ends the pending operation, the connection stays open
+static void ngx_mrb_socket_finish(ngx_mrb_socket_t *sock)
+{
+  ngx_connection_t *c = sock->peer.connection;
+
+  if (c->read->timer_set) {
+    ngx_del_timer(c->read);
+  }
+  if (c->write->timer_set) {
+    ngx_del_timer(c->write);
+  }
+  if (sock->out_data != NULL) {
+    ngx_free(sock->out_data);
+    sock->out_data = NULL;
+  }
+  sock->op = NGX_MRB_SOCKET_OP_NONE;
+}
+
+// closes the connection and returns the Nginx::Socket::Error to raise
+static mrb_value ngx_mrb_socket_error(ngx_mrb_socket_t *sock, const char *msg)
+{
+  ngx_mrb_socket_close_connection(sock);
+
+  return mrb_exc_new(sock->mrb, ngx_mrb_ud(sock->mrb)->socket_error_class,
+      msg, ngx_strlen(msg));
+}
+
+static void ngx_mrb_socket_free(mrb_state *mrb, void *data)
+{
+  ngx_mrb_socket_t *sock = data;
+
+  if (sock == NULL) {
+    return;
+  }
+  if (sock->cleanup != NULL) {
+    sock->cleanup->handler = NULL;
+  }
+  ngx_mrb_socket_close_connection(sock);
+  if (sock->key != NULL) {
+    ngx_free(sock->key);
+  }
+  if (sock->buf_start != NULL) {
+    ngx_free(sock->buf_start);
+  }
+  if (sock->pattern != NULL) {
+    ngx_free(sock->pattern);
+  }
+  ngx_free(sock);
+}
+
+static void ngx_mrb_socket_cleanup(void *data)
+{
+  ngx_mrb_socket_t *sock = data;
+
+  sock->cleanup = NULL;
+  if (sock->op != NGX_MRB_SOCKET_OP_NONE) {
+    // the request went away while waiting, the connection state is unknown
+    ngx_mrb_socket_close_connection(sock);
+  }
+}
+
+static ngx_int_t ngx_mrb_socket_test_connect(ngx_connection_t *c)
+{
+  int err;
+  socklen_t len;
+
+#if (NGX_HAVE_KQUEUE)
+  if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+    if (c->write->pending_eof || c->read->pending_eof) {
+      err = c->write->pending_eof ? c->write->kq_errno : c->read->kq_errno;
+      ngx_log_error(NGX_LOG_ERR, c->log, err, "connect() failed");
+      return NGX_ERROR;
+    }
+  }
+  else
+#endif
+  {
+    err = 0;
+    len = sizeof(int);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+      err = ngx_socket_errno;
+    }
+    if (err) {
+      ngx_log_error(NGX_LOG_ERR, c->log, err, "connect() failed");
+      return NGX_ERROR;
+    }
+  }
+
+  return c->write->ready ? NGX_OK : NGX_AGAIN;
+}
+
+static ngx_int_t ngx_mrb_socket_do_send(ngx_mrb_socket_t *sock, mrb_value *v)
+{
+  ngx_connection_t *c = sock->peer.connection;
+  ssize_t n;
+
+  while (sock->out_len > 0) {
+    n = c->send(c, sock->out, sock->out_len);
+    if (n == NGX_AGAIN) {
+      ngx_add_timer(c->write, sock->timeout);
+      if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        *v = ngx_mrb_socket_error(sock, "send failed");
+        return NGX_ERROR;
+      }
+      return NGX_AGAIN;
+    }
+    if (n == NGX_ERROR) {
+      *v = ngx_mrb_socket_error(sock, "send failed");
+      return NGX_ERROR;
+    }
+    sock->out += n;
+    sock->out_len -= n;
+  }
+  *v = mrb_fixnum_value(sock->out_total);
+
+  return NGX_OK;
+}
+
+// takes the requested data off the receive buffer when it is complete
+static ngx_int_t ngx_mrb_socket_match(ngx_mrb_socket_t *sock, mrb_value *v)
+{
+  u_char *p, *last;
+  size_t len;
+
+  if (sock->pattern_len == 0) {
+    len = sock->buf_last - sock->buf_pos;
+    if (sock->partial && len > 0) {
+      len = ngx_min(len, sock->want);
+    }
+    else if (len < sock->want) {
+      return NGX_AGAIN;
+    }
+    else {
+      len = sock->want;
+    }
+    *v = mrb_str_new(sock->mrb, (char *) sock->buf_pos, len);
+    sock->buf_pos += len;
+  }
+  else {
+    if ((size_t) (sock->buf_last - sock->buf_pos) < sock->pattern_len) {
+      return NGX_AGAIN;
+    }
+    last = sock->buf_last - sock->pattern_len + 1;
+    for (p = sock->buf_pos + sock->scanned; p < last; p++) {
+      if (*p == sock->pattern[0]
+          && ngx_memcmp(p, sock->pattern, sock->pattern_len) == 0) {
+        break;
+      }
+    }
+    if (p >= last) {
+      sock->scanned = last - sock->buf_pos;
+      return NGX_AGAIN;
+    }
+    len = p - sock->buf_pos;
+    if (sock->line && len > 0 && p[-1] == '\r') {
+      len--;
+    }
+    *v = mrb_str_new(sock->mrb, (char *) sock->buf_pos, len);
+    sock->buf_pos = p + sock->pattern_len;
+    sock->scanned = 0;
+  }
+  if (sock->buf_pos == sock->buf_last) {
+    sock->buf_pos = sock->buf_last = sock->buf_start;
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_mrb_socket_buffer_grow(ngx_mrb_socket_t *sock)
+{
+  size_t size, used;
+  u_char *p;
+
+  used = sock->buf_last - sock->buf_pos;
+  if (sock->buf_pos > sock->buf_start) {
+    ngx_memmove(sock->buf_start, sock->buf_pos, used);
+    sock->buf_pos = sock->buf_start;
+    sock->buf_last = sock->buf_start + used;
+    return NGX_OK;
+  }
+
+  size = sock->buf_end - sock->buf_start;
+  size = size ? size * 2 : NGX_MRB_SOCKET_BUFFER_SIZE;
+  if (sock->pattern_len == 0) {
+    if (size < sock->want) {
+      size = sock->want;
+    }
+  }
+  else if (used >= NGX_MRB_SOCKET_LINE_MAX) {
+    return NGX_DECLINED;
+  }
+  p = ngx_alloc(size, ngx_cycle->log);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+  if (sock->buf_start != NULL) {
+    ngx_memcpy(p, sock->buf_pos, used);
+    ngx_free(sock->buf_start);
+  }
+  sock->buf_start = sock->buf_pos = p;
+  sock->buf_last = p + used;
+  sock->buf_end = p + size;
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_mrb_socket_do_receive(ngx_mrb_socket_t *sock,
+    mrb_value *v)
+{
+  ngx_connection_t *c = sock->peer.connection;
+  ngx_int_t rc;
+  ssize_t n;
+
+  for ( ;; ) {
+    if (ngx_mrb_socket_match(sock, v) == NGX_OK) {
+      return NGX_OK;
+    }
+    if (sock->buf_last == sock->buf_end) {
+      rc = ngx_mrb_socket_buffer_grow(sock);
+      if (rc != NGX_OK) {
+        *v = ngx_mrb_socket_error(sock, rc == NGX_DECLINED
+            ? "pattern not found in receive buffer limit"
+            : "failed to allocate receive buffer");
+        return NGX_ERROR;
+      }
+    }
+    n = c->recv(c, sock->buf_last, sock->buf_end - sock->buf_last);
+    if (n == NGX_AGAIN) {
+      ngx_add_timer(c->read, sock->timeout);
+      if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        *v = ngx_mrb_socket_error(sock, "receive failed");
+        return NGX_ERROR;
+      }
+      return NGX_AGAIN;
+    }
+    if (n == 0) {
+      if (sock->partial) {
+        *v = mrb_nil_value();
+        return NGX_OK;
+      }
+      *v = ngx_mrb_socket_error(sock, "closed");
+      return NGX_ERROR;
+    }
+    if (n == NGX_ERROR) {
+      *v = ngx_mrb_socket_error(sock, "receive failed");
+      return NGX_ERROR;
+    }
+    sock->buf_last += n;
+  }
+}
+
+// advances the pending operation, NGX_OK and NGX_ERROR end it with *v
+static ngx_int_t ngx_mrb_socket_step(ngx_mrb_socket_t *sock, mrb_value *v)
+{
+  ngx_int_t rc;
+
+  switch (sock->op) {
+  case NGX_MRB_SOCKET_OP_CONNECT:
+    rc = ngx_mrb_socket_test_connect(sock->peer.connection);
+    if (rc == NGX_ERROR) {
+      *v = ngx_mrb_socket_error(sock, "connect failed");
+    }
+    else {
+      *v = mrb_true_value();
+    }
+    break;
+  case NGX_MRB_SOCKET_OP_SEND:
+    rc = ngx_mrb_socket_do_send(sock, v);
+    break;
+  case NGX_MRB_SOCKET_OP_RECEIVE:
+    rc = ngx_mrb_socket_do_receive(sock, v);
+    break;
+  default:
+    return NGX_AGAIN;
+  }
+  if (rc == NGX_OK) {
+    ngx_mrb_socket_finish(sock);
+  }
+
+  return rc;
+}
+
+static void ngx_mrb_socket_event_handler(ngx_event_t *ev)
+{
+  ngx_connection_t *c = ev->data;
+  ngx_mrb_socket_t *sock = c->data;
+  ngx_http_mruby_ctx_t *ctx = sock->ctx;
+  mrb_state *mrb = sock->mrb;
+  mrb_value v;
+  int ai;
+
+  if (sock->op == NGX_MRB_SOCKET_OP_NONE) {
+    return;
+  }
+
+  ai = mrb_gc_arena_save(mrb);
+  if (ev->timedout) {
+    v = ngx_mrb_socket_error(sock, "timeout");
+  }
+  else if (ngx_mrb_socket_step(sock, &v) == NGX_AGAIN) {
+    mrb_gc_arena_restore(mrb, ai);
+    return;
+  }
+  sock->ctx = NULL;
+
+  // the fiber may close or drop the socket, do not touch it afterwards
+  ngx_mrb_async_resume(ctx, v);
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+// parks the handler fiber until the pending operation ends
+static mrb_value ngx_mrb_socket_wait(mrb_state *mrb, ngx_mrb_socket_t *sock,
+    ngx_http_mruby_ctx_t *ctx)
+{
+  ngx_pool_cleanup_t *cln;
+
+  if (sock->cleanup == NULL || sock->cleanup_r != ctx->r) {
+    cln = ngx_pool_cleanup_add(ctx->r->pool, 0);
+    if (cln == NULL) {
+      ngx_mrb_socket_close_connection(sock);
+      mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate socket cleanup");
+    }
+    if (sock->cleanup != NULL) {
+      sock->cleanup->handler = NULL;
+    }
+    cln->handler = ngx_mrb_socket_cleanup;
+    cln->data = sock;
+    sock->cleanup = cln;
+    sock->cleanup_r = ctx->r;
+  }
+  sock->ctx = ctx;
+  ctx->async_wait = 1;
+
+  return mrb_symbol_value(ngx_mrb_ud(mrb)->again_sym);
+}
+
+static mrb_value ngx_mrb_socket_run(mrb_state *mrb, ngx_mrb_socket_t *sock,
+    ngx_http_mruby_ctx_t *ctx)
+{
+  mrb_value v;
+  ngx_int_t rc;
+
+  rc = ngx_mrb_socket_step(sock, &v);
+  if (rc == NGX_AGAIN) {
+    return ngx_mrb_socket_wait(mrb, sock, ctx);
+  }
+  if (rc == NGX_ERROR) {
+    mrb_exc_raise(mrb, v);
+  }
+
+  return v;
+}
+
+static ngx_mrb_socket_t *ngx_mrb_socket_get(mrb_state *mrb, mrb_value self,
+    ngx_uint_t connected)
+{
+  ngx_mrb_socket_t *sock;
+
+  sock = mrb_data_get_ptr(mrb, self, &ngx_mrb_socket_data_type);
+  if (sock == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::Socket");
+  }
+  if (sock->op != NGX_MRB_SOCKET_OP_NONE) {
+    mrb_raise(mrb, ngx_mrb_ud(mrb)->socket_error_class, "socket busy");
+  }
+  if (connected && sock->peer.connection == NULL) {
+    mrb_raise(mrb, ngx_mrb_ud(mrb)->socket_error_class, "not connected");
+  }
+
+  return sock;
+}
+
+static mrb_value ngx_mrb_socket_init(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock;
+
+  sock = DATA_PTR(self);
+  if (sock != NULL) {
+    ngx_mrb_socket_free(mrb, sock);
+  }
+  DATA_TYPE(self) = &ngx_mrb_socket_data_type;
+  DATA_PTR(self) = NULL;
+
+  sock = ngx_calloc(sizeof(ngx_mrb_socket_t), ngx_cycle->log);
+  if (sock == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::Socket");
+  }
+  sock->mrb = mrb;
+  sock->timeout = NGX_MRB_SOCKET_TIMEOUT;
+  DATA_PTR(self) = sock;
+
+  return self;
+}
+
+static mrb_value ngx_mrb_socket_settimeout(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 0);
+  mrb_int msec;
+
+  mrb_get_args(mrb, "i", &msec);
+  if (msec <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "timeout must be positive");
+  }
+  sock->timeout = (ngx_msec_t) msec;
+
+  return self;
+}
+
+// resolves host (an IP address or "unix:/path") into sock->sockaddr
+static void ngx_mrb_socket_addr(mrb_state *mrb, ngx_mrb_socket_t *sock,
+    ngx_http_request_t *r, mrb_value host, mrb_value port)
+{
+  ngx_url_t u;
+  ngx_addr_t addr;
+  mrb_int p;
+
+  if (RSTRING_LEN(host) > 5
+      && ngx_strncmp(RSTRING_PTR(host), "unix:", 5) == 0) {
+    ngx_memzero(&u, sizeof(ngx_url_t));
+    u.url.data = (u_char *) RSTRING_PTR(host);
+    u.url.len = RSTRING_LEN(host);
+    if (ngx_parse_url(r->pool, &u) != NGX_OK || u.naddrs == 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid unix domain socket path");
+    }
+    addr = u.addrs[0];
+  }
+  else {
+    if (mrb_nil_p(port)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "port required");
+    }
+    p = mrb_fixnum(mrb_to_int(mrb, port));
+    if (p <= 0 || p > 65535) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid port");
+    }
+    // Nginx::Socket#connect resolves host names with Nginx::Resolver
+    if (ngx_parse_addr(r->pool, &addr, (u_char *) RSTRING_PTR(host),
+          RSTRING_LEN(host)) != NGX_OK) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "host must be an IP address or a"
+          " unix: path");
+    }
+    switch (addr.sockaddr->sa_family) {
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+      ((struct sockaddr_in6 *) addr.sockaddr)->sin6_port = htons((in_port_t) p);
+      break;
+#endif
+    default:
+      ((struct sockaddr_in *) addr.sockaddr)->sin_port = htons((in_port_t) p);
+      break;
+    }
+  }
+
+  ngx_memcpy(sock->sockaddr, addr.sockaddr, addr.socklen);
+  sock->peer.sockaddr = (struct sockaddr *) sock->sockaddr;
+  sock->peer.socklen = addr.socklen;
+}
+
+// "host:port:pool", the pool defaults to empty
+static void ngx_mrb_socket_key(mrb_state *mrb, ngx_mrb_socket_t *sock,
+    mrb_value host, mrb_value port, mrb_value pool)
+{
+  size_t len;
+  u_char *p;
+
+  len = RSTRING_LEN(host) + 1 + NGX_INT_T_LEN + 1;
+  if (!mrb_nil_p(pool)) {
+    len += RSTRING_LEN(pool);
+  }
+  if (sock->key != NULL) {
+    ngx_free(sock->key);
+  }
+  sock->key = ngx_alloc(len, ngx_cycle->log);
+  if (sock->key == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate socket name");
+  }
+
+  p = ngx_cpymem(sock->key, RSTRING_PTR(host), RSTRING_LEN(host));
+  if (!mrb_nil_p(port)) {
+    p = ngx_sprintf(p, ":%i", (ngx_int_t) mrb_fixnum(port));
+  }
+  sock->name.data = sock->key;
+  sock->name.len = p - sock->key;
+  *p++ = ':';
+  if (!mrb_nil_p(pool)) {
+    p = ngx_cpymem(p, RSTRING_PTR(pool), RSTRING_LEN(pool));
+  }
+  sock->key_len = p - sock->key;
+}
+
+static ngx_connection_t *ngx_mrb_socket_keepalive_get(ngx_mrb_socket_t *sock)
+{
+  ngx_queue_t *q;
+  ngx_mrb_socket_keepalive_t *item;
+  ngx_connection_t *c;
+
+  ngx_mrb_socket_keepalive_init();
+  for (q = ngx_queue_head(&ngx_mrb_socket_keepalive);
+      q != ngx_queue_sentinel(&ngx_mrb_socket_keepalive);
+      q = ngx_queue_next(q)) {
+    item = ngx_queue_data(q, ngx_mrb_socket_keepalive_t, queue);
+    if (item->key_len != sock->key_len
+        || ngx_memcmp(item->key, sock->key, sock->key_len) != 0) {
+      continue;
+    }
+    ngx_queue_remove(q);
+    c = item->connection;
+    if (c->read->timer_set) {
+      ngx_del_timer(c->read);
+    }
+    c->idle = 0;
+    sock->reused = item->reused + 1;
+    ngx_free(item);
+    return c;
+  }
+
+  return NULL;
+}
+
+static mrb_value ngx_mrb_socket_connect(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 0);
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_connection_t *c;
+  mrb_value host, port = mrb_nil_value(), pool = mrb_nil_value();
+  ngx_int_t rc;
+
+  mrb_get_args(mrb, "S|oo", &host, &port, &pool);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Socket#connect");
+  if (!mrb_nil_p(pool)) {
+    pool = mrb_str_to_str(mrb, pool);
+  }
+  if (!mrb_nil_p(port)) {
+    port = mrb_to_int(mrb, port);
+  }
+
+  ngx_mrb_socket_close_connection(sock);
+  ngx_mrb_socket_addr(mrb, sock, ctx->r, host, port);
+  ngx_mrb_socket_key(mrb, sock, host, port, pool);
+
+  c = ngx_mrb_socket_keepalive_get(sock);
+  if (c != NULL) {
+    c->data = sock;
+    c->read->handler = ngx_mrb_socket_event_handler;
+    c->write->handler = ngx_mrb_socket_event_handler;
+    sock->peer.connection = c;
+    return mrb_true_value();
+  }
+
+  sock->reused = 0;
+  sock->peer.name = &sock->name;
+  sock->peer.get = ngx_event_get_peer;
+  sock->peer.log = ngx_cycle->log;
+  sock->peer.log_error = NGX_ERROR_ERR;
+  sock->peer.tries = 1;
+
+  rc = ngx_event_connect_peer(&sock->peer);
+  if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+    ngx_mrb_socket_close_connection(sock);
+    mrb_raise(mrb, ngx_mrb_ud(mrb)->socket_error_class, "connect failed");
+  }
+  c = sock->peer.connection;
+  c->data = sock;
+  c->read->handler = ngx_mrb_socket_event_handler;
+  c->write->handler = ngx_mrb_socket_event_handler;
+  if (rc == NGX_OK) {
+    return mrb_true_value();
+  }
+
+  sock->op = NGX_MRB_SOCKET_OP_CONNECT;
+  ngx_add_timer(c->write, sock->timeout);
+
+  return ngx_mrb_socket_wait(mrb, sock, ctx);
+}
+
+static mrb_value ngx_mrb_socket_send(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 1);
+  ngx_http_mruby_ctx_t *ctx;
+  mrb_value data, v;
+  ngx_int_t rc;
+
+  mrb_get_args(mrb, "S", &data);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Socket#send");
+
+  sock->op = NGX_MRB_SOCKET_OP_SEND;
+  sock->out = (u_char *) RSTRING_PTR(data);
+  sock->out_len = sock->out_total = RSTRING_LEN(data);
+  rc = ngx_mrb_socket_step(sock, &v);
+  if (rc == NGX_ERROR) {
+    mrb_exc_raise(mrb, v);
+  }
+  if (rc == NGX_OK) {
+    return v;
+  }
+
+  // the string may change or go away while the fiber waits
+  sock->out_data = ngx_alloc(sock->out_len, ngx_cycle->log);
+  if (sock->out_data == NULL) {
+    ngx_mrb_socket_close_connection(sock);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate send buffer");
+  }
+  ngx_memcpy(sock->out_data, sock->out, sock->out_len);
+  sock->out = sock->out_data;
+
+  return ngx_mrb_socket_wait(mrb, sock, ctx);
+}
+
+static mrb_value ngx_mrb_socket_receive(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 1);
+  ngx_http_mruby_ctx_t *ctx;
+  mrb_value size = mrb_nil_value();
+
+  mrb_get_args(mrb, "|o", &size);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Socket#receive");
+
+  sock->scanned = 0;
+  if (mrb_nil_p(size)) {
+    // a line, without its terminator
+    if (sock->pattern_size == 0) {
+      sock->pattern = ngx_alloc(1, ngx_cycle->log);
+      if (sock->pattern == NULL) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate receive pattern");
+      }
+      sock->pattern_size = 1;
+    }
+    sock->pattern[0] = '\n';
+    sock->pattern_len = 1;
+    sock->line = 1;
+  }
+  else {
+    sock->want = mrb_fixnum(mrb_to_int(mrb, size));
+    if ((mrb_int) sock->want < 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "negative receive size");
+    }
+    sock->pattern_len = 0;
+    sock->line = 0;
+  }
+  sock->partial = 0;
+  sock->op = NGX_MRB_SOCKET_OP_RECEIVE;
+
+  return ngx_mrb_socket_run(mrb, sock, ctx);
+}
+
+static mrb_value ngx_mrb_socket_receive_until(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 1);
+  ngx_http_mruby_ctx_t *ctx;
+  mrb_value pattern;
+  size_t len;
+
+  mrb_get_args(mrb, "S", &pattern);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Socket#receive_until");
+
+  len = RSTRING_LEN(pattern);
+  if (len == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "empty pattern");
+  }
+  if (len > sock->pattern_size) {
+    if (sock->pattern != NULL) {
+      ngx_free(sock->pattern);
+    }
+    sock->pattern_size = 0;
+    sock->pattern = ngx_alloc(len, ngx_cycle->log);
+    if (sock->pattern == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate receive pattern");
+    }
+    sock->pattern_size = len;
+  }
+  ngx_memcpy(sock->pattern, RSTRING_PTR(pattern), len);
+  sock->pattern_len = len;
+  sock->line = 0;
+  sock->partial = 0;
+  sock->scanned = 0;
+  sock->op = NGX_MRB_SOCKET_OP_RECEIVE;
+
+  return ngx_mrb_socket_run(mrb, sock, ctx);
+}
+
+// whatever has arrived, at most size bytes, or nil once the peer has closed
+static mrb_value ngx_mrb_socket_receive_any(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 1);
+  ngx_http_mruby_ctx_t *ctx;
+  mrb_int size;
+
+  mrb_get_args(mrb, "i", &size);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Socket#receive_any");
+  if (size <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "receive size must be positive");
+  }
+
+  sock->want = size;
+  sock->pattern_len = 0;
+  sock->line = 0;
+  sock->partial = 1;
+  sock->scanned = 0;
+  sock->op = NGX_MRB_SOCKET_OP_RECEIVE;
+
+  return ngx_mrb_socket_run(mrb, sock, ctx);
+}
+
+static void ngx_mrb_socket_keepalive_handler(ngx_event_t *ev)
+{
+  ngx_connection_t *c = ev->data;
+  ngx_mrb_socket_keepalive_t *item = c->data;
+  ssize_t n;
+  char buf[1];
+
+  if (ev->write) {
+    return;
+  }
+
+  // anything but EAGAIN means the peer closed or sent unexpected data
+  if (!ev->timedout && !c->close) {
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+      ev->ready = 0;
+      if (ngx_handle_read_event(c->read, 0) == NGX_OK) {
+        return;
+      }
+    }
+  }
+
+  ngx_queue_remove(&item->queue);
+  ngx_close_connection(c);
+  ngx_free(item);
+}
+
+static mrb_value ngx_mrb_socket_setkeepalive(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 1);
+  ngx_connection_t *c = sock->peer.connection;
+  ngx_mrb_socket_keepalive_t *item;
+  ngx_queue_t *q;
+  mrb_int timeout = NGX_MRB_SOCKET_TIMEOUT, size = NGX_MRB_SOCKET_POOL_SIZE;
+  ngx_int_t n = 0;
+
+  mrb_get_args(mrb, "|ii", &timeout, &size);
+
+  // unread data would be seen by the next user of the connection
+  if (sock->buf_pos != sock->buf_last || c->read->eof || c->read->error) {
+    ngx_mrb_socket_close_connection(sock);
+    return mrb_false_value();
+  }
+
+  ngx_mrb_socket_keepalive_init();
+  for (q = ngx_queue_head(&ngx_mrb_socket_keepalive);
+      q != ngx_queue_sentinel(&ngx_mrb_socket_keepalive);
+      q = ngx_queue_next(q)) {
+    item = ngx_queue_data(q, ngx_mrb_socket_keepalive_t, queue);
+    if (item->key_len == sock->key_len
+        && ngx_memcmp(item->key, sock->key, sock->key_len) == 0) {
+      n++;
+    }
+  }
+  if (n >= size) {
+    ngx_mrb_socket_close_connection(sock);
+    return mrb_false_value();
+  }
+
+  item = ngx_alloc(offsetof(ngx_mrb_socket_keepalive_t, key) + sock->key_len,
+      ngx_cycle->log);
+  if (item == NULL) {
+    ngx_mrb_socket_close_connection(sock);
+    return mrb_false_value();
+  }
+  item->connection = c;
+  item->reused = sock->reused;
+  item->key_len = sock->key_len;
+  ngx_memcpy(item->key, sock->key, sock->key_len);
+  ngx_queue_insert_head(&ngx_mrb_socket_keepalive, &item->queue);
+
+  sock->peer.connection = NULL;
+  c->data = item;
+  c->idle = 1;
+  c->read->handler = ngx_mrb_socket_keepalive_handler;
+  c->write->handler = ngx_mrb_socket_keepalive_handler;
+  if (timeout > 0) {
+    ngx_add_timer(c->read, (ngx_msec_t) timeout);
+  }
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK || c->read->ready) {
+    ngx_mrb_socket_keepalive_handler(c->read);
+  }
+
+  return mrb_true_value();
+}
+
+static mrb_value ngx_mrb_socket_close(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 0);
+
+  ngx_mrb_socket_close_connection(sock);
+
+  return mrb_nil_value();
+}
+
+static mrb_value ngx_mrb_socket_reused_times(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_socket_t *sock = ngx_mrb_socket_get(mrb, self, 0);
+
+  return mrb_fixnum_value(sock->reused);
+}
+
+void ngx_mrb_socket_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_socket;
+
+  class_socket = mrb_define_class_under(mrb, class, "Socket", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_socket, MRB_TT_DATA);
+  mrb_define_class_under(mrb, class_socket, "Error", mrb->eStandardError_class);
+
+  mrb_define_method(mrb, class_socket, "initialize", ngx_mrb_socket_init, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_socket, "settimeout", ngx_mrb_socket_settimeout, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_socket, "_connect", ngx_mrb_socket_connect, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, class_socket, "_send", ngx_mrb_socket_send, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_socket, "_receive", ngx_mrb_socket_receive, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_socket, "_receive_until", ngx_mrb_socket_receive_until, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_socket, "_receive_any", ngx_mrb_socket_receive_any, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_socket, "setkeepalive", ngx_mrb_socket_setkeepalive, MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, class_socket, "close", ngx_mrb_socket_close, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_socket, "reused_times", ngx_mrb_socket_reused_times, MRB_ARGS_NONE());
+}
@@ -0,0 +1,669 @@
+/*
+// ngx_http_mruby_subrequest.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_subrequest.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::Subrequest.capture_multi starts all subrequests at once and parks
+// the handler fiber. The header and body filters keep the output of those
+// subrequests away from the client and copy the body; each finished
+// subrequest posts its parent, and the parent resumes the fiber once the
+// last one is done (ngx_mrb_capture_wake).
+//
+// Nginx::Subrequest.hedged starts further copies of a subrequest while no
+// answer has arrived (ngx_mrb_hedge_t) and resumes with the first one.
+// nginx can not abort a running subrequest, so the others are detached
+// instead: they leave the postponed output of the parent, their output is
+// dropped, and the reference they hold on the main request is released
+// when they end (ngx_mrb_capture_release).
+*/
+
+typedef struct {
+  ngx_str_t uri;
+  ngx_str_t args;
+  ngx_str_t body;
+  ngx_uint_t method;
+  ngx_str_t method_name;
+  ngx_uint_t has_body;
+} ngx_mrb_capture_req_t;
+
+typedef struct {
+  ngx_str_t name;
+  ngx_uint_t method;
+} ngx_mrb_capture_method_t;
+
+typedef struct ngx_mrb_hedge_t {
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_mrb_capture_req_t *reqs;
+  ngx_mrb_capture_t *caps;
+  ngx_uint_t max;
+  ngx_uint_t started;
+  ngx_msec_t after;
+  ngx_event_t timer;
+} ngx_mrb_hedge_t;
+
+static ngx_int_t ngx_mrb_capture_post(ngx_http_request_t *sr, void *data,
+    ngx_int_t rc);
+
+static ngx_mrb_capture_method_t ngx_mrb_capture_methods[] = {
+  { ngx_string("GET"), NGX_HTTP_GET },
+  { ngx_string("HEAD"), NGX_HTTP_HEAD },
+  { ngx_string("POST"), NGX_HTTP_POST },
+  { ngx_string("PUT"), NGX_HTTP_PUT },
+  { ngx_string("DELETE"), NGX_HTTP_DELETE },
+  { ngx_string("OPTIONS"), NGX_HTTP_OPTIONS },
+  { ngx_string("PATCH"), NGX_HTTP_PATCH },
+  { ngx_null_string, 0 }
+};
+
+// the parent context may be gone (a content handler drops it once it has
+// sent its response), so subrequests are recognised by their post handler
+static ngx_mrb_capture_t *ngx_mrb_capture_find(ngx_http_request_t *r)
+{
+  if (r->post_subrequest == NULL
+      || r->post_subrequest->handler != ngx_mrb_capture_post) {
+    return NULL;
+  }
+
+  return r->post_subrequest->data;
+}
+
+ngx_int_t ngx_mrb_capture_header_filter(ngx_http_request_t *r)
+{
+  if (ngx_mrb_capture_find(r) == NULL) {
+    return NGX_DECLINED;
+  }
+  r->header_sent = 1;
+  r->filter_need_in_memory = 1;
+
+  return NGX_OK;
+}
+
+ngx_int_t ngx_mrb_capture_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+  ngx_mrb_capture_t *cap;
+  ngx_chain_t *cl, *ln;
+  ngx_buf_t *b, *nb;
+  size_t size;
+
+  cap = ngx_mrb_capture_find(r);
+  if (cap == NULL) {
+    return NGX_DECLINED;
+  }
+
+  for (cl = in; cl != NULL; cl = cl->next) {
+    b = cl->buf;
+    if (ngx_buf_in_memory(b)) {
+      size = b->last - b->pos;
+      if (size > 0 && !cap->detached) {
+        nb = ngx_create_temp_buf(r->pool, size);
+        ln = ngx_alloc_chain_link(r->pool);
+        if (nb == NULL || ln == NULL) {
+          return NGX_ERROR;
+        }
+        nb->last = ngx_cpymem(nb->pos, b->pos, size);
+        ln->buf = nb;
+        ln->next = NULL;
+        *cap->last = ln;
+        cap->last = &ln->next;
+        cap->body_len += size;
+      }
+      b->pos = b->last;
+    }
+    if (b->in_file) {
+      b->file_pos = b->file_last;
+    }
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_mrb_capture_post(ngx_http_request_t *sr, void *data,
+    ngx_int_t rc)
+{
+  ngx_mrb_capture_t *cap = data;
+
+  // called on every finalization of the subrequest
+  if (cap->done) {
+    return rc;
+  }
+  cap->done = 1;
+  cap->rc = rc;
+
+  if (cap->detached) {
+    // not from here: the finalization of sr is still running
+    ngx_post_event(&cap->release, &ngx_posted_events);
+  }
+  else if (cap->ctx->captures_pending > 0) {
+    cap->ctx->captures_pending--;
+  }
+
+  return rc;
+}
+
+// drops the reference a detached subrequest held on the main request, which
+// nginx would have dropped had the subrequest stayed in the postponed list
+static void ngx_mrb_capture_release(ngx_event_t *ev)
+{
+  ngx_http_request_t *r = ev->data;
+  ngx_connection_t *c = r->connection;
+
+  ngx_http_finalize_request(r, NGX_DONE);
+  ngx_http_run_posted_requests(c);
+}
+
+static void ngx_mrb_capture_release_cleanup(void *data)
+{
+  ngx_event_t *ev = data;
+
+  if (ev->posted) {
+    ngx_delete_posted_event(ev);
+  }
+}
+
+static void ngx_mrb_capture_detach(ngx_http_request_t *r,
+    ngx_mrb_capture_t *cap)
+{
+  ngx_http_postponed_request_t **pr;
+  ngx_pool_cleanup_t *cln;
+  ngx_http_request_t *sr = cap->sr;
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) {
+    // stays in the postponed list and delays the response until it ends
+    return;
+  }
+  cln->handler = ngx_mrb_capture_release_cleanup;
+  cln->data = &cap->release;
+  cap->release.handler = ngx_mrb_capture_release;
+  cap->release.data = r->main;
+  cap->release.log = r->connection->log;
+
+  for (pr = &r->postponed; *pr != NULL; /* void */) {
+    if ((*pr)->request == sr) {
+      *pr = (*pr)->next;
+    }
+    else {
+      pr = &(*pr)->next;
+    }
+  }
+  if (r->connection->data == sr) {
+    r->connection->data = r;
+  }
+  cap->detached = 1;
+}
+
+static ngx_int_t ngx_mrb_capture_status(ngx_mrb_capture_t *cap)
+{
+  ngx_http_request_t *sr = cap->sr;
+
+  if (sr != NULL && sr->headers_out.status) {
+    return sr->headers_out.status;
+  }
+  if (cap->rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return cap->rc;
+  }
+  if (sr != NULL && (cap->rc == NGX_OK || cap->rc == NGX_DONE)) {
+    return NGX_HTTP_OK;
+  }
+
+  return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+static mrb_value ngx_mrb_capture_result(mrb_state *mrb, ngx_mrb_capture_t *cap)
+{
+  ngx_http_request_t *sr = cap->sr;
+  ngx_list_part_t *part;
+  ngx_table_elt_t *h;
+  ngx_chain_t *cl;
+  ngx_uint_t i;
+  mrb_value result, body, headers;
+  char *p;
+
+  body = mrb_str_new(mrb, NULL, cap->body_len);
+  p = RSTRING_PTR(body);
+  for (cl = cap->body; cl != NULL; cl = cl->next) {
+    p = (char *) ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  }
+
+  headers = mrb_hash_new(mrb);
+  if (sr != NULL) {
+    if (sr->headers_out.content_type.len) {
+      mrb_hash_set(mrb, headers, mrb_str_new_lit(mrb, "Content-Type"),
+          mrb_str_new(mrb, (char *) sr->headers_out.content_type.data,
+            sr->headers_out.content_type.len));
+    }
+    part = &sr->headers_out.headers.part;
+    h = part->elts;
+    for (i = 0; /* void */; i++) {
+      if (i >= part->nelts) {
+        if (part->next == NULL) {
+          break;
+        }
+        part = part->next;
+        h = part->elts;
+        i = 0;
+      }
+      if (h[i].hash == 0) {
+        continue;
+      }
+      mrb_hash_set(mrb, headers,
+          mrb_str_new(mrb, (char *) h[i].key.data, h[i].key.len),
+          mrb_str_new(mrb, (char *) h[i].value.data, h[i].value.len));
+    }
+  }
+
+  result = mrb_ary_new_capa(mrb, 3);
+  mrb_ary_push(mrb, result, mrb_fixnum_value(ngx_mrb_capture_status(cap)));
+  mrb_ary_push(mrb, result, body);
+  mrb_ary_push(mrb, result, headers);
+
+  return result;
+}
+
+// write_event_handler of the parent while it waits for its subrequests
+static void ngx_mrb_capture_wake(ngx_http_request_t *r)
+{
+  ngx_http_mruby_ctx_t *ctx;
+  mrb_state *mrb;
+  mrb_value results;
+  ngx_uint_t i;
+  int ai;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  if (ctx == NULL || ctx->captures == NULL || ctx->captures_pending > 0) {
+    return;
+  }
+
+  mrb = ctx->async_state->mrb;
+  ai = mrb_gc_arena_save(mrb);
+  results = mrb_ary_new_capa(mrb, ctx->ncaptures);
+  for (i = 0; i < ctx->ncaptures; i++) {
+    mrb_ary_push(mrb, results, ngx_mrb_capture_result(mrb, &ctx->captures[i]));
+  }
+  ctx->captures = NULL;
+  ctx->ncaptures = 0;
+
+  ngx_mrb_async_resume(ctx, results);
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+static void ngx_mrb_capture_str(mrb_state *mrb, ngx_http_request_t *r,
+    mrb_value value, ngx_str_t *str)
+{
+  value = mrb_str_to_str(mrb, value);
+  str->len = RSTRING_LEN(value);
+  str->data = ngx_pnalloc(r->pool, str->len + 1);
+  if (str->data == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate subrequest");
+  }
+  ngx_memcpy(str->data, RSTRING_PTR(value), str->len);
+  str->data[str->len] = '\0';
+}
+
+static mrb_value ngx_mrb_capture_opt(mrb_state *mrb, mrb_value opts,
+    const char *name)
+{
+  if (!mrb_hash_p(opts)) {
+    return mrb_nil_value();
+  }
+
+  return mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+}
+
+static void ngx_mrb_capture_parse(mrb_state *mrb, ngx_http_request_t *r,
+    mrb_value spec, ngx_mrb_capture_req_t *req)
+{
+  ngx_mrb_capture_method_t *m;
+  mrb_value uri, opts, v;
+  ngx_uint_t flags = 0;
+
+  uri = mrb_ary_ref(mrb, spec, 0);
+  opts = mrb_ary_ref(mrb, spec, 1);
+  if (!mrb_nil_p(opts) && !mrb_hash_p(opts)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "subrequest options must be a Hash");
+  }
+
+  ngx_mrb_capture_str(mrb, r, uri, &req->uri);
+  ngx_str_null(&req->args);
+  if (ngx_http_parse_unsafe_uri(r, &req->uri, &req->args, &flags)
+      != NGX_OK) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unsafe subrequest uri: %S", uri);
+  }
+  v = ngx_mrb_capture_opt(mrb, opts, "args");
+  if (!mrb_nil_p(v)) {
+    ngx_mrb_capture_str(mrb, r, v, &req->args);
+  }
+
+  v = ngx_mrb_capture_opt(mrb, opts, "body");
+  req->has_body = !mrb_nil_p(v);
+  if (req->has_body) {
+    ngx_mrb_capture_str(mrb, r, v, &req->body);
+  }
+
+  req->method = req->has_body ? NGX_HTTP_POST : NGX_HTTP_GET;
+  v = ngx_mrb_capture_opt(mrb, opts, "method");
+  if (!mrb_nil_p(v)) {
+    v = mrb_str_to_str(mrb, v);
+    for (m = ngx_mrb_capture_methods; m->name.len; m++) {
+      if (m->name.len == (size_t) RSTRING_LEN(v)
+          && ngx_strncasecmp(m->name.data, (u_char *) RSTRING_PTR(v),
+            m->name.len) == 0) {
+        break;
+      }
+    }
+    if (m->name.len == 0) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "unsupported subrequest method: %S", v);
+    }
+    req->method = m->method;
+  }
+  for (m = ngx_mrb_capture_methods; m->method != req->method; m++) {
+    /* void */
+  }
+  req->method_name = m->name;
+}
+
+static ngx_int_t ngx_mrb_capture_start(ngx_http_request_t *r,
+    ngx_mrb_capture_req_t *req, ngx_mrb_capture_t *cap)
+{
+  ngx_http_post_subrequest_t *psr;
+  ngx_http_request_body_t *rb;
+  ngx_http_request_t *sr;
+  ngx_buf_t *b;
+
+  cap->ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  cap->last = &cap->body;
+
+  psr = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+  if (psr == NULL) {
+    return NGX_ERROR;
+  }
+  psr->handler = ngx_mrb_capture_post;
+  psr->data = cap;
+
+  if (ngx_http_subrequest(r, &req->uri, &req->args, &sr, psr, 0) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  cap->sr = sr;
+  sr->filter_need_in_memory = 1;
+  sr->method = req->method;
+  sr->method_name = req->method_name;
+  if (req->method == NGX_HTTP_HEAD) {
+    sr->header_only = 1;
+  }
+
+  // a subrequest shares the request body of its parent unless it has one
+  if (req->has_body) {
+    rb = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_t));
+    b = ngx_calloc_buf(r->pool);
+    if (rb == NULL || b == NULL) {
+      return NGX_ERROR;
+    }
+    b->pos = b->start = req->body.data;
+    b->last = b->end = req->body.data + req->body.len;
+    b->temporary = 1;
+    b->last_buf = 1;
+    rb->bufs = ngx_alloc_chain_link(r->pool);
+    if (rb->bufs == NULL) {
+      return NGX_ERROR;
+    }
+    rb->bufs->buf = b;
+    rb->bufs->next = NULL;
+    rb->buf = b;
+    sr->request_body = rb;
+    sr->headers_in.content_length_n = req->body.len;
+  }
+
+  return NGX_OK;
+}
+
+static void ngx_mrb_capture_log_error(ngx_http_request_t *r,
+    ngx_mrb_capture_req_t *req)
+{
+  ngx_log_error(NGX_LOG_ERR
+    , r->connection->log
+    , 0
+    , "%s ERROR %s:%d: failed to start subrequest \"%V\""
+    , MODULE_NAME
+    , __func__
+    , __LINE__
+    , &req->uri
+  );
+}
+
+// checks every [uri, opts] of specs before the first subrequest starts
+static ngx_mrb_capture_req_t *ngx_mrb_capture_parse_all(mrb_state *mrb,
+    ngx_http_mruby_ctx_t *ctx, mrb_value specs, ngx_mrb_capture_t **caps)
+{
+  ngx_http_request_t *r = ctx->r;
+  ngx_mrb_capture_req_t *reqs;
+  mrb_value spec;
+  mrb_int i, n;
+
+  if (ctx->captures != NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "subrequests already pending");
+  }
+
+  n = RARRAY_LEN(specs);
+  reqs = ngx_pcalloc(r->pool, sizeof(ngx_mrb_capture_req_t) * n);
+  *caps = ngx_pcalloc(r->pool, sizeof(ngx_mrb_capture_t) * n);
+  if (n == 0 || reqs == NULL || *caps == NULL) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no subrequest to capture");
+  }
+
+  for (i = 0; i < n; i++) {
+    spec = mrb_ary_ref(mrb, specs, i);
+    if (!mrb_array_p(spec)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "subrequest must be [uri, opts]");
+    }
+    ngx_mrb_capture_parse(mrb, r, spec, &reqs[i]);
+  }
+
+  return reqs;
+}
+
+// starts one subrequest per [uri, opts] of specs, the caller then yields
+static mrb_value ngx_mrb_capture(mrb_state *mrb, mrb_value self)
+{
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_http_request_t *r;
+  ngx_mrb_capture_req_t *reqs;
+  ngx_mrb_capture_t *caps;
+  mrb_value specs;
+  mrb_int i, n;
+
+  mrb_get_args(mrb, "A", &specs);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Subrequest.capture");
+  r = ctx->r;
+  reqs = ngx_mrb_capture_parse_all(mrb, ctx, specs, &caps);
+  n = RARRAY_LEN(specs);
+
+  ctx->captures = caps;
+  ctx->ncaptures = n;
+  ctx->captures_pending = n;
+  for (i = 0; i < n; i++) {
+    if (ngx_mrb_capture_start(r, &reqs[i], &caps[i]) != NGX_OK) {
+      ngx_mrb_capture_log_error(r, &reqs[i]);
+      if (caps[i].sr == NULL) {
+        caps[i].done = 1;
+        caps[i].rc = NGX_ERROR;
+        ctx->captures_pending--;
+      }
+    }
+  }
+
+  ctx->async_write_handler = ngx_mrb_capture_wake;
+  ctx->async_wait = 1;
+  if (ctx->captures_pending == 0) {
+    // nothing started, let the posted request resume the fiber
+    ngx_http_post_request(r, NULL);
+  }
+
+  return self;
+}
+
+static void ngx_mrb_hedge_start(ngx_mrb_hedge_t *hedge)
+{
+  ngx_http_mruby_ctx_t *ctx = hedge->ctx;
+  ngx_http_request_t *r = ctx->r;
+  ngx_uint_t i = hedge->started++;
+
+  ctx->ncaptures = hedge->started;
+  ctx->captures_pending++;
+  if (ngx_mrb_capture_start(r, &hedge->reqs[i], &hedge->caps[i]) != NGX_OK) {
+    ngx_mrb_capture_log_error(r, &hedge->reqs[i]);
+    if (hedge->caps[i].sr == NULL) {
+      hedge->caps[i].done = 1;
+      hedge->caps[i].rc = NGX_ERROR;
+      ctx->captures_pending--;
+      ngx_http_post_request(r, NULL);
+    }
+  }
+}
+
+static void ngx_mrb_hedge_timer_handler(ngx_event_t *ev)
+{
+  ngx_mrb_hedge_t *hedge = ev->data;
+  ngx_connection_t *c = hedge->ctx->r->connection;
+
+  ngx_mrb_hedge_start(hedge);
+  if (hedge->started < hedge->max) {
+    ngx_add_timer(ev, hedge->after);
+  }
+  ngx_http_run_posted_requests(c);
+}
+
+static void ngx_mrb_hedge_cleanup(void *data)
+{
+  ngx_mrb_hedge_t *hedge = data;
+
+  if (hedge->timer.timer_set) {
+    ngx_del_timer(&hedge->timer);
+  }
+}
+
+// write_event_handler of the parent while it waits for a hedged answer
+static void ngx_mrb_hedge_wake(ngx_http_request_t *r)
+{
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_mrb_hedge_t *hedge;
+  ngx_mrb_capture_t *cap, *winner = NULL;
+  mrb_state *mrb;
+  mrb_value result;
+  ngx_uint_t i;
+  int ai;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_mruby_module);
+  if (ctx == NULL || ctx->hedge == NULL) {
+    return;
+  }
+  hedge = ctx->hedge;
+
+  // the first answer below 500 wins
+  for (i = 0; i < hedge->started; i++) {
+    cap = &hedge->caps[i];
+    if (cap->done
+        && ngx_mrb_capture_status(cap) < NGX_HTTP_INTERNAL_SERVER_ERROR) {
+      winner = cap;
+      break;
+    }
+  }
+  if (winner == NULL) {
+    if (ctx->captures_pending > 0) {
+      return;
+    }
+    // every attempt so far failed: try the next one at once, or give up
+    // with the last answer
+    if (hedge->started < hedge->max) {
+      ngx_mrb_hedge_start(hedge);
+      return;
+    }
+    winner = &hedge->caps[hedge->started - 1];
+  }
+
+  if (hedge->timer.timer_set) {
+    ngx_del_timer(&hedge->timer);
+  }
+  for (i = 0; i < hedge->started; i++) {
+    cap = &hedge->caps[i];
+    if (!cap->done && cap->sr != NULL) {
+      ngx_mrb_capture_detach(r, cap);
+    }
+  }
+  ctx->hedge = NULL;
+  ctx->captures = NULL;
+  ctx->ncaptures = 0;
+  ctx->captures_pending = 0;
+
+  mrb = ctx->async_state->mrb;
+  ai = mrb_gc_arena_save(mrb);
+  result = ngx_mrb_capture_result(mrb, winner);
+  ngx_mrb_async_resume(ctx, result);
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+// starts specs[0] and one more of specs every after msec while no answer has
+// arrived, the caller then yields
+static mrb_value ngx_mrb_hedge(mrb_state *mrb, mrb_value self)
+{
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_http_request_t *r;
+  ngx_pool_cleanup_t *cln;
+  ngx_mrb_hedge_t *hedge;
+  mrb_value specs;
+  mrb_int after;
+
+  mrb_get_args(mrb, "Ai", &specs, &after);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Subrequest.hedged");
+  r = ctx->r;
+  if (after < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative hedging delay");
+  }
+
+  hedge = ngx_pcalloc(r->pool, sizeof(ngx_mrb_hedge_t));
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (hedge == NULL || cln == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate hedged subrequest");
+  }
+  hedge->reqs = ngx_mrb_capture_parse_all(mrb, ctx, specs, &hedge->caps);
+  hedge->ctx = ctx;
+  hedge->max = RARRAY_LEN(specs);
+  hedge->after = (ngx_msec_t) after;
+  hedge->timer.handler = ngx_mrb_hedge_timer_handler;
+  hedge->timer.data = hedge;
+  hedge->timer.log = r->connection->log;
+  cln->handler = ngx_mrb_hedge_cleanup;
+  cln->data = hedge;
+
+  ctx->hedge = hedge;
+  ctx->captures = hedge->caps;
+  ctx->ncaptures = 0;
+  ctx->captures_pending = 0;
+  ngx_mrb_hedge_start(hedge);
+  if (hedge->started < hedge->max) {
+    ngx_add_timer(&hedge->timer, hedge->after);
+  }
+
+  ctx->async_write_handler = ngx_mrb_hedge_wake;
+  ctx->async_wait = 1;
+
+  return self;
+}
+
+void ngx_mrb_subrequest_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_subrequest;
+
+  class_subrequest = mrb_define_class_under(mrb, class, "Subrequest", mrb->object_class);
+  mrb_define_class_method(mrb, class_subrequest, "_capture", ngx_mrb_capture, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, class_subrequest, "_hedge", ngx_mrb_hedge, MRB_ARGS_REQ(2));
+}
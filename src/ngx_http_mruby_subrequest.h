@@ -0,0 +1,33 @@
+/*
+// ngx_http_mruby_subrequest.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_SUBREQUEST_H
+#define NGX_HTTP_MRUBY_SUBREQUEST_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+typedef struct ngx_mrb_capture_t {
+  ngx_http_request_t *sr;
+  // context of the parent that waits for sr
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_int_t rc;
+  ngx_chain_t *body;
+  ngx_chain_t **last;
+  size_t body_len;
+  // posted when a detached sr ends, see ngx_mrb_capture_detach
+  ngx_event_t release;
+  unsigned done:1;
+  unsigned detached:1;
+} ngx_mrb_capture_t;
+
+// NGX_DECLINED when r is not a captured subrequest
+ngx_int_t ngx_mrb_capture_header_filter(ngx_http_request_t *r);
+ngx_int_t ngx_mrb_capture_body_filter(ngx_http_request_t *r, ngx_chain_t *in);
+
+#endif // NGX_HTTP_MRUBY_SUBREQUEST_H
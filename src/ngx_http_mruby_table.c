@@ -0,0 +1,496 @@
+/*
+// ngx_http_mruby_table.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_table.h"
+
+#include <sys/mman.h>
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::MmapTable, a read only map in a file built with
+// tools/ngx_mruby_table.c: a hash table of string keys, or sorted ranges of
+// addresses or integers (e.g. IP to geo data). The file is mapped shared,
+// so workers read it from the page cache instead of each building a Hash
+// the GC has to mark, and long values are returned as strings pointing
+// into the mapping, without a copy.
+//
+// Tables are kept per worker by path and reloaded like Nginx::BloomFilter:
+// at most once a second a lookup stats the path and swaps in a file renamed
+// over it. Values up to NGX_MRB_TABLE_COPY_MAX bytes are copied, so the old
+// mapping is unmapped at once unless a longer value was handed out from it;
+// strings may still point into it then and it stays mapped until the worker
+// exits. After NGX_MRB_TABLE_RETAIN_MAX such mappings the table copies all
+// values, so the mappings of a worker stay bounded however often the file
+// is rebuilt.
+*/
+
+#define NGX_MRB_TABLE_COPY_MAX         128
+#define NGX_MRB_TABLE_RETAIN_MAX       4
+
+typedef struct {
+  u_char *addr;
+  size_t size;
+  ngx_file_uniq_t uniq;
+  time_t mtime;
+  ngx_uint_t kind;
+  uint64_t count;
+  uint64_t nslots;
+  u_char *index;
+  // a value pointing into the mapping was handed out
+  ngx_uint_t views;
+} ngx_mrb_table_map_t;
+
+typedef struct {
+  ngx_queue_t queue;
+  // NUL terminated
+  ngx_str_t path;
+  ngx_mrb_table_map_t map;
+  time_t checked;
+  // the file last seen at path, which may have been rejected
+  ngx_file_uniq_t uniq;
+  time_t mtime;
+  off_t size;
+  // old mappings kept for values handed out, see NGX_MRB_TABLE_RETAIN_MAX
+  ngx_uint_t retained;
+  ngx_uint_t copy;
+} ngx_mrb_table_t;
+
+// tables live as long as the worker, the objects only point at them
+static const struct mrb_data_type ngx_mrb_table_data_type = {
+  "Nginx::MmapTable", NULL,
+};
+
+static ngx_queue_t ngx_mrb_tables;
+
+static uint64_t ngx_mrb_table_le(u_char *p, ngx_uint_t n)
+{
+  uint64_t v = 0;
+
+  while (n--) {
+    v = (v << 8) | p[n];
+  }
+
+  return v;
+}
+
+// FNV-1a with the murmur3 finalizer; the builder hashes the same way
+static uint64_t ngx_mrb_table_hash(u_char *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+// maps path into m, or returns the reason it can not
+static char *ngx_mrb_table_map(u_char *path, ngx_mrb_table_map_t *m)
+{
+  ngx_file_info_t fi;
+  ngx_fd_t fd;
+  uint64_t off, len;
+  u_char *p;
+  char *err = NULL;
+
+  fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if (fd == NGX_INVALID_FILE) {
+    return ngx_open_file_n " failed";
+  }
+  if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+    ngx_close_file(fd);
+    return ngx_fd_info_n " failed";
+  }
+  if (ngx_file_size(&fi) < NGX_MRB_TABLE_HEADER) {
+    ngx_close_file(fd);
+    return "not a table file";
+  }
+
+  m->size = (size_t) ngx_file_size(&fi);
+  m->uniq = ngx_file_uniq(&fi);
+  m->mtime = ngx_file_mtime(&fi);
+  p = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+  ngx_close_file(fd);
+  if (p == MAP_FAILED) {
+    return "mmap() failed";
+  }
+
+  m->kind = (ngx_uint_t) ngx_mrb_table_le(p + 12, 4);
+  m->count = ngx_mrb_table_le(p + 16, 8);
+  m->nslots = ngx_mrb_table_le(p + 24, 8);
+  off = ngx_mrb_table_le(p + 32, 8);
+  if (m->kind == NGX_MRB_TABLE_HASH) {
+    len = m->nslots * 16;
+  }
+  else {
+    len = m->count * (2 * NGX_MRB_TABLE_KEY + 8);
+  }
+
+  if (ngx_memcmp(p, NGX_MRB_TABLE_MAGIC, 8) != 0) {
+    err = "not a table file";
+  }
+  else if (ngx_mrb_table_le(p + 8, 4) != NGX_MRB_TABLE_VERSION) {
+    err = "unsupported table version";
+  }
+  else if (m->kind != NGX_MRB_TABLE_HASH && m->kind != NGX_MRB_TABLE_RANGE) {
+    err = "unknown table kind";
+  }
+  else if ((m->kind == NGX_MRB_TABLE_HASH
+            && (m->nslots <= m->count || (m->nslots & (m->nslots - 1))))
+           || m->count > m->size || m->nslots > m->size
+           || off % 8 || off < NGX_MRB_TABLE_HEADER || off > m->size
+           || len > m->size - off) {
+    err = "truncated or corrupt table file";
+  }
+  if (err != NULL) {
+    munmap(p, m->size);
+    return err;
+  }
+  m->addr = p;
+  m->index = p + off;
+  m->views = 0;
+
+  return NULL;
+}
+
+// swaps in the file renamed over the path of t, at most once a second
+static void ngx_mrb_table_check(ngx_mrb_table_t *t)
+{
+  ngx_mrb_table_map_t m;
+  ngx_file_info_t fi;
+  char *err;
+
+  if (t->checked == ngx_time()) {
+    return;
+  }
+  t->checked = ngx_time();
+
+  if (ngx_file_info(t->path.data, &fi) == NGX_FILE_ERROR
+      || (ngx_file_uniq(&fi) == t->uniq
+          && ngx_file_mtime(&fi) == t->mtime
+          && ngx_file_size(&fi) == t->size)) {
+    return;
+  }
+  // not again until the file changes once more, whether it loads or not
+  t->uniq = ngx_file_uniq(&fi);
+  t->mtime = ngx_file_mtime(&fi);
+  t->size = ngx_file_size(&fi);
+
+  err = ngx_mrb_table_map(t->path.data, &m);
+  if (err != NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0
+      , "%s ERROR %s:%d: %s, keeping the table loaded from \"%V\""
+      , MODULE_NAME
+      , __func__
+      , __LINE__
+      , err
+      , &t->path
+    );
+    return;
+  }
+
+  if (!t->map.views) {
+    munmap(t->map.addr, t->map.size);
+  }
+  else if (++t->retained == NGX_MRB_TABLE_RETAIN_MAX) {
+    t->copy = 1;
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0
+      , "%s WARN %s:%d: %ui old mappings of table \"%V\" kept for values"
+        " handed out, copying all values from now on"
+      , MODULE_NAME
+      , __func__
+      , __LINE__
+      , t->retained
+      , &t->path
+    );
+  }
+  t->map = m;
+  ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0
+    , "%s NOTICE %s:%d: reloaded table \"%V\""
+    , MODULE_NAME
+    , __func__
+    , __LINE__
+    , &t->path
+  );
+}
+
+static ngx_mrb_table_t *ngx_mrb_table_get(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_table_t *t;
+
+  t = mrb_data_get_ptr(mrb, self, &ngx_mrb_table_data_type);
+  if (t == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::MmapTable");
+  }
+
+  return t;
+}
+
+static void ngx_mrb_table_corrupt(mrb_state *mrb, ngx_mrb_table_t *t)
+{
+  mrb_raisef(mrb, ngx_mrb_ud(mrb)->table_error_class, "corrupt table file %S",
+      mrb_str_new(mrb, (char *) t->path.data, t->path.len));
+}
+
+// the value of the record at off, a string pointing into the mapping
+// unless it is short enough to copy
+static mrb_value ngx_mrb_table_value(mrb_state *mrb, ngx_mrb_table_t *t,
+    uint64_t off, size_t klen)
+{
+  uint64_t vlen;
+  char *v;
+
+  vlen = ngx_mrb_table_le(t->map.addr + off + 4, 4);
+  if (vlen > t->map.size - off - 8 - klen) {
+    ngx_mrb_table_corrupt(mrb, t);
+  }
+  v = (char *) t->map.addr + off + 8 + klen;
+
+  if (vlen <= NGX_MRB_TABLE_COPY_MAX || t->copy) {
+    return mrb_str_new(mrb, v, (size_t) vlen);
+  }
+  t->map.views = 1;
+
+  return mrb_str_new_static(mrb, v, (size_t) vlen);
+}
+
+static mrb_value ngx_mrb_table_hash_get(mrb_state *mrb, ngx_mrb_table_t *t,
+    mrb_value key)
+{
+  uint64_t h, i, n, mask, off;
+  u_char *slot, *rec;
+  size_t len;
+
+  if (!mrb_string_p(key)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "key of a hash table must be a String");
+  }
+  len = RSTRING_LEN(key);
+  h = ngx_mrb_table_hash((u_char *) RSTRING_PTR(key), len);
+  mask = t->map.nslots - 1;
+
+  // the builder leaves more than half of the slots empty
+  for (i = h & mask, n = 0; n < t->map.nslots; i = (i + 1) & mask, n++) {
+    slot = t->map.index + i * 16;
+    off = ngx_mrb_table_le(slot + 8, 8);
+    if (off == 0) {
+      return mrb_nil_value();
+    }
+    if (ngx_mrb_table_le(slot, 8) != h) {
+      continue;
+    }
+    if (off > t->map.size - 8) {
+      break;
+    }
+    rec = t->map.addr + off;
+    if (ngx_mrb_table_le(rec, 4) == len && len <= t->map.size - off - 8
+        && ngx_memcmp(rec + 8, RSTRING_PTR(key), len) == 0) {
+      return ngx_mrb_table_value(mrb, t, off, len);
+    }
+  }
+
+  ngx_mrb_table_corrupt(mrb, t);
+
+  return mrb_nil_value();
+}
+
+// an address or a non negative Integer as a range key
+static ngx_int_t ngx_mrb_table_range_key(mrb_state *mrb, mrb_value key,
+    u_char *k)
+{
+  in_addr_t a;
+  mrb_int n;
+  ngx_uint_t i;
+
+  ngx_memzero(k, NGX_MRB_TABLE_KEY);
+  if (mrb_fixnum_p(key)) {
+    n = mrb_fixnum(key);
+    if (n < 0) {
+      return NGX_ERROR;
+    }
+    for (i = NGX_MRB_TABLE_KEY; i > 8; i--, n >>= 8) {
+      k[i - 1] = (u_char) (n & 0xff);
+    }
+    return NGX_OK;
+  }
+  if (!mrb_string_p(key)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "key of a range table must be an address"
+        " or an Integer");
+  }
+
+  a = ngx_inet_addr((u_char *) RSTRING_PTR(key), RSTRING_LEN(key));
+  if (a != INADDR_NONE) {
+    k[10] = 0xff;
+    k[11] = 0xff;
+    ngx_memcpy(k + 12, &a, 4);
+    return NGX_OK;
+  }
+#if (NGX_HAVE_INET6)
+  return ngx_inet6_addr((u_char *) RSTRING_PTR(key), RSTRING_LEN(key), k);
+#else
+  return NGX_ERROR;
+#endif
+}
+
+static mrb_value ngx_mrb_table_range_get(mrb_state *mrb, ngx_mrb_table_t *t,
+    mrb_value key)
+{
+  u_char k[NGX_MRB_TABLE_KEY], *starts, *ends;
+  uint64_t lo, hi, mid, off;
+
+  if (ngx_mrb_table_range_key(mrb, key, k) != NGX_OK) {
+    return mrb_nil_value();
+  }
+
+  // the last range starting at or before k
+  starts = t->map.index;
+  lo = 0;
+  hi = t->map.count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ngx_memcmp(starts + mid * NGX_MRB_TABLE_KEY, k,
+          NGX_MRB_TABLE_KEY) <= 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return mrb_nil_value();
+  }
+  lo--;
+
+  ends = starts + t->map.count * NGX_MRB_TABLE_KEY;
+  if (ngx_memcmp(k, ends + lo * NGX_MRB_TABLE_KEY, NGX_MRB_TABLE_KEY) > 0) {
+    return mrb_nil_value();
+  }
+  off = ngx_mrb_table_le(ends + t->map.count * NGX_MRB_TABLE_KEY + lo * 8, 8);
+  if (off > t->map.size - 8) {
+    ngx_mrb_table_corrupt(mrb, t);
+  }
+
+  return ngx_mrb_table_value(mrb, t, off, 0);
+}
+
+// Nginx::MmapTable.open(path), the same table for the same path
+static mrb_value ngx_mrb_table_open(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_table_map_t m;
+  ngx_mrb_table_t *t;
+  ngx_queue_t *q;
+  mrb_value path;
+  char *err;
+
+  mrb_get_args(mrb, "S", &path);
+  if (ngx_mrb_tables.next == NULL) {
+    ngx_queue_init(&ngx_mrb_tables);
+  }
+
+  for (q = ngx_queue_head(&ngx_mrb_tables);
+       q != ngx_queue_sentinel(&ngx_mrb_tables);
+       q = ngx_queue_next(q)) {
+    t = ngx_queue_data(q, ngx_mrb_table_t, queue);
+    if (t->path.len == (size_t) RSTRING_LEN(path)
+        && ngx_strncmp(t->path.data, RSTRING_PTR(path), t->path.len) == 0) {
+      ngx_mrb_table_check(t);
+      goto found;
+    }
+  }
+
+  t = ngx_calloc(sizeof(ngx_mrb_table_t) + RSTRING_LEN(path) + 1,
+      ngx_cycle->log);
+  if (t == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::MmapTable");
+  }
+  t->path.data = (u_char *) (t + 1);
+  t->path.len = RSTRING_LEN(path);
+  ngx_memcpy(t->path.data, RSTRING_PTR(path), t->path.len);
+
+  err = ngx_mrb_table_map(t->path.data, &m);
+  if (err != NULL) {
+    ngx_free(t);
+    mrb_raisef(mrb, ngx_mrb_ud(mrb)->table_error_class, "%S: %S",
+        mrb_str_new_cstr(mrb, err), path);
+  }
+  t->map = m;
+  t->uniq = m.uniq;
+  t->mtime = m.mtime;
+  t->size = (off_t) m.size;
+  t->checked = ngx_time();
+  ngx_queue_insert_tail(&ngx_mrb_tables, &t->queue);
+
+found:
+
+  return mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_ptr(self), t,
+        &ngx_mrb_table_data_type));
+}
+
+// [](key): the value String, or nil; range tables take an address or an
+// Integer
+static mrb_value ngx_mrb_table_aref(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_table_t *t = ngx_mrb_table_get(mrb, self);
+  mrb_value key;
+
+  mrb_get_args(mrb, "o", &key);
+  ngx_mrb_table_check(t);
+
+  if (t->map.kind == NGX_MRB_TABLE_HASH) {
+    return ngx_mrb_table_hash_get(mrb, t, key);
+  }
+
+  return ngx_mrb_table_range_get(mrb, t, key);
+}
+
+static mrb_value ngx_mrb_table_size(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_table_t *t = ngx_mrb_table_get(mrb, self);
+
+  ngx_mrb_table_check(t);
+
+  return mrb_fixnum_value((mrb_int) t->map.count);
+}
+
+static mrb_value ngx_mrb_table_range_p(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_table_t *t = ngx_mrb_table_get(mrb, self);
+
+  return mrb_bool_value(t->map.kind == NGX_MRB_TABLE_RANGE);
+}
+
+static mrb_value ngx_mrb_table_path(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_table_t *t = ngx_mrb_table_get(mrb, self);
+
+  return mrb_str_new(mrb, (char *) t->path.data, t->path.len);
+}
+
+void ngx_mrb_table_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_table;
+
+  class_table = mrb_define_class_under(mrb, class, "MmapTable", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_table, MRB_TT_DATA);
+  mrb_define_class_under(mrb, class_table, "Error", mrb->eStandardError_class);
+
+  mrb_define_class_method(mrb, class_table, "open", ngx_mrb_table_open, MRB_ARGS_REQ(1));
+  mrb_undef_class_method(mrb, class_table, "new");
+  mrb_define_method(mrb, class_table, "[]", ngx_mrb_table_aref, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_table, "size", ngx_mrb_table_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_table, "range?", ngx_mrb_table_range_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_table, "path", ngx_mrb_table_path, MRB_ARGS_NONE());
+}
@@ -0,0 +1,41 @@
+/*
+// ngx_http_mruby_table.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_TABLE_H
+#define NGX_HTTP_MRUBY_TABLE_H
+
+#include <ngx_http.h>
+#include <mruby.h>
+#include "ngx_http_mruby_module.h"
+#include "ngx_http_mruby_core.h"
+
+/*
+// the file format, written by tools/ngx_mruby_table.c; numbers are little
+// endian, offsets are from the start of the file
+//
+//   0  "NGXTABLE"
+//   8  version, 32 bit
+//  12  kind, 32 bit
+//  16  number of records, 64 bit
+//  24  number of index slots, 64 bit
+//  32  offset of the index, 64 bit and a multiple of 8
+//
+// then records of a 32 bit key length, a 32 bit value length, the key and
+// the value. The index of a hash table is a power of two slots of a 64 bit
+// key hash and the 64 bit offset of the record, 0 for an empty slot,
+// probed linearly. The index of a range table is the start keys of the
+// ranges in order, their end keys and the offsets of their records, which
+// have no key. Range keys are 16 bytes big endian: IPv6 addresses, IPv4
+// ones mapped to ::ffff:0:0/96 and integers in the last 8 bytes.
+*/
+#define NGX_MRB_TABLE_MAGIC            "NGXTABLE"
+#define NGX_MRB_TABLE_VERSION          1
+#define NGX_MRB_TABLE_HEADER           64
+#define NGX_MRB_TABLE_HASH             1
+#define NGX_MRB_TABLE_RANGE            2
+#define NGX_MRB_TABLE_KEY              16
+
+#endif // NGX_HTTP_MRUBY_TABLE_H
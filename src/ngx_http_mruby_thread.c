@@ -0,0 +1,576 @@
+/*
+// ngx_http_mruby_thread.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_thread.h"
+
+/*
+// mruby_thread_pool runs the content handler of a location on an nginx
+// thread pool, for handlers that burn CPU or block. Request data is not safe
+// to touch from a pool thread, so the handler works on a copy: its script
+// evaluates to an object responding to call, which gets an env Hash
+// ("method", "uri", "args", "headers", "body") and returns a String or
+// [status, headers, body]. The Nginx bindings are not available there.
+// Every pool thread compiles the script into its own mrb_state on first use
+// (an irep can not be shared between states) and keeps the handler object,
+// or the error of a script that failed, so it is compiled once per thread.
+// The response is sent on the event loop by ngx_mrb_thread_done; until then
+// the request is blocked, so nginx does not free it under the thread when
+// the client goes away.
+*/
+
+#if (NGX_HTTP_MRUBY_THREADS)
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+#include <mruby/compile.h>
+#include <mruby/variable.h>
+
+#define NGX_MRB_THREAD_ERROR_LEN 256
+// global of the thread mrb_states that keeps the handler objects alive
+#define NGX_MRB_THREAD_ROOTS "$_ngx_mrb_thread_handlers"
+
+typedef struct ngx_mrb_thread_handler_t {
+  ngx_mrb_code_t *code;
+  mrb_value handler;
+  // of a script that failed to compile or run, handler is nil then
+  u_char error[NGX_MRB_THREAD_ERROR_LEN];
+  size_t error_len;
+  struct ngx_mrb_thread_handler_t *next;
+} ngx_mrb_thread_handler_t;
+
+typedef struct {
+  mrb_state *mrb;
+  ngx_mrb_thread_handler_t *handlers;
+} ngx_mrb_thread_state_t;
+
+typedef struct {
+  ngx_http_request_t *r;
+  ngx_mrb_code_t *code;
+
+  // copied from r before the task is posted
+  ngx_str_t method;
+  ngx_str_t uri;
+  ngx_str_t args;
+  ngx_array_t headers_in;
+  ngx_str_t body;
+
+  // set by the thread, headers_out and out point into mem
+  u_char *mem;
+  ngx_int_t status;
+  ngx_keyval_t *headers_out;
+  ngx_uint_t nheaders_out;
+  ngx_str_t out;
+  u_char error[NGX_MRB_THREAD_ERROR_LEN];
+  size_t error_len;
+} ngx_mrb_thread_ctx_t;
+
+static pthread_key_t ngx_mrb_thread_key;
+static pthread_once_t ngx_mrb_thread_once = PTHREAD_ONCE_INIT;
+static int ngx_mrb_thread_key_err;
+
+static void ngx_mrb_thread_state_free(void *data)
+{
+  ngx_mrb_thread_state_t *ts = data;
+  ngx_mrb_thread_handler_t *h, *next;
+
+  for (h = ts->handlers; h != NULL; h = next) {
+    next = h->next;
+    ngx_free(h);
+  }
+  mrb_close(ts->mrb);
+  ngx_free(ts);
+}
+
+static void ngx_mrb_thread_key_init(void)
+{
+  ngx_mrb_thread_key_err = pthread_key_create(&ngx_mrb_thread_key,
+      ngx_mrb_thread_state_free);
+}
+
+// the mrb_state of the calling pool thread, closed when the thread exits
+static ngx_mrb_thread_state_t *ngx_mrb_thread_state(ngx_log_t *log)
+{
+  ngx_mrb_thread_state_t *ts;
+
+  pthread_once(&ngx_mrb_thread_once, ngx_mrb_thread_key_init);
+  if (ngx_mrb_thread_key_err != 0) {
+    return NULL;
+  }
+  ts = pthread_getspecific(ngx_mrb_thread_key);
+  if (ts != NULL) {
+    return ts;
+  }
+
+  ts = ngx_alloc(sizeof(ngx_mrb_thread_state_t), log);
+  if (ts == NULL) {
+    return NULL;
+  }
+  ts->handlers = NULL;
+  ts->mrb = mrb_open();
+  if (ts->mrb == NULL) {
+    ngx_free(ts);
+    return NULL;
+  }
+  mrb_gv_set(ts->mrb, mrb_intern_lit(ts->mrb, NGX_MRB_THREAD_ROOTS),
+      mrb_ary_new(ts->mrb));
+  if (pthread_setspecific(ngx_mrb_thread_key, ts) != 0) {
+    ngx_mrb_thread_state_free(ts);
+    return NULL;
+  }
+
+  return ts;
+}
+
+static void ngx_mrb_thread_exc(mrb_state *mrb, ngx_mrb_thread_ctx_t *t)
+{
+  mrb_value exc = mrb_obj_value(mrb->exc);
+  mrb_value msg;
+
+  mrb->exc = 0;
+  msg = mrb_inspect(mrb, exc);
+  if (mrb->exc) {
+    mrb->exc = 0;
+    msg = mrb_str_new_lit(mrb, "exception");
+  }
+  t->error_len = ngx_min((size_t) RSTRING_LEN(msg), NGX_MRB_THREAD_ERROR_LEN);
+  ngx_memcpy(t->error, RSTRING_PTR(msg), t->error_len);
+}
+
+static mrb_value ngx_mrb_thread_compile(mrb_state *mrb, ngx_mrb_code_t *code,
+    ngx_mrb_thread_ctx_t *t)
+{
+  struct mrb_parser_state *p;
+  struct RProc *proc = NULL;
+  mrbc_context *c;
+  mrb_value handler;
+  FILE *fp = NULL;
+
+  if (code->code_type == NGX_MRB_CODE_TYPE_FILE
+      && (fp = fopen(code->code.file, "r")) == NULL) {
+    t->error_len = ngx_snprintf(t->error, NGX_MRB_THREAD_ERROR_LEN,
+        "mrb_file(%s) open failed", code->code.file) - t->error;
+    return mrb_nil_value();
+  }
+  c = mrbc_context_new(mrb);
+  mrbc_filename(mrb, c, fp ? code->code.file : "INLINE CODE");
+  if (fp) {
+    p = mrb_parse_file(mrb, fp, c);
+    fclose(fp);
+  }
+  else {
+    p = mrb_parse_string(mrb, code->code.string, c);
+  }
+  if (p != NULL) {
+    if (p->nerr == 0) {
+      proc = mrb_generate_code(mrb, p);
+    }
+    mrb_pool_close(p->pool);
+  }
+  mrbc_context_free(mrb, c);
+  if (proc == NULL) {
+    t->error_len = ngx_snprintf(t->error, NGX_MRB_THREAD_ERROR_LEN,
+        "failed to compile handler script") - t->error;
+    return mrb_nil_value();
+  }
+
+  handler = mrb_run(mrb, proc, mrb_top_self(mrb));
+  if (mrb->exc) {
+    ngx_mrb_thread_exc(mrb, t);
+    return mrb_nil_value();
+  }
+  if (!mrb_respond_to(mrb, handler, mrb_intern_lit(mrb, "call"))) {
+    t->error_len = ngx_snprintf(t->error, NGX_MRB_THREAD_ERROR_LEN,
+        "handler script must return an object responding to call")
+      - t->error;
+    return mrb_nil_value();
+  }
+
+  return handler;
+}
+
+// the handler of t->code in this thread, compiled on first use
+static mrb_value ngx_mrb_thread_handler_get(ngx_mrb_thread_state_t *ts,
+    ngx_mrb_thread_ctx_t *t, ngx_log_t *log)
+{
+  mrb_state *mrb = ts->mrb;
+  ngx_mrb_thread_handler_t *h;
+
+  for (h = ts->handlers; h != NULL; h = h->next) {
+    if (h->code == t->code) {
+      goto found;
+    }
+  }
+
+  h = ngx_alloc(sizeof(ngx_mrb_thread_handler_t), log);
+  if (h == NULL) {
+    t->error_len = ngx_snprintf(t->error, NGX_MRB_THREAD_ERROR_LEN,
+        "failed to allocate handler") - t->error;
+    return mrb_nil_value();
+  }
+  h->code = t->code;
+  h->handler = ngx_mrb_thread_compile(mrb, t->code, t);
+  h->error_len = t->error_len;
+  ngx_memcpy(h->error, t->error, t->error_len);
+  if (!mrb_nil_p(h->handler)) {
+    mrb_ary_push(mrb, mrb_gv_get(mrb,
+          mrb_intern_lit(mrb, NGX_MRB_THREAD_ROOTS)), h->handler);
+  }
+  h->next = ts->handlers;
+  ts->handlers = h;
+
+found:
+
+  t->error_len = h->error_len;
+  ngx_memcpy(t->error, h->error, h->error_len);
+
+  return h->handler;
+}
+
+// res is [status, [[name, value], ...], body], see Kernel#_ngx_mrb_thread_call
+static void ngx_mrb_thread_result(mrb_state *mrb, mrb_value res,
+    ngx_mrb_thread_ctx_t *t, ngx_log_t *log)
+{
+  mrb_value headers, body, k, v;
+  mrb_int i, n;
+  size_t size;
+  u_char *p;
+
+  t->status = mrb_fixnum(mrb_ary_ref(mrb, res, 0));
+  if (t->status < 100 || t->status > 999) {
+    t->error_len = ngx_snprintf(t->error, NGX_MRB_THREAD_ERROR_LEN,
+        "invalid status %i", t->status) - t->error;
+    return;
+  }
+  headers = mrb_ary_ref(mrb, res, 1);
+  body = mrb_ary_ref(mrb, res, 2);
+
+  n = RARRAY_LEN(headers);
+  size = n * sizeof(ngx_keyval_t) + RSTRING_LEN(body) + 1;
+  for (i = 0; i < n; i++) {
+    k = mrb_ary_ref(mrb, mrb_ary_ref(mrb, headers, i), 0);
+    v = mrb_ary_ref(mrb, mrb_ary_ref(mrb, headers, i), 1);
+    size += RSTRING_LEN(k) + RSTRING_LEN(v);
+  }
+  t->mem = ngx_alloc(size, log);
+  if (t->mem == NULL) {
+    t->error_len = ngx_snprintf(t->error, NGX_MRB_THREAD_ERROR_LEN,
+        "failed to allocate response") - t->error;
+    return;
+  }
+
+  t->headers_out = (ngx_keyval_t *) t->mem;
+  t->nheaders_out = n;
+  p = t->mem + n * sizeof(ngx_keyval_t);
+  for (i = 0; i < n; i++) {
+    k = mrb_ary_ref(mrb, mrb_ary_ref(mrb, headers, i), 0);
+    v = mrb_ary_ref(mrb, mrb_ary_ref(mrb, headers, i), 1);
+    t->headers_out[i].key.data = p;
+    t->headers_out[i].key.len = RSTRING_LEN(k);
+    p = ngx_cpymem(p, RSTRING_PTR(k), RSTRING_LEN(k));
+    t->headers_out[i].value.data = p;
+    t->headers_out[i].value.len = RSTRING_LEN(v);
+    p = ngx_cpymem(p, RSTRING_PTR(v), RSTRING_LEN(v));
+  }
+  t->out.data = p;
+  t->out.len = RSTRING_LEN(body);
+  ngx_memcpy(p, RSTRING_PTR(body), t->out.len);
+}
+
+static void ngx_mrb_thread_env_set(mrb_state *mrb, mrb_value env,
+    const char *key, ngx_str_t *value)
+{
+  mrb_hash_set(mrb, env, mrb_str_new_cstr(mrb, key),
+      mrb_str_new(mrb, (char *) value->data, value->len));
+}
+
+// runs in a pool thread
+static void ngx_mrb_thread_task_handler(void *data, ngx_log_t *log)
+{
+  ngx_mrb_thread_ctx_t *t = data;
+  ngx_mrb_thread_state_t *ts;
+  ngx_keyval_t *kv;
+  ngx_uint_t i;
+  mrb_state *mrb;
+  mrb_value handler, env, headers, args[2], res;
+  int ai;
+
+  ts = ngx_mrb_thread_state(log);
+  if (ts == NULL) {
+    t->error_len = ngx_snprintf(t->error, NGX_MRB_THREAD_ERROR_LEN,
+        "failed to create mrb_state") - t->error;
+    return;
+  }
+  mrb = ts->mrb;
+  ai = mrb_gc_arena_save(mrb);
+
+  handler = ngx_mrb_thread_handler_get(ts, t, log);
+  if (t->error_len == 0) {
+    env = mrb_hash_new(mrb);
+    ngx_mrb_thread_env_set(mrb, env, "method", &t->method);
+    ngx_mrb_thread_env_set(mrb, env, "uri", &t->uri);
+    ngx_mrb_thread_env_set(mrb, env, "args", &t->args);
+    ngx_mrb_thread_env_set(mrb, env, "body", &t->body);
+    headers = mrb_hash_new(mrb);
+    kv = t->headers_in.elts;
+    for (i = 0; i < t->headers_in.nelts; i++) {
+      mrb_hash_set(mrb, headers,
+          mrb_str_new(mrb, (char *) kv[i].key.data, kv[i].key.len),
+          mrb_str_new(mrb, (char *) kv[i].value.data, kv[i].value.len));
+    }
+    mrb_hash_set(mrb, env, mrb_str_new_lit(mrb, "headers"), headers);
+
+    args[0] = handler;
+    args[1] = env;
+    res = mrb_funcall_argv(mrb, mrb_top_self(mrb),
+        mrb_intern_lit(mrb, "_ngx_mrb_thread_call"), 2, args);
+    if (mrb->exc) {
+      ngx_mrb_thread_exc(mrb, t);
+    }
+    else {
+      ngx_mrb_thread_result(mrb, res, t, log);
+    }
+  }
+
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+// bodies buffered to a temporary file are not passed, the handler sees the
+// part kept in memory (see client_body_buffer_size)
+static ngx_int_t ngx_mrb_thread_copy_request(ngx_http_request_t *r,
+    ngx_mrb_thread_ctx_t *t)
+{
+  ngx_list_part_t *part;
+  ngx_table_elt_t *h;
+  ngx_keyval_t *kv;
+  ngx_chain_t *cl;
+  ngx_uint_t i;
+  size_t len = 0;
+  u_char *p;
+
+  t->method = r->method_name;
+  t->uri = r->uri;
+  t->args = r->args;
+
+  if (ngx_array_init(&t->headers_in, r->pool, 8, sizeof(ngx_keyval_t))
+      != NGX_OK) {
+    return NGX_ERROR;
+  }
+  part = &r->headers_in.headers.part;
+  h = part->elts;
+  for (i = 0; /* void */; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL) {
+        break;
+      }
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+    kv = ngx_array_push(&t->headers_in);
+    if (kv == NULL) {
+      return NGX_ERROR;
+    }
+    kv->key = h[i].key;
+    kv->value = h[i].value;
+  }
+
+  if (r->request_body == NULL) {
+    return NGX_OK;
+  }
+  for (cl = r->request_body->bufs; cl != NULL; cl = cl->next) {
+    if (ngx_buf_in_memory(cl->buf)) {
+      len += cl->buf->last - cl->buf->pos;
+    }
+  }
+  if (len == 0) {
+    return NGX_OK;
+  }
+  p = ngx_pnalloc(r->pool, len);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+  t->body.data = p;
+  t->body.len = len;
+  for (cl = r->request_body->bufs; cl != NULL; cl = cl->next) {
+    if (ngx_buf_in_memory(cl->buf)) {
+      p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_mrb_thread_send(ngx_http_request_t *r,
+    ngx_mrb_thread_ctx_t *t)
+{
+  ngx_table_elt_t *h;
+  ngx_keyval_t *kv;
+  ngx_chain_t out;
+  ngx_buf_t *b;
+  ngx_uint_t i;
+  ngx_int_t rc;
+
+  if (t->error_len) {
+    ngx_log_error(NGX_LOG_ERR
+      , r->connection->log
+      , 0
+      , "%s ERROR %s:%d: thread pool handler failed: %*s"
+      , MODULE_NAME
+      , __func__
+      , __LINE__
+      , t->error_len
+      , t->error
+    );
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  r->headers_out.status = t->status;
+  r->headers_out.content_length_n = t->out.len;
+  kv = t->headers_out;
+  for (i = 0; i < t->nheaders_out; i++) {
+    if (kv[i].key.len == sizeof("Content-Type") - 1
+        && ngx_strncasecmp(kv[i].key.data, (u_char *) "Content-Type",
+          kv[i].key.len) == 0) {
+      r->headers_out.content_type.data = ngx_pstrdup(r->pool, &kv[i].value);
+      if (r->headers_out.content_type.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      r->headers_out.content_type.len = kv[i].value.len;
+      r->headers_out.content_type_len = kv[i].value.len;
+      continue;
+    }
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    h->hash = 1;
+    h->key.len = kv[i].key.len;
+    h->key.data = ngx_pstrdup(r->pool, &kv[i].key);
+    h->value.len = kv[i].value.len;
+    h->value.data = ngx_pstrdup(r->pool, &kv[i].value);
+    if (h->key.data == NULL || h->value.data == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
+  if (r->headers_out.content_type.len == 0
+      && ngx_http_set_content_type(r) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if (t->out.len == 0) {
+    r->header_only = 1;
+  }
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  b = ngx_create_temp_buf(r->pool, t->out.len);
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+  b->last = ngx_cpymem(b->pos, t->out.data, t->out.len);
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  out.buf = b;
+  out.next = NULL;
+
+  return ngx_http_output_filter(r, &out);
+}
+
+// completion event of the task, back on the event loop
+static void ngx_mrb_thread_done(ngx_event_t *ev)
+{
+  ngx_mrb_thread_ctx_t *t = ev->data;
+  ngx_http_request_t *r = t->r;
+  ngx_connection_t *c = r->connection;
+  ngx_int_t rc;
+
+  ngx_http_set_log_request(c->log, r);
+  r->main->blocked--;
+  r->aio = 0;
+
+  rc = ngx_mrb_thread_send(r, t);
+  if (t->mem != NULL) {
+    ngx_free(t->mem);
+    t->mem = NULL;
+  }
+  ngx_http_finalize_request(r, rc);
+  ngx_http_run_posted_requests(c);
+}
+
+// called once the request body has been read
+static void ngx_mrb_thread_post(ngx_http_request_t *r)
+{
+  ngx_http_mruby_loc_conf_t *mlcf = ngx_http_get_module_loc_conf(r,
+      ngx_http_mruby_module);
+  ngx_thread_task_t *task;
+  ngx_mrb_thread_ctx_t *t;
+
+  task = ngx_thread_task_alloc(r->pool, sizeof(ngx_mrb_thread_ctx_t));
+  if (task == NULL) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+  t = task->ctx;
+  t->r = r;
+  t->code = mlcf->content_code;
+  if (ngx_mrb_thread_copy_request(r, t) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  task->handler = ngx_mrb_thread_task_handler;
+  task->event.handler = ngx_mrb_thread_done;
+  task->event.data = t;
+  if (ngx_thread_task_post(mlcf->thread_pool, task) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  // the thread uses r and its pool until ngx_mrb_thread_done
+  r->main->blocked++;
+  r->aio = 1;
+}
+
+ngx_int_t ngx_http_mruby_thread_handler(ngx_http_request_t *r)
+{
+  ngx_int_t rc;
+
+  rc = ngx_http_read_client_request_body(r, ngx_mrb_thread_post);
+  if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+
+  return NGX_DONE;
+}
+
+#endif
+
+char *ngx_http_mruby_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+#if (NGX_HTTP_MRUBY_THREADS)
+  ngx_http_mruby_loc_conf_t *mlcf = conf;
+  ngx_str_t *value;
+
+  if (mlcf->thread_pool != NGX_CONF_UNSET_PTR) {
+    return "is duplicated";
+  }
+
+  value = cf->args->elts;
+  mlcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+  if (mlcf->thread_pool == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+#else
+  return "requires nginx 1.7.11 or later built with --with-threads";
+#endif
+}
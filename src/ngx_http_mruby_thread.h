@@ -0,0 +1,21 @@
+/*
+// ngx_http_mruby_thread.h - ngx_mruby mruby module header
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#ifndef NGX_HTTP_MRUBY_THREAD_H
+#define NGX_HTTP_MRUBY_THREAD_H
+
+#include <ngx_http.h>
+#include "ngx_http_mruby_module.h"
+
+char *ngx_http_mruby_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+#if (NGX_HTTP_MRUBY_THREADS)
+// runs mruby_content_handler of the location on its mruby_thread_pool
+ngx_int_t ngx_http_mruby_thread_handler(ngx_http_request_t *r);
+#endif
+
+#endif // NGX_HTTP_MRUBY_THREAD_H
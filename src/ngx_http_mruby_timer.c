@@ -0,0 +1,183 @@
+/*
+// ngx_http_mruby_timer.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_timer.h"
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/variable.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::Timer runs a block on an nginx timer of the worker, outside of any
+// request: once (Nginx::Timer.at) or every interval msec (Nginx::Timer.every)
+// until cancelled. The Timer object is kept alive while it is pending, so the
+// caller need not hold on to it. The block runs in the mrb_state that created
+// the timer and can not suspend; exceptions are logged and a repeating timer
+// keeps running. Repeating timers stop when the worker is shutting down.
+*/
+
+typedef struct {
+  mrb_state *mrb;
+  ngx_event_t ev;
+  // 0 for a timer that runs once
+  ngx_msec_t interval;
+  mrb_value self;
+  unsigned active:1;
+  unsigned running:1;
+} ngx_mrb_timer_t;
+
+static void ngx_mrb_timer_free(mrb_state *mrb, void *data);
+
+static const struct mrb_data_type ngx_mrb_timer_data_type = {
+  "Nginx::Timer", ngx_mrb_timer_free,
+};
+
+static void ngx_mrb_timer_free(mrb_state *mrb, void *data)
+{
+  ngx_mrb_timer_t *t = data;
+
+  // only reached for a pending timer when its mrb_state is closed
+  if (t->ev.timer_set) {
+    ngx_del_timer(&t->ev);
+  }
+  ngx_free(t);
+}
+
+static void ngx_mrb_timer_handler(ngx_event_t *ev)
+{
+  ngx_mrb_timer_t *t = ev->data;
+  mrb_state *mrb = t->mrb;
+  ngx_mrb_ud_t *ud = ngx_mrb_ud(mrb);
+  ngx_http_mruby_ctx_t *prev_ctx;
+  mrb_value block;
+  int ai;
+
+  ai = mrb_gc_arena_save(mrb);
+  if (t->interval == 0 || ngx_exiting) {
+    t->active = 0;
+  }
+
+  block = mrb_iv_get(mrb, t->self, mrb_intern_lit(mrb, "@block"));
+  prev_ctx = ud->ctx;
+  ud->ctx = NULL;
+  t->running = 1;
+  mrb_funcall_argv(mrb, block, ud->call_sym, 0, NULL);
+  t->running = 0;
+  ud->ctx = prev_ctx;
+  if (mrb->exc) {
+    ngx_mrb_raise_cycle_error(mrb, mrb_obj_value(mrb->exc),
+        (ngx_cycle_t *) ngx_cycle);
+    mrb->exc = 0;
+  }
+  mrb_gc_arena_restore(mrb, ai);
+
+  // the block may have cancelled the timer
+  if (t->active) {
+    ngx_add_timer(ev, t->interval);
+    return;
+  }
+  // lets the Timer, and with it t, be collected
+  ngx_mrb_gc_unregister(mrb, t->self);
+}
+
+static ngx_mrb_timer_t *ngx_mrb_timer_get(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_timer_t *t;
+
+  t = mrb_data_get_ptr(mrb, self, &ngx_mrb_timer_data_type);
+  if (t == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::Timer");
+  }
+
+  return t;
+}
+
+// initialize(delay, interval, block), see Nginx::Timer.at and .every
+static mrb_value ngx_mrb_timer_init(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_timer_t *t;
+  mrb_int delay, interval;
+  mrb_value block;
+
+  mrb_get_args(mrb, "iio", &delay, &interval, &block);
+  if (delay < 0 || interval < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative timer delay");
+  }
+  if (!mrb_respond_to(mrb, block, ngx_mrb_ud(mrb)->call_sym)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "timer block required");
+  }
+  // there is no event loop before ngx_event_process_init, e.g. in mruby_init
+  if (ngx_cycle->connections == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::Timer is only available in"
+        " workers, see mruby_init_worker");
+  }
+  if (DATA_PTR(self) != NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::Timer already initialized");
+  }
+  DATA_TYPE(self) = &ngx_mrb_timer_data_type;
+
+  t = ngx_calloc(sizeof(ngx_mrb_timer_t), ngx_cycle->log);
+  if (t == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::Timer");
+  }
+  t->mrb = mrb;
+  t->self = self;
+  t->interval = (ngx_msec_t) interval;
+  t->ev.handler = ngx_mrb_timer_handler;
+  t->ev.data = t;
+  t->ev.log = ngx_cycle->log;
+#if (nginx_version >= 1007011)
+  // pending timers do not hold up a graceful shutdown
+  t->ev.cancelable = 1;
+#endif
+  DATA_PTR(self) = t;
+
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@block"), block);
+  ngx_mrb_gc_register(mrb, self);
+  t->active = 1;
+  ngx_add_timer(&t->ev, (ngx_msec_t) delay);
+
+  return self;
+}
+
+static mrb_value ngx_mrb_timer_cancel(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_timer_t *t = ngx_mrb_timer_get(mrb, self);
+
+  if (!t->active) {
+    return mrb_false_value();
+  }
+  t->active = 0;
+  if (t->ev.timer_set) {
+    ngx_del_timer(&t->ev);
+  }
+  // a running block is unrooted by ngx_mrb_timer_handler
+  if (!t->running) {
+    ngx_mrb_gc_unregister(mrb, self);
+  }
+
+  return mrb_true_value();
+}
+
+static mrb_value ngx_mrb_timer_active(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_timer_t *t = ngx_mrb_timer_get(mrb, self);
+
+  return mrb_bool_value(t->active);
+}
+
+void ngx_mrb_timer_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_timer;
+
+  class_timer = mrb_define_class_under(mrb, class, "Timer", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_timer, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_timer, "initialize", ngx_mrb_timer_init, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, class_timer, "cancel", ngx_mrb_timer_cancel, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_timer, "active?", ngx_mrb_timer_active, MRB_ARGS_NONE());
+}
@@ -0,0 +1,622 @@
+/*
+// ngx_http_mruby_topk.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_topk.h"
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::Sketch::TopK finds the heaviest keys of a stream in a zone declared
+// with mruby_topk_zone and shared by all workers. Every key is counted in a
+// count-min sketch of NGX_MRB_TOPK_DEPTH rows of atomic counters, which is
+// an add per row and no lock. The k keys with the largest estimates are
+// kept in a space-saving table: a min-heap of the entries with a hash index
+// over it. A key whose estimate is below the smallest count in a full table
+// can not be in it and is done with after the sketch; otherwise the table
+// is updated under the zone mutex, but only when it is free, so no worker
+// ever waits for another and a skipped update is made up for the next time
+// the key is seen. With decay, all counts are halved every decay interval by
+// the first worker to notice that one has passed.
+*/
+
+#define NGX_MRB_TOPK_DEPTH             4
+#define NGX_MRB_TOPK_WIDTH_MIN         64
+// longer keys are kept cut to this, they are counted in full
+#define NGX_MRB_TOPK_KEY_MAX           128
+#define NGX_MRB_TOPK_K_MAX             65536
+
+typedef struct {
+  uint64_t count;
+  uint32_t hash;
+  // position in the heap
+  uint32_t heap;
+  size_t len;
+  u_char key[NGX_MRB_TOPK_KEY_MAX];
+} ngx_mrb_topk_entry_t;
+
+typedef struct {
+  // msec since the epoch of the next halving, when decay is set
+  ngx_atomic_t next_decay;
+  ngx_msec_t decay;
+  // the least count in the table while it is full, else 0
+  ngx_atomic_t min;
+  ngx_uint_t k;
+  ngx_uint_t n;
+  ngx_uint_t width;
+  ngx_atomic_t *cms;
+  ngx_mrb_topk_entry_t *entries;
+  // entries by count, least first
+  uint32_t *heap;
+  // open addressing, entry index + 1 or 0
+  uint32_t *index;
+  ngx_uint_t index_mask;
+} ngx_mrb_topk_sh_t;
+
+// shm_zone->data of a mruby_topk_zone, one per cycle
+typedef struct {
+  ngx_str_t name;
+  ngx_uint_t k;
+  ngx_msec_t decay;
+  ngx_mrb_topk_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ngx_mrb_topk_t;
+
+static const struct mrb_data_type ngx_mrb_topk_data_type = {
+  "Nginx::Sketch::TopK", NULL,
+};
+
+static uint64_t ngx_mrb_topk_now(void)
+{
+  ngx_time_t *tp = ngx_timeofday();
+
+  return (uint64_t) tp->sec * 1000 + tp->msec;
+}
+
+static ngx_int_t ngx_mrb_topk_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_mrb_topk_t *octx = data;
+  ngx_mrb_topk_t *ctx = shm_zone->data;
+  ngx_mrb_topk_sh_t *sh;
+  size_t avail, len;
+  ngx_uint_t nindex, width;
+
+  // the zone of the previous cycle, kept with its contents and its k
+  if (octx != NULL) {
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    if (ctx->sh->k != ctx->k) {
+      ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0
+        , "%s WARN %s:%d: mruby_topk_zone \"%V\" keeps k=%ui until its size"
+          " changes"
+        , MODULE_NAME
+        , __func__
+        , __LINE__
+        , &ctx->name
+        , ctx->sh->k
+      );
+    }
+    ctx->sh->decay = ctx->decay;
+    return NGX_OK;
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  if (shm_zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+
+  sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_mrb_topk_sh_t));
+  if (sh == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(sh, sizeof(ngx_mrb_topk_sh_t));
+  ctx->sh = sh;
+  ctx->shpool->data = sh;
+  sh->k = ctx->k;
+  sh->decay = ctx->decay;
+
+  for (nindex = 1; nindex < 2 * sh->k; nindex <<= 1) { /* void */ }
+  sh->index_mask = nindex - 1;
+  sh->entries = ngx_slab_alloc(ctx->shpool,
+      sh->k * sizeof(ngx_mrb_topk_entry_t));
+  sh->heap = ngx_slab_alloc(ctx->shpool, sh->k * sizeof(uint32_t));
+  sh->index = ngx_slab_alloc(ctx->shpool, nindex * sizeof(uint32_t));
+  if (sh->entries == NULL || sh->heap == NULL || sh->index == NULL) {
+    goto small;
+  }
+  ngx_memzero(sh->index, nindex * sizeof(uint32_t));
+
+  // the sketch gets what is left of half the zone
+  len = sh->k * (sizeof(ngx_mrb_topk_entry_t) + sizeof(uint32_t))
+        + nindex * sizeof(uint32_t);
+  avail = shm_zone->shm.size / 2;
+  avail = avail > len ? avail - len : 0;
+  for (width = NGX_MRB_TOPK_WIDTH_MIN;
+       2 * width * NGX_MRB_TOPK_DEPTH * sizeof(ngx_atomic_t) <= avail;
+       width <<= 1) { /* void */ }
+  sh->width = width;
+  len = NGX_MRB_TOPK_DEPTH * width * sizeof(ngx_atomic_t);
+  sh->cms = ngx_slab_alloc(ctx->shpool, len);
+  if (sh->cms == NULL) {
+    goto small;
+  }
+  ngx_memzero((void *) sh->cms, len);
+
+  len = sizeof(" in mruby_topk_zone \"\"") + shm_zone->shm.name.len;
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if (ctx->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(ctx->shpool->log_ctx, " in mruby_topk_zone \"%V\"%Z",
+      &shm_zone->shm.name);
+
+  return NGX_OK;
+
+small:
+
+  ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0
+    , "%s ERROR %s:%d: mruby_topk_zone \"%V\" is too small for k=%ui"
+    , MODULE_NAME
+    , __func__
+    , __LINE__
+    , &ctx->name
+    , ctx->k
+  );
+
+  return NGX_ERROR;
+}
+
+// mruby_topk_zone name size [k=number] [decay=time]
+char *ngx_http_mruby_topk_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+  ngx_http_mruby_main_conf_t *mmcf = conf;
+  ngx_str_t *value, s;
+  ngx_shm_zone_t *shm_zone, **zp;
+  ngx_mrb_topk_t *ctx;
+  ngx_uint_t i;
+  ngx_int_t n;
+  ssize_t size;
+
+  value = cf->args->elts;
+
+#if (NGX_PTR_SIZE < 8)
+  // the counters are 64 bit atomic words
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_topk_zone needs a 64 bit"
+      " platform");
+  return NGX_CONF_ERROR;
+#endif
+
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"",
+        &value[2]);
+    return NGX_CONF_ERROR;
+  }
+  if (size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "mruby_topk_zone \"%V\" is too"
+        " small", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_mrb_topk_t));
+  if (ctx == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  ctx->name = value[1];
+  ctx->k = 100;
+
+  for (i = 3; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "k=", 2) == 0) {
+      n = ngx_atoi(value[i].data + 2, value[i].len - 2);
+      if (n < 1 || n > NGX_MRB_TOPK_K_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid k \"%V\"",
+            &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      ctx->k = (ngx_uint_t) n;
+      continue;
+    }
+    if (ngx_strncmp(value[i].data, "decay=", 6) == 0) {
+      s.data = value[i].data + 6;
+      s.len = value[i].len - 6;
+      n = ngx_parse_time(&s, 0);
+      if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid decay \"%V\"",
+            &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      ctx->decay = (ngx_msec_t) n;
+      continue;
+    }
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+        &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+      &ngx_http_mruby_module);
+  if (shm_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  // zone names are shared with the other mruby zones
+  if (shm_zone->data != NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+        &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  shm_zone->init = ngx_mrb_topk_init_zone;
+  shm_zone->data = ctx;
+
+  if (mmcf->topk_zones == NULL) {
+    mmcf->topk_zones = ngx_array_create(cf->pool, 4,
+        sizeof(ngx_shm_zone_t *));
+    if (mmcf->topk_zones == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+  zp = ngx_array_push(mmcf->topk_zones);
+  if (zp == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  *zp = shm_zone;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_mrb_topk_t *ngx_mrb_topk_zone(mrb_state *mrb, mrb_value name)
+{
+  ngx_http_mruby_main_conf_t *mmcf;
+  ngx_shm_zone_t **zones;
+  ngx_mrb_topk_t *t;
+  ngx_uint_t i;
+
+  name = mrb_str_to_str(mrb, name);
+  mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_mruby_module);
+  if (mmcf != NULL && mmcf->topk_zones != NULL) {
+    zones = mmcf->topk_zones->elts;
+    for (i = 0; i < mmcf->topk_zones->nelts; i++) {
+      t = zones[i]->data;
+      if (t->name.len == (size_t) RSTRING_LEN(name)
+          && ngx_strncmp(t->name.data, RSTRING_PTR(name), t->name.len) == 0
+          && t->sh != NULL) {
+        return t;
+      }
+    }
+  }
+
+  // the zones are mapped after the configuration, i.e. after mruby_init
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "no mruby_topk_zone %S", name);
+
+  return NULL;
+}
+
+static ngx_mrb_topk_t *ngx_mrb_topk_self(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_topk_t *t;
+
+  t = mrb_data_get_ptr(mrb, self, &ngx_mrb_topk_data_type);
+  if (t == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::Sketch::TopK");
+  }
+
+  return t;
+}
+
+// the counter of row i, rows hash by h1 + i * h2
+#define ngx_mrb_topk_counter(sh, i, h1, h2)                                  \
+  (&(sh)->cms[(i) * (sh)->width + (((h1) + (i) * (h2)) & ((sh)->width - 1))])
+
+/*
+// adds n to the counters of a key and returns its estimate, the least of
+// them; with n 0 it just estimates
+*/
+static uint64_t ngx_mrb_topk_sketch(ngx_mrb_topk_sh_t *sh, uint32_t h1,
+    uint32_t h2, uint64_t n)
+{
+  ngx_atomic_t *c;
+  uint64_t v, est = (uint64_t) -1;
+  ngx_uint_t i;
+
+  for (i = 0; i < NGX_MRB_TOPK_DEPTH; i++) {
+    c = ngx_mrb_topk_counter(sh, i, h1, h2);
+    v = n ? ngx_atomic_fetch_add(c, n) + n : *c;
+    if (v < est) {
+      est = v;
+    }
+  }
+
+  return est;
+}
+
+static void ngx_mrb_topk_swap(ngx_mrb_topk_sh_t *sh, ngx_uint_t a,
+    ngx_uint_t b)
+{
+  uint32_t e = sh->heap[a];
+
+  sh->heap[a] = sh->heap[b];
+  sh->heap[b] = e;
+  sh->entries[sh->heap[a]].heap = a;
+  sh->entries[sh->heap[b]].heap = b;
+}
+
+#define ngx_mrb_topk_heap_count(sh, i)  (sh)->entries[(sh)->heap[i]].count
+
+static void ngx_mrb_topk_sift_up(ngx_mrb_topk_sh_t *sh, ngx_uint_t i)
+{
+  while (i > 0 && ngx_mrb_topk_heap_count(sh, (i - 1) / 2)
+                  > ngx_mrb_topk_heap_count(sh, i)) {
+    ngx_mrb_topk_swap(sh, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void ngx_mrb_topk_sift_down(ngx_mrb_topk_sh_t *sh, ngx_uint_t i)
+{
+  ngx_uint_t c;
+
+  for ( ;; ) {
+    c = 2 * i + 1;
+    if (c >= sh->n) {
+      return;
+    }
+    if (c + 1 < sh->n
+        && ngx_mrb_topk_heap_count(sh, c + 1) < ngx_mrb_topk_heap_count(sh, c)) {
+      c++;
+    }
+    if (ngx_mrb_topk_heap_count(sh, i) <= ngx_mrb_topk_heap_count(sh, c)) {
+      return;
+    }
+    ngx_mrb_topk_swap(sh, i, c);
+    i = c;
+  }
+}
+
+// the index slot of key, or of the free slot it would go to
+static ngx_uint_t ngx_mrb_topk_find(ngx_mrb_topk_sh_t *sh, u_char *key,
+    size_t len, uint32_t hash)
+{
+  ngx_mrb_topk_entry_t *e;
+  ngx_uint_t i;
+
+  for (i = hash & sh->index_mask; sh->index[i]; i = (i + 1) & sh->index_mask) {
+    e = &sh->entries[sh->index[i] - 1];
+    if (e->hash == hash && e->len == len && ngx_memcmp(e->key, key, len) == 0) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+// empties slot i of the index, moving back entries that probed past it
+static void ngx_mrb_topk_unindex(ngx_mrb_topk_sh_t *sh, ngx_uint_t i)
+{
+  ngx_uint_t j, h;
+
+  for (j = (i + 1) & sh->index_mask; sh->index[j];
+       j = (j + 1) & sh->index_mask) {
+    h = sh->entries[sh->index[j] - 1].hash & sh->index_mask;
+    // moves unless its home slot lies cyclically in (i, j]
+    if (i <= j ? (h <= i || h > j) : (h <= i && h > j)) {
+      sh->index[i] = sh->index[j];
+      i = j;
+    }
+  }
+  sh->index[i] = 0;
+}
+
+// counts est for key in the table, the lock is held
+static void ngx_mrb_topk_update(ngx_mrb_topk_sh_t *sh, u_char *key,
+    size_t len, uint32_t hash, uint64_t est)
+{
+  ngx_mrb_topk_entry_t *e;
+  ngx_uint_t i, idx;
+
+  i = ngx_mrb_topk_find(sh, key, len, hash);
+  if (sh->index[i]) {
+    e = &sh->entries[sh->index[i] - 1];
+    if (est > e->count) {
+      e->count = est;
+      ngx_mrb_topk_sift_down(sh, e->heap);
+    }
+    goto done;
+  }
+
+  if (sh->n < sh->k) {
+    idx = sh->n++;
+    sh->heap[idx] = idx;
+    sh->entries[idx].heap = idx;
+  }
+  else {
+    // space saving: the newcomer takes the place of the least
+    idx = sh->heap[0];
+    if (est <= sh->entries[idx].count) {
+      goto done;
+    }
+    e = &sh->entries[idx];
+    ngx_mrb_topk_unindex(sh, ngx_mrb_topk_find(sh, e->key, e->len, e->hash));
+    i = ngx_mrb_topk_find(sh, key, len, hash);
+  }
+
+  e = &sh->entries[idx];
+  e->count = est;
+  e->hash = hash;
+  e->len = len;
+  ngx_memcpy(e->key, key, len);
+  sh->index[i] = idx + 1;
+  ngx_mrb_topk_sift_up(sh, e->heap);
+  ngx_mrb_topk_sift_down(sh, e->heap);
+
+done:
+
+  sh->min = sh->n == sh->k ? ngx_mrb_topk_heap_count(sh, 0) : 0;
+}
+
+// halves all counts once per decay interval passed
+static void ngx_mrb_topk_decay(ngx_mrb_topk_t *t)
+{
+  ngx_mrb_topk_sh_t *sh = t->sh;
+  ngx_atomic_uint_t next, v;
+  uint64_t now;
+  ngx_uint_t i, shift;
+
+  next = sh->next_decay;
+  now = ngx_mrb_topk_now();
+  if (sh->decay == 0 || now < next) {
+    return;
+  }
+  if (!ngx_atomic_cmp_set(&sh->next_decay, next, now + sh->decay)) {
+    return;
+  }
+  // the first add starts the clock
+  if (next == 0) {
+    return;
+  }
+
+  shift = (now - next) / sh->decay + 1;
+  if (shift > 63) {
+    shift = 63;
+  }
+  // an add racing with it keeps its count
+  for (i = 0; i < NGX_MRB_TOPK_DEPTH * sh->width; i++) {
+    v = sh->cms[i];
+    if (v) {
+      (void) ngx_atomic_fetch_add(&sh->cms[i],
+          -(ngx_atomic_int_t) (v - (v >> shift)));
+    }
+  }
+
+  // halving keeps the order of the heap
+  ngx_shmtx_lock(&t->shpool->mutex);
+  for (i = 0; i < sh->n; i++) {
+    sh->entries[i].count >>= shift;
+  }
+  sh->min = sh->n == sh->k ? ngx_mrb_topk_heap_count(sh, 0) : 0;
+  ngx_shmtx_unlock(&t->shpool->mutex);
+}
+
+static mrb_value ngx_mrb_topk_init(mrb_state *mrb, mrb_value self)
+{
+  mrb_value name;
+
+  mrb_get_args(mrb, "o", &name);
+  DATA_TYPE(self) = &ngx_mrb_topk_data_type;
+  DATA_PTR(self) = ngx_mrb_topk_zone(mrb, name);
+
+  return self;
+}
+
+// add(key, n = 1): counts key n times and returns its estimated count
+static mrb_value ngx_mrb_topk_add(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_topk_t *t = ngx_mrb_topk_self(mrb, self);
+  ngx_mrb_topk_sh_t *sh = t->sh;
+  mrb_value key;
+  mrb_int n = 1;
+  uint32_t h1, h2;
+  uint64_t est;
+  size_t len;
+
+  mrb_get_args(mrb, "S|i", &key, &n);
+  if (n < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "n must be positive");
+  }
+  ngx_mrb_topk_decay(t);
+
+  len = RSTRING_LEN(key);
+  h1 = ngx_murmur_hash2((u_char *) RSTRING_PTR(key), len);
+  h2 = ngx_crc32_short((u_char *) RSTRING_PTR(key), len) | 1;
+  est = ngx_mrb_topk_sketch(sh, h1, h2, (uint64_t) n);
+
+  // below the least of a full table it is not in it, nor will it be
+  if (est > sh->min && ngx_shmtx_trylock(&t->shpool->mutex)) {
+    ngx_mrb_topk_update(sh, (u_char *) RSTRING_PTR(key),
+        ngx_min(len, NGX_MRB_TOPK_KEY_MAX), h1, est);
+    ngx_shmtx_unlock(&t->shpool->mutex);
+  }
+
+  return mrb_fixnum_value((mrb_int) est);
+}
+
+// count(key): the estimated count of key, never below the true one
+static mrb_value ngx_mrb_topk_count(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_topk_t *t = ngx_mrb_topk_self(mrb, self);
+  mrb_value key;
+  size_t len;
+
+  mrb_get_args(mrb, "S", &key);
+  len = RSTRING_LEN(key);
+
+  return mrb_fixnum_value((mrb_int) ngx_mrb_topk_sketch(t->sh,
+        ngx_murmur_hash2((u_char *) RSTRING_PTR(key), len),
+        ngx_crc32_short((u_char *) RSTRING_PTR(key), len) | 1, 0));
+}
+
+static int ngx_libc_cdecl ngx_mrb_topk_cmp(const void *one, const void *two)
+{
+  const ngx_mrb_topk_entry_t *a = one, *b = two;
+
+  return a->count < b->count ? 1 : (a->count > b->count ? -1 : 0);
+}
+
+// top(n = k): [[key, count], ...] heaviest first
+static mrb_value ngx_mrb_topk_top(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_topk_t *t = ngx_mrb_topk_self(mrb, self);
+  ngx_mrb_topk_entry_t *entries;
+  mrb_value res, pair;
+  mrb_int limit = -1;
+  ngx_uint_t i, n;
+  int ai;
+
+  mrb_get_args(mrb, "|i", &limit);
+  ngx_mrb_topk_decay(t);
+
+  // copied out, nothing may raise while the lock is held
+  entries = mrb_malloc(mrb, t->sh->k * sizeof(ngx_mrb_topk_entry_t));
+  ngx_shmtx_lock(&t->shpool->mutex);
+  n = t->sh->n;
+  ngx_memcpy(entries, t->sh->entries, n * sizeof(ngx_mrb_topk_entry_t));
+  ngx_shmtx_unlock(&t->shpool->mutex);
+
+  ngx_qsort(entries, n, sizeof(ngx_mrb_topk_entry_t), ngx_mrb_topk_cmp);
+  if (limit >= 0 && (ngx_uint_t) limit < n) {
+    n = (ngx_uint_t) limit;
+  }
+
+  res = mrb_ary_new_capa(mrb, n);
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < n; i++) {
+    pair = mrb_assoc_new(mrb,
+        mrb_str_new(mrb, (char *) entries[i].key, entries[i].len),
+        mrb_fixnum_value((mrb_int) entries[i].count));
+    mrb_ary_push(mrb, res, pair);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_free(mrb, entries);
+
+  return res;
+}
+
+void ngx_mrb_topk_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *module_sketch, *class_topk;
+
+  module_sketch = mrb_define_module_under(mrb, class, "Sketch");
+  class_topk = mrb_define_class_under(mrb, module_sketch, "TopK", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_topk, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_topk, "initialize", ngx_mrb_topk_init, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_topk, "add", ngx_mrb_topk_add, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class_topk, "count", ngx_mrb_topk_count, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_topk, "top", ngx_mrb_topk_top, MRB_ARGS_OPT(1));
+}
@@ -75,30 +75,38 @@
   { ngx_string("tcpinfo_rcv_space"), NULL, ngx_http_variable_tcpinfo,
 */
 
-static mrb_value ngx_mrb_var_get(mrb_state *mrb, mrb_value self,
-    const char *c_name, size_t c_len, ngx_http_request_t *r)
+// names of the variables read by the Connection, Server and Request
+// accessors, indexed by ngx_mrb_var_id_t; keys are hashed at class init
+static ngx_str_t ngx_mrb_var_names[] = {
+  ngx_string("remote_addr"),
+  ngx_string("remote_port"),
+  ngx_string("server_addr"),
+  ngx_string("server_port"),
+  ngx_string("document_root"),
+  ngx_string("realpath_root"),
+  ngx_string("hostname"),
+  ngx_string("request_filename"),
+  ngx_string("remote_user")
+};
+
+static ngx_uint_t ngx_mrb_var_keys[NGX_MRB_VAR_MAX];
+
+// name must be lowercase and key its ngx_hash_key
+mrb_value ngx_mrb_var_get(mrb_state *mrb, ngx_http_request_t *r,
+    ngx_str_t *name, ngx_uint_t key)
 {
   ngx_http_variable_value_t *var;
-  ngx_str_t ngx_name;
-
-  size_t len;
-  ngx_uint_t key;
 
-  ngx_name.len = c_len;
-  ngx_name.data = (u_char *)c_name;
-  len = ngx_name.len;
-
-  key = ngx_hash_strlow(ngx_name.data, ngx_name.data, len);
-  var = ngx_http_get_variable(r, &ngx_name, key);
+  var = ngx_http_get_variable(r, name, key);
   if (var == NULL) {
     ngx_log_error(NGX_LOG_ERR
       , r->connection->log
       , 0
-      , "%s ERROR %s:%d: %s is NULL"
+      , "%s ERROR %s:%d: %V is NULL"
       , MODULE_NAME
       , __func__
       , __LINE__
-      , c_name
+      , name
     );
     return mrb_nil_value();
   }
@@ -111,16 +119,23 @@ static mrb_value ngx_mrb_var_get(mrb_state *mrb, mrb_value self,
     ngx_log_error(NGX_LOG_ERR
       , r->connection->log
       , 0
-      , "%s ERROR %s:%d: %s not found"
+      , "%s ERROR %s:%d: %V not found"
       , MODULE_NAME
       , __func__
       , __LINE__
-      , c_name
+      , name
     );
     return mrb_nil_value();
   }
 }
 
+mrb_value ngx_mrb_var_get_by_id(mrb_state *mrb, ngx_http_request_t *r,
+    ngx_mrb_var_id_t id)
+{
+  return ngx_mrb_var_get(mrb, r, &ngx_mrb_var_names[id],
+      ngx_mrb_var_keys[id]);
+}
+
 static mrb_value ngx_mrb_var_set(mrb_state *mrb, mrb_value self, char *k,
     mrb_value o, ngx_http_request_t *r)
 {
@@ -157,7 +172,7 @@ static mrb_value ngx_mrb_var_set(mrb_state *mrb, mrb_value self, char *k,
   ngx_cpystrn(valp, val.data, val.len + 1);
 
   hash = ngx_hash_strlow(key.data, key.data, key.len);
-  r = ngx_mrb_get_request();
+  r = ngx_mrb_get_request_or_raise(mrb);
   cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
   v = ngx_hash_find(&cmcf->variables_hash, hash, key.data, key.len);
 
@@ -242,9 +257,11 @@ static mrb_value ngx_mrb_var_method_missing(mrb_state *mrb, mrb_value self)
   int alen, c_len;
   mrb_value s_name;
   char *c_name;
+  ngx_str_t ngx_name;
+  ngx_uint_t key;
   ngx_http_request_t *r;
 
-  r = ngx_mrb_get_request();
+  r = ngx_mrb_get_request_or_raise(mrb);
 
   // get var symble from method_missing(sym, *args)
   mrb_get_args(mrb, "n*", &name, &a, &alen);
@@ -260,7 +277,11 @@ static mrb_value ngx_mrb_var_method_missing(mrb_state *mrb, mrb_value self)
     return ngx_mrb_var_set(mrb, self, strtok(c_name, "="), a[0], r);
   }
   else {
-    return ngx_mrb_var_get(mrb, self, c_name, c_len, r);
+    // c_name is a fresh copy of the symbol name, so it can be lowered
+    ngx_name.len = c_len;
+    ngx_name.data = (u_char *)c_name;
+    key = ngx_hash_strlow(ngx_name.data, ngx_name.data, ngx_name.len);
+    return ngx_mrb_var_get(mrb, r, &ngx_name, key);
   }
 }
 
@@ -284,7 +305,7 @@ static mrb_value ngx_mrb_var_set_func(mrb_state *mrb, mrb_value self)
     o = mrb_funcall(mrb, o, "to_s", 0, NULL);
   }
 
-  r = ngx_mrb_get_request();
+  r = ngx_mrb_get_request_or_raise(mrb);
 
   key.data = (u_char *)RSTRING_PTR(k);
   key.len  = RSTRING_LEN(k);
@@ -404,6 +425,12 @@ ARENA_RESTOR_AND_ERROR:
 void ngx_mrb_var_class_init(mrb_state *mrb, struct RClass *class)
 {
   struct RClass *class_var;
+  ngx_uint_t i;
+
+  for (i = 0; i < NGX_MRB_VAR_MAX; i++) {
+    ngx_mrb_var_keys[i] = ngx_hash_key(ngx_mrb_var_names[i].data,
+        ngx_mrb_var_names[i].len);
+  }
 
   class_var = mrb_define_class_under(mrb, class, "Var", mrb->object_class);
   mrb_define_method(mrb, class_var, "method_missing", ngx_mrb_var_method_missing, MRB_ARGS_ANY());
@@ -14,4 +14,22 @@
 #include "ngx_http_mruby_module.h"
 #include "ngx_http_mruby_request.h"
 
+typedef enum ngx_mrb_var_id_t {
+  NGX_MRB_VAR_REMOTE_ADDR,
+  NGX_MRB_VAR_REMOTE_PORT,
+  NGX_MRB_VAR_SERVER_ADDR,
+  NGX_MRB_VAR_SERVER_PORT,
+  NGX_MRB_VAR_DOCUMENT_ROOT,
+  NGX_MRB_VAR_REALPATH_ROOT,
+  NGX_MRB_VAR_HOSTNAME,
+  NGX_MRB_VAR_REQUEST_FILENAME,
+  NGX_MRB_VAR_REMOTE_USER,
+  NGX_MRB_VAR_MAX
+} ngx_mrb_var_id_t;
+
+mrb_value ngx_mrb_var_get(mrb_state *mrb, ngx_http_request_t *r,
+    ngx_str_t *name, ngx_uint_t key);
+mrb_value ngx_mrb_var_get_by_id(mrb_state *mrb, ngx_http_request_t *r,
+    ngx_mrb_var_id_t id);
+
 #endif // NGX_HTTP_MRUBY_VAR_H
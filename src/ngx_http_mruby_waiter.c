@@ -0,0 +1,191 @@
+/*
+// ngx_http_mruby_waiter.c - ngx_mruby mruby module
+//
+// See Copyright Notice in ngx_http_mruby_module.c
+*/
+
+#include "ngx_http_mruby_waiter.h"
+
+#include <mruby.h>
+#include <mruby/data.h>
+#include <mruby/variable.h>
+#include <mruby/class.h>
+
+/*
+// Nginx::Waiter lets a handler fiber wait until other code of the worker,
+// e.g. the fiber of another request or a timer block, hands it a value.
+// A fiber can not resume the fiber of another request itself, so wake only
+// stores the value and posts an event; the event handler resumes the waiting
+// fiber from the event loop like any other async operation. A waiter belongs
+// to the request that created it and is disarmed when that request ends.
+*/
+
+typedef struct {
+  mrb_state *mrb;
+  ngx_http_mruby_ctx_t *ctx;
+  // detaches the waiter from its request when the request ends first
+  ngx_pool_cleanup_t *cleanup;
+  // posted by wake, or the timer of wait
+  ngx_event_t ev;
+  unsigned waiting:1;
+  unsigned woken:1;
+} ngx_mrb_waiter_t;
+
+static void ngx_mrb_waiter_free(mrb_state *mrb, void *data);
+
+static const struct mrb_data_type ngx_mrb_waiter_data_type = {
+  "Nginx::Waiter", ngx_mrb_waiter_free,
+};
+
+static void ngx_mrb_waiter_disarm(ngx_mrb_waiter_t *w)
+{
+  if (w->ev.timer_set) {
+    ngx_del_timer(&w->ev);
+  }
+  if (w->ev.posted) {
+    ngx_delete_posted_event(&w->ev);
+  }
+}
+
+static void ngx_mrb_waiter_free(mrb_state *mrb, void *data)
+{
+  ngx_mrb_waiter_t *w = data;
+
+  ngx_mrb_waiter_disarm(w);
+  if (w->cleanup != NULL) {
+    w->cleanup->handler = NULL;
+  }
+  ngx_free(w);
+}
+
+static void ngx_mrb_waiter_cleanup(void *data)
+{
+  ngx_mrb_waiter_t *w = data;
+
+  ngx_mrb_waiter_disarm(w);
+  w->cleanup = NULL;
+  w->ctx = NULL;
+  w->waiting = 0;
+}
+
+// resumes the fiber with true when woken and false when the wait timed out
+static void ngx_mrb_waiter_handler(ngx_event_t *ev)
+{
+  ngx_mrb_waiter_t *w = ev->data;
+  mrb_state *mrb = w->mrb;
+  int ai;
+
+  ai = mrb_gc_arena_save(mrb);
+  w->waiting = 0;
+  // the fiber may drop the waiter, do not touch it afterwards
+  ngx_mrb_async_resume(w->ctx, mrb_bool_value(w->woken));
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+static ngx_mrb_waiter_t *ngx_mrb_waiter_get(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_waiter_t *w;
+
+  w = mrb_data_get_ptr(mrb, self, &ngx_mrb_waiter_data_type);
+  if (w == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Nginx::Waiter");
+  }
+
+  return w;
+}
+
+static mrb_value ngx_mrb_waiter_init(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_waiter_t *w;
+  ngx_http_mruby_ctx_t *ctx;
+  ngx_pool_cleanup_t *cln;
+
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Waiter");
+  if (DATA_PTR(self) != NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::Waiter already initialized");
+  }
+  DATA_TYPE(self) = &ngx_mrb_waiter_data_type;
+
+  w = ngx_calloc(sizeof(ngx_mrb_waiter_t), ngx_cycle->log);
+  cln = ngx_pool_cleanup_add(ctx->r->pool, 0);
+  if (w == NULL || cln == NULL) {
+    if (w != NULL) {
+      ngx_free(w);
+    }
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed to allocate Nginx::Waiter");
+  }
+  w->mrb = mrb;
+  w->ctx = ctx;
+  w->cleanup = cln;
+  w->ev.handler = ngx_mrb_waiter_handler;
+  w->ev.data = w;
+  w->ev.log = ctx->r->connection->log;
+  cln->handler = ngx_mrb_waiter_cleanup;
+  cln->data = w;
+  DATA_PTR(self) = w;
+
+  return self;
+}
+
+// arms the waiter, wait then yields the handler fiber
+static mrb_value ngx_mrb_waiter_wait(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_waiter_t *w = ngx_mrb_waiter_get(mrb, self);
+  ngx_http_mruby_ctx_t *ctx;
+  mrb_int msec;
+
+  mrb_get_args(mrb, "i", &msec);
+  ctx = ngx_mrb_get_async_ctx(mrb, "Nginx::Waiter#wait");
+  if (w->ctx != ctx) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::Waiter of another request");
+  }
+  if (w->waiting) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Nginx::Waiter already waiting");
+  }
+  if (msec < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative wait time");
+  }
+
+  w->waiting = 1;
+  w->woken = 0;
+  if (msec > 0) {
+    ngx_add_timer(&w->ev, (ngx_msec_t) msec);
+  }
+  ctx->async_wait = 1;
+
+  return self;
+}
+
+// false when nothing waits on the waiter anymore: the wait has timed out,
+// another value is on its way or the request is gone
+static mrb_value ngx_mrb_waiter_wake(mrb_state *mrb, mrb_value self)
+{
+  ngx_mrb_waiter_t *w = ngx_mrb_waiter_get(mrb, self);
+  mrb_value v;
+
+  mrb_get_args(mrb, "o", &v);
+  if (!w->waiting || w->woken || w->ctx == NULL) {
+    return mrb_false_value();
+  }
+
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@value"), v);
+  w->woken = 1;
+  if (w->ev.timer_set) {
+    ngx_del_timer(&w->ev);
+  }
+  ngx_post_event(&w->ev, &ngx_posted_events);
+
+  return mrb_true_value();
+}
+
+void ngx_mrb_waiter_class_init(mrb_state *mrb, struct RClass *class)
+{
+  struct RClass *class_waiter;
+
+  class_waiter = mrb_define_class_under(mrb, class, "Waiter", mrb->object_class);
+  MRB_SET_INSTANCE_TT(class_waiter, MRB_TT_DATA);
+
+  mrb_define_method(mrb, class_waiter, "initialize", ngx_mrb_waiter_init, MRB_ARGS_NONE());
+  mrb_define_method(mrb, class_waiter, "_wait", ngx_mrb_waiter_wait, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class_waiter, "wake", ngx_mrb_waiter_wake, MRB_ARGS_REQ(1));
+}
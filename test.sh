@@ -11,6 +11,10 @@ set -e
 
 NGINX_INSTALL_DIR=`pwd`'/build/nginx'
 NGINX_CONFIG_OPT="--prefix=${NGINX_INSTALL_DIR} --with-http_stub_status_module"
+# mruby_thread_pool, nginx 1.7.11 or later
+if [ -n "${NGINX_WITH_THREADS}" ]; then
+    NGINX_CONFIG_OPT="${NGINX_CONFIG_OPT} --with-threads"
+fi
 
 if [ ! -d "./mruby/src" ]; then
     echo "mruby Downloading ..."
@@ -59,8 +63,21 @@ make install
 ps -C nginx && killall nginx
 cp -p test/build_config.rb ./mruby/.
 sed -e "s|__NGXDOCROOT__|${NGINX_INSTALL_DIR}/html/|g" test/conf/nginx.conf > ${NGINX_INSTALL_DIR}/conf/nginx.conf
+rm -f ${NGINX_INSTALL_DIR}/conf/threads.conf
+if [ -n "${NGINX_WITH_THREADS}" ]; then
+    cp -p test/conf/threads.conf ${NGINX_INSTALL_DIR}/conf/.
+fi
 cp -p test/html/* ${NGINX_INSTALL_DIR}/html/.
+cc -O2 -o build/ngx_mruby_bloom tools/ngx_mruby_bloom.c -lm
+printf "bad.example\nevil.example\n" | ./build/ngx_mruby_bloom ${NGINX_INSTALL_DIR}/html/test.bloom
+cc -O2 -o build/ngx_mruby_table tools/ngx_mruby_table.c
+printf "acme\ttenant-1\nglobex\ttenant-2\nacme\ttenant-3\n" | ./build/ngx_mruby_table ${NGINX_INSTALL_DIR}/html/test.table
+printf "10.0.0.0/8\tprivate\n1.0.0.0\t1.0.0.255\tau\n2001:db8::/32\tdoc\n100\t199\tn\n" | ./build/ngx_mruby_table -r ${NGINX_INSTALL_DIR}/html/test_range.table
 
+ruby test/stub/redis.rb 58379 &
+STUB_REDIS_PID=$!
+ruby test/stub/dns.rb 58054 &
+STUB_DNS_PID=$!
 ${NGINX_INSTALL_DIR}/sbin/nginx &
 sleep 2
 cd mruby
@@ -68,6 +85,7 @@ rake clean
 rake
 ./bin/mruby ../test/t/ngx_mruby.rb
 killall nginx
+kill ${STUB_REDIS_PID} ${STUB_DNS_PID}
 echo "ngx_mruby testing ... Done"
 
 echo "test.sh ... successful"
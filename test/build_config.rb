@@ -27,6 +27,8 @@ MRuby::Build.new do |conf|
   conf.gem :github => 'mattn/mruby-http'
   conf.gem :github => 'iij/mruby-io'
   conf.gem :github => 'iij/mruby-socket'
+  # HAR capture support of tools/ngx_mruby_replay.rb
+  conf.gem :github => 'mattn/mruby-json'
   # include the default GEMs
   conf.gembox 'default'
 
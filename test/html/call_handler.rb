@@ -0,0 +1,14 @@
+# evaluated once per worker; the returned object handles every request
+$call_handler_setup = ($call_handler_setup || 0) + 1
+
+class CallHandler
+  def initialize(setup)
+    @setup = setup
+  end
+
+  def call(r)
+    Nginx.rputs "#{r.uri} #{r.args} #{@setup}"
+  end
+end
+
+CallHandler.new $call_handler_setup
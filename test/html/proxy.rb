@@ -1,5 +1,6 @@
 # location /proxy {
-#   mruby_set $backend "/path/to/proxy.rb";
+#   set $backend "";
+#   mruby_rewrite_handler "/path/to/proxy.rb" fiber;
 #   proxy_pass   http://$backend;
 # }
 
@@ -9,5 +10,5 @@ backends = [
   "test3",
 ]
 
-r = Redis.new "192.168.12.251", 6379
-r.get backends[rand(backends.length)]
+r = Nginx::Redis.new "192.168.12.251", 6379
+Nginx::Request.new.var.set "backend", r.get(backends[rand(backends.length)])
@@ -0,0 +1,54 @@
+# stub DNS server for the Nginx::Resolver tests
+#
+#   ruby test/stub/dns.rb 58054
+#
+# answers A queries with a TTL of 1 second:
+#   gone*   NXDOMAIN
+#   count*  0.0.x.y, where x.y is the number of A queries for gone* so far
+#   *       10.0.x.y, where x.y is the number of A queries for this name
+# and other query types with no records
+
+require 'socket'
+
+TTL = 1
+
+socket = UDPSocket.new
+socket.bind('127.0.0.1', (ARGV[0] || 58054).to_i)
+queries = Hash.new(0)
+gone = 0
+
+loop do
+  packet, from = socket.recvfrom(512)
+  next if packet.bytesize < 12
+
+  id, flags = packet.unpack('nn')
+  pos = 12
+  labels = []
+  while (len = packet.getbyte(pos)) && len > 0
+    labels << packet.byteslice(pos + 1, len)
+    pos += len + 1
+  end
+  next if len.nil?
+  pos += 1
+  qtype, = packet.byteslice(pos, 4).unpack('n')
+  question = packet.byteslice(12, pos + 4 - 12)
+  name = labels.join('.').downcase
+
+  rcode = 0
+  answer = nil
+  if qtype == 1
+    if name.start_with?('gone')
+      gone += 1
+      rcode = 3
+    else
+      n = name.start_with?('count') ? gone : (queries[name] += 1)
+      prefix = name.start_with?('count') ? 0 : 10
+      answer = [0xc00c, 1, 1, TTL, 4, prefix, 0, n >> 8, n & 0xff].pack('nnnNnCCCC')
+    end
+  elsif name.start_with?('gone')
+    rcode = 3
+  end
+
+  header = [id, 0x8180 | (flags & 0x0100) | rcode, 1, answer ? 1 : 0, 0, 0].pack('nnnnnn')
+  socket.send(header + question + answer.to_s, 0, from[3], from[1])
+end
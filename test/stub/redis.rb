@@ -0,0 +1,115 @@
+# stub Redis server for the Nginx::Socket and Nginx::Redis tests
+#
+#   ruby test/stub/redis.rb 58379
+#
+# answers PING, SET, GET, DEL and INCR from memory, STUB CONNECTIONS with the
+# number of connections accepted so far, and STUB BATCH with the most commands
+# that arrived in one read since the previous STUB BATCH
+
+require 'socket'
+
+server = TCPServer.new('127.0.0.1', (ARGV[0] || 58379).to_i)
+store = {}
+connections = 0
+batch = 0
+lock = Mutex.new
+
+def reply(v)
+  case v
+  when nil then "$-1\r\n"
+  when Integer then ":#{v}\r\n"
+  when Symbol then "+#{v}\r\n"
+  when StandardError then "-ERR #{v.message}\r\n"
+  else "$#{v.bytesize}\r\n#{v}\r\n"
+  end
+end
+
+class Reader
+  # commands parsed from the current read so far
+  attr_accessor :count
+
+  def initialize(io)
+    @io = io
+    @buf = ''.b
+    @count = 0
+  end
+
+  # true when no more bytes of the current read are left
+  def drained?
+    @buf.empty?
+  end
+
+  def command
+    line = gets or return nil
+    raise ArgumentError, "inline commands are not supported" unless line.start_with?('*')
+    @count += 1
+    Array.new(line[1..-1].to_i) do
+      n = gets[1..-1].to_i
+      v = read(n + 2)
+      v[0, n]
+    end
+  end
+
+  private
+
+  def fill
+    @buf << @io.readpartial(65536)
+    true
+  rescue EOFError
+    false
+  end
+
+  def gets
+    until (i = @buf.index("\r\n"))
+      return nil unless fill
+    end
+    @buf.slice!(0, i + 2)
+  end
+
+  def read(n)
+    while @buf.bytesize < n
+      raise EOFError unless fill
+    end
+    @buf.slice!(0, n)
+  end
+end
+
+loop do
+  client = server.accept
+  lock.synchronize { connections += 1 }
+  Thread.new(client) do |io|
+    begin
+      reader = Reader.new(io)
+      while (cmd = reader.command)
+        name = cmd[0].to_s.upcase
+        res = lock.synchronize do
+          case name
+          when 'PING' then :PONG
+          when 'SET' then store[cmd[1]] = cmd[2]; :OK
+          when 'GET' then store[cmd[1]]
+          when 'DEL' then cmd[1..-1].count { |k| store.delete(k) }
+          when 'INCR' then store[cmd[1]] = (store[cmd[1]].to_i + 1).to_s; store[cmd[1]].to_i
+          when 'STUB'
+            if cmd[1].to_s.upcase == 'BATCH'
+              n = batch
+              batch = 0
+              reader.count = 0
+              n
+            else
+              connections
+            end
+          else StandardError.new("unknown command '#{cmd[0]}'")
+          end
+        end
+        if reader.drained?
+          lock.synchronize { batch = reader.count if reader.count > batch }
+          reader.count = 0
+        end
+        io.write reply(res)
+      end
+    rescue IOError, SystemCallError, ArgumentError
+    ensure
+      io.close
+    end
+  end
+end
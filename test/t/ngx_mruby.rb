@@ -141,4 +141,182 @@ t.assert('ngx_mruby - get server class name', 'location /server_class') do
   t.assert_equal "Nginx", res["body"]
 end
 
+t.assert('ngx_mruby - mruby_stats_header', 'location /stats_header') do
+  res = HttpRequest.new.get base + '/stats_header'
+  t.assert_equal "stats", res["body"]
+  stats = {}
+  res["x-mruby-stats"].split(";").each do |kv|
+    k, v = kv.strip.split("=")
+    stats[k] = v.to_i
+  end
+  t.assert_equal 1, stats["runs"]
+  t.assert_equal true, stats["usec"] >= 0
+  # 100 strings too long to be embedded, and the Array holding them
+  t.assert_equal true, stats["allocs"] >= 100
+end
+
+t.assert('ngx_mruby - handler object with call option', 'location /call_handler') do
+  res = HttpRequest.new.get base + '/call_handler?a=1'
+  t.assert_equal "/call_handler a=1 1", res["body"]
+  res = HttpRequest.new.get base + '/call_handler?a=2'
+  t.assert_equal "/call_handler a=2 1", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx.sleep', 'location /sleep') do
+  res = HttpRequest.new.get base + '/sleep'
+  t.assert_equal "rewrite content", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx.sleep without fiber', 'location /sleep_without_fiber') do
+  res = HttpRequest.new.get base + '/sleep_without_fiber'
+  t.assert_equal "no fiber", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Socket', 'location /socket') do
+  res = HttpRequest.new.get base + '/socket'
+  t.assert_equal "HTTP/1.1 200 OK <!DOCTYPE html> 1", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Subrequest', 'location /capture') do
+  res = HttpRequest.new.get base + '/capture'
+  t.assert_equal "200:Hello ngx_mruby world!,200:GET x=1,200:POST y=2,404", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Subrequest.hedged', 'location /hedge') do
+  res = HttpRequest.new.get base + '/hedge'
+  t.assert_equal "200:GET ", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::HTTP::Client', 'location /http_client') do
+  res = HttpRequest.new.get base + '/http_client'
+  t.assert_equal "200:Hello ngx_mruby world! GET x=1 200 true true", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Resolver', 'location /resolver') do
+  res = HttpRequest.new.get base + '/resolver'
+  t.assert_equal "127.0.0.1 true", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Resolver with a stub server', 'location /resolver_stub') do
+  res = HttpRequest.new.get base + '/resolver_stub'
+  t.assert_equal "10.0.0.1 10.0.0.1 10.0.0.2 error error 1", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::SharedDict', 'location /shared_dict') do
+  res = HttpRequest.new.get base + '/shared_dict'
+  t.assert_equal '[false, "v", nil, 2, 5, [1, 2.5, true, nil], true, nil, "x", nil]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::SharedDict crc32 collision', 'location /shared_dict_collision') do
+  res = HttpRequest.new.get base + '/shared_dict_collision'
+  t.assert_equal '["aa", "b", true, nil, "b"]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::LRUCache', 'location /lru_cache') do
+  res = HttpRequest.new.get base + '/lru_cache'
+  t.assert_equal '[1, nil, 3, 2, false, 5, 5, nil] 4 2 3 1', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::TieredCache', 'location /tiered_cache') do
+  res = HttpRequest.new.get base + '/tiered_cache'
+  t.assert_equal '["a", true, "b", nil, "c", "c", "c", "d", "user", "user", "user"]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::RateLimiter', 'location /rate_limiter') do
+  res = HttpRequest.new.get base + '/rate_limiter'
+  t.assert_equal '[0.0, 1.0, 2.0, false, 0.0, 0.0, false, true, true, false]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Metrics registry and mruby_metrics', 'location /metrics_registry') do
+  res = HttpRequest.new.get base + '/metrics_registry'
+  t.assert_equal '3.0 4.0 3 3.55', res["body"]
+  # the metrics set by the request above, as served by location /metrics
+  res = HttpRequest.new.get base + '/metrics'
+  t.assert_equal [
+    '# HELP t_requests_total requests',
+    '# TYPE t_requests_total counter',
+    't_requests_total{code="200",method="GET"} 3',
+    '# TYPE t_conns gauge',
+    't_conns 4',
+    '# TYPE t_seconds histogram',
+    't_seconds_bucket{le="0.1"} 1',
+    't_seconds_bucket{le="1"} 2',
+    't_seconds_bucket{le="+Inf"} 3',
+    't_seconds_sum 3.55',
+    't_seconds_count 3'
+  ].join("\n") + "\n", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Sketch::TopK', 'location /topk') do
+  res = HttpRequest.new.get base + '/topk'
+  t.assert_equal '[["a", 10], ["e", 7], ["b", 5]] 10 [["a", 10]]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::HyperLogLog', 'location /hyperloglog') do
+  res = HttpRequest.new.get base + '/hyperloglog'
+  t.assert_equal '[true, false, true, true]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::BloomFilter', 'location /bloom_filter') do
+  res = HttpRequest.new.get base + '/bloom_filter'
+  t.assert_equal '[true, true, false, 2, :error]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::IPSet', 'location /ipset') do
+  res = HttpRequest.new.get base + '/ipset'
+  t.assert_equal '[1, 2, 3, nil, 6, 3, nil, 4, nil, true, false, true]', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::MmapTable', 'location /mmap_table') do
+  res = HttpRequest.new.get base + '/mmap_table'
+  t.assert_equal '["tenant-3", "tenant-2", nil, 2, false, "private", "au", nil, "doc", "n", nil, true, :error]', res["body"]
+end
+
+# test/conf/threads.conf is only installed for nginx built with threads
+if HttpRequest.new.get(base + '/thread_pool').code != 404
+  t.assert('ngx_mruby - mruby_thread_pool', 'location /thread_pool') do
+    res = HttpRequest.new.get base + '/thread_pool?a=1'
+    t.assert_equal 201, res.code
+    t.assert_equal "yes", res["x-thread"]
+    t.assert_equal "GET /thread_pool a=1", res["body"]
+  end
+
+  t.assert('ngx_mruby - mruby_thread_pool error', 'location /thread_pool_error') do
+    res = HttpRequest.new.get base + '/thread_pool_error'
+    t.assert_equal 500, res.code
+    res = HttpRequest.new.get base + '/thread_pool_error'
+    t.assert_equal 500, res.code
+  end
+end
+
+t.assert('ngx_mruby - Nginx::Timer', 'location /timer') do
+  res = HttpRequest.new.get base + '/timer'
+  t.assert_equal "1 true true false", res["body"]
+end
+
+t.assert('ngx_mruby - request bindings in a timer', 'location /timer_request') do
+  res = HttpRequest.new.get base + '/timer_request'
+  t.assert_equal "no request outside a handler", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Metrics::UDP', 'location /metrics_udp') do
+  res = HttpRequest.new.get base + '/metrics_udp'
+  t.assert_equal "t.req:2|c\nt.bytes:10|c|#a:b\nt.g:1.5|g/t.lat:3:4|ms 2 0", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Redis', 'location /redis_resp') do
+  res = HttpRequest.new.get base + '/redis_resp'
+  t.assert_equal 'true OK 3 hello ["a", nil, 1] ERR bad', res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Redis with a stub server', 'location /redis') do
+  res = HttpRequest.new.get base + '/redis'
+  t.assert_equal "PONG OK true v ERR unknown command 'FOO' 0 true", res["body"]
+end
+
+t.assert('ngx_mruby - Nginx::Redis shared connection', 'location /redis_shared') do
+  res = HttpRequest.new.get base + '/redis_shared'
+  t.assert_equal "1,2,3 2 0", res["body"]
+end
+
 t.report
@@ -0,0 +1,201 @@
+/*
+// ngx_mruby_bloom.c - build filter files for Nginx::BloomFilter
+//
+// See Copyright Notice in LEGAL
+//
+// Reads tokens, one per line, from a file or from stdin and writes a
+// blocked bloom filter in the format of src/ngx_http_mruby_bloom.h, sized
+// for the number of tokens and the false positive rate given. The file is
+// written next to out and renamed over it, so workers with the filter open
+// pick up the new one on their next lookup, a second later at most.
+//
+// Usage:
+//
+//   cc -O2 -o ngx_mruby_bloom tools/ngx_mruby_bloom.c -lm
+//   ./ngx_mruby_bloom [-p 0.001] [-n expected] out.bloom [tokens.txt]
+//
+// -n sizes the filter for more tokens than there are now, so it can be
+// rebuilt with the same size as the list grows.
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOOM_MAGIC    "NGXBLOOM"
+#define BLOOM_VERSION  1
+#define BLOOM_HEADER   64
+#define BLOOM_BLOCK    64
+#define BLOOM_K_MAX    32
+
+// the hashes of src/ngx_http_mruby_bloom.c, they must not change
+static uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+static uint64_t hash(const unsigned char *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return mix(h);
+}
+
+static void add(unsigned char *blocks, uint64_t nblocks, unsigned k,
+    uint64_t h)
+{
+  unsigned char *block = blocks + (h % nblocks) * BLOOM_BLOCK;
+  uint64_t g = mix(h ^ 0x9e3779b97f4a7c15ULL);
+  unsigned i, bit;
+
+  for (i = 0; i < k; i++) {
+    if (i > 0 && i % 7 == 0) {
+      g = mix(g + i);
+    }
+    bit = (g >> (i % 7 * 9)) & 511;
+    block[bit >> 3] |= 1 << (bit & 7);
+  }
+}
+
+static void put_le(unsigned char *p, uint64_t v, unsigned n)
+{
+  while (n--) {
+    *p++ = v & 0xff;
+    v >>= 8;
+  }
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: ngx_mruby_bloom [-p rate] [-n expected]"
+      " out.bloom [tokens.txt]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  double p = 0.001, m;
+  unsigned long long expected = 0;
+  uint64_t *hashes = NULL, n = 0, cap = 0, nblocks, i;
+  unsigned char header[BLOOM_HEADER], *blocks;
+  char *line = NULL, *out, *tmp;
+  size_t size = 0;
+  ssize_t len;
+  unsigned k;
+  FILE *in = stdin, *f;
+  int c;
+
+  while ((c = getopt(argc, argv, "p:n:")) != -1) {
+    switch (c) {
+    case 'p':
+      p = strtod(optarg, NULL);
+      break;
+    case 'n':
+      expected = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind < 1 || argc - optind > 2 || !(p > 0 && p < 1)) {
+    usage();
+  }
+  out = argv[optind];
+  if (argc - optind == 2 && (in = fopen(argv[optind + 1], "r")) == NULL) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+
+  // only the hashes are kept, tokens are hashed the same in any filter size
+  while ((len = getline(&line, &size, in)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      len--;
+    }
+    if (len == 0) {
+      continue;
+    }
+    if (n == cap) {
+      cap = cap ? cap * 2 : 4096;
+      if ((hashes = realloc(hashes, cap * sizeof(uint64_t))) == NULL) {
+        perror("realloc");
+        return 1;
+      }
+    }
+    hashes[n++] = hash((unsigned char *) line, (size_t) len);
+  }
+  free(line);
+
+  // m = -n ln p / (ln 2)^2 bits and k = m / n ln 2 probes
+  if (expected < n) {
+    expected = n;
+  }
+  if (expected == 0) {
+    expected = 1;
+  }
+  m = -(double) expected * log(p) / (M_LN2 * M_LN2);
+  nblocks = (uint64_t) ceil(m / (BLOOM_BLOCK * 8));
+  k = (unsigned) lround(m / expected * M_LN2);
+  if (k < 1) {
+    k = 1;
+  }
+  if (k > BLOOM_K_MAX) {
+    k = BLOOM_K_MAX;
+  }
+
+  blocks = calloc(nblocks, BLOOM_BLOCK);
+  if (blocks == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  for (i = 0; i < n; i++) {
+    add(blocks, nblocks, k, hashes[i]);
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, BLOOM_MAGIC, 8);
+  put_le(header + 8, BLOOM_VERSION, 4);
+  put_le(header + 12, k, 4);
+  put_le(header + 16, nblocks, 8);
+  put_le(header + 24, n, 8);
+
+  tmp = malloc(strlen(out) + sizeof(".tmp"));
+  if (tmp == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  sprintf(tmp, "%s.tmp", out);
+  f = fopen(tmp, "wb");
+  if (f == NULL
+      || fwrite(header, sizeof(header), 1, f) != 1
+      || fwrite(blocks, BLOOM_BLOCK, nblocks, f) != nblocks
+      || fclose(f) != 0) {
+    perror(tmp);
+    unlink(tmp);
+    return 1;
+  }
+  if (rename(tmp, out) != 0) {
+    perror(out);
+    unlink(tmp);
+    return 1;
+  }
+
+  fprintf(stderr, "%s: %llu tokens, %llu bytes, k=%u\n", out,
+      (unsigned long long) n, (unsigned long long) nblocks * BLOOM_BLOCK, k);
+
+  return 0;
+}
@@ -0,0 +1,198 @@
+##
+# ngx_mruby_replay.rb - replay captured requests against ngx_mruby handlers
+#
+# See Copyright Notice in LEGAL
+#
+# Replays requests captured in an nginx access log (combined format) or in
+# a HAR file against a running nginx, and reports latency, mruby execution
+# time and memory allocations per location. When a candidate base url is
+# given, every request is sent to both servers and responses are compared,
+# so a new handler script can be checked against the current one before
+# rollout.
+#
+# Locations under test need "mruby_stats_header on;" to report the mruby
+# side numbers (X-Mruby-Stats response header).
+#
+# Usage (with the mruby built by test.sh, which has the needed mrbgems):
+#
+#   ./mruby/bin/mruby tools/ngx_mruby_replay.rb access.log http://127.0.0.1:58080
+#   ./mruby/bin/mruby tools/ngx_mruby_replay.rb capture.har \
+#       http://127.0.0.1:58080 http://127.0.0.1:58090
+#
+
+class ReplayRequest
+  attr_reader :method, :path, :headers, :body
+
+  def initialize(method, path, headers, body)
+    @method = method
+    @path = path
+    @headers = headers
+    @body = body
+  end
+
+  def location
+    q = @path.index("?")
+    q ? @path[0, q] : @path
+  end
+end
+
+class ReplayCapture
+  def self.load(file)
+    data = File.open(file, "r") { |f| f.read }
+    if data.lstrip[0] == "{"
+      from_har data
+    else
+      from_access_log data
+    end
+  end
+
+  # HAR 1.2: log.entries[].request
+  def self.from_har(data)
+    JSON.parse(data)["log"]["entries"].map do |e|
+      req = e["request"]
+      headers = {}
+      (req["headers"] || []).each do |h|
+        name = h["name"]
+        # pseudo headers (HTTP/2) and hop-by-hop headers are not replayed
+        next if name[0] == ":" || name.downcase == "host" || name.downcase == "content-length"
+        headers[name] = h["value"]
+      end
+      body = req["postData"] ? req["postData"]["text"] : nil
+      ReplayRequest.new req["method"], strip_origin(req["url"]), headers, body
+    end
+  end
+
+  # $remote_addr - $remote_user [$time_local] "$request" $status ... "$http_user_agent"
+  def self.from_access_log(data)
+    reqs = []
+    data.split("\n").each do |line|
+      s = line.index('"')
+      next if s.nil?
+      e = line.index('"', s + 1)
+      next if e.nil?
+      request = line[s + 1, e - s - 1].split(" ")
+      next if request.length < 2
+      headers = {}
+      quoted = line[e + 1, line.length].split('"')
+      # combined format ends with "$http_referer" "$http_user_agent"
+      if quoted.length >= 4
+        headers["Referer"] = quoted[1] if quoted[1] != "-"
+        headers["User-Agent"] = quoted[3] if quoted[3] != "-"
+      end
+      reqs << ReplayRequest.new(request[0], request[1], headers, nil)
+    end
+    reqs
+  end
+
+  def self.strip_origin(url)
+    s = url.index("://")
+    return url if s.nil?
+    p = url.index("/", s + 3)
+    p ? url[p, url.length] : "/"
+  end
+end
+
+class ReplayResult
+  attr_reader :status, :body, :msec, :usec, :allocs
+
+  def initialize(res, msec)
+    @status = res.code
+    @body = res["body"]
+    @msec = msec
+    @usec = nil
+    @allocs = nil
+    stats = res["x-mruby-stats"]
+    unless stats.nil?
+      stats.split(";").each do |kv|
+        k, v = kv.strip.split("=")
+        @usec = v.to_i if k == "usec"
+        @allocs = v.to_i if k == "allocs"
+      end
+    end
+  end
+end
+
+class ReplayStats
+  def initialize
+    @msec = []
+    @usec = []
+    @allocs = []
+  end
+
+  def add(result)
+    @msec << result.msec
+    @usec << result.usec unless result.usec.nil?
+    @allocs << result.allocs unless result.allocs.nil?
+  end
+
+  def count
+    @msec.length
+  end
+
+  def report(label)
+    s = @msec.sort
+    format("  %-10s n=%-6d avg=%8.3fms p50=%8.3fms p99=%8.3fms mruby=%8.1fus allocs=%8.1f",
+      label, s.length, avg(s), pct(s, 50), pct(s, 99), avg(@usec), avg(@allocs))
+  end
+
+  def avg(a)
+    return 0.0 if a.empty?
+    sum = 0.0
+    a.each { |v| sum += v }
+    sum / a.length
+  end
+
+  def pct(sorted, n)
+    return 0.0 if sorted.empty?
+    sorted[((sorted.length - 1) * n / 100.0).round]
+  end
+end
+
+class Replayer
+  def initialize(requests, bases)
+    @requests = requests
+    @bases = bases
+    @stats = {}
+    @mismatch = {}
+  end
+
+  def replay(base, req)
+    t = Time.now.to_f
+    res = HttpRequest.new.request(req.method, base + req.path, req.body, req.headers)
+    ReplayResult.new res, (Time.now.to_f - t) * 1000.0
+  end
+
+  def run
+    @requests.each do |req|
+      results = @bases.map { |base| replay(base, req) }
+      loc = req.location
+      @stats[loc] ||= @bases.map { ReplayStats.new }
+      results.each_with_index { |res, i| @stats[loc][i].add res }
+      if results.length == 2
+        a, b = results
+        if a.status != b.status || a.body != b.body
+          @mismatch[loc] ||= 0
+          @mismatch[loc] += 1
+        end
+      end
+    end
+    self
+  end
+
+  def report
+    labels = @bases.length == 2 ? ["current", "candidate"] : ["current"]
+    @stats.keys.sort.each do |loc|
+      puts loc
+      @stats[loc].each_with_index { |st, i| puts st.report(labels[i]) }
+      puts "  mismatched responses: #{@mismatch[loc] || 0}" if @bases.length == 2
+    end
+  end
+end
+
+if ARGV.length < 2 || ARGV.length > 3
+  puts "usage: ngx_mruby_replay.rb <access.log|capture.har> <base_url> [<candidate_base_url>]"
+else
+  requests = ReplayCapture.load ARGV[0]
+  puts "replaying #{requests.length} requests"
+  Replayer.new(requests, ARGV[1, 2]).run.report
+end
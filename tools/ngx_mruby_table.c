@@ -0,0 +1,369 @@
+/*
+// ngx_mruby_table.c - build table files for Nginx::MmapTable
+//
+// See Copyright Notice in LEGAL
+//
+// Reads a table from a file or from stdin and writes it in the format of
+// src/ngx_http_mruby_table.h. The file is written next to out and renamed
+// over it, so workers with the table open pick up the new one on their next
+// lookup, a second later at most.
+//
+// Hash tables are read from lines of a key, a tab and a value; the last
+// line of a key wins. Range tables (-r) are read from lines of a start, an
+// end and a value, separated by tabs, or of a CIDR prefix and a value.
+// Starts and ends are IPv4 or IPv6 addresses or decimal integers, ranges
+// must not overlap, and equal values are stored once.
+//
+// Usage:
+//
+//   cc -O2 -o ngx_mruby_table tools/ngx_mruby_table.c
+//   ./ngx_mruby_table out.table [tenants.tsv]
+//   ./ngx_mruby_table -r out.table [geo.tsv]
+*/
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TABLE_MAGIC    "NGXTABLE"
+#define TABLE_VERSION  1
+#define TABLE_HEADER   64
+#define TABLE_HASH     1
+#define TABLE_RANGE    2
+#define TABLE_KEY      16
+
+typedef struct {
+  char *key;
+  size_t klen;
+  char *value;
+  size_t vlen;
+  unsigned char start[TABLE_KEY];
+  unsigned char end[TABLE_KEY];
+  uint64_t hash;
+  uint64_t off;
+  unsigned long line;
+} entry_t;
+
+static char *out, *tmp;
+
+// the hash of src/ngx_http_mruby_table.c, it must not change
+static uint64_t hash(const unsigned char *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+static void fail(const char *what, unsigned long line)
+{
+  if (line) {
+    fprintf(stderr, "line %lu: %s\n", line, what);
+  }
+  else {
+    perror(what);
+  }
+  if (tmp) {
+    unlink(tmp);
+  }
+  exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+  p = realloc(p, size);
+  if (p == NULL) {
+    fail("realloc", 0);
+  }
+
+  return p;
+}
+
+static void put_le(unsigned char *p, uint64_t v, unsigned n)
+{
+  while (n--) {
+    *p++ = v & 0xff;
+    v >>= 8;
+  }
+}
+
+// an address or a decimal integer as a 16 byte big endian key
+static int range_key(const char *s, unsigned char *k)
+{
+  unsigned long long n;
+  char *end;
+  int i;
+
+  memset(k, 0, TABLE_KEY);
+  if (inet_pton(AF_INET, s, k + 12) == 1) {
+    k[10] = 0xff;
+    k[11] = 0xff;
+    return 0;
+  }
+  if (inet_pton(AF_INET6, s, k) == 1) {
+    return 0;
+  }
+  if (*s < '0' || *s > '9') {
+    return -1;
+  }
+  n = strtoull(s, &end, 10);
+  if (*end != '\0') {
+    return -1;
+  }
+  for (i = TABLE_KEY - 1; i >= 8; i--, n >>= 8) {
+    k[i] = n & 0xff;
+  }
+
+  return 0;
+}
+
+// prefix/len as the range of its first and last address
+static int range_cidr(char *s, unsigned char *start, unsigned char *end)
+{
+  char *slash = strchr(s, '/');
+  long len;
+  int i, v4;
+
+  *slash = '\0';
+  v4 = strchr(s, ':') == NULL;
+  len = strtol(slash + 1, NULL, 10);
+  if (range_key(s, start) != 0 || len < 0 || len > (v4 ? 32 : 128)) {
+    return -1;
+  }
+  if (v4) {
+    len += 96;
+  }
+  for (i = 0; i < TABLE_KEY; i++, len -= 8) {
+    if (len >= 8) {
+      end[i] = start[i];
+    }
+    else {
+      start[i] &= len > 0 ? 0xff << (8 - len) : 0;
+      end[i] = start[i] | (len > 0 ? 0xff >> len : 0xff);
+    }
+  }
+
+  return 0;
+}
+
+static int cmp_start(const void *one, const void *two)
+{
+  const entry_t *a = one, *b = two;
+
+  return memcmp(a->start, b->start, TABLE_KEY);
+}
+
+static void write_all(FILE *f, const void *p, size_t len)
+{
+  if (len && fwrite(p, len, 1, f) != 1) {
+    fail(tmp, 0);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  unsigned char header[TABLE_HEADER], buf[8];
+  entry_t *e = NULL, **dedup = NULL;
+  char *line = NULL, *f1, *f2, *f3;
+  size_t size = 0, cap = 0, n = 0, i, j;
+  uint64_t off, nslots, mask, *slots;
+  unsigned long lineno = 0;
+  int c, range = 0;
+  ssize_t len;
+  FILE *in = stdin, *f;
+
+  while ((c = getopt(argc, argv, "r")) != -1) {
+    if (c != 'r') {
+      fprintf(stderr, "usage: ngx_mruby_table [-r] out.table [input.tsv]\n");
+      return 2;
+    }
+    range = 1;
+  }
+  if (argc - optind < 1 || argc - optind > 2) {
+    fprintf(stderr, "usage: ngx_mruby_table [-r] out.table [input.tsv]\n");
+    return 2;
+  }
+  out = argv[optind];
+  if (argc - optind == 2 && (in = fopen(argv[optind + 1], "r")) == NULL) {
+    fail(argv[optind + 1], 0);
+  }
+
+  while ((len = getline(&line, &size, in)) != -1) {
+    lineno++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    if (n == cap) {
+      cap = cap ? cap * 2 : 4096;
+      e = xrealloc(e, cap * sizeof(entry_t));
+    }
+    memset(&e[n], 0, sizeof(entry_t));
+    e[n].line = lineno;
+    f1 = strdup(line);
+    if (f1 == NULL) {
+      fail("strdup", 0);
+    }
+    f2 = strchr(f1, '\t');
+    if (f2 != NULL) {
+      *f2++ = '\0';
+    }
+
+    if (!range) {
+      e[n].key = f1;
+      e[n].klen = strlen(f1);
+      e[n].value = f2 ? f2 : f1 + e[n].klen;
+      e[n].vlen = strlen(e[n].value);
+      e[n].hash = hash((unsigned char *) f1, e[n].klen);
+      n++;
+      continue;
+    }
+
+    if (f2 == NULL) {
+      fail("a range and a value required", lineno);
+    }
+    if (strchr(f1, '/') != NULL) {
+      if (range_cidr(f1, e[n].start, e[n].end) != 0) {
+        fail("invalid prefix", lineno);
+      }
+      e[n].value = f2;
+    }
+    else {
+      f3 = strchr(f2, '\t');
+      if (f3 == NULL) {
+        fail("a start, an end and a value required", lineno);
+      }
+      *f3++ = '\0';
+      if (range_key(f1, e[n].start) != 0 || range_key(f2, e[n].end) != 0
+          || memcmp(e[n].start, e[n].end, TABLE_KEY) > 0) {
+        fail("invalid range", lineno);
+      }
+      e[n].value = f3;
+    }
+    e[n].vlen = strlen(e[n].value);
+    e[n].hash = hash((unsigned char *) e[n].value, e[n].vlen);
+    n++;
+  }
+  free(line);
+
+  if (range) {
+    qsort(e, n, sizeof(entry_t), cmp_start);
+    for (i = 1; i < n; i++) {
+      if (memcmp(e[i].start, e[i - 1].end, TABLE_KEY) <= 0) {
+        fail("range overlaps another one", e[i].line);
+      }
+    }
+  }
+
+  // a power of two, more than twice the entries, also for deduplication
+  for (nslots = 1; nslots <= n * 2; nslots <<= 1) { }
+  mask = nslots - 1;
+  slots = calloc(nslots, sizeof(uint64_t));
+  dedup = calloc(nslots, sizeof(entry_t *));
+  if (slots == NULL || dedup == NULL) {
+    fail("calloc", 0);
+  }
+
+  tmp = malloc(strlen(out) + sizeof(".tmp"));
+  if (tmp == NULL) {
+    fail("malloc", 0);
+  }
+  sprintf(tmp, "%s.tmp", out);
+  f = fopen(tmp, "wb");
+  if (f == NULL) {
+    fail(tmp, 0);
+  }
+  memset(header, 0, sizeof(header));
+  write_all(f, header, sizeof(header));
+
+  // records; keys of hash tables take the slot of an earlier equal key
+  off = TABLE_HEADER;
+  for (i = 0; i < n; i++) {
+    for (j = e[i].hash & mask; dedup[j] != NULL; j = (j + 1) & mask) {
+      if (range ? (dedup[j]->vlen == e[i].vlen
+                   && memcmp(dedup[j]->value, e[i].value, e[i].vlen) == 0)
+                : (dedup[j]->klen == e[i].klen
+                   && memcmp(dedup[j]->key, e[i].key, e[i].klen) == 0)) {
+        break;
+      }
+    }
+    if (range && dedup[j] != NULL) {
+      e[i].off = dedup[j]->off;
+      continue;
+    }
+    dedup[j] = &e[i];
+    e[i].off = off;
+    slots[j] = off;
+    put_le(buf, e[i].klen, 4);
+    put_le(buf + 4, e[i].vlen, 4);
+    write_all(f, buf, 8);
+    write_all(f, e[i].key, e[i].klen);
+    write_all(f, e[i].value, e[i].vlen);
+    off += 8 + e[i].klen + e[i].vlen;
+  }
+  memset(buf, 0, sizeof(buf));
+  write_all(f, buf, (8 - off % 8) % 8);
+  off += (8 - off % 8) % 8;
+
+  memcpy(header, TABLE_MAGIC, 8);
+  put_le(header + 8, TABLE_VERSION, 4);
+  put_le(header + 32, off, 8);
+  if (range) {
+    put_le(header + 12, TABLE_RANGE, 4);
+    put_le(header + 16, n, 8);
+    put_le(header + 24, n, 8);
+    for (i = 0; i < n; i++) {
+      write_all(f, e[i].start, TABLE_KEY);
+    }
+    for (i = 0; i < n; i++) {
+      write_all(f, e[i].end, TABLE_KEY);
+    }
+    for (i = 0; i < n; i++) {
+      put_le(buf, e[i].off, 8);
+      write_all(f, buf, 8);
+    }
+  }
+  else {
+    for (i = 0, j = 0; i < nslots; i++) {
+      j += dedup[i] != NULL;
+    }
+    put_le(header + 12, TABLE_HASH, 4);
+    put_le(header + 16, j, 8);
+    put_le(header + 24, nslots, 8);
+    for (i = 0; i < nslots; i++) {
+      put_le(buf, dedup[i] ? dedup[i]->hash : 0, 8);
+      write_all(f, buf, 8);
+      put_le(buf, slots[i], 8);
+      write_all(f, buf, 8);
+    }
+  }
+
+  if (fseek(f, 0, SEEK_SET) != 0) {
+    fail(tmp, 0);
+  }
+  write_all(f, header, sizeof(header));
+  if (fclose(f) != 0) {
+    fail(tmp, 0);
+  }
+  if (rename(tmp, out) != 0) {
+    fail(out, 0);
+  }
+
+  fprintf(stderr, "%s: %zu %s\n", out, n, range ? "ranges" : "lines");
+
+  return 0;
+}